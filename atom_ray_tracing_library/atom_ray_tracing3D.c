@@ -2,11 +2,24 @@
 #define ATOM_RAY_TRACING3D_C_
 
 #include "common_helpers.c"
+#include "memory_account.c"
+#include "time_budget.c"
+#include "bvh.c"
+#include "voxel.c"
+#include "visibility.c"
+#include "material_map.c"
 #include "ray_tracing_core3D.c"
 #include "distributions3D.c"
+#include "diagnostics.c"
+#include "pixel_features.c"
+#include "symmetry.c"
 #include "intersect_detection3D.c"
 #include "tracing_functions.c"
 #include "trace_ray.c"
+#include "bidirectional.c"
+#include "metropolis.c"
+#include "multilevel.c"
+#include "fitting.c"
 #include "experiments.c"
 
 #endif
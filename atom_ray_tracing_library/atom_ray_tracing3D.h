@@ -9,11 +9,24 @@
 #define ATOM_RAY_TRACING3D_H_
 
 #include "common_helpers.h"
+#include "memory_account.h"
+#include "time_budget.h"
+#include "bvh.h"
+#include "voxel.h"
+#include "visibility.h"
+#include "material_map.h"
 #include "ray_tracing_core3D.h"
 #include "distributions3D.h"
+#include "diagnostics.h"
+#include "pixel_features.h"
+#include "symmetry.h"
 #include "intersect_detection3D.h"
 #include "tracing_functions.h"
 #include "trace_ray.h"
+#include "bidirectional.h"
+#include "metropolis.h"
+#include "multilevel.h"
+#include "fitting.h"
 #include "experiments.h"
 
 #endif /* ATOM_RAY_TRACING3D_H_ */
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * The bidirectional estimator of the simple model of the pinhole plate, see
+ * bidirectional.h.
+ *
+ * A path x_0 (the source) ... x_k (a point in an aperture) can be made by the
+ * strategies s = 1 ... k. Strategy s samples x_1 ... x_s forwards from the
+ * source and x_k ... x_(s+1) backwards from the aperture and joins x_s to
+ * x_(s+1), strategy k is the forward path on its own. pdf_fwd and pdf_bwd of a
+ * vertex are the densities per unit area of sampling it forwards and
+ * backwards, the count of the path is then the product of pdf_fwd/pdf_bwd over
+ * the backward part of the path.
+ */
+
+#include "bidirectional.h"
+#include "ray_tracing_core3D.h"
+#include "intersect_detection3D.h"
+#include "distributions3D.h"
+#include "memory_account.h"
+#include "mtwister.h"
+#include <math.h>
+#include <stdlib.h>
+
+int64_t bidir_paths_memory(int n_detect) {
+    return (int64_t)n_detect*((BIDIR_MAX_VERTICES + 1)*sizeof(PathVertex) + sizeof(int));
+}
+
+void set_up_bidir_paths(int n_detect, BidirPaths * const paths) {
+    paths->n_detect = n_detect;
+    account_memory(MEM_RAYS, bidir_paths_memory(n_detect));
+    paths->detector = (PathVertex*)malloc(n_detect*(BIDIR_MAX_VERTICES + 1)*sizeof(PathVertex));
+    paths->n_detector = (int*)malloc(n_detect*sizeof(int));
+}
+
+void clean_up_bidir_paths(BidirPaths * const paths) {
+    account_memory(MEM_RAYS, -bidir_paths_memory(paths->n_detect));
+    free(paths->detector);
+    free(paths->n_detector);
+}
+
+/* Unit vector from a to b, and the square of the distance between them */
+static void direction_between(PathVertex const * const a, PathVertex const * const b,
+        double dir[3], double * const dist2) {
+    int k;
+
+    *dist2 = 0;
+    for (k = 0; k < 3; k++) {
+        dir[k] = b->position[k] - a->position[k];
+        *dist2 += dir[k]*dir[k];
+    }
+    for (k = 0; k < 3; k++)
+        dir[k] /= sqrt(*dist2);
+}
+
+/*
+ * Density per unit area of reaching b along dir from a, which was arrived at
+ * along in_dir, if the direction from a has a density.
+ */
+static double forward_density(PathVertex const * const a, PathVertex const * const b,
+        const double in_dir[3], const double dir[3], double dist2) {
+    double cos_b;
+
+    dot(b->frame.normal, dir, &cos_b);
+    if (cos_b >= 0)
+        return 0;
+    return scatter_density(a->material->func, &a->frame, in_dir, dir,
+        a->material->params)*(-cos_b)/dist2;
+}
+
+/* Density per unit area of reaching a from b, dir is from a to b */
+static double backward_density(PathVertex const * const a, PathVertex const * const b,
+        const double dir[3], double dist2) {
+    double cos_a, cos_b;
+
+    dot(a->frame.normal, dir, &cos_a);
+    dot(b->frame.normal, dir, &cos_b);
+    if ((cos_a <= 0) || (cos_b >= 0))
+        return 0;
+    return -cos_b/M_PI*cos_a/dist2;
+}
+
+/*
+ * Move the ray to the next surface it hits, as scatterSimpleMulti without
+ * scattering. The plate is only included if with_plate. Returns 0 if nothing
+ * is hit, 1 if a surface is hit (v is filled in) and 2 if an aperture is
+ * entered (its number is put in aperture).
+ */
+static int next_vertex(Ray3D * const the_ray, Surface3D sample, NBackWall const * const plate,
+        AnalytSphere const * const the_sphere, int with_plate, PathVertex * const v,
+        int * const aperture) {
+    double nearest_n[3];
+    double nearest_inter[3];
+    int tri_hit = -1;
+    int which_surface = -1;
+    int meets = 0;
+    int meets_sphere = 0;
+    int detected = 0;
+    double min_dist = 10.0e10;
+
+    scatterTriag(the_ray, sample, &min_dist, nearest_inter, nearest_n, &meets,
+        &tri_hit, &which_surface);
+
+    if (the_sphere->make_sphere && (the_ray->on_surface != the_sphere->surf_index)) {
+        scatterSphere(the_ray, *the_sphere, &min_dist, nearest_inter, nearest_n,
+            &tri_hit, &which_surface, &meets_sphere);
+    }
+
+    if (with_plate && (the_ray->on_surface != plate->surf_index)) {
+        int meets_wall = 0;
+        multiBackWall(the_ray, *plate, &min_dist, nearest_inter, nearest_n,
+            &meets_wall, &tri_hit, &which_surface, &detected);
+        meets = meets || meets_wall;
+    }
+
+    if (detected) {
+        update_ray_position(the_ray, nearest_inter);
+        *aperture = detected;
+        return 2;
+    }
+    if (!(meets || meets_sphere))
+        return 0;
+
+    v->position[0] = nearest_inter[0];
+    v->position[1] = nearest_inter[1];
+    v->position[2] = nearest_inter[2];
+    v->surface = which_surface;
+    v->element = tri_hit;
+    if (which_surface == sample.surf_index) {
+        v->material = sample.compositions[tri_hit];
+        v->frame = sample.frames[tri_hit];
+    } else {
+        /* The sphere and the simple plate have their frames made on the fly */
+        if (which_surface == the_sphere->surf_index)
+            v->material = &the_sphere->material;
+        else
+            v->material = &plate->material;
+        make_frame(nearest_n, &v->frame);
+    }
+
+    the_ray->on_element = tri_hit;
+    the_ray->on_surface = which_surface;
+    update_ray_position(the_ray, nearest_inter);
+    return 1;
+}
+
+/* Is the segment from a along dir of squared length dist2 unobstructed */
+static int visible(PathVertex const * const a, const double dir[3], double dist2,
+        Surface3D sample, AnalytSphere const * const the_sphere) {
+    Ray3D ray;
+    double nearest_n[3];
+    double nearest_inter[3];
+    int tri_hit = -1;
+    int which_surface = -1;
+    int meets = 0;
+    /* Stop just short of the far end, the plate never obstructs */
+    double const limit = dist2*(1 - 2e-7);
+    double min_dist = limit;
+
+    new_Ray(&ray, a->position, dir);
+    ray.on_element = a->element;
+    ray.on_surface = a->surface;
+
+    scatterTriag(&ray, sample, &min_dist, nearest_inter, nearest_n, &meets,
+        &tri_hit, &which_surface);
+    if (min_dist < limit)
+        return 0;
+
+    if (the_sphere->make_sphere && (a->surface != the_sphere->surf_index)) {
+        scatterSphere(&ray, *the_sphere, &min_dist, nearest_inter, nearest_n,
+            &tri_hit, &which_surface, &meets);
+        if (min_dist < limit)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * The count of a path made by strategy s, given the densities of its vertices
+ * 1 ... k. Strategies s_min ... k could have made it, they are weighted by the
+ * power heuristic.
+ */
+static double mis_estimate(double const pdf_fwd[], double const pdf_bwd[], int s_min,
+        int k, int s) {
+    double p = 1;   /* Density of strategy j relative to s_min */
+    double p_s = 1;
+    double sum = 1;
+    int j;
+
+    /* Strategies that sample a vertex with zero backward density cannot make it */
+    for (j = k; j > s_min; j--) {
+        if (pdf_bwd[j] <= 0) {
+            s_min = j;
+            break;
+        }
+    }
+    if (s < s_min)
+        return 0;
+
+    for (j = s_min + 1; j <= k; j++) {
+        p *= pdf_fwd[j]/pdf_bwd[j];
+        if (p > 1e100) {
+            /* Rescale, only the ratios matter */
+            p *= 1e-100;
+            p_s *= 1e-100;
+            sum *= 1e-200;
+        }
+        sum += p*p;
+        if (j == s)
+            p_s = p;
+    }
+    return p*p_s/sum;
+}
+
+/* The detector subpath of aperture a, the aperture point is uniform on it */
+static void trace_detector_subpath(int a, Surface3D sample, NBackWall const * const plate,
+        AnalytSphere const * const the_sphere, int maxScatters, BidirPaths * const paths,
+        MTRand * const myrng) {
+    PathVertex * const y = paths->detector + a*(BIDIR_MAX_VERTICES + 1);
+    double const up[3] = {0, -1, 0};
+    double const * c = plate->aperture_c;
+    double const * axes = plate->aperture_axes;
+    double r, phi, dir[3], dist2, new_dir[3];
+    Ray3D ray;
+    int j, b, aperture;
+
+    paths->n_detector[a] = -1;
+
+    genRand(myrng, &r);
+    genRand(myrng, &phi);
+    r = sqrt(r);
+    phi *= 2*M_PI;
+    y[0].position[0] = c[2*a] + 0.5*axes[2*a]*r*cos(phi);
+    y[0].position[1] = 0;
+    y[0].position[2] = c[2*a + 1] + 0.5*axes[2*a + 1]*r*sin(phi);
+
+    /* The point is counted by the first aperture it is in */
+    for (b = 0; b < a; b++) {
+        double x_disp = y[0].position[0] - c[2*b];
+        double z_disp = y[0].position[2] - c[2*b + 1];
+        if (x_disp*x_disp/(0.25*axes[2*b]*axes[2*b]) +
+                z_disp*z_disp/(0.25*axes[2*b + 1]*axes[2*b + 1]) < 1)
+            return;
+    }
+
+    make_frame(up, &y[0].frame);
+    y[0].material = NULL;
+    y[0].surface = plate->surf_index;
+    y[0].element = -1;
+    y[0].n_sample = 0;
+    y[0].pdf_bwd = 1/(M_PI*0.25*axes[2*a]*axes[2*a + 1]);
+    y[0].pdf_fwd = 0;
+    paths->n_detector[a] = 0;
+
+    cosine_scatter(&y[0].frame, up, new_dir, NULL, myrng);
+    new_Ray(&ray, y[0].position, new_dir);
+    ray.on_surface = plate->surf_index;
+
+    for (j = 1; j < BIDIR_MAX_VERTICES; j++) {
+        if (next_vertex(&ray, sample, plate, the_sphere, 1, &y[j], &aperture) != 1)
+            break;
+
+        y[j].n_sample = y[j - 1].n_sample + (y[j].surface != plate->surf_index);
+        y[j].pdf_fwd = 0;
+
+        /* Such paths are not counted, nor can they be joined through y[j] */
+        if ((y[j].n_sample > maxScatters) || (density_fraction(y[j].material->func,
+                y[j].material->params) <= 0))
+            break;
+
+        direction_between(&y[j], &y[j - 1], dir, &dist2);
+        y[j].pdf_bwd = backward_density(&y[j], &y[j - 1], dir, dist2);
+        if (j >= 2) {
+            double in_dir[3] = {-ray.direction[0], -ray.direction[1], -ray.direction[2]};
+            double out_dir[3], out_dist2;
+
+            /* Forwards, y[j - 2] is reached from y[j - 1] which came from y[j] */
+            direction_between(&y[j - 1], &y[j - 2], out_dir, &out_dist2);
+            y[j - 2].pdf_fwd = forward_density(&y[j - 1], &y[j - 2], in_dir, out_dir,
+                out_dist2);
+        }
+        paths->n_detector[a] = j;
+
+        cosine_scatter(&y[j].frame, ray.direction, new_dir, NULL, myrng);
+        update_ray_direction(&ray, new_dir);
+    }
+}
+
+/* Join vertex s of the source subpath to vertex t of the subpath of aperture a */
+static void join_subpaths(BidirPaths const * const paths, int s, int a, int t,
+        double weight, Surface3D sample, AnalytSphere const * const the_sphere,
+        int maxScatters, double * const cntr_detected, double * const numScattersRay) {
+    PathVertex const * const x = paths->source;
+    PathVertex const * const y = paths->detector + a*(BIDIR_MAX_VERTICES + 1);
+    double pdf_fwd[BIDIR_MAX_VERTICES + 2];
+    double pdf_bwd[BIDIR_MAX_VERTICES + 2];
+    double dir[3], in_dir[3], dist2, in_dist2;
+    double fwd_y, fwd_next = 0, bwd_x, estimate;
+    int const n_sample = x[s].n_sample + y[t].n_sample;
+    int const k = s + t + 1;
+    int i, s_min;
+
+    if ((n_sample > maxScatters) || (s + t > BIDIR_MAX_VERTICES))
+        return;
+
+    direction_between(&x[s - 1], &x[s], in_dir, &in_dist2);
+    direction_between(&x[s], &y[t], dir, &dist2);
+    fwd_y = forward_density(&x[s], &y[t], in_dir, dir, dist2);
+    if (fwd_y <= 0)
+        return;
+
+    if (t >= 1) {
+        double out_dir[3], out_dist2;
+
+        direction_between(&y[t], &y[t - 1], out_dir, &out_dist2);
+        fwd_next = forward_density(&y[t], &y[t - 1], dir, out_dir, out_dist2);
+        if (fwd_next <= 0)
+            return;
+    }
+
+    bwd_x = backward_density(&x[s], &y[t], dir, dist2);
+    if (!visible(&x[s], dir, dist2, sample, the_sphere))
+        return;
+
+    /* The densities along the joined path x_0 ... x_s, y_t ... y_0 */
+    s_min = 1;
+    for (i = 1; i < s; i++) {
+        pdf_fwd[i] = x[i].pdf_fwd;
+        pdf_bwd[i] = x[i].pdf_bwd;
+        if (!x[i].density)
+            s_min = i + 1;
+    }
+    pdf_fwd[s] = x[s].pdf_fwd;
+    pdf_bwd[s] = bwd_x;
+    for (i = s + 1; i <= k; i++) {
+        pdf_fwd[i] = y[k - i].pdf_fwd;
+        pdf_bwd[i] = y[k - i].pdf_bwd;
+    }
+    pdf_fwd[s + 1] = fwd_y;
+    if (t >= 1)
+        pdf_fwd[s + 2] = fwd_next;
+
+    estimate = weight*mis_estimate(pdf_fwd, pdf_bwd, s_min, k, s);
+    cntr_detected[a] += estimate;
+    numScattersRay[scatter_bin(a + 1, n_sample, maxScatters)] += estimate;
+}
+
+void trace_ray_bidirectional(Ray3D * const the_ray, int maxScatters, Surface3D sample,
+        NBackWall const * const plate, AnalytSphere const * const the_sphere,
+        BidirPaths * const paths, PixelFeatures * const feat, MTRand * const myrng,
+        double * const cntr_detected, double * const numScattersRay) {
+    PathVertex * const x = paths->source;
+    double dir[3], dist2;
+    int a, n, aperture;
+
+    for (a = 0; a < paths->n_detect; a++)
+        trace_detector_subpath(a, sample, plate, the_sphere, maxScatters, paths, myrng);
+
+    x[0].position[0] = the_ray->position[0];
+    x[0].position[1] = the_ray->position[1];
+    x[0].position[2] = the_ray->position[2];
+    x[0].material = NULL;
+    x[0].n_sample = 0;
+
+    for (n = 0; ; n++) {
+        double start[3] = {the_ray->position[0], the_ray->position[1],
+            the_ray->position[2]};
+        double new_dir[3];
+        int hit;
+
+        /* The first step, from the source, does not include the plate */
+        hit = next_vertex(the_ray, sample, plate, the_sphere, n > 0, &x[n + 1], &aperture);
+        if ((n == 0) && (feat != NULL)) {
+            the_ray->status = hit == 1 ? 0 : 1;
+            features_first_hit(feat, the_ray, start, &sample, the_sphere);
+        }
+
+        if (hit == 0) {
+            the_ray->status = 1;
+            break;
+        }
+
+        if (hit == 2) {
+            /* The forward strategy, x[n + 1] is the point in the aperture */
+            PathVertex * const x_k = &x[n + 1];
+            double const up[3] = {0, -1, 0};
+            double const * axes = plate->aperture_axes + 2*(aperture - 1);
+            double pdf_fwd[BIDIR_MAX_VERTICES + 2];
+            double pdf_bwd[BIDIR_MAX_VERTICES + 2];
+            double estimate;
+            int i, s_min = 1;
+
+            x_k->position[0] = the_ray->position[0];
+            x_k->position[1] = the_ray->position[1];
+            x_k->position[2] = the_ray->position[2];
+            make_frame(up, &x_k->frame);
+            x_k->pdf_fwd = 0;
+
+            direction_between(&x[n], x_k, dir, &dist2);
+            x[n].pdf_bwd = backward_density(&x[n], x_k, dir, dist2);
+            if (x[n].density) {
+                double in_dir[3], in_dist2;
+
+                direction_between(&x[n - 1], &x[n], in_dir, &in_dist2);
+                x_k->pdf_fwd = forward_density(&x[n], x_k, in_dir, dir, dist2);
+            }
+            x_k->pdf_bwd = 1/(M_PI*0.25*axes[0]*axes[1]);
+
+            for (i = 1; i <= n + 1; i++) {
+                pdf_fwd[i] = x[i].pdf_fwd;
+                pdf_bwd[i] = x[i].pdf_bwd;
+                if ((i <= n) && !x[i].density)
+                    s_min = i + 1;
+            }
+
+            estimate = the_ray->weight*mis_estimate(pdf_fwd, pdf_bwd, s_min, n + 1, n + 1);
+            cntr_detected[aperture - 1] += estimate;
+            numScattersRay[scatter_bin(aperture, x[n].n_sample, maxScatters)] += estimate;
+
+            the_ray->status = 2;
+            the_ray->detector = aperture;
+            break;
+        }
+
+        /* Hit a surface */
+        x[n + 1].n_sample = x[n].n_sample + (x[n + 1].surface != plate->surf_index);
+        the_ray->nScatters = x[n + 1].n_sample;
+        if ((x[n + 1].n_sample > maxScatters) || (n + 1 > BIDIR_MAX_VERTICES)) {
+            the_ray->nScatters = -1;
+            the_ray->status = -1;
+            break;
+        }
+
+        /* The densities of the new vertex and of the one before it */
+        direction_between(&x[n], &x[n + 1], dir, &dist2);
+        x[n + 1].pdf_fwd = 0;
+        if ((n >= 1) && x[n].density) {
+            double in_dir[3], in_dist2;
+
+            direction_between(&x[n - 1], &x[n], in_dir, &in_dist2);
+            x[n + 1].pdf_fwd = forward_density(&x[n], &x[n + 1], in_dir, dir, dist2);
+        }
+        if (n >= 1)
+            x[n].pdf_bwd = backward_density(&x[n], &x[n + 1], dir, dist2);
+
+        /* Join the new vertex to every detector subpath */
+        if (density_fraction(x[n + 1].material->func, x[n + 1].material->params) > 0) {
+            for (a = 0; a < paths->n_detect; a++) {
+                int t;
+
+                for (t = 0; t <= paths->n_detector[a]; t++)
+                    join_subpaths(paths, n + 1, a, t, the_ray->weight, sample,
+                        the_sphere, maxScatters, cntr_detected, numScattersRay);
+            }
+        }
+
+        x[n + 1].density = scatter_split(x[n + 1].material->func, &x[n + 1].frame,
+            the_ray->direction, new_dir, x[n + 1].material->params, myrng);
+        update_ray_direction(the_ray, new_dir);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A bidirectional estimator of the counts of the simple (N aperture) model of
+ * the pinhole plate. For deep features few forward paths find their way into a
+ * small aperture; here subpaths are also traced backwards from points sampled
+ * on each aperture and every vertex of the forward (source) subpath is joined
+ * to every vertex of the backward (detector) subpaths, with a visibility test.
+ * The strategies that could have made a path are combined with the power
+ * heuristic (Veach, 1997), the forward strategy alone counts what the others
+ * cannot.
+ *
+ * The estimate has the same expectation as generating_rays_simple_pinhole:
+ *  - Joining through a vertex needs the density of the scattering distribution
+ *    there, which is only known for the diffuse parts (see scatter_density). A
+ *    path that was specularly scattered after its last diffuse vertex can only
+ *    be made forwards.
+ *  - Backward directions are cosine about the normal, the source is only
+ *    sampled forwards.
+ *  - The limits on the number of scattering events (maxScatters off the
+ *    sample and sphere, 50 in total) are applied to the joined paths.
+ *  - Visibility is symmetric, which holds when the sample surfaces are closed
+ *    or only seen from their front.
+ * Roulette and the ray diagnostics are not used.
+ */
+
+#ifndef BIDIRECTIONAL_H_
+#define BIDIRECTIONAL_H_
+
+#include "ray_tracing_core3D.h"
+#include "distributions3D.h"
+#include "pixel_features.h"
+
+/* The most surface vertices on a path, as trace_ray_simple_multi */
+#define BIDIR_MAX_VERTICES 50
+
+typedef struct _pathVertex {
+    double position[3];
+    SurfaceFrame frame;         /* Frame of the surface, the aperture normal on an aperture */
+    Material const * material;  /* NULL for the source and aperture vertices */
+    int surface;                /* Index of the surface the vertex is on */
+    int element;                /* Element of the sample, -1 otherwise */
+    int n_sample;               /* Sample and sphere vertices on the subpath up to here */
+    int density;                /* Was the next direction from the part with a density */
+    double pdf_fwd;             /* Density (per area) of sampling the vertex forwards */
+    double pdf_bwd;             /* Density (per area) of sampling the vertex backwards */
+} PathVertex;
+
+/* The subpaths of one source ray, reused between rays */
+typedef struct _bidirPaths {
+    int n_detect;
+    PathVertex source[BIDIR_MAX_VERTICES + 2];
+    PathVertex * detector;  /* n_detect x (BIDIR_MAX_VERTICES + 1), from the aperture */
+    int * n_detector;       /* Surface vertices on each detector subpath, -1 for none */
+} BidirPaths;
+
+/* Allocates the detector subpaths, must call clean_up_bidir_paths */
+void set_up_bidir_paths(int n_detect, BidirPaths * const paths);
+
+void clean_up_bidir_paths(BidirPaths * const paths);
+
+/* The bytes set_up_bidir_paths allocates */
+int64_t bidir_paths_memory(int n_detect);
+
+/*
+ * Trace a ray from the source and a subpath back from each aperture, adding the
+ * (weighted) counts of all their joined paths to cntr_detected and to the
+ * histogram numScattersRay, by detector and number of sample scattering
+ * events. The status of the ray is that of its forward subpath, -1 if it was
+ * killed for scattering too many times. If feat is not NULL the first bounce
+ * is added to the features.
+ */
+void trace_ray_bidirectional(Ray3D * const the_ray, int maxScatters, Surface3D sample,
+        NBackWall const * const plate, AnalytSphere const * const the_sphere,
+        BidirPaths * const paths, PixelFeatures * const feat, MTRand * const myrng,
+        double * const cntr_detected, double * const numScattersRay);
+
+#endif /* BIDIRECTIONAL_H_ */
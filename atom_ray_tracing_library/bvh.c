@@ -0,0 +1,616 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Building of the linear bounding volume hierarchy, see bvh.h.
+ */
+
+#include "bvh.h"
+#include "memory_account.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <sys/time.h>
+
+/*
+ * The parallel loops only use OpenMP if it is enabled, the pragmas are given
+ * through _Pragma so that they vanish otherwise.
+ */
+#ifdef _OPENMP
+#define BVH_PARALLEL_FOR _Pragma("omp parallel for schedule(static)")
+#define BVH_PARALLEL_FOR_DYNAMIC _Pragma("omp parallel for schedule(dynamic, 1024)")
+#define BVH_ATOMIC_CAPTURE _Pragma("omp atomic capture")
+#define BVH_FLUSH _Pragma("omp flush")
+#else
+#define BVH_PARALLEL_FOR
+#define BVH_PARALLEL_FOR_DYNAMIC
+#define BVH_ATOMIC_CAPTURE
+#define BVH_FLUSH
+#endif
+
+/* Number of blocks the faces are split into for the reductions and the sort */
+#define BVH_BLOCKS 64
+#define BVH_RADIX 256
+
+/* Number of leaves of a treelet */
+#define BVH_TREELET 5
+
+static double bvh_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+/* Boxes are stored as floats, rounded outwards so that they stay conservative */
+static float round_down(double x) {
+    float f = (float)x;
+    if ((double)f > x)
+        f = nextafterf(f, -FLT_MAX);
+    return f;
+}
+
+static float round_up(double x) {
+    float f = (float)x;
+    if ((double)f < x)
+        f = nextafterf(f, FLT_MAX);
+    return f;
+}
+
+static void box_union(float const a[6], float const b[6], float out[6]) {
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        out[k] = a[k] < b[k] ? a[k] : b[k];
+        out[k + 3] = a[k + 3] > b[k + 3] ? a[k + 3] : b[k + 3];
+    }
+}
+
+static double box_area(float const box[6]) {
+    double dx = (double)box[3] - box[0];
+    double dy = (double)box[4] - box[1];
+    double dz = (double)box[5] - box[2];
+
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+/* Number of leading zeros of a non-zero 32 bit integer */
+static int clz32(uint32_t x) {
+#ifdef __GNUC__
+    return __builtin_clz(x);
+#else
+    int n = 0;
+    while (!(x & 0x80000000u)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Spreads the lower 10 bits of v so there are two zeros between each bit */
+static uint32_t expand_bits(uint32_t v) {
+    v = (v*0x00010001u) & 0xFF0000FFu;
+    v = (v*0x00000101u) & 0x0F00F00Fu;
+    v = (v*0x00000011u) & 0xC30C30C3u;
+    v = (v*0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/* 30 bit Morton code of a point with coordinates in [0, 1] */
+static uint32_t morton3D(double x, double y, double z) {
+    uint32_t q[3];
+    double p[3];
+    int k;
+
+    p[0] = x;
+    p[1] = y;
+    p[2] = z;
+    for (k = 0; k < 3; k++) {
+        double s = p[k]*1024;
+        s = s < 0 ? 0 : s;
+        s = s > 1023 ? 1023 : s;
+        q[k] = expand_bits((uint32_t)s);
+    }
+    return (q[0] << 2) | (q[1] << 1) | q[2];
+}
+
+/*
+ * Stable least significant digit radix sort of the keys, carrying the values
+ * with them. Each of the four passes counts the digits of each block, finds
+ * where each block writes each digit and then scatters the blocks, the blocks
+ * are processed in parallel.
+ */
+static void radix_sort(uint32_t * keys, int * vals, int n) {
+    uint32_t * keys_tmp = malloc(n*sizeof(uint32_t));
+    int * vals_tmp = malloc(n*sizeof(int));
+    size_t * counts = malloc(BVH_BLOCKS*BVH_RADIX*sizeof(size_t));
+    int shift;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        size_t offset = 0;
+        uint32_t * swap_keys;
+        int * swap_vals;
+        int b, digit;
+
+        BVH_PARALLEL_FOR
+        for (b = 0; b < BVH_BLOCKS; b++) {
+            size_t * c = &counts[b*BVH_RADIX];
+            int start = (int)((int64_t)n*b/BVH_BLOCKS);
+            int end = (int)((int64_t)n*(b + 1)/BVH_BLOCKS);
+            int i;
+
+            memset(c, 0, BVH_RADIX*sizeof(size_t));
+            for (i = start; i < end; i++)
+                c[(keys[i] >> shift) & (BVH_RADIX - 1)]++;
+        }
+
+        /* Each digit goes after all smaller digits and the same digit of earlier blocks */
+        for (digit = 0; digit < BVH_RADIX; digit++) {
+            for (b = 0; b < BVH_BLOCKS; b++) {
+                size_t c = counts[b*BVH_RADIX + digit];
+                counts[b*BVH_RADIX + digit] = offset;
+                offset += c;
+            }
+        }
+
+        BVH_PARALLEL_FOR
+        for (b = 0; b < BVH_BLOCKS; b++) {
+            size_t * c = &counts[b*BVH_RADIX];
+            int start = (int)((int64_t)n*b/BVH_BLOCKS);
+            int end = (int)((int64_t)n*(b + 1)/BVH_BLOCKS);
+            int i;
+
+            for (i = start; i < end; i++) {
+                size_t to = c[(keys[i] >> shift) & (BVH_RADIX - 1)]++;
+                keys_tmp[to] = keys[i];
+                vals_tmp[to] = vals[i];
+            }
+        }
+
+        swap_keys = keys;
+        keys = keys_tmp;
+        keys_tmp = swap_keys;
+        swap_vals = vals;
+        vals = vals_tmp;
+        vals_tmp = swap_vals;
+    }
+
+    /* After an even number of passes the sorted data is back in the inputs */
+    free(keys_tmp);
+    free(vals_tmp);
+    free(counts);
+}
+
+/*
+ * Length of the longest common prefix of the codes of leaves i and j, leaves
+ * with equal codes are told apart by their index. -1 if j is out of range.
+ */
+static int bvh_delta(uint32_t const * codes, int n, int i, int j) {
+    if (j < 0 || j >= n)
+        return -1;
+    if (codes[i] == codes[j])
+        return 32 + clz32((uint32_t)(i ^ j));
+    return clz32(codes[i] ^ codes[j]);
+}
+
+/*
+ * Emit internal node i: find the range of leaves it covers and where that
+ * range splits (Karras, 2012). Each node only depends on the sorted codes.
+ */
+static void emit_node(uint32_t const * codes, int n, int i, float const * face_boxes,
+        int const * faces, SurfaceBVH * const bvh, int * const leaf_parents) {
+    int d, d_min, l_max, l, t, j, d_node, s, div, split;
+    int first, last;
+    BVHNode * node = &bvh->nodes[i];
+
+    /* Direction of the range */
+    d = bvh_delta(codes, n, i, i + 1) - bvh_delta(codes, n, i, i - 1) >= 0 ? 1 : -1;
+
+    /* Upper bound of the length of the range, then the other end */
+    d_min = bvh_delta(codes, n, i, i - d);
+    l_max = 2;
+    while (bvh_delta(codes, n, i, i + l_max*d) > d_min)
+        l_max *= 2;
+    l = 0;
+    for (t = l_max/2; t >= 1; t /= 2) {
+        if (bvh_delta(codes, n, i, i + (l + t)*d) > d_min)
+            l += t;
+    }
+    j = i + l*d;
+
+    /* Binary search for where the common prefix of the range changes */
+    d_node = bvh_delta(codes, n, i, j);
+    s = 0;
+    div = 2;
+    do {
+        t = (l + div - 1)/div;
+        if (bvh_delta(codes, n, i, i + (s + t)*d) > d_node)
+            s += t;
+        div *= 2;
+    } while (t > 1);
+    split = i + s*d + (d < 0 ? d : 0);
+
+    first = i < j ? i : j;
+    last = i < j ? j : i;
+    if (first == split) {
+        node->child[0] = ~split;
+        memcpy(node->box[0], &face_boxes[6*faces[split]], 6*sizeof(float));
+        leaf_parents[split] = i;
+    } else {
+        node->child[0] = split;
+        bvh->parents[split] = i;
+    }
+    if (last == split + 1) {
+        node->child[1] = ~(split + 1);
+        memcpy(node->box[1], &face_boxes[6*faces[split + 1]], 6*sizeof(float));
+        leaf_parents[split + 1] = i;
+    } else {
+        node->child[1] = split + 1;
+        bvh->parents[split + 1] = i;
+    }
+}
+
+/*
+ * Restructure the treelet rooted at node r: grow it to BVH_TREELET leaves by
+ * expanding the leaf of largest area and find the topology of least surface
+ * area over all subsets of its leaves (Karras & Aila, 2013). The internal
+ * nodes of the treelet are reused so nothing outside of it changes.
+ */
+static void restructure_treelet(SurfaceBVH * const bvh, int r) {
+    int refs[BVH_TREELET];
+    float boxes[BVH_TREELET][6];
+    int internals[BVH_TREELET - 1];
+    float sub_box[1 << BVH_TREELET][6];
+    double cost[1 << BVH_TREELET];
+    int split[1 << BVH_TREELET];
+    int stack_mask[BVH_TREELET];
+    int stack_node[BVH_TREELET];
+    int n_leaves = 2, n_int = 1, next, n_stack;
+    int mask, full;
+
+    internals[0] = r;
+    for (int k = 0; k < 2; k++) {
+        refs[k] = bvh->nodes[r].child[k];
+        memcpy(boxes[k], bvh->nodes[r].box[k], 6*sizeof(float));
+    }
+
+    /* Grow the treelet */
+    while (n_leaves < BVH_TREELET) {
+        int best = -1;
+        double best_area = -1;
+        BVHNode * node;
+
+        for (int k = 0; k < n_leaves; k++) {
+            if (refs[k] >= 0 && box_area(boxes[k]) > best_area) {
+                best = k;
+                best_area = box_area(boxes[k]);
+            }
+        }
+        if (best < 0)
+            break;
+        node = &bvh->nodes[refs[best]];
+        internals[n_int++] = refs[best];
+        refs[best] = node->child[0];
+        memcpy(boxes[best], node->box[0], 6*sizeof(float));
+        refs[n_leaves] = node->child[1];
+        memcpy(boxes[n_leaves], node->box[1], 6*sizeof(float));
+        n_leaves++;
+    }
+    if (n_leaves < 3)
+        return;
+
+    /* Best topology of each subset, subsets of a mask are smaller than it */
+    full = (1 << n_leaves) - 1;
+    for (mask = 1; mask <= full; mask++) {
+        int low = mask & -mask;
+        int p;
+
+        if (mask == low) {
+            int k = 0;
+            while (!((1 << k) & mask))
+                k++;
+            memcpy(sub_box[mask], boxes[k], 6*sizeof(float));
+            cost[mask] = 0;
+            continue;
+        }
+        box_union(sub_box[low], sub_box[mask ^ low], sub_box[mask]);
+        cost[mask] = DBL_MAX;
+        /* Partitions with the lowest leaf on the left, to count each once */
+        for (p = (mask - 1) & mask; p > 0; p = (p - 1) & mask) {
+            double c;
+            if (!(p & low))
+                continue;
+            c = cost[p] + cost[mask ^ p];
+            if (c < cost[mask]) {
+                cost[mask] = c;
+                split[mask] = p;
+            }
+        }
+        cost[mask] += box_area(sub_box[mask]);
+    }
+
+    /* Rebuild the treelet from the best partitions */
+    next = 1;
+    n_stack = 1;
+    stack_mask[0] = full;
+    stack_node[0] = r;
+    while (n_stack > 0) {
+        int m, node;
+
+        n_stack--;
+        m = stack_mask[n_stack];
+        node = stack_node[n_stack];
+        for (int side = 0; side < 2; side++) {
+            int part = side == 0 ? split[m] : m ^ split[m];
+            int child;
+
+            if ((part & (part - 1)) == 0) {
+                int k = 0;
+                while (!((1 << k) & part))
+                    k++;
+                child = refs[k];
+            } else {
+                child = internals[next++];
+                stack_mask[n_stack] = part;
+                stack_node[n_stack] = child;
+                n_stack++;
+            }
+            bvh->nodes[node].child[side] = child;
+            memcpy(bvh->nodes[node].box[side], sub_box[part], 6*sizeof(float));
+            if (child >= 0)
+                bvh->parents[child] = node;
+        }
+    }
+}
+
+/* The depth and the surface area cost, relative to the root, of the hierarchy */
+static void bvh_measure(SurfaceBVH * const bvh) {
+    int * stack = malloc(bvh->n_faces*sizeof(int));
+    int * depth = malloc(bvh->n_faces*sizeof(int));
+    float root_box[6];
+    double area = 0;
+    int n_stack = 1;
+
+    box_union(bvh->nodes[0].box[0], bvh->nodes[0].box[1], root_box);
+    stack[0] = 0;
+    depth[0] = 1;
+    bvh->depth = 1;
+    while (n_stack > 0) {
+        BVHNode const * node;
+        int d;
+
+        n_stack--;
+        node = &bvh->nodes[stack[n_stack]];
+        d = depth[n_stack];
+        for (int k = 0; k < 2; k++) {
+            area += box_area(node->box[k]);
+            if (node->child[k] >= 0) {
+                stack[n_stack] = node->child[k];
+                depth[n_stack] = d + 1;
+                n_stack++;
+            } else if (d + 1 > bvh->depth) {
+                bvh->depth = d + 1;
+            }
+        }
+    }
+    bvh->sah_cost = box_area(root_box) > 0 ? 1 + area/box_area(root_box) : 0;
+    free(stack);
+    free(depth);
+}
+
+/* Bytes of the hierarchy of ntriag faces */
+static int64_t bvh_bytes(int ntriag) {
+    return (int64_t)sizeof(SurfaceBVH) + (int64_t)(ntriag - 1)*(sizeof(BVHNode) + sizeof(int))
+        + (int64_t)ntriag*sizeof(int);
+}
+
+/* Bytes of the temporary arrays used to build the hierarchy, including the sort */
+static int64_t bvh_build_bytes(int ntriag) {
+    return (int64_t)ntriag*(6*sizeof(float) + 2*sizeof(uint32_t) + 3*sizeof(int))
+        + BVH_BLOCKS*BVH_RADIX*sizeof(size_t);
+}
+
+int64_t bvh_memory(int ntriag) {
+    if (ntriag < BVH_MIN_FACES)
+        return 0;
+    return bvh_bytes(ntriag) + bvh_build_bytes(ntriag);
+}
+
+/*
+ * Builds the hierarchy of the faces of a surface.
+ *
+ * INPUTS:
+ *  V      - 3 x n array of the vertices
+ *  F      - 3 x ntriag array of the indices (from 1) of the vertices of each
+ *           face
+ *  ntriag - the number of faces
+ *
+ * OUTPUT:
+ *  Pointer to the hierarchy, NULL if there are fewer than BVH_MIN_FACES faces,
+ *  must be freed with free_bvh.
+ */
+SurfaceBVH * build_bvh(double const V[], int32_t const F[], int ntriag) {
+    SurfaceBVH * bvh;
+    float * face_boxes;
+    uint32_t * codes;
+    int * leaf_parents;
+    int * flags;
+    double block_min[BVH_BLOCKS][3], block_max[BVH_BLOCKS][3];
+    double c_min[3], c_max[3], scale[3];
+    double t0;
+    int b, i, k;
+
+    if (ntriag < BVH_MIN_FACES)
+        return NULL;
+    t0 = bvh_now();
+    account_memory(MEM_GEOMETRY, bvh_bytes(ntriag) + bvh_build_bytes(ntriag));
+
+    bvh = malloc(sizeof(SurfaceBVH));
+    bvh->n_faces = ntriag;
+    bvh->nodes = malloc((ntriag - 1)*sizeof(BVHNode));
+    bvh->parents = malloc((ntriag - 1)*sizeof(int));
+    bvh->faces = malloc(ntriag*sizeof(int));
+    bvh->treelet_time = 0;
+    bvh->n_queries = 0;
+    bvh->n_visited = 0;
+    bvh->n_tested = 0;
+    face_boxes = malloc(6*ntriag*sizeof(float));
+    codes = malloc(ntriag*sizeof(uint32_t));
+    leaf_parents = malloc(ntriag*sizeof(int));
+    flags = calloc(ntriag - 1, sizeof(int));
+
+    /* Box of each face and the bounds of the centroids, per block */
+    BVH_PARALLEL_FOR
+    for (b = 0; b < BVH_BLOCKS; b++) {
+        int start = (int)((int64_t)ntriag*b/BVH_BLOCKS);
+        int end = (int)((int64_t)ntriag*(b + 1)/BVH_BLOCKS);
+
+        for (int m = 0; m < 3; m++) {
+            block_min[b][m] = DBL_MAX;
+            block_max[b][m] = -DBL_MAX;
+        }
+        for (int f = start; f < end; f++) {
+            for (int m = 0; m < 3; m++) {
+                double lo = DBL_MAX, hi = -DBL_MAX, c;
+                for (int v = 0; v < 3; v++) {
+                    double x = V[3*(F[3*f + v] - 1) + m];
+                    lo = x < lo ? x : lo;
+                    hi = x > hi ? x : hi;
+                }
+                face_boxes[6*f + m] = round_down(lo);
+                face_boxes[6*f + m + 3] = round_up(hi);
+                c = 0.5*(lo + hi);
+                block_min[b][m] = c < block_min[b][m] ? c : block_min[b][m];
+                block_max[b][m] = c > block_max[b][m] ? c : block_max[b][m];
+            }
+        }
+    }
+    for (k = 0; k < 3; k++) {
+        c_min[k] = DBL_MAX;
+        c_max[k] = -DBL_MAX;
+        for (b = 0; b < BVH_BLOCKS; b++) {
+            c_min[k] = block_min[b][k] < c_min[k] ? block_min[b][k] : c_min[k];
+            c_max[k] = block_max[b][k] > c_max[k] ? block_max[b][k] : c_max[k];
+        }
+        scale[k] = c_max[k] > c_min[k] ? 1/(c_max[k] - c_min[k]) : 0;
+    }
+
+    /* Morton codes of the centres of the boxes, then sort the faces by them */
+    BVH_PARALLEL_FOR
+    for (i = 0; i < ntriag; i++) {
+        float const * box = &face_boxes[6*i];
+        codes[i] = morton3D((0.5*(box[0] + box[3]) - c_min[0])*scale[0],
+                            (0.5*(box[1] + box[4]) - c_min[1])*scale[1],
+                            (0.5*(box[2] + box[5]) - c_min[2])*scale[2]);
+        bvh->faces[i] = i;
+    }
+    radix_sort(codes, bvh->faces, ntriag);
+
+    /* Emit the internal nodes */
+    bvh->parents[0] = -1;
+    BVH_PARALLEL_FOR
+    for (i = 0; i < ntriag - 1; i++)
+        emit_node(codes, ntriag, i, face_boxes, bvh->faces, bvh, leaf_parents);
+
+    /*
+     * Fill in the boxes bottom up, the second of the two children of a node to
+     * finish puts the box of the node into its parent.
+     */
+    BVH_PARALLEL_FOR
+    for (i = 0; i < ntriag; i++) {
+        int node = leaf_parents[i];
+
+        while (node >= 0) {
+            int prev;
+            int parent;
+
+            BVH_FLUSH
+            BVH_ATOMIC_CAPTURE
+            prev = flags[node]++;
+            if (prev == 0)
+                break;
+            BVH_FLUSH
+            parent = bvh->parents[node];
+            if (parent >= 0) {
+                int side = bvh->nodes[parent].child[0] == node ? 0 : 1;
+                box_union(bvh->nodes[node].box[0], bvh->nodes[node].box[1],
+                    bvh->nodes[parent].box[side]);
+            }
+            node = parent;
+        }
+    }
+
+    free(face_boxes);
+    free(codes);
+    free(leaf_parents);
+    free(flags);
+    account_memory(MEM_GEOMETRY, -bvh_build_bytes(ntriag));
+
+    bvh_measure(bvh);
+    bvh->build_time = bvh_now() - t0;
+    return bvh;
+}
+
+/*
+ * Restructure the hierarchy with treelets. The treelets are processed bottom
+ * up in the same way as the boxes are built: a node is restructured once both
+ * of its children have been, so the treelets being restructured in parallel
+ * never overlap. One pass is made.
+ */
+void bvh_treelet_optimise(SurfaceBVH * const bvh) {
+    int n = bvh->n_faces;
+    int * leaf_parents = malloc(n*sizeof(int));
+    int * flags = calloc(n - 1, sizeof(int));
+    double t0 = bvh_now();
+    int i;
+
+    account_memory(MEM_GEOMETRY, (int64_t)(2*n - 1)*sizeof(int));
+    BVH_PARALLEL_FOR
+    for (i = 0; i < n - 1; i++) {
+        for (int k = 0; k < 2; k++) {
+            if (bvh->nodes[i].child[k] < 0)
+                leaf_parents[~bvh->nodes[i].child[k]] = i;
+        }
+    }
+
+    BVH_PARALLEL_FOR_DYNAMIC
+    for (i = 0; i < n; i++) {
+        int node = leaf_parents[i];
+
+        while (node >= 0) {
+            int prev;
+
+            BVH_FLUSH
+            BVH_ATOMIC_CAPTURE
+            prev = flags[node]++;
+            if (prev == 0)
+                break;
+            BVH_FLUSH
+            restructure_treelet(bvh, node);
+            BVH_FLUSH
+            node = bvh->parents[node];
+        }
+    }
+
+    free(leaf_parents);
+    free(flags);
+    account_memory(MEM_GEOMETRY, -(int64_t)(2*n - 1)*sizeof(int));
+
+    bvh_measure(bvh);
+    bvh->treelet_time = bvh_now() - t0;
+}
+
+void free_bvh(SurfaceBVH * const bvh) {
+    if (bvh == NULL)
+        return;
+    account_memory(MEM_GEOMETRY, -bvh_bytes(bvh->n_faces));
+    free(bvh->nodes);
+    free(bvh->parents);
+    free(bvh->faces);
+    free(bvh);
+}
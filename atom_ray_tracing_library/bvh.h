@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A linear bounding volume hierarchy (LBVH) of the faces of a triangulated
+ * surface, used by scatterTriag in place of looping over every face.
+ *
+ * The hierarchy is built as in Karras (2012): the faces are sorted by the
+ * Morton code of their centroid with a radix sort and the internal nodes are
+ * then emitted independently of each other from the sorted codes. The boxes
+ * are filled in bottom up. All three steps are run in parallel when the
+ * library is compiled with OpenMP (make OPENMP=1), otherwise they run serially
+ * and give the same hierarchy. An optional treelet restructuring pass
+ * (Karras & Aila, 2013) lowers the surface area cost of the hierarchy, and so
+ * the cost of traversal, at the expense of extra build time.
+ *
+ * There is one face per leaf. The boxes of the children are stored in their
+ * parent so that both children are tested when a node is visited.
+ */
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <stdint.h>
+
+/* Surfaces with fewer faces than this are not given a hierarchy */
+#define BVH_MIN_FACES 16
+
+/* Maximum depth of the hierarchy that can be traversed */
+#define BVH_STACK_SIZE 128
+
+typedef struct _bvhNode {
+    float box[2][6];    /* Boxes of the two children, min x y z then max x y z */
+    int child[2];       /* >= 0 an internal node, < 0 leaf ~child in faces */
+} BVHNode;
+
+typedef struct _surfaceBVH {
+    int n_faces;        /* Number of faces (leaves) */
+    BVHNode * nodes;    /* The n_faces - 1 internal nodes, 0 is the root */
+    int * parents;      /* Parent of each internal node, -1 for the root */
+    int * faces;        /* The face of each leaf, in Morton order */
+    int depth;          /* The maximum depth of the hierarchy */
+    double sah_cost;    /* Surface area cost of the hierarchy, relative to the root */
+    double build_time;  /* Time taken to build the hierarchy (s) */
+    double treelet_time;/* Time taken by the treelet restructuring (s) */
+
+    /* Cost of traversal, counted over all queries */
+    int64_t n_queries;  /* Number of rays intersected with the surface */
+    int64_t n_visited;  /* Number of internal nodes visited */
+    int64_t n_tested;   /* Number of ray-triangle tests */
+} SurfaceBVH;
+
+/*
+ * Build the hierarchy of the faces given the vertices (3 x nvert) and the
+ * faces (3 x ntriag, indices starting at 1). Returns NULL if there are fewer
+ * than BVH_MIN_FACES faces. Must be freed with free_bvh.
+ */
+SurfaceBVH * build_bvh(double const V[], int32_t const F[], int ntriag);
+
+/* Restructure the hierarchy with treelets of up to 5 leaves */
+void bvh_treelet_optimise(SurfaceBVH * const bvh);
+
+void free_bvh(SurfaceBVH * const bvh);
+
+/* The bytes used to build the hierarchy of ntriag faces, including the
+ * temporary arrays, 0 if it is not given one */
+int64_t bvh_memory(int ntriag);
+
+#endif /* BVH_H_ */
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Diagnostics for rays that take a long time to trace, see diagnostics.h.
+ */
+
+#include "diagnostics.h"
+#include "ray_tracing_core3D.h"
+#include "memory_account.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* The current time in seconds */
+static double diag_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+int64_t diagnostics_memory(int capacity, int max_path) {
+    return (int64_t)capacity*max_path*(3*sizeof(double) + 2*sizeof(int))
+        + (int64_t)capacity*(2*sizeof(int) + sizeof(double))
+        + (int64_t)max_path*(3*sizeof(double) + 2*sizeof(int));
+}
+
+/*
+ * Allocates the memory for the diagnostics. At the end of the program, MUST
+ * call clean_up_diagnostics to free allocated memory.
+ *
+ * INPUTS:
+ *  bounce_threshold - record rays with at least this many scattering events
+ *                     (sample and pinhole plate), 0 or less to not use
+ *  time_threshold   - record rays that took at least this long to trace in
+ *                     seconds, 0 or less to not use
+ *  capacity         - the number of paths to keep, the oldest paths are
+ *                     overwritten
+ *  max_path         - the maximum number of vertices of a path to keep
+ *
+ * OUTPUT:
+ *  diag - the diagnostics struct
+ */
+void set_up_diagnostics(int bounce_threshold, double time_threshold, int capacity,
+        int max_path, RayDiagnostics * const diag) {
+    diag->bounce_threshold = bounce_threshold;
+    diag->time_threshold = time_threshold;
+    diag->capacity = capacity;
+    diag->max_path = max_path;
+
+    diag->n_recorded = 0;
+    diag->next = 0;
+    account_memory(MEM_OUTPUTS, diagnostics_memory(capacity, max_path));
+    diag->positions = (double*)calloc(capacity*max_path*3, sizeof(double));
+    diag->faces = (int*)calloc(capacity*max_path, sizeof(int));
+    diag->surfaces = (int*)calloc(capacity*max_path, sizeof(int));
+    diag->path_length = (int*)calloc(capacity, sizeof(int));
+    diag->status = (int*)calloc(capacity, sizeof(int));
+    diag->path_time = (double*)calloc(capacity, sizeof(double));
+
+    memset(diag->time_hist, 0, sizeof(diag->time_hist));
+    diag->total_time = 0;
+    diag->n_rays = 0;
+
+    diag->cur_length = 0;
+    diag->cur_start = 0;
+    diag->cur_positions = (double*)malloc(max_path*3*sizeof(double));
+    diag->cur_faces = (int*)malloc(max_path*sizeof(int));
+    diag->cur_surfaces = (int*)malloc(max_path*sizeof(int));
+}
+
+void clean_up_diagnostics(RayDiagnostics * const diag) {
+    account_memory(MEM_OUTPUTS, -diagnostics_memory(diag->capacity, diag->max_path));
+    free(diag->positions);
+    free(diag->faces);
+    free(diag->surfaces);
+    free(diag->path_length);
+    free(diag->status);
+    free(diag->path_time);
+    free(diag->cur_positions);
+    free(diag->cur_faces);
+    free(diag->cur_surfaces);
+}
+
+void diag_start_ray(RayDiagnostics * const diag, Ray3D const * const the_ray) {
+    diag->cur_length = 0;
+    diag_add_vertex(diag, the_ray);
+    diag->cur_start = diag_now();
+}
+
+void diag_add_vertex(RayDiagnostics * const diag, Ray3D const * const the_ray) {
+    int n = diag->cur_length;
+
+    if (n < diag->max_path) {
+        diag->cur_positions[n*3] = the_ray->position[0];
+        diag->cur_positions[n*3 + 1] = the_ray->position[1];
+        diag->cur_positions[n*3 + 2] = the_ray->position[2];
+        diag->cur_faces[n] = the_ray->on_element;
+        diag->cur_surfaces[n] = the_ray->on_surface;
+    }
+    diag->cur_length++;
+}
+
+/*
+ * Finish recording the path of a ray. The time is added to the histogram and
+ * the path is copied into the ring buffer if the ray exceeded either of the
+ * thresholds.
+ */
+void diag_end_ray(RayDiagnostics * const diag, Ray3D const * const the_ray,
+        int n_allScatters) {
+    double t;
+    double us;
+    int bin;
+    int keep;
+
+    /* Add the time to the histogram */
+    t = diag_now() - diag->cur_start;
+    diag->total_time += t;
+    diag->n_rays++;
+    us = t*1e6;
+    bin = 0;
+    while ((us >= 1) && (bin < DIAG_TIME_BINS - 1)) {
+        us /= 2;
+        bin++;
+    }
+    diag->time_hist[bin]++;
+
+    keep = ((diag->bounce_threshold > 0) && (n_allScatters >= diag->bounce_threshold)) ||
+           ((diag->time_threshold > 0) && (t >= diag->time_threshold));
+    if (keep && diag->capacity > 0) {
+        int i = diag->next;
+        int n = diag->cur_length < diag->max_path ? diag->cur_length : diag->max_path;
+
+        memcpy(&diag->positions[i*diag->max_path*3], diag->cur_positions,
+                n*3*sizeof(double));
+        memcpy(&diag->faces[i*diag->max_path], diag->cur_faces, n*sizeof(int));
+        memcpy(&diag->surfaces[i*diag->max_path], diag->cur_surfaces, n*sizeof(int));
+        diag->path_length[i] = diag->cur_length;
+        diag->status[i] = the_ray->status;
+        diag->path_time[i] = t;
+
+        diag->next = (i + 1) % diag->capacity;
+        diag->n_recorded++;
+    }
+}
+
+int diag_n_stored(RayDiagnostics const * const diag) {
+    return diag->n_recorded < diag->capacity ? diag->n_recorded : diag->capacity;
+}
+
+int diag_stored_index(RayDiagnostics const * const diag, int i) {
+    if (diag->n_recorded <= diag->capacity)
+        return i;
+    return (diag->next + i) % diag->capacity;
+}
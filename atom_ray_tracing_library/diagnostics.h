@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Diagnostics for rays that take a long time to trace, e.g. rays that get
+ * trapped between the sample and the pinhole plate. The full bounce paths of
+ * rays that exceed a number of scattering events or a time are recorded in a
+ * ring buffer of bounded size, and a histogram of the time taken to trace each
+ * ray is kept.
+ *
+ * The diagnostics are passed to the tracing functions as a pointer, if the
+ * pointer is NULL no diagnostics are recorded.
+ */
+
+#ifndef DIAGNOSTICS_H_
+#define DIAGNOSTICS_H_
+
+#include "ray_tracing_core3D.h"
+
+/* Number of bins in the histogram of ray times, bin 0 is <1us and bin k is
+ * [2^(k-1), 2^k) us, the last bin includes all longer times */
+#define DIAG_TIME_BINS 24
+
+typedef struct _rayDiagnostics {
+    int bounce_threshold;   /* Record rays with at least this many scattering events, <=0 off */
+    double time_threshold;  /* Record rays that took at least this long (s), <=0 off */
+    int capacity;           /* The number of paths the ring buffer holds */
+    int max_path;           /* The maximum number of vertices stored per path */
+
+    int n_recorded;         /* Total number of paths recorded, may exceed capacity */
+    int next;               /* Index in the ring buffer of the next path */
+    double *positions;      /* capacity x max_path x 3 positions of the vertices */
+    int *faces;             /* capacity x max_path the face hit at each vertex */
+    int *surfaces;          /* capacity x max_path the surface hit at each vertex */
+    int *path_length;       /* The number of vertices of each path (may exceed max_path) */
+    int *status;            /* The final status of the ray of each path */
+    double *path_time;      /* The time taken to trace the ray of each path (s) */
+
+    int64_t time_hist[DIAG_TIME_BINS]; /* Histogram of the times to trace rays */
+    double total_time;                 /* Total time spent tracing rays (s) */
+    int64_t n_rays;                    /* Number of rays traced */
+
+    /* The path of the ray currently being traced */
+    int cur_length;
+    double cur_start;
+    double *cur_positions;
+    int *cur_faces;
+    int *cur_surfaces;
+} RayDiagnostics;
+
+/* Allocates the memory for the diagnostics, must call clean_up_diagnostics */
+void set_up_diagnostics(int bounce_threshold, double time_threshold, int capacity,
+        int max_path, RayDiagnostics * const diag);
+
+void clean_up_diagnostics(RayDiagnostics * const diag);
+
+/* The bytes set_up_diagnostics allocates */
+int64_t diagnostics_memory(int capacity, int max_path);
+
+/* Start recording the path of a ray, records its initial position */
+void diag_start_ray(RayDiagnostics * const diag, Ray3D const * const the_ray);
+
+/* Record a scattering event of the ray */
+void diag_add_vertex(RayDiagnostics * const diag, Ray3D const * const the_ray);
+
+/* Finish recording the path of a ray, keeps it if it exceeded a threshold */
+void diag_end_ray(RayDiagnostics * const diag, Ray3D const * const the_ray,
+        int n_allScatters);
+
+/* The number of paths held in the ring buffer */
+int diag_n_stored(RayDiagnostics const * const diag);
+
+/* The index in the ring buffer of the i-th oldest stored path */
+int diag_stored_index(RayDiagnostics const * const diag, int i);
+
+#endif /* DIAGNOSTICS_H_ */
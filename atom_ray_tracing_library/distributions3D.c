@@ -51,10 +51,62 @@ distribution_func distribution_by_name(const char * name) {
     return NULL;
 } 
 
-void pure_specular(const double normal[3], const double init_dir[3],
+int distribution_n_params(distribution_func func) {
+    /* The Debye-Waller filter reads 5 and the diffraction pattern 9 */
+    if (func == diffuse_and_specular)
+        return 2;
+    if (func == diffuse_and_diffraction)
+        return 1 + 9;
+    if (func == debye_waller_specular)
+        return 5 + 1;
+    if (func == debye_waller_diffraction)
+        return 5 + 9;
+    return 0;
+}
+
+/* Make the frame of a surface with the given unit normal, without a lattice */
+void make_frame(const double normal[3], SurfaceFrame * const frame) {
+    int k;
+
+    for (k = 0; k < 3; k++)
+        frame->normal[k] = normal[k];
+    perpendicular_plane(normal, frame->t1, frame->t2);
+    frame->has_lattice = 0;
+}
+
+/*
+ * Store the reciprocal lattice vectors, scaled by the lambda/a ratio, of a
+ * diffracting distribution in the frame. Distributions that do not diffract
+ * leave the frame without a lattice. The lattice vectors are given in the
+ * (t1, t2) basis of the frame.
+ */
+void set_frame_lattice(distribution_func func, const double * const params,
+        SurfaceFrame * const frame) {
+    const double * diff_params;
+    int k;
+
+    frame->has_lattice = 0;
+    if (params == NULL)
+        return;
+    if (func == diffraction_pattern)
+        diff_params = params;
+    else if (func == diffuse_and_diffraction)
+        diff_params = params + 1;
+    else if (func == debye_waller_diffraction)
+        diff_params = params + 5;
+    else
+        return;
+
+    /* params[2] is the lambda/a ratio, params[3..6] are b1 and b2 */
+    for (k = 0; k < 4; k++)
+        frame->lattice[k] = diff_params[2]*diff_params[3 + k];
+    frame->has_lattice = 1;
+}
+
+void pure_specular(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
     //printf("\nIt has reflected\n");
-    reflect3D(normal, init_dir, new_dir);
+    reflect3D(frame->normal, init_dir, new_dir);
 }
 
 /*
@@ -64,16 +116,16 @@ void pure_specular(const double normal[3], const double init_dir[3],
  *  first the level (0 - 1) of the diffuse background, then sigma of
  * broad_specular.
  */
-void diffuse_and_specular(const double normal[3], const double init_dir[3],
+void diffuse_and_specular(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
 
     double diffuse_lvl = params[0];
     double tester;
     genRand(myrng, &tester);
     if(tester < diffuse_lvl)
-        cosine_scatter(normal, init_dir, new_dir, params+1, myrng);
+        cosine_scatter(frame, init_dir, new_dir, params+1, myrng);
     else
-        broad_specular_scatter(normal, init_dir, new_dir, params+1, myrng);
+        broad_specular_scatter(frame, init_dir, new_dir, params+1, myrng);
 }
 
 /*
@@ -84,16 +136,16 @@ void diffuse_and_specular(const double normal[3], const double init_dir[3],
  *  first the level (0 - 1) of the diffuse background, then as for
  * diffraction_pattern.
  */
-void diffuse_and_diffraction(const double normal[3], const double init_dir[3],
+void diffuse_and_diffraction(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
 
     double diffuse_lvl = params[0];
     double tester;
     genRand(myrng, &tester);
     if(tester < diffuse_lvl)
-        cosine_scatter(normal, init_dir, new_dir, params+1, myrng);
+        cosine_scatter(frame, init_dir, new_dir, params+1, myrng);
     else
-        diffraction_pattern(normal, init_dir, new_dir, params+1, myrng);
+        diffraction_pattern(frame, init_dir, new_dir, params+1, myrng);
 }
 
 
@@ -111,7 +163,7 @@ void diffuse_and_diffraction(const double normal[3], const double init_dir[3],
  * + followed by all the params for the original distribution
  */
 void debye_waller_filter_diffuse(distribution_func original_distr,
-        const double normal[3], const double init_dir[3],
+        SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
 
     // this prefactor appears in the DW exponent if the following
@@ -128,7 +180,7 @@ void debye_waller_filter_diffuse(distribution_func original_distr,
     gaussian_random_tail(1, energy_sigma, -1, myrng, &energy_ratio);
 
     // generate a new direction with the original distribution
-    original_distr(normal, init_dir, new_dir, params+5, myrng);
+    original_distr(frame, init_dir, new_dir, params+5, myrng);
 
     // with probability proportional to debye-waller factor turn it into diffuse scattering
     double tmp;
@@ -137,19 +189,19 @@ void debye_waller_filter_diffuse(distribution_func original_distr,
     genRand(myrng, &tester);
 
     if(tester > dwf)
-        cosine_scatter(normal, init_dir, new_dir, NULL, myrng);
+        cosine_scatter(frame, init_dir, new_dir, NULL, myrng);
 }
 
-void debye_waller_specular(const double normal[3], const double init_dir[3],
+void debye_waller_specular(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
-    debye_waller_filter_diffuse(broad_specular_scatter, normal, init_dir,
+    debye_waller_filter_diffuse(broad_specular_scatter, frame, init_dir,
         new_dir, params, myrng);
 }
 
 
-void debye_waller_diffraction(const double normal[3], const double init_dir[3],
+void debye_waller_diffraction(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
-    debye_waller_filter_diffuse(diffraction_pattern, normal, init_dir,
+    debye_waller_filter_diffuse(diffraction_pattern, frame, init_dir,
         new_dir, params, myrng);
 }
 
@@ -165,11 +217,16 @@ void debye_waller_diffraction(const double normal[3], const double init_dir[3],
  *  a coefficient to pre-multiply the basis vectors
  *  4 floats for 2 x 2D basis vectors
  *  the sigma to broaden the peaks by, and the sigma of the overall gaussian envelope
+ *
+ * If the frame has a lattice (see set_frame_lattice) it is used instead of
+ * scaling the basis vectors in params.
  */
-void diffraction_pattern(const double normal[3], const double init_dir[3],
+void diffraction_pattern(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
 
-    double e1[3], e2[3];    // unit vectors spanning the surface
+    const double * e1 = frame->t1;     // unit vectors spanning the surface
+    const double * e2 = frame->t2;
+    const double * normal = frame->normal;
     double ni[3], nf[3];    // initial and final directions relative to surface
     double delta[2];        // perturbation to smudge the peaks
     double plane_component2;// squared length of the projection parallel to surface
@@ -178,19 +235,25 @@ void diffraction_pattern(const double normal[3], const double init_dir[3],
 
     // unpack the arguments
     const int maxp = (int)params[0], maxq = (int)params[1];
-    const double ratio = params[2]; // the lambda/a ratio that scales the reciprocal vector
 
-    double b1[2], b2[2];    // the reciprocal lattice vectors
-    b1[0] = params[3];
-    b1[1] = params[4];
-    b2[0] = params[5];
-    b2[1] = params[6];
+    double b1[2], b2[2];    // the reciprocal lattice vectors, scaled by lambda/a
+    if (frame->has_lattice) {
+        b1[0] = frame->lattice[0];
+        b1[1] = frame->lattice[1];
+        b2[0] = frame->lattice[2];
+        b2[1] = frame->lattice[3];
+    } else {
+        const double ratio = params[2]; // the lambda/a ratio that scales the reciprocal vector
+        b1[0] = ratio*params[3];
+        b1[1] = ratio*params[4];
+        b2[0] = ratio*params[5];
+        b2[1] = ratio*params[6];
+    }
 
     double peak_sig = params[7];    // width of individual peaks
     double envelope_sig = params[8]; // width of overall envelope
 
     // switch to surface-specific coordinates: (x, y) in the plane, z orthogonal:
-    perpendicular_plane(normal, e1, e2);
     dot(init_dir, e1, &ni[0]);
     dot(init_dir, e2, &ni[1]);
     dot(init_dir, normal, &ni[2]);
@@ -213,8 +276,8 @@ void diffraction_pattern(const double normal[3], const double init_dir[3],
         gaussian_random(0, peak_sig, delta, myrng);
 
         // add it to the in-plane components of incident direction
-        nf[0] = ni[0] + ratio * (p*b1[0] + q*b2[0]) + delta[0];
-        nf[1] = ni[1] + ratio * (p*b1[1] + q*b2[1]) + delta[1];
+        nf[0] = ni[0] + (p*b1[0] + q*b2[0]) + delta[0];
+        nf[1] = ni[1] + (p*b1[1] + q*b2[1]) + delta[1];
         plane_component2 = nf[0]*nf[0] + nf[1]*nf[1];
 
     } while(plane_component2 > 1);
@@ -237,13 +300,13 @@ void diffraction_pattern(const double normal[3], const double init_dir[3],
  * and theta is the angle between the new direction and the specular.
  *
  * INPUTS:
- *  normal - the surface normal at the ray surface intersection
+ *  frame    - the frame of the surface at the ray surface intersection
  *  init_dir - the initial direction of the ray
  *  new_dir  - array to put the new direction in
  *  params   - first element must be standard deviation of gaussian distribution
  *  myrng    - 
  */
-void broad_specular_scatter(const double normal[3], const double init_dir[3],
+void broad_specular_scatter(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
 
     double theta, phi;
@@ -253,7 +316,7 @@ void broad_specular_scatter(const double normal[3], const double init_dir[3],
     double tester = 1.0;
 
     /* The 'specular' direction is stored in t0 */
-    reflect3D(normal, init_dir, t0);
+    reflect3D(frame->normal, init_dir, t0);
     /* t1 and t2 are the tangential directions */
     perpendicular_plane(t0, t1, t2);
 
@@ -273,7 +336,7 @@ void broad_specular_scatter(const double normal[3], const double init_dir[3],
 
         /* Calculate the polar angle (normal, new_dir) to the surface normal for
          * the new direction */
-        dot(normal, new_dir, &cos_normal);
+        dot(frame->normal, new_dir, &cos_normal);
 
         /* If the value of theta_normal is greater than pi/2 reject */
         if (cos_normal < 0)
@@ -311,25 +374,26 @@ static double theta_generate(double sigma, MTRand * const myrng) {
          * and use the previously generated one if we are on an even iteration 
          * (2nd, 4th, etc.)
          */
-        if (cnt % 2) {
+        if (!(cnt % 2)) {
             gaussian_random(0, sigma, Z, myrng);
             rand1 = Z[0];
         } else {
             rand1 = Z[1];
         }
+        cnt++;
         theta = fabs(rand1);
         
         /* If theta exceeds pi then try again */
-        if (theta > M_PI)
+        if (theta > M_PI) {
+            s_theta = -1;
             continue;
+        }
 
         /* Calculate the sine of the angle */
         s_theta = 0.5*sin(theta);
 
         /* Generate a tester variable */
         genRand(myrng, &tester);
-        
-        cnt++;
     } while (s_theta < tester);
 
     return(theta);
@@ -341,19 +405,19 @@ static double theta_generate(double sigma, MTRand * const myrng) {
  * about the provided normal and stores the result in the provided array.
  *
  * INPUTS:
- *  normal  - double array, the normal to the surface at the point of scattering
+ *  frame   - the frame (normal and tangents) of the surface at the point of
+ *            scattering
  *  initial_dir - can be NULL
  *  new_dir - double array, an array to store the new direction of the ray
  *  params  - no parameters expected, can be NULL
  *  myrng   - 
  */
-void cosine_scatter(const double normal[3], const double init_dir[3],
+void cosine_scatter(SurfaceFrame const * const frame, const double init_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
     double s_theta, c_theta, phi;
-    double t1[3];
-    double t2[3];
-
-    perpendicular_plane(normal, t1, t2);
+    const double * t1 = frame->t1;
+    const double * t2 = frame->t2;
+    const double * normal = frame->normal;
 
     double uni_rand;
     genRand(myrng, &uni_rand);
@@ -372,7 +436,7 @@ void cosine_scatter(const double normal[3], const double init_dir[3],
  * Generated a random normalized direction according to a cosine distribution
  * about the specular direction.
  */
-void cosine_specular_scatter(const double normal[3], const double initial_dir[3],
+void cosine_specular_scatter(SurfaceFrame const * const frame, const double initial_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
     double s_theta, c_theta, phi;
     double dot_normal;
@@ -382,7 +446,7 @@ void cosine_specular_scatter(const double normal[3], const double initial_dir[3]
 
 
     /* The 'specular' direction is stored in t0 */
-    reflect3D(normal, initial_dir, t0);
+    reflect3D(frame->normal, initial_dir, t0);
     perpendicular_plane(t0, t1, t2);
 
     /* Keep generating direction until one is in the allowed range (not going
@@ -405,7 +469,7 @@ void cosine_specular_scatter(const double normal[3], const double initial_dir[3]
         normalise(new_dir);
 
         /* Calculate the polar angle to the surface normal for the new direction */
-        dot(normal, new_dir, &dot_normal);
+        dot(frame->normal, new_dir, &dot_normal);
     } while (dot_normal < 0);
 }
 
@@ -414,19 +478,19 @@ void cosine_specular_scatter(const double normal[3], const double initial_dir[3]
  * angle about the provided normal.
  *
  * INPUTS:
- *  normal  - double array, the normal to the surface at the point of scattering
+ *  frame   - the frame (normal and tangents) of the surface at the point of
+ *            scattering
  *  initial_dir - can be NULL
  *  new_dir - double array, an array to store the new direction of the ray
  *  params  - no parameters expected, can be NULL
  *  myrng   - 
  */
-void uniform_scatter(const double normal[3], const double initial_dir[3],
+void uniform_scatter(SurfaceFrame const * const frame, const double initial_dir[3],
         double new_dir[3], const double * const params, MTRand * const myrng) {
     double s_theta, c_theta, phi;
-    double t1[3];
-    double t2[3];
-
-    perpendicular_plane(normal, t1, t2);
+    const double * t1 = frame->t1;
+    const double * t2 = frame->t2;
+    const double * normal = frame->normal;
 
     /* Generate random numbers for phi and cos(theta) */
     double uni_rand;
@@ -441,3 +505,230 @@ void uniform_scatter(const double normal[3], const double initial_dir[3],
         new_dir[k] = t1[k]*cos(phi)*s_theta + t2[k]*sin(phi)*s_theta + normal[k]*c_theta;
     }
 }
+
+double density_fraction(distribution_func func, const double * const params) {
+    if ((func == cosine_scatter) || (func == uniform_scatter) ||
+            (func == cosine_specular_scatter))
+        return 1;
+    if ((func == diffuse_and_specular) || (func == diffuse_and_diffraction))
+        return params[0] < 0 ? 0 : (params[0] > 1 ? 1 : params[0]);
+    return 0;
+}
+
+int scatter_split(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], double new_dir[3], const double * const params,
+        MTRand * const myrng) {
+    double frac = density_fraction(func, params);
+    double tester;
+
+    if ((func != diffuse_and_specular) && (func != diffuse_and_diffraction)) {
+        func(frame, init_dir, new_dir, params, myrng);
+        return frac > 0;
+    }
+
+    /* As for the mixtures themselves, but knowing which part was chosen */
+    genRand(myrng, &tester);
+    if (tester < frac) {
+        cosine_scatter(frame, init_dir, new_dir, params + 1, myrng);
+        return 1;
+    }
+    if (func == diffuse_and_specular)
+        broad_specular_scatter(frame, init_dir, new_dir, params + 1, myrng);
+    else
+        diffraction_pattern(frame, init_dir, new_dir, params + 1, myrng);
+    return 0;
+}
+
+double scatter_density(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], const double new_dir[3], const double * const params) {
+    double cos_normal;
+
+    dot(frame->normal, new_dir, &cos_normal);
+    if (cos_normal <= 0)
+        return 0;
+
+    if (func == cosine_scatter)
+        return cos_normal/M_PI;
+
+    /* The cosine of the polar angle is uniform on [0.0001, 1] */
+    if (func == uniform_scatter)
+        return cos_normal < 0.0001 ? 0 : 1/(2*M_PI*0.9999);
+
+    /*
+     * A cosine about the specular direction with the part going into the
+     * surface rejected, which is a fraction (1 - cos(alpha))/2 of it where
+     * alpha is the angle of the specular direction to the normal.
+     */
+    if (func == cosine_specular_scatter) {
+        double t0[3];
+        double cos_specular, cos_alpha;
+
+        reflect3D(frame->normal, init_dir, t0);
+        dot(t0, new_dir, &cos_specular);
+        dot(frame->normal, t0, &cos_alpha);
+        if (cos_specular <= 0)
+            return 0;
+        return cos_specular/(M_PI*0.5*(1 + cos_alpha));
+    }
+
+    return density_fraction(func, params)*cos_normal/M_PI;
+}
+
+int has_score(distribution_func func, int k) {
+    if (func == diffuse_and_specular)
+        return k == 0 || k == 1;
+    if (func == diffuse_and_diffraction)
+        return k == 0;
+    if (func == debye_waller_specular)
+        return (k >= 0 && k <= 3) || k == 5;
+    if (func == debye_waller_diffraction)
+        return k >= 0 && k <= 3;
+    return 0;
+}
+
+int specular_sigma_index(distribution_func func) {
+    if (func == diffuse_and_specular)
+        return 1;
+    if (func == debye_waller_specular)
+        return 5;
+    return -1;
+}
+
+/*
+ * The integral over the azimuth about the specular direction of the cosine of
+ * the direction to the normal where it is positive, cos(normal) = a + b cos(phi)
+ * with b >= 0.
+ */
+static double azimuthal_cosine(double a, double b) {
+    double phi0;
+
+    if (a >= b)
+        return 2*M_PI*a;
+    if (a <= -b)
+        return 0;
+    phi0 = acos(-a/b);
+    return 2*(a*phi0 + b*sin(phi0));
+}
+
+/*
+ * The density of the broadened specular is exp(-theta^2/(2 sigma^2)) cos(normal)
+ * per steradian, over its normalisation Z. So d log Z / d sigma is the mean of
+ * theta^2/sigma^3, found with Simpson's rule over theta for each alpha.
+ */
+void set_up_specular_score(double sigma, SpecularScore * const table) {
+    int const n = 512;
+    double const theta_max = 12*sigma < M_PI ? 12*sigma : M_PI;
+    double const h = theta_max/n;
+    int i, j;
+
+    table->sigma = sigma;
+    for (i = 0; i < SPECULAR_SCORE_SIZE; i++) {
+        double const c_alpha = (double)i/(SPECULAR_SCORE_SIZE - 1);
+        double const s_alpha = sqrt(1 - c_alpha*c_alpha);
+        double z = 0, z2 = 0;
+
+        for (j = 0; j <= n; j++) {
+            double const theta = j*h;
+            double const c = (j == 0 || j == n) ? 1 : (j % 2 ? 4 : 2);
+            double const w = c*exp(-theta*theta/(2*sigma*sigma))*sin(theta)*
+                azimuthal_cosine(cos(theta)*c_alpha, sin(theta)*s_alpha);
+            z += w;
+            z2 += w*theta*theta;
+        }
+        table->dlog_norm[i] = z > 0 ? z2/(z*sigma*sigma*sigma) : 0;
+    }
+}
+
+/* The score of the sigma of a direction from the broadened specular */
+static double specular_score(SpecularScore const * const spec,
+        SurfaceFrame const * const frame, const double init_dir[3],
+        const double new_dir[3]) {
+    double t0[3];
+    double c_theta, c_alpha, theta, x;
+    int i;
+
+    reflect3D(frame->normal, init_dir, t0);
+    dot(t0, new_dir, &c_theta);
+    dot(frame->normal, t0, &c_alpha);
+    theta = acos(c_theta > 1 ? 1 : (c_theta < -1 ? -1 : c_theta));
+
+    /* Linear interpolation in the table */
+    x = (c_alpha < 0 ? 0 : (c_alpha > 1 ? 1 : c_alpha))*(SPECULAR_SCORE_SIZE - 1);
+    i = (int)x;
+    if (i > SPECULAR_SCORE_SIZE - 2)
+        i = SPECULAR_SCORE_SIZE - 2;
+    x -= i;
+    return theta*theta/(spec->sigma*spec->sigma*spec->sigma) -
+        ((1 - x)*spec->dlog_norm[i] + x*spec->dlog_norm[i + 1]);
+}
+
+void scatter_score(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], double new_dir[3], const double * const params,
+        SpecularScore const * const spec, double score[SCORE_N_PARAMS],
+        MTRand * const myrng) {
+    int k;
+
+    for (k = 0; k < SCORE_N_PARAMS; k++)
+        score[k] = 0;
+
+    /* The diffuse level chooses the part of the mixture */
+    if ((func == diffuse_and_specular) || (func == diffuse_and_diffraction)) {
+        double tester;
+
+        genRand(myrng, &tester);
+        if (tester < params[0]) {
+            cosine_scatter(frame, init_dir, new_dir, params + 1, myrng);
+            score[0] = 1/params[0];
+        } else {
+            if (func == diffuse_and_specular) {
+                broad_specular_scatter(frame, init_dir, new_dir, params + 1, myrng);
+                if (spec != NULL)
+                    score[1] = specular_score(spec, frame, init_dir, new_dir);
+            } else {
+                diffraction_pattern(frame, init_dir, new_dir, params + 1, myrng);
+            }
+            score[0] = -1/(1 - params[0]);
+        }
+        return;
+    }
+
+    /*
+     * As debye_waller_filter_diffuse. The Debye-Waller factor is exp(-x), the
+     * ray is kept with that probability and turned diffuse otherwise.
+     */
+    if ((func == debye_waller_specular) || (func == debye_waller_diffraction)) {
+        const double prefactor = 278.5085;
+        double const scale = prefactor/(params[1]*params[3]*params[3]);
+        double energy_ratio, c_dir, g, x, dwf, tester, dlog;
+
+        gaussian_random_tail(1, params[4], -1, myrng, &energy_ratio);
+        if (func == debye_waller_specular) {
+            broad_specular_scatter(frame, init_dir, new_dir, params + 5, myrng);
+            if (spec != NULL)
+                score[5] = specular_score(spec, frame, init_dir, new_dir);
+        } else {
+            diffraction_pattern(frame, init_dir, new_dir, params + 5, myrng);
+        }
+
+        dot(init_dir, new_dir, &c_dir);
+        g = 1.0 + energy_ratio - 2*sqrt(energy_ratio)*c_dir;
+        x = scale*params[0]*params[2]*g;
+        dwf = exp(-x);
+        genRand(myrng, &tester);
+
+        /* d log p / d x for the choice made */
+        if (tester > dwf) {
+            cosine_scatter(frame, init_dir, new_dir, NULL, myrng);
+            dlog = dwf/(1 - dwf);
+        } else {
+            dlog = -1;
+        }
+        score[0] = dlog*scale*params[2]*g;
+        score[1] = -dlog*x/params[1];
+        score[2] = dlog*scale*params[0]*g;
+        score[3] = -2*dlog*x/params[3];
+        return;
+    }
+
+    func(frame, init_dir, new_dir, params, myrng);
+}
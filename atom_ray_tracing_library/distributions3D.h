@@ -13,22 +13,53 @@
 
 #include "mtwister.h"
 
+/*
+ * An orthonormal frame at a point on a surface, the normal and two tangents.
+ * For the triangulated surfaces the frame of each face is built once with the
+ * surface, for the analytic sphere and the simple pinhole plate it is made on
+ * the fly with make_frame.
+ *
+ * For faces of a diffracting material the reciprocal lattice vectors, scaled
+ * by the lambda/a ratio, are stored in the (t1, t2) basis of the face so they
+ * do not have to be unpacked and scaled on every scattering event.
+ */
+typedef struct _surfaceFrame {
+    double normal[3];   /* Unit normal to the surface */
+    double t1[3];       /* First unit tangent */
+    double t2[3];       /* Second unit tangent, normal x t1 */
+    int has_lattice;    /* Is lattice set */
+    double lattice[4];  /* Scaled b1 (0, 1) and b2 (2, 3) in the (t1, t2) basis */
+} SurfaceFrame;
+
 /*
  * This is the TYPE of a distribution function. They take in:
- * - a surface normal
+ * - the frame of the surface (normal and tangents) at the scattering point
  * - an original direction
  * - a new direction, which will be overwritten
  * - a pointer to a double array of parameters
  * - a GSL random number generator
  */
-typedef void (*distribution_func)(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+typedef void (*distribution_func)(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 distribution_func distribution_by_name(const char * name);
 
+/* The number of parameters a distribution function reads */
+int distribution_n_params(distribution_func func);
+
+/* Make the frame of a surface with the given unit normal, without a lattice */
+void make_frame(const double normal[3], SurfaceFrame * const frame);
+
+/*
+ * Store the scaled reciprocal lattice vectors in the frame if the distribution
+ * func is a diffracting one, params are its parameters.
+ */
+void set_frame_lattice(distribution_func func, const double * const params,
+        SurfaceFrame * const frame);
+
 /* Perfect specular scattering */
-void pure_specular(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void pure_specular(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generate rays with some original distribution, and the apply a Debye-Waller
@@ -42,11 +73,11 @@ void pure_specular(const double normal[3], const double init_dir[3],
  *  std dev of final/initial energy ratio
  * + followed by all the params for the original distribution
  */
-void debye_waller_specular(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void debye_waller_specular(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
-void debye_waller_diffraction(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void debye_waller_diffraction(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generate rays with broadened specular distribution and a diffuse background.
@@ -55,8 +86,8 @@ void debye_waller_diffraction(const double normal[3], const double init_dir[3],
  *  first the level (0 - 1) of the diffuse background, then sigma of
  * broad_specular.
  */
-void diffuse_and_specular(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void diffuse_and_specular(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generate rays according to a 2D diffraction pattern but with cosine-distributed
@@ -66,8 +97,8 @@ void diffuse_and_specular(const double normal[3], const double init_dir[3],
  *  first the level (0 - 1) of the diffuse background, then as for
  * diffraction_pattern.
  */
-void diffuse_and_diffraction(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void diffuse_and_diffraction(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generate rays according to a 2D diffraction pattern given by two
@@ -82,8 +113,8 @@ void diffuse_and_diffraction(const double normal[3], const double init_dir[3],
  *  4 floats for 2 x 2D basis vectors
  *  the sigma to broaden the peaks by, and the sigma of the overall gaussian envelope
  */
-void diffraction_pattern(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void diffraction_pattern(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generate a random direction according to the Gaussian broadened specular:
@@ -95,37 +126,38 @@ void diffraction_pattern(const double normal[3], const double init_dir[3],
  * and theta is the angle between the new direction and the specular.
  *
  * INPUTS:
- *  normal - the surface normal at the ray surface intersection
+ *  frame    - the frame of the surface at the ray surface intersection
  *  init_dir - the initial direction of the ray
  *  new_dir  - array to put the new direction in
  *  params   - first element must be standard deviation of gaussian distribution
  *  my_rng   - random number generator object
  */
-void broad_specular_scatter(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void broad_specular_scatter(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 /*
  * Generates a random normalized direction according to a cosine distribution
  * about the provided normal and stores the result in the provided array.
  *
  * INPUTS:
- *  normal  - double array, the normal to the surface at the point of scattering
+ *  frame   - the frame (normal and tangents) of the surface at the point of
+ *            scattering
  *  initial_dir - can be NULL
  *  new_dir - double array, an array to store the new direction of the ray
  *  params  - no parameters expected, can be NULL
  *  my_rng   - gsl_rng pointer, pointer to a GSL random number generator that has
  *            been created and set up with setupGSL()
  */
-void cosine_scatter(const double normal[3], const double init_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void cosine_scatter(SurfaceFrame const * const frame, const double init_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 
 /*
  * Generated a random normalized direction according to a cosine distribution
  * about the specular direction.
  */
-void cosine_specular_scatter(const double normal[3], const double initial_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void cosine_specular_scatter(SurfaceFrame const * const frame, const double initial_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
 
 
 /*
@@ -133,14 +165,94 @@ void cosine_specular_scatter(const double normal[3], const double initial_dir[3]
  * angle about the provided normal.
  *
  * INPUTS:
- *  normal  - double array, the normal to the surface at the point of scattering
+ *  frame   - the frame (normal and tangents) of the surface at the point of
+ *            scattering
  *  initial_dir - can be NULL
  *  new_dir - double array, an array to store the new direction of the ray
  *  params  - no parameters expected, can be NULL
  *  my_rng  - gsl_rng pointer, pointer to a GSL random number generator that has
  *            been created and set up with setupGSL()
  */
-void uniform_scatter(const double normal[3], const double initial_dir[3],
-        double new_dir[3], const double * params, MTRand * const myrng);
+void uniform_scatter(SurfaceFrame const * const frame, const double initial_dir[3],
+        double new_dir[3], const double * const params, MTRand * const myrng);
+
+/*
+ * The part of a distribution whose density can be evaluated, used to connect
+ * paths in the bidirectional estimator (bidirectional.h). The cosine, uniform
+ * and cosine_specular distributions have a density, as does the diffuse
+ * background of diffuse_and_specular and diffuse_and_diffraction. The
+ * specular, broadened specular and diffraction peaks can only be sampled.
+ */
+
+/* The probability that a scattered direction comes from the part with a density */
+double density_fraction(distribution_func func, const double * const params);
+
+/*
+ * Scatter from the distribution, returns 1 if the direction came from the part
+ * with a density and 0 if it came from the rest. The directions are
+ * distributed as for func itself.
+ */
+int scatter_split(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], double new_dir[3], const double * const params,
+        MTRand * const myrng);
+
+/*
+ * The density per steradian of new_dir from the part of the distribution with
+ * a density, multiplied by its density_fraction. 0 for directions into the
+ * surface.
+ */
+double scatter_density(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], const double new_dir[3], const double * const params);
+
+/*
+ * Score function estimates of the derivatives with respect to the parameters
+ * of the distributions, used to fit them (fitting.h). The score of a scattering
+ * event is d log p / d params[k], where p is the density of the choices made
+ * in sampling it: which part of a mixture, whether the Debye-Waller factor
+ * turned the ray diffuse and the direction from the broadened specular.
+ *
+ * The parameters that have a score are:
+ *  diffuse_and_specular    - 0 the diffuse level, 1 the sigma
+ *  diffuse_and_diffraction - 0 the diffuse level
+ *  debye_waller_specular   - 0 the incident energy, 1 the lattice mass, 2 the
+ *                            temperature, 3 the Debye temperature, 5 the sigma
+ *  debye_waller_diffraction - 0 to 3 as for debye_waller_specular
+ * all of which come in the first SCORE_N_PARAMS parameters.
+ */
+#define SCORE_N_PARAMS 6
+
+/* Points in cos(alpha) of the table of a SpecularScore */
+#define SPECULAR_SCORE_SIZE 65
+
+/*
+ * The normalisation of the broadened specular depends on sigma and on the
+ * angle alpha of the specular direction to the normal, as the part going into
+ * the surface is rejected. Its log derivative with respect to sigma is
+ * tabulated against cos(alpha).
+ */
+typedef struct _specularScore {
+    double sigma;
+    double dlog_norm[SPECULAR_SCORE_SIZE];  /* At cos(alpha) = i/(SIZE - 1) */
+} SpecularScore;
+
+/* Does func have a score for params[k] */
+int has_score(distribution_func func, int k);
+
+/* The index of the sigma of the broadened specular in the params of func, -1 if none */
+int specular_sigma_index(distribution_func func);
+
+/* Tabulate the derivative of the log normalisation of the specular with sigma */
+void set_up_specular_score(double sigma, SpecularScore * const table);
+
+/*
+ * Scatter from the distribution, with the same random numbers as func itself,
+ * and write the score of each of the first SCORE_N_PARAMS parameters into
+ * score, 0 for those that have none. spec is the table for the sigma of the
+ * broadened specular, if NULL its score is 0.
+ */
+void scatter_score(distribution_func func, SurfaceFrame const * const frame,
+        const double init_dir[3], double new_dir[3], const double * const params,
+        SpecularScore const * const spec, double score[SCORE_N_PARAMS],
+        MTRand * const myrng);
 
 #endif
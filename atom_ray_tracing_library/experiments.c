@@ -7,37 +7,55 @@
 
 #include "trace_ray.h"
 #include "ray_tracing_core3D.h"
+#include "bidirectional.h"
+#include "metropolis.h"
+#include "time_budget.h"
+#include <stdlib.h>
+#include "probes.h"
 
 /*
- * Using C ray generation and a CAD model of the pinhole plate with a single
- * detector.
+ * Using C ray generation and a CAD model of the pinhole plate. There is a single
+ * detector unless regions is not NULL, when the rays are counted for each of
+ * its detectors: cntr_detected has regions->n_detect elements and
+ * numScattersRay is SCATTER_BINS(maxScatters) x n_detect. If refine is not NULL the fine
+ * model of the plate is used near the apertures. If diag is not NULL
+ * diagnostics of the rays are recorded, if feat is not NULL the features of
+ * their first bounce.
+ *
+ * The ray counts are 64 bit and the histogram is double (exact to 2^53) so that
+ * more than 2^31 rays may be traced in a single call.
  *
  * TODO: const the objects passed around
  */
-void generating_rays_cad_pinhole(SourceParam source, int nrays, int *killed,
-		int * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
-		AnalytSphere the_sphere, double const backWall[], MTRand * const myrng,
-		int32_t * const numScattersRay) {
-	int i;
+void generating_rays_cad_pinhole(SourceParam source, int64_t nrays, int64_t * const killed,
+		int64_t * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
+		PlateRefine const * const refine, AnalytSphere the_sphere,
+		double const backWall[], DetectorRegions const * const regions,
+		RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+		double * const numScattersRay) {
+	int64_t i;
 
+	SHEM_PROBE2(rays_start, "generating_rays_cad_pinhole", nrays);
 	// TODO: this will be where memory is moved to the GPU
 
     for (i = 0; i < nrays; i++) {
         Ray3D the_ray;
 
+        SHEM_PROBE_RAY_BATCH(i, nrays);
         create_ray(&the_ray, &source, myrng);
 
-        trace_ray_triag_plate(&the_ray, maxScatters, sample, plate, the_sphere,
-                backWall, myrng);
+        trace_ray_triag_plate(&the_ray, maxScatters, sample, plate, refine,
+                the_sphere, backWall, regions, diag, feat, myrng);
 
         /*
          * Add the number of scattering events the ray has undergone to the
-         * histogram. But only if it is detected.
+         * histogram of its detector. But only if it is detected.
          */
         switch (the_ray.status) {
             case 2:
-                numScattersRay[the_ray.nScatters - 1]++;
-                *cntr_detected += 1;
+                numScattersRay[scatter_bin(the_ray.detector, the_ray.nScatters,
+                    maxScatters)] += 1;
+                cntr_detected[the_ray.detector - 1] += 1;
                 break;
             case 1:
                 // The ray died naturally...
@@ -53,31 +71,47 @@ void generating_rays_cad_pinhole(SourceParam source, int nrays, int *killed,
     }
 
     // TODO: this is where memory is extracted from the GPU
+    SHEM_PROBE3(rays_end, "generating_rays_cad_pinhole", nrays, *killed);
 }
 
-void generating_rays_simple_pinhole(SourceParam source, int n_rays, int * const killed,
-        int * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
-        AnalytSphere the_sphere, MTRand * const myrng, int32_t * const numScattersRay) {
+/*
+ * Using C ray generation and a simple model of the pinhole plate with multiple
+ * detectors. The detected rays are counted by their weight, which is 1 unless
+ * roulette is used. With roulette rays that scattered off the sample more than
+ * maxScatters times are put into the overflow bin of the histogram, see
+ * SCATTER_BINS. If diag is not
+ * NULL diagnostics of the rays are recorded, if feat is not NULL the features of
+ * their first bounce.
+ */
+void generating_rays_simple_pinhole(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, RouletteParam const * const roulette,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay) {
+
+    int64_t i;
 
-    int i;
+    SHEM_PROBE2(rays_start, "generating_rays_simple_pinhole", n_rays);
     // TODO: this will be where memory is moved to the GPU
 
     for (i = 0; i < n_rays; i++) {
         Ray3D the_ray;
         int ind;
 
+        SHEM_PROBE_RAY_BATCH(i, n_rays);
         create_ray(&the_ray, &source, myrng);
 
-        trace_ray_simple_multi(&the_ray, maxScatters, sample, plate, the_sphere, myrng);
+        trace_ray_simple_multi(&the_ray, maxScatters, sample, plate, the_sphere,
+                roulette, diag, feat, myrng);
         /*
          * Add the number of scattering events the ray has undergone to the
          * histogram. But only if it is detected.
          */
         switch (the_ray.status) {
             case 2:
-                ind = (the_ray.detector - 1)*maxScatters + (the_ray.nScatters - 1);
-                numScattersRay[ind]++;
-                cntr_detected[the_ray.detector - 1] += 1;
+                ind = scatter_bin(the_ray.detector, the_ray.nScatters, maxScatters);
+                numScattersRay[ind] += the_ray.weight;
+                cntr_detected[the_ray.detector - 1] += the_ray.weight;
                 break;
             case 1:
                 // The ray died naturally...
@@ -93,23 +127,194 @@ void generating_rays_simple_pinhole(SourceParam source, int n_rays, int * const
     }
 
     // TODO: this is where memory is extracted from the GPU
+    SHEM_PROBE3(rays_end, "generating_rays_simple_pinhole", n_rays, *killed);
 }
 
-void given_rays_simple_pinhole(Rays3D * const all_rays, int * killed,
-        int * const cntr_detected, Surface3D sample, NBackWall plate,
-        AnalytSphere the_sphere, int maxScatters, int32_t * const detected,
-        int32_t * const which_detector, MTRand * const myrng) {
+/*
+ * As generating_rays_simple_pinhole but each ray is traced with the
+ * bidirectional estimator (see bidirectional.h), which adds subpaths traced back
+ * from the apertures. Every ray adds fractions of a count to many bins of the
+ * histogram. killed counts the rays whose forward subpath scattered too many
+ * times. Roulette and diagnostics are not used.
+ */
+void generating_rays_bidirectional(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay) {
+    BidirPaths paths;
+    int64_t i;
+
+    SHEM_PROBE2(rays_start, "generating_rays_bidirectional", n_rays);
+    set_up_bidir_paths(plate.n_detect, &paths);
+
+    for (i = 0; i < n_rays; i++) {
+        Ray3D the_ray;
+
+        SHEM_PROBE_RAY_BATCH(i, n_rays);
+        create_ray(&the_ray, &source, myrng);
+
+        trace_ray_bidirectional(&the_ray, maxScatters, sample, &plate, &the_sphere,
+                &paths, feat, myrng, cntr_detected, numScattersRay);
+        if (the_ray.status == -1)
+            *killed += 1;
+    }
+
+    clean_up_bidir_paths(&paths);
+    SHEM_PROBE3(rays_end, "generating_rays_bidirectional", n_rays, *killed);
+}
+
+/*
+ * Metropolis sampling of the detected paths (see metropolis.h). A forward run
+ * of mlt->n_forward rays finds the starting paths of the chains and, with the
+ * large steps of the chains, the fraction of rays that are detected. The
+ * chains then share that fraction between the detectors and the bins of the
+ * histogram. The counts, and the killed rays of the forward run, are scaled to
+ * n_rays rays. If feat is not NULL the features of the forward run are
+ * recorded. If stats is not NULL the statistics of the chains are added to it.
+ */
+void generating_rays_metropolis(SourceParam source, int64_t n_rays,
+        MetropolisParam const * const mlt, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay, MetropolisStats * const stats) {
+    PrimarySample * starts;
+    MetropolisStats chain_stats = {0, 0, 0, 0};
+    double * occupancy;
+    double detected_frac;
+    int64_t n_detected = 0, n_killed = 0;
+    int64_t i;
+    int n_starts = 0;
+    int j;
+
+    SHEM_PROBE2(rays_start, "generating_rays_metropolis", n_rays);
+    account_memory(MEM_RAYS, metropolis_memory(mlt->n_chains, plate.n_detect, maxScatters));
+    starts = (PrimarySample*)malloc(mlt->n_chains*sizeof(PrimarySample));
+    occupancy = (double*)calloc((size_t)plate.n_detect*SCATTER_BINS(maxScatters),
+        sizeof(double));
+
+    /* The forward run, keeping the first detected paths to start the chains */
+    for (i = 0; i < mlt->n_forward; i++) {
+        MTRand const saved = *myrng;
+        Ray3D the_ray;
+
+        SHEM_PROBE_RAY_BATCH(i, mlt->n_forward);
+        create_ray(&the_ray, &source, myrng);
+        trace_ray_simple_multi(&the_ray, maxScatters, sample, plate, the_sphere,
+                NULL, NULL, feat, myrng);
+        if (the_ray.status == 2) {
+            n_detected++;
+            if (n_starts < mlt->n_chains)
+                primary_sample_from_rng(&saved, &starts[n_starts++]);
+        } else if (the_ray.status == -1) {
+            n_killed++;
+        }
+    }
+
+    metropolis_chains(starts, n_starts, mlt, &source, maxScatters, sample, plate,
+            the_sphere, myrng, occupancy, &chain_stats);
+
+    /* The large steps are forward paths too */
+    detected_frac = (double)(n_detected + chain_stats.n_large_detected)/
+        (double)(mlt->n_forward + chain_stats.n_large);
+    if (chain_stats.n_steps > 0) {
+        for (j = 0; j < plate.n_detect*SCATTER_BINS(maxScatters); j++) {
+            double const counts = n_rays*detected_frac*occupancy[j]/chain_stats.n_steps;
+
+            numScattersRay[j] += counts;
+            cntr_detected[j/SCATTER_BINS(maxScatters)] += counts;
+        }
+    }
+    if (mlt->n_forward > 0)
+        *killed += (int64_t)((double)n_killed*n_rays/mlt->n_forward + 0.5);
+
+    if (stats != NULL) {
+        stats->n_steps += chain_stats.n_steps;
+        stats->n_accepted += chain_stats.n_accepted;
+        stats->n_large += chain_stats.n_large;
+        stats->n_large_detected += chain_stats.n_large_detected;
+    }
+
+    free(starts);
+    free(occupancy);
+    account_memory(MEM_RAYS, -metropolis_memory(mlt->n_chains, plate.n_detect, maxScatters));
+    SHEM_PROBE3(rays_end, "generating_rays_metropolis", n_rays, *killed);
+}
+
+/*
+ * As generating_rays_simple_pinhole, or generating_rays_bidirectional if
+ * bidirectional is non-zero, but the rays are traced in chunks and budget (see
+ * time_budget.h) is checked between them, NULL for no budget. The first chunk is
+ * always traced. Returns the number of rays traced, the counts are of those
+ * rays only.
+ */
+int64_t budgeted_rays_simple_pinhole(SourceParam source, int64_t n_rays,
+        TimeBudget * const budget, int bidirectional, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, RouletteParam const * const roulette,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay) {
+    int64_t done;
+
+    for (done = 0; done < n_rays && (done == 0 || budget == NULL ||
+            !budget_exhausted(budget)); done += budget_chunk(n_rays - done)) {
+        if (bidirectional)
+            generating_rays_bidirectional(source, budget_chunk(n_rays - done), killed,
+                    cntr_detected, maxScatters, sample, plate, the_sphere, feat, myrng,
+                    numScattersRay);
+        else
+            generating_rays_simple_pinhole(source, budget_chunk(n_rays - done), killed,
+                    cntr_detected, maxScatters, sample, plate, the_sphere, roulette,
+                    diag, feat, myrng, numScattersRay);
+    }
+    return done;
+}
+
+/*
+ * As generating_rays_cad_pinhole but the rays are traced in chunks and budget is
+ * checked between them, as budgeted_rays_simple_pinhole. Returns the number of
+ * rays traced.
+ */
+int64_t budgeted_rays_cad_pinhole(SourceParam source, int64_t n_rays,
+        TimeBudget * const budget, int64_t * const killed,
+        int64_t * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
+        PlateRefine const * const refine, AnalytSphere the_sphere,
+        double const backWall[], DetectorRegions const * const regions,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay) {
+    int64_t done;
+
+    for (done = 0; done < n_rays && (done == 0 || budget == NULL ||
+            !budget_exhausted(budget)); done += budget_chunk(n_rays - done))
+        generating_rays_cad_pinhole(source, budget_chunk(n_rays - done), killed,
+                cntr_detected, maxScatters, sample, plate, refine, the_sphere, backWall,
+                regions, diag, feat, myrng, numScattersRay);
+    return done;
+}
+
+/*
+ * Trace the given rays with a simple model of the pinhole plate. weights is set
+ * to the weight of each detected ray, 0 for the rest, which is 1 unless roulette
+ * is given (not NULL) and turned on, cntr_detected counts the detected rays of
+ * each detector by their weight.
+ */
+void given_rays_simple_pinhole(Rays3D * const all_rays, int64_t * const killed,
+        double * const cntr_detected, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, int maxScatters, RouletteParam const * const roulette,
+        double * const weights, int32_t * const which_detector, MTRand * const myrng) {
     int i;
 
     // TODO: this will be where memory is moved to the GPU
 
+    SHEM_PROBE2(rays_start, "given_rays_simple_pinhole", all_rays->nrays);
     for (i = 0; i < all_rays->nrays; i++) {
-        trace_ray_simple_multi(&all_rays->rays[i], maxScatters, sample, plate, the_sphere, myrng);
+        SHEM_PROBE_RAY_BATCH(i, all_rays->nrays);
+        trace_ray_simple_multi(&all_rays->rays[i], maxScatters, sample, plate,
+                the_sphere, roulette, NULL, NULL, myrng);
         which_detector[i] = all_rays->rays[i].detector;
         switch (all_rays->rays[i].status) {
             case 2:
-                detected[i] = 1;
-                cntr_detected[all_rays->rays[i].detector - 1] += 1;
+                weights[i] = all_rays->rays[i].weight;
+                cntr_detected[all_rays->rays[i].detector - 1] += all_rays->rays[i].weight;
                 break;
             case 1:
                 // The ray died naturally...
@@ -125,23 +330,35 @@ void given_rays_simple_pinhole(Rays3D * const all_rays, int * killed,
     }
 
     // TODO: this is where memory is extracted from the GPU
+    SHEM_PROBE3(rays_end, "given_rays_simple_pinhole", all_rays->nrays, *killed);
 }
 
-void given_rays_cad_pinhole(Rays3D * const all_rays, int * const killed, int * const cntr_detected,
-        Surface3D sample, Surface3D plate, AnalytSphere the_sphere, double const backWall[],
-        int maxScatters, int32_t * const detected, MTRand * const myrng) {
+/*
+ * Trace the given rays with a CAD model of the pinhole plate, detected is set to
+ * the detector of each detected ray, from 1, and cntr_detected counts each
+ * detector (a single one unless regions is not NULL, see
+ * generating_rays_cad_pinhole).
+ */
+void given_rays_cad_pinhole(Rays3D * const all_rays, int64_t * const killed,
+        int64_t * const cntr_detected,
+        Surface3D sample, Surface3D plate, PlateRefine const * const refine,
+        AnalytSphere the_sphere, double const backWall[],
+        DetectorRegions const * const regions, int maxScatters,
+        int32_t * const detected, MTRand * const myrng) {
     int i;
 
     // TODO: this will be where memory is moved to the GPU
 
+    SHEM_PROBE2(rays_start, "given_rays_cad_pinhole", all_rays->nrays);
     for (i = 0; i < all_rays->nrays; i++) {
-        trace_ray_triag_plate(&all_rays->rays[i], maxScatters, sample, plate, the_sphere,
-                        backWall, myrng);
+        SHEM_PROBE_RAY_BATCH(i, all_rays->nrays);
+        trace_ray_triag_plate(&all_rays->rays[i], maxScatters, sample, plate, refine,
+                        the_sphere, backWall, regions, NULL, NULL, myrng);
 
         switch (all_rays->rays[i].status) {
             case 2:
-                detected[i] = 1;
-                *cntr_detected += 1;
+                detected[i] = all_rays->rays[i].detector;
+                cntr_detected[all_rays->rays[i].detector - 1] += 1;
                 break;
             case 1:
                 // The ray died naturally...
@@ -157,4 +374,5 @@ void given_rays_cad_pinhole(Rays3D * const all_rays, int * const killed, int * c
     }
 
     // TODO: this is where memory is extracted from the GPU
+    SHEM_PROBE3(rays_end, "given_rays_cad_pinhole", all_rays->nrays, *killed);
 }
@@ -8,21 +8,55 @@
 #ifndef EXPERIMENTS_H_
 #define EXPERIMENTS_H_
 
-void generating_rays_cad_pinhole(SourceParam source, int nrays, int *killed,
-        int32_t * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
-        AnalytSphere the_sphere, double const backWall[], MTRand * const myrng, int32_t * const numScattersRay);
-
-void generating_rays_simple_pinhole(SourceParam source, int n_rays, int * const killed,
-        int32_t * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
-        AnalytSphere the_sphere, MTRand * const myrng, int32_t * const numScattersRay);
-
-void given_rays_simple_pinhole(Rays3D * const all_rays, int * killed,
-        int * const cntr_detected, Surface3D sample, NBackWall plate,
-        AnalytSphere the_sphere, int maxScatters, int32_t * const detected,
-        int32_t * const which_detector, MTRand * const myrng);
-
-void given_rays_cad_pinhole(Rays3D * const all_rays, int * const killed, int * const cntr_detected,
-        Surface3D sample, Surface3D plate, AnalytSphere the_sphere, double const backWall[],
-        int maxScatters, int32_t * const detected, MTRand * const myrng);
+void generating_rays_cad_pinhole(SourceParam source, int64_t nrays, int64_t * const killed,
+        int64_t * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
+        PlateRefine const * const refine, AnalytSphere the_sphere,
+        double const backWall[], DetectorRegions const * const regions,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay);
+
+void generating_rays_simple_pinhole(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, RouletteParam const * const roulette,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay);
+
+void generating_rays_bidirectional(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay);
+
+void generating_rays_metropolis(SourceParam source, int64_t n_rays,
+        MetropolisParam const * const mlt, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay, MetropolisStats * const stats);
+
+int64_t budgeted_rays_simple_pinhole(SourceParam source, int64_t n_rays,
+        TimeBudget * const budget, int bidirectional, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, RouletteParam const * const roulette,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay);
+
+int64_t budgeted_rays_cad_pinhole(SourceParam source, int64_t n_rays,
+        TimeBudget * const budget, int64_t * const killed,
+        int64_t * const cntr_detected, int maxScatters, Surface3D sample, Surface3D plate,
+        PlateRefine const * const refine, AnalytSphere the_sphere,
+        double const backWall[], DetectorRegions const * const regions,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng,
+        double * const numScattersRay);
+
+void given_rays_simple_pinhole(Rays3D * const all_rays, int64_t * const killed,
+        double * const cntr_detected, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, int maxScatters, RouletteParam const * const roulette,
+        double * const weights, int32_t * const which_detector, MTRand * const myrng);
+
+void given_rays_cad_pinhole(Rays3D * const all_rays, int64_t * const killed,
+        int64_t * const cntr_detected,
+        Surface3D sample, Surface3D plate, PlateRefine const * const refine,
+        AnalytSphere the_sphere, double const backWall[],
+        DetectorRegions const * const regions, int maxScatters,
+        int32_t * const detected, MTRand * const myrng);
 
 #endif /* EXPERIMENTS_H_ */
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Score function gradients and the fitting of parameters, see fitting.h.
+ */
+
+#include "fitting.h"
+#include "trace_ray.h"
+#include "ray_tracing_core3D.h"
+#include "distributions3D.h"
+#include "memory_account.h"
+#include "mtwister.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probes.h"
+
+/* Damping of the first step */
+#define FIT_LAMBDA0 1e-2
+
+int set_up_fit_param(Material const * const material, double const * const params,
+        int param, FitParam * const fit) {
+    if (param < 0 || param >= material->n_params || !has_score(material->func, param))
+        return 0;
+
+    fit->material = material;
+    fit->params = params;
+    fit->param = param;
+    fit->has_spec = param == specular_sigma_index(material->func);
+    if (fit->has_spec)
+        set_up_specular_score(params[param], &fit->spec);
+    return 1;
+}
+
+void scatter_scored(PathScore * const path, Material const * const material,
+        SurfaceFrame const * const frame, const double init_dir[3], double new_dir[3],
+        MTRand * const myrng) {
+    double score[SCORE_N_PARAMS];
+    SpecularScore const * spec = NULL;
+    double const * params = NULL;
+    int j;
+
+    for (j = 0; j < path->n_fit; j++) {
+        if (path->fit[j].material->params == material->params) {
+            if (params == NULL)
+                params = path->fit[j].params;
+            if (path->fit[j].has_spec)
+                spec = &path->fit[j].spec;
+        }
+    }
+    if (params == NULL) {
+        material->func(frame, init_dir, new_dir, material->params, myrng);
+        return;
+    }
+
+    scatter_score(material->func, frame, init_dir, new_dir, params, spec, score, myrng);
+    for (j = 0; j < path->n_fit; j++) {
+        if (path->fit[j].material->params == material->params)
+            path->score[j] += score[path->fit[j].param];
+    }
+}
+
+void generating_rays_score(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, FitParam const * const fit, int n_fit,
+        MTRand * const myrng, double * const numScattersRay, double * const gradient) {
+    PathScore path;
+    int64_t i;
+    int j;
+
+    SHEM_PROBE2(rays_start, "generating_rays_score", n_rays);
+
+    path.n_fit = n_fit;
+    path.fit = fit;
+    path.score = (double*)malloc((n_fit > 0 ? n_fit : 1)*sizeof(double));
+
+    for (i = 0; i < n_rays; i++) {
+        MTRand ray_rng;
+        Ray3D the_ray;
+        unsigned long seed;
+        int ind;
+
+        SHEM_PROBE_RAY_BATCH(i, n_rays);
+
+        /*
+         * Each ray has its own numbers, so that changing the parameters only
+         * changes the numbers of the rays whose paths it changes
+         */
+        genRandLong(myrng, &seed);
+        seedRand(seed, &ray_rng);
+        create_ray(&the_ray, &source, &ray_rng);
+        for (j = 0; j < n_fit; j++)
+            path.score[j] = 0;
+        the_ray.score = &path;
+
+        trace_ray_simple_multi(&the_ray, maxScatters, sample, plate, the_sphere, NULL,
+            NULL, NULL, &ray_rng);
+
+        switch (the_ray.status) {
+            case 2:
+                ind = scatter_bin(the_ray.detector, the_ray.nScatters, maxScatters);
+                numScattersRay[ind] += the_ray.weight;
+                cntr_detected[the_ray.detector - 1] += the_ray.weight;
+                for (j = 0; j < n_fit; j++)
+                    gradient[the_ray.detector - 1 + plate.n_detect*j] +=
+                        the_ray.weight*path.score[j];
+                break;
+            case -1:
+                *killed += 1;
+                break;
+        }
+    }
+
+    free(path.score);
+    SHEM_PROBE3(rays_end, "generating_rays_score", n_rays, *killed);
+}
+
+/******************************************************************************/
+/*                                The optimiser                               */
+/******************************************************************************/
+
+/* The bytes set_up_fit allocates */
+static int64_t fit_memory(int n_fit, int max_evals) {
+    return ((int64_t)4*n_fit + (int64_t)n_fit*n_fit + n_fit +
+        (int64_t)(n_fit + 1)*max_evals)*sizeof(double);
+}
+
+void set_up_fit(int n_fit, int n_pixels, double const * const measured,
+        double const * const x0, double const * const lower,
+        double const * const upper, int max_evals, double tolerance,
+        FitState * const state) {
+    int k;
+
+    state->n_fit = n_fit;
+    state->n_pixels = n_pixels;
+    state->max_evals = max_evals > 1 ? max_evals : 1;
+    state->tolerance = tolerance;
+    state->measured = measured;
+    state->lower = (double*)malloc(4*n_fit*sizeof(double));
+    state->upper = state->lower + n_fit;
+    state->x = state->upper + n_fit;
+    state->trial = state->x + n_fit;
+    state->jtj = (double*)calloc((size_t)n_fit*n_fit + n_fit, sizeof(double));
+    state->jtr = state->jtj + (size_t)n_fit*n_fit;
+    state->history = (double*)calloc((size_t)(n_fit + 1)*state->max_evals, sizeof(double));
+    state->loss = 0;
+    state->scale = 0;
+    state->lambda = FIT_LAMBDA0;
+    state->n_evals = 0;
+    account_memory(MEM_RAYS, fit_memory(n_fit, state->max_evals));
+
+    for (k = 0; k < n_fit; k++) {
+        state->lower[k] = lower[k];
+        state->upper[k] = upper[k];
+        state->trial[k] = x0[k] < lower[k] ? lower[k] : (x0[k] > upper[k] ? upper[k] : x0[k]);
+        state->x[k] = state->trial[k];
+    }
+}
+
+void clean_up_fit(FitState * const state) {
+    free(state->lower);
+    free(state->jtj);
+    free(state->history);
+    account_memory(MEM_RAYS, -fit_memory(state->n_fit, state->max_evals));
+}
+
+/*
+ * Solve the n x n system A x = b in place by Gaussian elimination with partial
+ * pivoting, b is overwritten with x. Returns 0 if A is singular.
+ */
+static int solve_linear(int n, double * const A, double * const b) {
+    int i, j, k;
+
+    for (k = 0; k < n; k++) {
+        int p = k;
+        for (i = k + 1; i < n; i++)
+            if (fabs(A[i*n + k]) > fabs(A[p*n + k]))
+                p = i;
+        if (A[p*n + k] == 0)
+            return 0;
+        if (p != k) {
+            double tmp;
+            for (j = 0; j < n; j++) {
+                tmp = A[k*n + j];
+                A[k*n + j] = A[p*n + j];
+                A[p*n + j] = tmp;
+            }
+            tmp = b[k];
+            b[k] = b[p];
+            b[p] = tmp;
+        }
+        for (i = k + 1; i < n; i++) {
+            double const f = A[i*n + k]/A[k*n + k];
+            for (j = k; j < n; j++)
+                A[i*n + j] -= f*A[k*n + j];
+            b[i] -= f*b[k];
+        }
+    }
+    for (k = n - 1; k >= 0; k--) {
+        for (j = k + 1; j < n; j++)
+            b[k] -= A[k*n + j]*b[j];
+        b[k] /= A[k*n + k];
+    }
+    return 1;
+}
+
+/*
+ * The residuals are r = s c - y with the best scale s = c.y/c.c, so their
+ * Jacobian is s dc + c ds with ds = (dc.y - 2 s c.dc)/c.c.
+ */
+static void residual_normal_equations(FitState * const state, double const * const counts,
+        double const * const gradient, double scale, double cc) {
+    int const n = state->n_fit;
+    double * J = (double*)malloc(n*sizeof(double));
+    double * ds = (double*)calloc(n, sizeof(double));
+    int i, k, l;
+
+    for (k = 0; k < n; k++) {
+        for (i = 0; i < state->n_pixels; i++) {
+            double const dc = gradient[i + (size_t)state->n_pixels*k];
+            ds[k] += dc*state->measured[i] - 2*scale*counts[i]*dc;
+        }
+        ds[k] = cc > 0 ? ds[k]/cc : 0;
+    }
+
+    memset(state->jtj, 0, ((size_t)n*n + n)*sizeof(double));
+    for (i = 0; i < state->n_pixels; i++) {
+        double const r = scale*counts[i] - state->measured[i];
+        for (k = 0; k < n; k++)
+            J[k] = scale*gradient[i + (size_t)state->n_pixels*k] + counts[i]*ds[k];
+        for (k = 0; k < n; k++) {
+            state->jtr[k] += J[k]*r;
+            for (l = 0; l < n; l++)
+                state->jtj[k*n + l] += J[k]*J[l];
+        }
+    }
+    free(J);
+    free(ds);
+}
+
+int fit_step(FitState * const state, double const * const counts,
+        double const * const gradient) {
+    int const n = state->n_fit;
+    double * const h = &state->history[(size_t)(n + 1)*state->n_evals];
+    double cc = 0, cy = 0, scale, loss = 0, step = 0;
+    double * A, * delta;
+    int first = state->n_evals == 0;
+    int i, k, l;
+
+    /* The loss with the best scale of the counts */
+    for (i = 0; i < state->n_pixels; i++) {
+        cc += counts[i]*counts[i];
+        cy += counts[i]*state->measured[i];
+    }
+    scale = cc > 0 ? cy/cc : 0;
+    for (i = 0; i < state->n_pixels; i++) {
+        double const r = scale*counts[i] - state->measured[i];
+        loss += r*r;
+    }
+    for (k = 0; k < n; k++)
+        h[k] = state->trial[k];
+    h[n] = loss;
+    state->n_evals++;
+
+    if (first || loss < state->loss) {
+        double const gain = first ? 1 : (state->loss - loss)/state->loss;
+
+        for (k = 0; k < n; k++)
+            state->x[k] = state->trial[k];
+        state->loss = loss;
+        state->scale = scale;
+        residual_normal_equations(state, counts, gradient, scale, cc);
+        if (!first) {
+            state->lambda /= 3;
+            if (gain < state->tolerance)
+                return 0;
+        }
+    } else {
+        state->lambda *= 4;
+    }
+    if (state->n_evals >= state->max_evals)
+        return 0;
+
+    /* The damped Gauss-Newton step from the best parameters, kept in bounds */
+    A = (double*)malloc(((size_t)n*n + n)*sizeof(double));
+    delta = A + (size_t)n*n;
+    for (k = 0; k < n; k++) {
+        for (l = 0; l < n; l++)
+            A[k*n + l] = state->jtj[k*n + l];
+        A[k*n + k] += state->lambda*state->jtj[k*n + k] + 1e-300;
+        delta[k] = -state->jtr[k];
+    }
+    if (!solve_linear(n, A, delta)) {
+        free(A);
+        return 0;
+    }
+    for (k = 0; k < n; k++) {
+        double t = state->x[k] + delta[k];
+        double const range = state->upper[k] - state->lower[k];
+
+        t = t < state->lower[k] ? state->lower[k] : (t > state->upper[k] ? state->upper[k] : t);
+        state->trial[k] = t;
+        if (fabs(t - state->x[k]) > step*range)
+            step = fabs(t - state->x[k])/range;
+    }
+    free(A);
+    return step >= state->tolerance;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Fitting the parameters of the scattering distributions to measured images.
+ *
+ * The derivatives of the detector counts with respect to the parameters are
+ * estimated in the same run as the counts themselves by the score function
+ * (likelihood ratio) method. The counts are the mean of the weight of the
+ * detected rays, so
+ *   d E[c] / d theta = E[c sum_events d log p / d theta],
+ * where p is the density of the choices made at each scattering event off a
+ * material that has theta (see scatter_score in distributions3D.h). A ray
+ * carries the sum of the scores of its events in a PathScore, which is added
+ * to the gradient if it is detected. The paths are not changed, so a gradient
+ * costs little more than the counts.
+ *
+ * The parameters are fitted by least squares with a damped Gauss-Newton
+ * (Levenberg-Marquardt) method kept within bounds. The counts are scaled to
+ * the measurements by the best scale for each set of parameters, so the
+ * measurements can be in any units. Each evaluation is a whole image, so the
+ * optimiser is bounded by the number of evaluations and takes the Jacobian of
+ * every pixel from each. Tracing every evaluation with the same random numbers
+ * (common random numbers) makes the differences in the loss between them
+ * smooth, so steps can be accepted or rejected on a few evaluations.
+ */
+
+#ifndef FITTING_H_
+#define FITTING_H_
+
+#include "ray_tracing_core3D.h"
+#include "distributions3D.h"
+#include "mtwister.h"
+
+/*
+ * A parameter being fitted. The material is traced with the parameters in
+ * params instead of its own, so that they can be varied without changing the
+ * material, the parameters being fitted of a material must share them.
+ */
+typedef struct _fitParam {
+    Material const * material;  /* Matched to the materials scattered off by
+                                 * their params, which copies share */
+    double const * params;      /* The parameters to trace the material with */
+    int param;                  /* Index into params */
+    int has_spec;               /* Is spec set, for the sigma of a specular */
+    SpecularScore spec;
+} FitParam;
+
+/* The score of the path of a ray, see Ray3D */
+typedef struct _pathScore {
+    int n_fit;
+    FitParam const * fit;
+    double * score;             /* Sum over the events of d log p / d param */
+} PathScore;
+
+/*
+ * Set up a parameter to fit, returns 0 if the distribution of the material has
+ * no score for it. params has material->n_params elements, it may be the
+ * params of the material itself. Must be set up again when params change.
+ */
+int set_up_fit_param(Material const * const material, double const * const params,
+        int param, FitParam * const fit);
+
+/*
+ * Scatter off a material, as its distribution does, adding the scores of the
+ * parameters being fitted to the path. A material being fitted is traced with
+ * the params of the first of its FitParams.
+ */
+void scatter_scored(PathScore * const path, Material const * const material,
+        SurfaceFrame const * const frame, const double init_dir[3], double new_dir[3],
+        MTRand * const myrng);
+
+/*
+ * As generating_rays_simple_pinhole, without roulette, diagnostics or features,
+ * also adding the derivative of the counts of each detector with respect to
+ * each parameter being fitted to gradient, n_detect x n_fit. Each ray has a
+ * generator of its own seeded from myrng, for common random numbers.
+ */
+void generating_rays_score(SourceParam source, int64_t n_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D sample, NBackWall plate,
+        AnalytSphere the_sphere, FitParam const * const fit, int n_fit,
+        MTRand * const myrng, double * const numScattersRay, double * const gradient);
+
+/*
+ * The state of the optimiser. It is driven by the caller: the counts of the
+ * image with the parameters in trial are passed to fit_step, which gives the
+ * parameters of the next image to evaluate.
+ */
+typedef struct _fitState {
+    int n_fit;
+    int n_pixels;
+    int max_evals;
+    double tolerance;           /* Relative change in the loss or the step at
+                                 * which to stop */
+    double const * measured;    /* n_pixels, not copied */
+    double * lower;             /* Bounds on the parameters, n_fit each */
+    double * upper;
+    double * x;                 /* The best parameters so far */
+    double * trial;             /* The parameters to evaluate next */
+    double loss;                /* Sum of squared residuals at x */
+    double scale;               /* Scale of the counts to the measurements at x */
+    double lambda;              /* Damping of the steps */
+    double * jtj;               /* J^T J and J^T r of the residuals at x */
+    double * jtr;
+    int n_evals;
+    double * history;           /* The parameters then the loss of each
+                                 * evaluation, (n_fit + 1) x max_evals */
+} FitState;
+
+/* The bounds must be finite with lower < upper, x0 is moved within them */
+void set_up_fit(int n_fit, int n_pixels, double const * const measured,
+        double const * const x0, double const * const lower,
+        double const * const upper, int max_evals, double tolerance,
+        FitState * const state);
+
+void clean_up_fit(FitState * const state);
+
+/*
+ * Take the counts of each pixel, n_pixels, and their gradients, n_pixels x
+ * n_fit, for the parameters in trial. Returns 1 if another evaluation is
+ * wanted, with its parameters in trial, 0 when the fit has finished.
+ */
+int fit_step(FitState * const state, double const * const counts,
+        double const * const gradient);
+
+#endif /* FITTING_H_ */
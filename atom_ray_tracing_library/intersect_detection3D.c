@@ -101,6 +101,254 @@ void scatterSphere(Ray3D * the_ray, AnalytSphere the_sphere, double * const min_
     return;
 }
 
+/*
+ * Intersection of a ray with face j of a triangulated surface, if it is nearer
+ * than min_dist the nearest intersection is updated, see scatterTriag.
+ */
+static inline void scatter_face(Ray3D const * const the_ray, Surface3D const * const sample,
+        int j, double * const min_dist, double nearest_inter[3], double nearest_n[3],
+        int * const meets, int * const tri_hit, int * const which_surface) {
+    double normal[3];
+    double const *e, *d;
+    double a[3];
+    double b[3];
+    double c[3];
+    double AA[3][3];
+    double v[3];
+    double u[3] = {0, 0, 0};
+    double epsilon;
+
+    /* Position and direction of the ray */
+    e = the_ray->position;
+    d = the_ray->direction;
+
+    /* Skip this triangle if the ray is already on it */
+    if ((the_ray->on_element == j) && (the_ray->on_surface == sample->surf_index)) {
+        return;
+    }
+
+    /*
+     * Specify which triangle and get its normal.
+     */
+    get_element3D(sample, j, a, b, c, normal);
+
+    /* If the triangle is 'back-facing' then the ray cannot hit it */
+    double test;
+    dot(normal, d, &test);
+    if (test > 0) {
+        return;
+    }
+
+    /*
+     * If the triangle is behind the current ray position then the ray
+     * cannot hit it. To do this we have to test each of the three vertices
+     * to find if they are `behind' the ray. If any one of the vertices is
+     * in-fornt of the ray we have to consider it. Re-use variable v.
+     */
+    v[0] = a[0] - e[0];
+    v[1] = a[1] - e[1];
+    v[2] = a[2] - e[2];
+    if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
+        v[0] = b[0] - e[0];
+        v[1] = b[1] - e[1];
+        v[2] = b[2] - e[2];
+        if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
+            v[0] = c[0] - e[0];
+            v[1] = c[1] - e[1];
+            v[2] = c[2] - e[2];
+            if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
+                return;
+            }
+        }
+    }
+
+    /*
+     * Construct the linear equation
+     * AA u = v, where u contains (alpha, beta, t) for the propagation
+     * equation:
+     * e + td = a + beta(b - a) + gamma(c - a)
+     */
+    //propagate3D(a, e, -1, v); // <- simpler to write, heavier computation
+    v[0] = a[0] - e[0];
+    v[1] = a[1] - e[1];
+    v[2] = a[2] - e[2];
+
+    /* This could be pre-calculated and stored, however it would involve an
+     * array of matrices
+     */
+    AA[0][0] = a[0] - b[0];
+    AA[0][1] = a[0] - c[0];
+    AA[0][2] = d[0];
+    AA[1][0] = a[1] - b[1];
+    AA[1][1] = a[1] - c[1];
+    AA[1][2] = d[1];
+    AA[2][0] = a[2] - b[2];
+    AA[2][1] = a[2] - c[2];
+    AA[2][2] = d[2];
+
+    /*
+     * Tests to see if this triangle is parallel to the ray, if it is the
+     * determinant of the matrix AA will be zero, we must set a tolerance for
+     * size of determinant we will allow.
+     */
+    epsilon = 0.0000000001;
+    int success = 0; // Default to no success, this was causing problems some how...
+    solve3x3(AA, u, v, epsilon, &success); // <- NOTE: this is the biggest computation
+    if (!success) {
+        return;
+    }
+
+    /* Find if the point of intersection is inside the triangle */
+    /* Must also find if the ray is propagating forwards */
+    if ((u[0] >= 0) && (u[1] >= 0) && ((u[0] + u[1]) <= 1) && (u[2] > 0)) {
+        double new_loc[3];
+        double movment[3];
+        double dist;
+
+        /* We have hit a triangle */
+        *meets = 1; // <- I think I've found the problem....
+
+        /* Store the location and normal of the nearest intersection */
+        new_loc[0] = e[0] + (u[2]*d[0]);
+        new_loc[1] = e[1] + (u[2]*d[1]);
+        new_loc[2] = e[2] + (u[2]*d[2]);
+
+        /* Movement is the vector from the current location to the possible
+         * new location */
+        movment[0] = new_loc[0] - e[0];
+        movment[1] = new_loc[1] - e[1];
+        movment[2] = new_loc[2] - e[2];
+
+        /* NOTE: we are comparing the square of the distance */
+        dist = movment[0]*movment[0] + movment[1]*movment[1] +
+            movment[2]*movment[2];
+        // Not good here!! :'(
+
+        if (dist < *min_dist) {
+            /* This is the smallest intersection found so far */
+            *min_dist = dist;
+
+            *tri_hit = j;
+            if (sample->vertex_normals != NULL) {
+                /* Interpolate the normals at the vertices, (u[0], u[1]) are
+                 * the barycentric coordinates of b and c */
+                double const * n_v = &sample->vertex_normals[9*j];
+                double const w = 1 - u[0] - u[1];
+                int k;
+
+                for (k = 0; k < 3; k++)
+                    nearest_n[k] = w*n_v[k] + u[0]*n_v[3 + k] + u[1]*n_v[6 + k];
+                normalise(nearest_n);
+            } else {
+                nearest_n[0] = normal[0];
+                nearest_n[1] = normal[1];
+                nearest_n[2] = normal[2];
+            }
+            nearest_inter[0] = new_loc[0];
+            nearest_inter[1] = new_loc[1];
+            nearest_inter[2] = new_loc[2];
+
+            *which_surface = sample->surf_index;
+        }
+    }
+}
+
+/*
+ * Distance along the ray to the nearest intersection found so far, boxes
+ * further away than this cannot contain a nearer triangle. min_dist is the
+ * square of the distance. Padded so that rounding cannot cull a hit.
+ */
+static inline double bvh_t_max(double min_dist, double const d[3]) {
+    return sqrt(min_dist/(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]))*1.000001 + 1e-9;
+}
+
+/*
+ * Intersection of a ray with a voxel surface, see scatterTriag and voxel.h. A
+ * ray on the surface is started just above the face it is on so that rounding
+ * cannot put it back into the voxel it left.
+ */
+static void scatter_voxels(Ray3D const * const the_ray, Surface3D const * const sample,
+        double * const min_dist, double nearest_inter[3], double nearest_n[3],
+        int * const meets, int * const tri_hit, int * const which_surface) {
+    VoxelGrid const * const grid = sample->voxels;
+    double const * const e = the_ray->position;
+    double const * const d = the_ray->direction;
+    double start[3], hit[3];
+    double t, dist, cos_in;
+    int64_t voxel;
+    int face, k;
+
+    for (k = 0; k < 3; k++)
+        start[k] = e[k];
+    if ((the_ray->on_surface == sample->surf_index) && (the_ray->on_element >= 0)) {
+        double f[3];
+        voxel_face_normal(the_ray->on_element % 6, f);
+        for (k = 0; k < 3; k++)
+            start[k] += 1e-6*grid->voxel_size*f[k];
+    }
+
+    if (!intersect_voxel_grid(grid, start, d, bvh_t_max(*min_dist, d), &t, &voxel, &face))
+        return;
+    for (k = 0; k < 3; k++)
+        hit[k] = start[k] + t*d[k];
+    dist = (hit[0] - e[0])*(hit[0] - e[0]) + (hit[1] - e[1])*(hit[1] - e[1]) +
+        (hit[2] - e[2])*(hit[2] - e[2]);
+    if (dist >= *min_dist)
+        return;
+
+    *meets = 1;
+    *min_dist = dist;
+    *tri_hit = (int)(6*voxel + face);
+    *which_surface = sample->surf_index;
+    for (k = 0; k < 3; k++)
+        nearest_inter[k] = hit[k];
+
+    /* The gradient normal cannot face away from the ray */
+    voxel_normal(grid, face, hit, nearest_n);
+    dot(nearest_n, d, &cos_in);
+    if (cos_in >= 0)
+        voxel_face_normal(face, nearest_n);
+}
+
+/*
+ * Intersection of a ray with a surface by its visibility map, see visibility.h.
+ * Returns 0 if the map cannot resolve the ray, the surface must then be
+ * intersected in full. The face of the map is tested as any other, so a
+ * resolved ray gives the same hit as the full intersection.
+ */
+static int scatter_visible(Ray3D const * const the_ray, Surface3D const * const sample,
+        double * const min_dist, double nearest_inter[3], double nearest_n[3],
+        int * const meets, int * const tri_hit, int * const which_surface) {
+    VisibilityMap * const map = sample->visibility;
+    double dist = 1e300;
+    double inter[3], n[3];
+    int hit = 0, face = -1, surface = -1;
+    int face_seen, k;
+
+    /* Not atomic, with several threads the counts are approximate */
+    map->n_queries++;
+    face_seen = visibility_face(map, the_ray->position, the_ray->direction);
+    if (face_seen < 0)
+        return 0;
+    scatter_face(the_ray, sample, face_seen, &dist, inter, n, &hit, &face, &surface);
+    if (!hit || !visibility_path_clear(map, the_ray->position, the_ray->direction,
+            inter, face_seen))
+        return 0;
+
+    map->n_resolved++;
+    if (dist < *min_dist) {
+        *min_dist = dist;
+        *meets = 1;
+        *tri_hit = face;
+        *which_surface = surface;
+        for (k = 0; k < 3; k++) {
+            nearest_inter[k] = inter[k];
+            nearest_n[k] = n[k];
+        }
+    }
+    return 1;
+}
+
 /*
  * Finds the distance to, the normal to, and the position of a ray's intersection
  * with an triangulated surface.
@@ -122,6 +370,20 @@ void scatterSphere(Ray3D * the_ray, AnalytSphere the_sphere, double * const min_
  *                    ray hits (if it hits any)
  *  which_surface   - int pointer, which surface does the ray intersect (if any)
  *
+ * If the surface has a bounding volume hierarchy only the faces whose boxes the
+ * ray passes through before the nearest intersection found so far are tested,
+ * so meets is only set for intersections nearer than min_dist.
+ *
+ * A voxel surface is marched through with a DDA instead, see voxel.h, the
+ * element hit is then the face of a voxel.
+ *
+ * If the surface has a visibility map, rays that are not on a surface, i.e.
+ * from the source, are first looked up in it, see visibility.h.
+ *
+ * If the surface has an offset it is translated by it: the ray is moved by
+ * -offset and the intersection back, so copies of a surface with different
+ * offsets share their vertices and hierarchy.
+ *
  * NOTE: this function is messy as attempts (mostly successful) have been made
  *       to improve the speed of the simulation as this is the section of code
  *       called the highest number of times, hence the rather low level looking
@@ -130,142 +392,130 @@ void scatterSphere(Ray3D * the_ray, AnalytSphere the_sphere, double * const min_
 void scatterTriag(Ray3D * the_ray, Surface3D sample, double * const min_dist,
         double nearest_inter[3], double nearest_n[3], int * const meets, int * const tri_hit,
         int * const which_surface) {
+    SurfaceBVH * const bvh = sample.bvh;
+    double const *e, *d;
+    double inv_d[3];
+    double t_max;
+    int stack[BVH_STACK_SIZE];
+    int n_stack;
+    int64_t n_visited = 0;
+    int64_t n_tested = 0;
     int j;
-    double normal[3];
-    double *e, *d;
 
-    /* Position and direction of the ray */
-    e = the_ray->position;
-    d = the_ray->direction;
+    /* Translated surfaces, intersect in the frame of the surface */
+    if (sample.offset[0] != 0 || sample.offset[1] != 0 || sample.offset[2] != 0) {
+        Ray3D moved = *the_ray;
+        Surface3D unmoved = sample;
+        double const old_dist = *min_dist;
 
-    /* Loop through all triangles in the surface */
-    for (j = 0; j < sample.n_faces; j++) {
-        double a[3];
-        double b[3];
-        double c[3];
-        double AA[3][3];
-        double v[3];
-        double u[3] = {0, 0, 0};
-        double epsilon;
-
-        /* Skip this triangle if the ray is already on it */
-        if ((the_ray->on_element == j) && (the_ray->on_surface == sample.surf_index)) {
-            continue;
+        for (j = 0; j < 3; j++) {
+            moved.position[j] -= sample.offset[j];
+            unmoved.offset[j] = 0;
+        }
+        scatterTriag(&moved, unmoved, min_dist, nearest_inter, nearest_n, meets,
+            tri_hit, which_surface);
+        if (*min_dist < old_dist) {
+            for (j = 0; j < 3; j++)
+                nearest_inter[j] += sample.offset[j];
         }
+        return;
+    }
 
-        /*
-         * Specify which triangle and get its normal.
-         */
-        get_element3D(&sample, j, a, b, c, normal);
+    if (sample.voxels != NULL) {
+        scatter_voxels(the_ray, &sample, min_dist, nearest_inter, nearest_n, meets,
+            tri_hit, which_surface);
+        return;
+    }
 
-        /* If the triangle is 'back-facing' then the ray cannot hit it */
-        double test;
-        dot(normal, d, &test);
-        if (test > 0) {
-            continue;
-        }
+    if (sample.visibility != NULL && the_ray->on_surface < 0 &&
+            scatter_visible(the_ray, &sample, min_dist, nearest_inter, nearest_n, meets,
+                tri_hit, which_surface))
+        return;
 
-        /*
-         * If the triangle is behind the current ray position then the ray
-         * cannot hit it. To do this we have to test each of the three vertices
-         * to find if they are `behind' the ray. If any one of the vertices is
-         * in-fornt of the ray we have to consider it. Re-use variable v.
-         */
-        v[0] = a[0] - e[0];
-        v[1] = a[1] - e[1];
-        v[2] = a[2] - e[2];
-        if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
-            v[0] = b[0] - e[0];
-            v[1] = b[1] - e[1];
-            v[2] = b[2] - e[2];
-            if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
-                v[0] = c[0] - e[0];
-                v[1] = c[1] - e[1];
-                v[2] = c[2] - e[2];
-                if (v[0]*d[0] + v[1]*d[1] + v[2]*d[2] < 0) {
-                    continue;
-                }
-            }
+    /* Small surfaces have no hierarchy, loop through all triangles */
+    if (bvh == NULL || bvh->depth > BVH_STACK_SIZE) {
+        for (j = 0; j < sample.n_faces; j++) {
+            scatter_face(the_ray, &sample, j, min_dist, nearest_inter, nearest_n,
+                meets, tri_hit, which_surface);
         }
+        return;
+    }
 
-        /*
-         * Construct the linear equation
-         * AA u = v, where u contains (alpha, beta, t) for the propagation
-         * equation:
-         * e + td = a + beta(b - a) + gamma(c - a)
-         */
-        //propagate3D(a, e, -1, v); // <- simpler to write, heavier computation
-        v[0] = a[0] - e[0];
-        v[1] = a[1] - e[1];
-        v[2] = a[2] - e[2];
-
-        /* This could be pre-calculated and stored, however it would involve an
-         * array of matrices
-         */
-        AA[0][0] = a[0] - b[0];
-        AA[0][1] = a[0] - c[0];
-        AA[0][2] = d[0];
-        AA[1][0] = a[1] - b[1];
-        AA[1][1] = a[1] - c[1];
-        AA[1][2] = d[1];
-        AA[2][0] = a[2] - b[2];
-        AA[2][1] = a[2] - c[2];
-        AA[2][2] = d[2];
+    /* Position and direction of the ray */
+    e = the_ray->position;
+    d = the_ray->direction;
 
-        /*
-         * Tests to see if this triangle is parallel to the ray, if it is the
-         * determinant of the matrix AA will be zero, we must set a tolerance for
-         * size of determinant we will allow.
-         */
-        epsilon = 0.0000000001;
-        int success = 0; // Default to no success, this was causing problems some how...
-        solve3x3(AA, u, v, epsilon, &success); // <- NOTE: this is the biggest computation
-        if (!success) {
-            continue;
+    /* Avoid division by zero, -ffast-math does not give inf */
+    for (j = 0; j < 3; j++) {
+        if (fabs(d[j]) > 1e-30) {
+            inv_d[j] = 1/d[j];
+        } else {
+            inv_d[j] = d[j] < 0 ? -1e30 : 1e30;
         }
+    }
 
-        /* Find if the point of intersection is inside the triangle */
-        /* Must also find if the ray is propagating forwards */
-        if ((u[0] >= 0) && (u[1] >= 0) && ((u[0] + u[1]) <= 1) && (u[2] > 0)) {
-            double new_loc[3];
-            double movment[3];
-            double dist;
-
-            /* We have hit a triangle */
-            *meets = 1; // <- I think I've found the problem....
-
-            /* Store the location and normal of the nearest intersection */
-            new_loc[0] = e[0] + (u[2]*d[0]);
-            new_loc[1] = e[1] + (u[2]*d[1]);
-            new_loc[2] = e[2] + (u[2]*d[2]);
-
-            /* Movement is the vector from the current location to the possible
-             * new location */
-            movment[0] = new_loc[0] - e[0];
-            movment[1] = new_loc[1] - e[1];
-            movment[2] = new_loc[2] - e[2];
-
-            /* NOTE: we are comparing the square of the distance */
-            dist = movment[0]*movment[0] + movment[1]*movment[1] +
-                movment[2]*movment[2];
-            // Not good here!! :'(
-
-            if (dist < *min_dist) {
-                /* This is the smallest intersection found so far */
-                *min_dist = dist;
-
-                *tri_hit = j;
-                nearest_n[0] = normal[0];
-                nearest_n[1] = normal[1];
-                nearest_n[2] = normal[2];
-                nearest_inter[0] = new_loc[0];
-                nearest_inter[1] = new_loc[1];
-                nearest_inter[2] = new_loc[2];
+    t_max = bvh_t_max(*min_dist, d);
+
+    /* Depth first traversal, nearest child first */
+    stack[0] = 0;
+    n_stack = 1;
+    while (n_stack > 0) {
+        BVHNode const * const node = &bvh->nodes[stack[--n_stack]];
+        double t_near[2];
+        int hit[2];
+        int k;
+
+        n_visited++;
+
+        /* Slab test of the boxes of both children */
+        for (k = 0; k < 2; k++) {
+            double t0 = 0;
+            double t1 = t_max;
+            int ax;
+            for (ax = 0; ax < 3; ax++) {
+                double ta = (node->box[k][ax] - e[ax])*inv_d[ax];
+                double tb = (node->box[k][ax + 3] - e[ax])*inv_d[ax];
+                if (ta > tb) {
+                    double tmp = ta;
+                    ta = tb;
+                    tb = tmp;
+                }
+                t0 = ta > t0 ? ta : t0;
+                t1 = tb < t1 ? tb : t1;
+            }
+            hit[k] = t0 <= t1;
+            t_near[k] = t0;
+        }
 
-                *which_surface = sample.surf_index;
+        /* Leaves are tested straight away, internal nodes are pushed with the
+         * further one first */
+        for (k = 0; k < 2; k++) {
+            if (hit[k] && node->child[k] < 0) {
+                double const old_dist = *min_dist;
+                n_tested++;
+                scatter_face(the_ray, &sample, bvh->faces[~node->child[k]], min_dist,
+                    nearest_inter, nearest_n, meets, tri_hit, which_surface);
+                if (*min_dist < old_dist) {
+                    t_max = bvh_t_max(*min_dist, d);
+                }
+                hit[k] = 0;
             }
         }
+        if (hit[0] && hit[1]) {
+            int const first = t_near[0] <= t_near[1] ? 0 : 1;
+            stack[n_stack++] = node->child[1 - first];
+            stack[n_stack++] = node->child[first];
+        } else if (hit[0]) {
+            stack[n_stack++] = node->child[0];
+        } else if (hit[1]) {
+            stack[n_stack++] = node->child[1];
+        }
     }
+
+    /* Not atomic, with several threads the counts are approximate */
+    bvh->n_queries++;
+    bvh->n_visited += n_visited;
+    bvh->n_tested += n_tested;
 }
 
 /*
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Material maps projected onto surfaces, see material_map.h.
+ */
+
+#include "material_map.h"
+#include "memory_account.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+int64_t material_map_memory(int64_t n_texels, int has_scales) {
+    return (int64_t)sizeof(MaterialMap) + n_texels*(has_scales ? 1 + sizeof(float) : 1);
+}
+
+MaterialMap * build_material_map(int kind, const double origin[3], const double axes[6],
+        const double texel[2], const int dims[2], uint8_t const ids[],
+        double const scales[], int scaled_param, struct _material * materials,
+        int n_materials) {
+    MaterialMap * map;
+    int64_t n_texels, i;
+    double len[2], uv;
+    int a, k;
+
+    if (kind == MATERIAL_MAP_IMAGE)
+        n_texels = (int64_t)dims[0]*dims[1];
+    else
+        n_texels = dims[0];
+    if (n_texels <= 0 || n_texels > INT32_MAX || !(texel[0] > 0) || !(texel[1] > 0))
+        return NULL;
+    for (i = 0; i < n_texels; i++)
+        if (ids[i] > n_materials)
+            return NULL;
+
+    for (a = 0; a < 2; a++) {
+        len[a] = 0;
+        for (k = 0; k < 3; k++)
+            len[a] += axes[3*a + k]*axes[3*a + k];
+        len[a] = sqrt(len[a]);
+        if (!(len[a] > 0))
+            return NULL;
+    }
+    uv = 0;
+    for (k = 0; k < 3; k++)
+        uv += axes[k]*axes[3 + k];
+    if (fabs(uv) > (1 - 1e-9)*len[0]*len[1])
+        return NULL;
+
+    map = malloc(sizeof(MaterialMap));
+    map->kind = kind;
+    for (k = 0; k < 3; k++) {
+        map->origin[k] = origin[k];
+        for (a = 0; a < 2; a++)
+            map->axes[a][k] = axes[3*a + k]/len[a];
+    }
+    map->texel[0] = texel[0];
+    map->texel[1] = texel[1];
+    map->dims[0] = kind == MATERIAL_MAP_IMAGE ? dims[0] : (int)n_texels;
+    map->dims[1] = kind == MATERIAL_MAP_IMAGE ? dims[1] : 1;
+    map->ids = malloc(n_texels);
+    memcpy(map->ids, ids, n_texels);
+    map->scaled_param = scales != NULL ? scaled_param : -1;
+    map->scales = NULL;
+    if (scales != NULL) {
+        map->scales = malloc(n_texels*sizeof(float));
+        for (i = 0; i < n_texels; i++)
+            map->scales[i] = (float)scales[i];
+    }
+    map->n_materials = n_materials;
+    map->materials = materials;
+    account_memory(MEM_GEOMETRY, material_map_memory(n_texels, scales != NULL));
+    return map;
+}
+
+void free_material_map(MaterialMap * const map) {
+    if (map == NULL)
+        return;
+    account_memory(MEM_GEOMETRY, -material_map_memory((int64_t)map->dims[0]*map->dims[1],
+        map->scales != NULL));
+    free(map->ids);
+    free(map->scales);
+    free(map);
+}
+
+int material_map_texel(MaterialMap const * const map, const double p[3]) {
+    double uv[2];
+    double n;
+    int a, k;
+
+    for (a = 0; a < 2; a++) {
+        uv[a] = 0;
+        for (k = 0; k < 3; k++)
+            uv[a] += (p[k] - map->origin[k])*map->axes[a][k];
+        uv[a] = floor(uv[a]/map->texel[a]);
+    }
+
+    switch (map->kind) {
+        case MATERIAL_MAP_IMAGE:
+            if (uv[0] < 0 || uv[0] >= map->dims[0] || uv[1] < 0 || uv[1] >= map->dims[1])
+                return -1;
+            return (int)uv[0] + map->dims[0]*(int)uv[1];
+        case MATERIAL_MAP_CHECKER:
+            uv[0] += uv[1];
+            break;
+    }
+
+    /* The patterns repeat, the index is taken modulo the ids cycled through */
+    n = fmod(uv[0], (double)map->dims[0]);
+    if (n < 0)
+        n += map->dims[0];
+    return (int)n % map->dims[0];
+}
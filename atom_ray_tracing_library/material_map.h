@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A material map gives the material of a surface at each point of it from a
+ * pattern projected onto it, rather than from the face that is hit. A sample
+ * of several materials, e.g. stripes or squares of two metals on a substrate,
+ * can then be a handful of faces instead of being split along every boundary
+ * between the materials.
+ *
+ * The pattern lies in the plane through origin spanned by the unit axes u and
+ * v, and is projected onto the surface along the normal to that plane. It is
+ * a grid of texels of texel[0] by texel[1], each holding an id: 0 keeps the
+ * material of the element that is hit, m gives the mth material of the map.
+ * Stripes (along v) cycle through dims[0] ids with u, a checkerboard through
+ * dims[0] ids with the sum of the texel indices along u and v, and an image
+ * has dims[0] x dims[1] ids (u fastest) with nothing outside it.
+ *
+ * Each texel may also scale one of the parameters of its material, e.g. the
+ * diffuse level, so a pattern of one material can vary in strength.
+ */
+
+#ifndef MATERIAL_MAP_H_
+#define MATERIAL_MAP_H_
+
+#include <stdint.h>
+
+#define MATERIAL_MAP_STRIPES 0
+#define MATERIAL_MAP_CHECKER 1
+#define MATERIAL_MAP_IMAGE 2
+
+/* Most parameters a material scaled by a map may have */
+#define MATERIAL_MAP_MAX_PARAMS 16
+
+struct _material;
+
+typedef struct _materialMap {
+    int kind;               /* MATERIAL_MAP_STRIPES, _CHECKER or _IMAGE */
+    double origin[3];       /* Low corner of texel (0, 0) */
+    double axes[2][3];      /* The unit axes (u, v) of the pattern */
+    double texel[2];        /* Size of a texel along u and v */
+    int dims[2];            /* Number of texels of an image, or of ids cycled
+                             * through and 1 */
+    uint8_t * ids;          /* Id of each texel, dims[0] x dims[1] */
+    float * scales;         /* Scale of scaled_param in each texel, or NULL */
+    int scaled_param;       /* Index of the parameter scaled, -1 for none */
+    int n_materials;        /* Number of materials */
+    struct _material * materials; /* Material m is materials[m - 1], not owned */
+} MaterialMap;
+
+/*
+ * Build a map of the given kind from the ids of its texels (dims[0] x dims[1],
+ * u fastest) and optionally scales of parameter scaled_param of their
+ * materials (NULL for none), which are copied. axes holds u then v, which are
+ * normalised. Returns NULL if the texels are not of positive size, u and v are
+ * parallel, or an id is more than n_materials. Must be freed with
+ * free_material_map.
+ */
+MaterialMap * build_material_map(int kind, const double origin[3], const double axes[6],
+        const double texel[2], const int dims[2], uint8_t const ids[],
+        double const scales[], int scaled_param, struct _material * materials,
+        int n_materials);
+
+void free_material_map(MaterialMap * const map);
+
+/* The bytes build_material_map allocates for a map of n_texels texels */
+int64_t material_map_memory(int64_t n_texels, int has_scales);
+
+/* The texel of the map at point p, -1 if p is outside an image */
+int material_map_texel(MaterialMap const * const map, const double p[3]);
+
+#endif /* MATERIAL_MAP_H_ */
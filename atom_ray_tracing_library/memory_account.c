@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Accounting of the memory allocated during a simulation, see memory_account.h.
+ */
+
+#include "memory_account.h"
+#include "ray_tracing_core3D.h"
+#include "bvh.h"
+#include <string.h>
+
+static MemoryAccount the_account;
+
+void reset_memory_account(int64_t budget) {
+    memset(&the_account, 0, sizeof(the_account));
+    the_account.budget = budget > 0 ? budget : 0;
+}
+
+void account_memory(MemoryKind kind, int64_t bytes) {
+    the_account.current[kind] += bytes;
+    the_account.total += bytes;
+    if (the_account.current[kind] > the_account.peak[kind])
+        the_account.peak[kind] = the_account.current[kind];
+    if (the_account.total > the_account.total_peak)
+        the_account.total_peak = the_account.total;
+}
+
+int memory_fits(int64_t bytes) {
+    return the_account.budget == 0 || the_account.total + bytes <= the_account.budget;
+}
+
+MemoryAccount const * get_memory_account(void) {
+    return &the_account;
+}
+
+int64_t surface_memory(int ntriag) {
+    return (int64_t)ntriag*(sizeof(Material*) + sizeof(SurfaceFrame)) + bvh_memory(ntriag);
+}
+
+int64_t rays_memory(int64_t nrays) {
+    return nrays*(int64_t)sizeof(Ray3D);
+}
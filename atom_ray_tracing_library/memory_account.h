@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Accounting of the memory allocated during a simulation, by kind: the
+ * geometry of the surfaces (frames and hierarchies), the composition tables,
+ * the ray buffers and the output arrays. The library adds to the account when
+ * it allocates and subtracts when it frees, the MEX gateways add their output
+ * arrays.
+ *
+ * There is a single account per process, reset at the start of each run. This
+ * is sufficient as a MEX gateway runs one call at a time and parfor workers are
+ * separate processes. A budget may be given, the gateways check an estimate of
+ * what they are about to allocate against it with memory_fits.
+ */
+
+#ifndef MEMORY_ACCOUNT_H_
+#define MEMORY_ACCOUNT_H_
+
+#include <stdint.h>
+
+typedef enum _memoryKind {
+    MEM_GEOMETRY = 0,   /* Frames and hierarchies of the surfaces */
+    MEM_COMPOSITIONS,   /* Material of each face */
+    MEM_RAYS,           /* Ray buffers and banks */
+    MEM_OUTPUTS,        /* Output arrays and diagnostics */
+    MEM_N_KINDS
+} MemoryKind;
+
+typedef struct _memoryAccount {
+    int64_t current[MEM_N_KINDS];   /* Bytes currently allocated of each kind */
+    int64_t peak[MEM_N_KINDS];      /* Peak bytes allocated of each kind */
+    int64_t total;                  /* Bytes currently allocated */
+    int64_t total_peak;             /* Peak bytes allocated */
+    int64_t budget;                 /* Budget in bytes, 0 for no budget */
+} MemoryAccount;
+
+/* Zero the account and set the budget (bytes, 0 for no budget) */
+void reset_memory_account(int64_t budget);
+
+/* Add bytes (negative when freeing) of a kind to the account */
+void account_memory(MemoryKind kind, int64_t bytes);
+
+/* Would allocating a further bytes stay within the budget, 1 if so */
+int memory_fits(int64_t bytes);
+
+MemoryAccount const * get_memory_account(void);
+
+/* The bytes set_up_surface allocates for a surface of ntriag faces, including
+ * the temporary memory used to build its hierarchy */
+int64_t surface_memory(int ntriag);
+
+/* The bytes of a buffer of nrays rays */
+int64_t rays_memory(int64_t nrays);
+
+#endif /* MEMORY_ACCOUNT_H_ */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Metropolis sampling of detected paths in primary sample space, see
+ * metropolis.h.
+ *
+ * Only the numbers a path uses affect it, the rest of its primary sample is
+ * uniform whatever the path. So a small step perturbs the numbers used by the
+ * current path and draws the rest afresh. They are drawn lazily: MLT_MARGIN
+ * past those used by the current path are set and, if the proposed path uses
+ * more than that, the rest are set and the path is traced again.
+ */
+
+#include "metropolis.h"
+#include "trace_ray.h"
+#include "ray_tracing_core3D.h"
+#include "mtwister.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The state of the Mersenne twister that gives y, the inverse of the
+ * tempering in genRandLong.
+ */
+static unsigned long untemper(unsigned long y) {
+    unsigned long t;
+    int k;
+
+    y ^= y >> 18;
+    t = y;
+    for (k = 0; k < 2; k++)
+        t = y ^ ((t << 15) & 0xefc60000UL);
+    y = t & 0xffffffffUL;
+    t = y;
+    for (k = 0; k < 4; k++)
+        t = y ^ ((t << 7) & 0x9d2c5680UL);
+    y = t & 0xffffffffUL;
+    t = y ^ (y >> 11);
+    y ^= t >> 11;
+    return y & 0xffffffffUL;
+}
+
+int64_t metropolis_memory(int n_chains, int n_detect, int maxScatters) {
+    return (int64_t)(n_chains + 1)*sizeof(PrimarySample) +
+        (int64_t)n_detect*SCATTER_BINS(maxScatters)*sizeof(double);
+}
+
+/* Draw numbers from to to of the primary sample afresh */
+static void fill_fresh(PrimarySample * const u, int from, int to, MTRand * const myrng) {
+    int i;
+
+    for (i = from; i < to; i++) {
+        genRandLong(myrng, &u->value[i]);
+        u->state[i] = untemper(u->value[i]);
+    }
+    u->n_set = to;
+}
+
+/* Perturb a number of the primary sample, symmetrically and wrapping around */
+static unsigned long perturb(unsigned long value, MTRand * const myrng) {
+    double sign, size, x;
+
+    genRand(myrng, &sign);
+    genRand(myrng, &size);
+    size = MLT_SMALL_MAX*exp(-log(MLT_SMALL_MAX/MLT_SMALL_MIN)*size);
+    x = value/4294967296.0 + (sign < 0.5 ? size : -size);
+    x -= floor(x);
+    return (unsigned long)(x*4294967296.0) & 0xffffffffUL;
+}
+
+void primary_sample_from_rng(MTRand const * const saved, PrimarySample * const u) {
+    MTRand copy = *saved;
+
+    fill_fresh(u, 0, MLT_DIMENSIONS, &copy);
+    u->n_used = MLT_DIMENSIONS;
+    u->detector = 0;
+    u->n_scatters = 0;
+}
+
+/*
+ * Trace the path of a primary sample, setting the rest of the sample from
+ * myrng if it uses more numbers than are set.
+ */
+static void trace_primary_sample(PrimarySample * const u, SourceParam const * const source,
+        int maxScatters, Surface3D sample, NBackWall plate, AnalytSphere the_sphere,
+        MTRand * const myrng) {
+    MTRand replay;
+    Ray3D the_ray;
+    int moved_on;
+
+    for (;;) {
+        memcpy(replay.mt, u->state, sizeof(u->state));
+        replay.index = 0;
+        create_ray(&the_ray, source, &replay);
+        trace_ray_simple_multi(&the_ray, maxScatters, sample, plate, the_sphere,
+                NULL, NULL, NULL, &replay);
+
+        /* Once all the numbers are used the generator moves to a new state */
+        moved_on = replay.mt[0] != u->state[0];
+        if ((u->n_set == MLT_DIMENSIONS) || (!moved_on && (replay.index <= u->n_set)))
+            break;
+        fill_fresh(u, u->n_set, MLT_DIMENSIONS, myrng);
+    }
+
+    u->n_used = moved_on ? MLT_DIMENSIONS : replay.index;
+    u->detector = the_ray.status == 2 ? the_ray.detector : 0;
+    u->n_scatters = the_ray.nScatters;
+}
+
+/* Propose a small step from current */
+static void small_step(PrimarySample const * const current, PrimarySample * const proposal,
+        MTRand * const myrng) {
+    int const n = current->n_used;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        proposal->value[i] = perturb(current->value[i], myrng);
+        proposal->state[i] = untemper(proposal->value[i]);
+    }
+    proposal->n_set = n;
+    fill_fresh(proposal, n, n + MLT_MARGIN < MLT_DIMENSIONS ? n + MLT_MARGIN : MLT_DIMENSIONS,
+        myrng);
+}
+
+void metropolis_chains(PrimarySample * const starts, int n_starts,
+        MetropolisParam const * const mlt, SourceParam const * const source,
+        int maxScatters, Surface3D sample, NBackWall plate, AnalytSphere the_sphere,
+        MTRand * const myrng, double * const occupancy, MetropolisStats * const stats) {
+    PrimarySample * const buffer = (PrimarySample*)malloc(sizeof(PrimarySample));
+    int c;
+
+    for (c = 0; c < n_starts; c++) {
+        PrimarySample * current = &starts[c];
+        PrimarySample * proposal = buffer;
+        int64_t n_steps = mlt->n_mutations/n_starts + (c < mlt->n_mutations % n_starts);
+        int64_t i;
+
+        /* Find the numbers the starting path uses */
+        trace_primary_sample(current, source, maxScatters, sample, plate, the_sphere, myrng);
+        if (current->detector == 0)
+            continue;
+
+        for (i = 0; i < n_steps; i++) {
+            double xi;
+            int large;
+
+            genRand(myrng, &xi);
+            large = xi < mlt->large_step;
+            if (large) {
+                proposal->n_set = 0;
+                fill_fresh(proposal, 0, MLT_MARGIN, myrng);
+            } else {
+                small_step(current, proposal, myrng);
+            }
+            trace_primary_sample(proposal, source, maxScatters, sample, plate,
+                the_sphere, myrng);
+
+            if (large) {
+                stats->n_large++;
+                stats->n_large_detected += proposal->detector != 0;
+            }
+
+            /* Every detected path has the same contribution, accept it */
+            if (proposal->detector != 0) {
+                PrimarySample * const tmp = current;
+                current = proposal;
+                proposal = tmp;
+                stats->n_accepted++;
+            }
+
+            occupancy[scatter_bin(current->detector, current->n_scatters, maxScatters)] += 1;
+            stats->n_steps++;
+        }
+    }
+
+    free(buffer);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Metropolis sampling of the detected paths of the simple (N aperture) model of
+ * the pinhole plate, in primary sample space (Kelemen et al., 2002).
+ *
+ * A path is a deterministic function of the random numbers the tracing uses,
+ * its primary sample. Here the primary sample is the sequence of numbers the
+ * Mersenne twister gives: the state of the generator is set so that it gives
+ * the chosen numbers, so the ordinary tracing functions (create_ray,
+ * trace_ray_simple_multi and the scattering distributions) are used unchanged.
+ * A Markov chain of primary samples is run whose stationary distribution is
+ * uniform over the detected paths. Its steps are:
+ *  - small steps, every number used by the current path (the position and
+ *    direction from the source and each scattering direction) is perturbed
+ *    slightly, so nearby paths through the same cavity are explored
+ *  - large steps, a new path is traced from the source, so the chain does not
+ *    get stuck.
+ * The proposed path is accepted if it is detected. The chains start from
+ * detected paths of a short forward run, which are already distributed as
+ * the chains are, so no burn in is needed.
+ *
+ * The chains give the fraction of the detected paths going into each
+ * detector and with each number of scattering events. The total is taken
+ * from the short forward run and the large steps, which are ordinary forward
+ * paths.
+ */
+
+#ifndef METROPOLIS_H_
+#define METROPOLIS_H_
+
+#include "ray_tracing_core3D.h"
+#include "mtwister.h"
+
+/* The length of a primary sample, numbers past it are made by the generator */
+#define MLT_DIMENSIONS STATE_VECTOR_LENGTH
+
+/* Numbers set past those used by the current path, the rest are set if used */
+#define MLT_MARGIN 32
+
+/* Range of the size of the perturbation of a small step */
+#define MLT_SMALL_MIN (1.0/1024)
+#define MLT_SMALL_MAX (1.0/64)
+
+typedef struct _metropolisParam {
+    int64_t n_forward;      /* Rays of the forward run */
+    int64_t n_mutations;    /* Steps of the chains, shared between them */
+    int n_chains;           /* Chains, started from different forward paths */
+    double large_step;      /* Probability that a step is a large step */
+} MetropolisParam;
+
+typedef struct _primarySample {
+    unsigned long value[MLT_DIMENSIONS];    /* The numbers given by genRandLong */
+    unsigned long state[MLT_DIMENSIONS];    /* The state of the generator that gives them */
+    int n_set;              /* The first n_set numbers are set, the rest are drawn if used */
+    int n_used;             /* The numbers used by the path */
+    int detector;           /* The detector the path goes into, 0 if none */
+    int n_scatters;         /* Sample scattering events of the path */
+} PrimarySample;
+
+/* Statistics of the chains */
+typedef struct _metropolisStats {
+    int64_t n_steps;        /* Steps of the chains */
+    int64_t n_accepted;     /* Accepted steps */
+    int64_t n_large;        /* Large steps */
+    int64_t n_large_detected; /* Large steps whose path was detected */
+} MetropolisStats;
+
+/* The bytes generating_rays_metropolis allocates */
+int64_t metropolis_memory(int n_chains, int n_detect, int maxScatters);
+
+/*
+ * The primary sample of the path traced with the generator in the state
+ * saved, e.g. a copy of the generator made before tracing a forward ray.
+ */
+void primary_sample_from_rng(MTRand const * const saved, PrimarySample * const u);
+
+/*
+ * Run n_starts chains from the detected primary samples starts, which are
+ * changed. The number of steps spent on paths into each detector and with
+ * each number of sample scattering events is added to occupancy (n_detect x
+ * SCATTER_BINS(maxScatters), as numScattersRay).
+ */
+void metropolis_chains(PrimarySample * const starts, int n_starts,
+        MetropolisParam const * const mlt, SourceParam const * const source,
+        int maxScatters, Surface3D sample, NBackWall plate, AnalytSphere the_sphere,
+        MTRand * const myrng, double * const occupancy, MetropolisStats * const stats);
+
+#endif /* METROPOLIS_H_ */
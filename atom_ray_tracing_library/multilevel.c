@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Multilevel Monte Carlo over meshes of the sample, see multilevel.h.
+ */
+
+#include "multilevel.h"
+#include "trace_ray.h"
+#include "ray_tracing_core3D.h"
+#include "memory_account.h"
+#include "mtwister.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "probes.h"
+
+/* No level gets more than this many samples per ray asked for */
+#define MLMC_MAX_RATIO 100
+
+/* Words of the stream of a sample set at first, enough for most paths */
+#define MLMC_STREAM_WORDS 64
+
+/*
+ * The random numbers of a sample of a correction, shared by its fine and coarse
+ * rays. Rather than seeding a generator for each sample, which initialises and
+ * twists all 624 words of its state, the first n_set words of the state are
+ * drawn from the generator of the run and the generator is started at index 0.
+ * It then gives those words, tempered, without any twist. A path that needs
+ * more words is traced again once more are set, the generator is only twisted
+ * when all of them are.
+ */
+typedef struct _coupledStream {
+    MTRand state;
+    int n_set;
+} CoupledStream;
+
+/* Set the words of the stream up to to from myrng */
+static void stream_fill(CoupledStream * const stream, int to, MTRand * const myrng) {
+    int i;
+
+    if (to > STATE_VECTOR_LENGTH)
+        to = STATE_VECTOR_LENGTH;
+    for (i = stream->n_set; i < to; i++)
+        genRandLong(myrng, &stream->state.mt[i]);
+    stream->n_set = to;
+}
+
+/* Start rng at the beginning of the stream */
+static void stream_start(CoupledStream const * const stream, MTRand * const rng) {
+    memcpy(rng->mt, stream->state.mt, (size_t)stream->n_set*sizeof(rng->mt[0]));
+    rng->index = 0;
+}
+
+/* Did rng, started from the stream, use words past those set */
+static int stream_overrun(CoupledStream const * const stream, MTRand const * const rng) {
+    return stream->n_set < STATE_VECTOR_LENGTH &&
+        (rng->index > stream->n_set || rng->mt[0] != stream->state.mt[0]);
+}
+
+/* The current time in seconds */
+static double multilevel_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+void set_up_multilevel_stats(int n_levels, int n_detect, MultilevelStats * const stats) {
+    stats->n_levels = n_levels;
+    stats->n_detect = n_detect;
+    stats->n_samples = (int64_t*)calloc(n_levels, sizeof(int64_t));
+    stats->sum = (double*)calloc((size_t)n_detect*n_levels, sizeof(double));
+    stats->sum_sq = (double*)calloc((size_t)n_detect*n_levels, sizeof(double));
+    stats->time = (double*)calloc(n_levels, sizeof(double));
+    stats->fine_sum = (double*)calloc(n_detect, sizeof(double));
+    stats->fine_sum_sq = (double*)calloc(n_detect, sizeof(double));
+    stats->fine_time = 0;
+    account_memory(MEM_RAYS, multilevel_memory(n_levels, n_detect));
+}
+
+void clean_up_multilevel_stats(MultilevelStats * const stats) {
+    free(stats->n_samples);
+    free(stats->sum);
+    free(stats->sum_sq);
+    free(stats->time);
+    free(stats->fine_sum);
+    free(stats->fine_sum_sq);
+    account_memory(MEM_RAYS, -multilevel_memory(stats->n_levels, stats->n_detect));
+}
+
+int64_t multilevel_memory(int n_levels, int n_detect) {
+    return (int64_t)n_levels*(sizeof(int64_t) + sizeof(double)) +
+        (int64_t)n_detect*(2*n_levels + 2)*sizeof(double);
+}
+
+double multilevel_mean(MultilevelStats const * const stats, int level, int detector) {
+    int64_t const n = stats->n_samples[level];
+
+    if (n == 0)
+        return 0;
+    return stats->sum[(size_t)level*stats->n_detect + detector]/(double)n;
+}
+
+/* The unbiased variance of n samples with the given sums */
+static double sample_variance(double sum, double sum_sq, int64_t n) {
+    double var;
+
+    if (n < 2)
+        return 0;
+    var = (sum_sq - sum*sum/(double)n)/(double)(n - 1);
+    return var > 0 ? var : 0;
+}
+
+double multilevel_variance(MultilevelStats const * const stats, int level, int detector) {
+    size_t const k = (size_t)level*stats->n_detect + detector;
+
+    return sample_variance(stats->sum[k], stats->sum_sq[k], stats->n_samples[level]);
+}
+
+double multilevel_fine_variance(MultilevelStats const * const stats, int detector) {
+    return sample_variance(stats->fine_sum[detector], stats->fine_sum_sq[detector],
+        stats->n_samples[stats->n_levels - 1]);
+}
+
+/*
+ * The variance of a sample of each level and of a ray on the finest mesh alone,
+ * summed over the detectors, and the cost of each. Returns sum_l sqrt(V_l C_l).
+ */
+static double level_costs(MultilevelStats const * const stats, double * const var,
+        double * const cost, double * const fine_var, double * const fine_cost) {
+    int64_t const n_fine = stats->n_samples[stats->n_levels - 1];
+    double total = 0;
+    int l, j;
+
+    *fine_var = 0;
+    for (j = 0; j < stats->n_detect; j++)
+        *fine_var += multilevel_fine_variance(stats, j);
+    *fine_cost = n_fine > 0 ? stats->fine_time/(double)n_fine : 0;
+
+    for (l = 0; l < stats->n_levels; l++) {
+        var[l] = 0;
+        for (j = 0; j < stats->n_detect; j++)
+            var[l] += multilevel_variance(stats, l, j);
+        /* The timer ticks in microseconds, a cheap level may not register */
+        cost[l] = stats->n_samples[l] > 0 ? stats->time[l]/(double)stats->n_samples[l] : 0;
+        if (cost[l] < 1e-9)
+            cost[l] = 1e-9;
+        total += sqrt(var[l]*cost[l]);
+    }
+    return total;
+}
+
+void multilevel_allocate(MultilevelStats const * const pilot, int64_t n_rays,
+        int64_t min_rays, int64_t * const level_rays) {
+    double * var = (double*)malloc(2*pilot->n_levels*sizeof(double));
+    double * cost = var + pilot->n_levels;
+    double fine_var, fine_cost, total;
+    int l;
+
+    total = level_costs(pilot, var, cost, &fine_var, &fine_cost);
+    for (l = 0; l < pilot->n_levels; l++) {
+        double n;
+
+        /* Nothing was detected in the pilot run, trace the coarsest mesh */
+        if (fine_var <= 0)
+            n = l == 0 ? (double)n_rays : 0;
+        else
+            n = ceil(sqrt(var[l]/cost[l])*total*(double)n_rays/fine_var);
+        if (n > (double)MLMC_MAX_RATIO*n_rays)
+            n = (double)MLMC_MAX_RATIO*n_rays;
+        level_rays[l] = n > (double)min_rays ? (int64_t)n : min_rays;
+    }
+    free(var);
+}
+
+double multilevel_speedup(MultilevelStats const * const stats) {
+    double * var = (double*)malloc(2*stats->n_levels*sizeof(double));
+    double * cost = var + stats->n_levels;
+    double fine_var, fine_cost, total;
+
+    total = level_costs(stats, var, cost, &fine_var, &fine_cost);
+    free(var);
+    if (total <= 0)
+        return 0;
+    return fine_var*fine_cost/(total*total);
+}
+
+/*
+ * Add a traced ray, with the sign of its term in the correction, to the
+ * estimate of the counts, the histogram and the killed rays, each of its rays
+ * standing for scale rays on the finest mesh.
+ */
+static void add_to_estimate(Ray3D const * const the_ray, double scale, int maxScatters,
+        double * const cntr_detected, double * const numScattersRay,
+        double * const killed) {
+    int ind;
+
+    switch (the_ray->status) {
+        case 2:
+            ind = scatter_bin(the_ray->detector, the_ray->nScatters, maxScatters);
+            numScattersRay[ind] += scale*the_ray->weight;
+            cntr_detected[the_ray->detector - 1] += scale*the_ray->weight;
+            break;
+        case -1:
+            *killed += scale;
+            break;
+    }
+}
+
+/* Add a sample of a level, the fine ray less the coarse one (NULL on level 0) */
+static void add_sample(MultilevelStats * const stats, int level, Ray3D const * const fine,
+        Ray3D const * const coarse) {
+    size_t const k = (size_t)level*stats->n_detect;
+    double y[2];
+    int det[2];
+    int n = 0;
+    int i;
+
+    if (fine->status == 2) {
+        det[n] = fine->detector - 1;
+        y[n++] = fine->weight;
+    }
+    if (coarse != NULL && coarse->status == 2) {
+        if (n > 0 && det[0] == coarse->detector - 1) {
+            y[0] -= coarse->weight;
+        } else {
+            det[n] = coarse->detector - 1;
+            y[n++] = -coarse->weight;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        stats->sum[k + det[i]] += y[i];
+        stats->sum_sq[k + det[i]] += y[i]*y[i];
+    }
+    stats->n_samples[level]++;
+
+    if (level == stats->n_levels - 1 && fine->status == 2) {
+        stats->fine_sum[fine->detector - 1] += fine->weight;
+        stats->fine_sum_sq[fine->detector - 1] += fine->weight*fine->weight;
+    }
+}
+
+void generating_rays_multilevel(SourceParam source, int64_t n_rays,
+        int64_t const * const level_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D const levels[],
+        int n_levels, NBackWall plate, AnalytSphere the_sphere,
+        RouletteParam const * const roulette, PixelFeatures * const feat,
+        MTRand * const myrng, double * const numScattersRay,
+        MultilevelStats * const stats) {
+    double killed_est = 0;
+    CoupledStream stream;
+    MTRand fine_rng, coarse_rng;
+    int64_t i;
+    int l;
+
+    SHEM_PROBE2(rays_start, "generating_rays_multilevel", n_rays);
+
+    /* Words past those set are only read by paths that are traced again */
+    memset(&fine_rng, 0, sizeof(fine_rng));
+    memset(&coarse_rng, 0, sizeof(coarse_rng));
+
+    for (l = 0; l < n_levels; l++) {
+        double const scale = level_rays[l] > 0 ? (double)n_rays/(double)level_rays[l] : 0;
+
+        for (i = 0; i < level_rays[l]; i++) {
+            Ray3D fine, coarse;
+            double start, t_fine;
+
+            SHEM_PROBE_RAY_BATCH(i, level_rays[l]);
+
+            start = multilevel_now();
+            if (l == 0) {
+                /* The coarsest level has no coarse ray, it needs no stream */
+                create_ray(&fine, &source, myrng);
+                trace_ray_simple_multi(&fine, maxScatters, levels[l], plate, the_sphere,
+                        roulette, NULL, feat, myrng);
+                t_fine = multilevel_now() - start;
+            } else {
+                /* The fine and coarse rays use the same numbers */
+                stream.n_set = 0;
+                stream_fill(&stream, MLMC_STREAM_WORDS, myrng);
+                for (;;) {
+                    double const trace_start = multilevel_now();
+
+                    stream_start(&stream, &fine_rng);
+                    create_ray(&fine, &source, &fine_rng);
+                    trace_ray_simple_multi(&fine, maxScatters, levels[l], plate,
+                            the_sphere, roulette, NULL, NULL, &fine_rng);
+                    t_fine = multilevel_now() - trace_start;
+                    if (!stream_overrun(&stream, &fine_rng))
+                        break;
+                    stream_fill(&stream, 2*stream.n_set, myrng);
+                }
+                /* The fine ray only used words that are kept as more are set */
+                for (;;) {
+                    stream_start(&stream, &coarse_rng);
+                    create_ray(&coarse, &source, &coarse_rng);
+                    trace_ray_simple_multi(&coarse, maxScatters, levels[l - 1], plate,
+                            the_sphere, roulette, NULL, NULL, &coarse_rng);
+                    if (!stream_overrun(&stream, &coarse_rng))
+                        break;
+                    stream_fill(&stream, 2*stream.n_set, myrng);
+                }
+                add_to_estimate(&coarse, -scale, maxScatters, cntr_detected,
+                        numScattersRay, &killed_est);
+            }
+            add_to_estimate(&fine, scale, maxScatters, cntr_detected, numScattersRay,
+                    &killed_est);
+
+            if (stats != NULL) {
+                add_sample(stats, l, &fine, l > 0 ? &coarse : NULL);
+                stats->time[l] += multilevel_now() - start;
+                if (l == n_levels - 1)
+                    stats->fine_time += t_fine;
+            }
+        }
+    }
+
+    if (killed_est > 0)
+        *killed += (int64_t)(killed_est + 0.5);
+    SHEM_PROBE3(rays_end, "generating_rays_multilevel", n_rays, *killed);
+}
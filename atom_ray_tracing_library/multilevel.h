@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Multilevel Monte Carlo (Giles, 2008) over a hierarchy of meshes of the sample
+ * with the simple (N aperture) model of the pinhole plate.
+ *
+ * The expected counts on the finest mesh, level L, are written as those on the
+ * coarsest mesh plus the corrections between successive meshes,
+ *   E[c_L] = E[c_0] + sum_{l = 1}^{L} E[c_l - c_{l-1}],
+ * and each term is estimated separately. A sample of the correction of level l
+ * traces a ray on mesh l and a ray on mesh l - 1 from the same random numbers,
+ * a short stream of numbers drawn for the sample that both rays replay.
+ * The two paths are the same until they meet a difference between the meshes,
+ * so the corrections have a small variance and few samples of them are needed.
+ * Most of the rays are then traced on the cheap coarse mesh.
+ *
+ * The samples of each level are chosen to minimise the cost for the variance of
+ * tracing the finest mesh alone, N_l proportional to sqrt(V_l/C_l) where V_l is
+ * the variance and C_l the cost of a sample, estimated from a short pilot run.
+ * Whatever the coarse meshes the estimate is unbiased for the finest mesh, they
+ * only need to be close to it for the method to pay.
+ */
+
+#ifndef MULTILEVEL_H_
+#define MULTILEVEL_H_
+
+#include "ray_tracing_core3D.h"
+#include "pixel_features.h"
+#include "mtwister.h"
+
+typedef struct _multilevelParam {
+    int64_t n_pilot;        /* Samples of each level in the pilot run */
+    int64_t min_rays;       /* Fewest samples of a level */
+} MultilevelParam;
+
+/*
+ * Statistics of the samples of each level. The variance of a sample is summed
+ * over the detectors when the samples are allocated.
+ */
+typedef struct _multilevelStats {
+    int n_levels;
+    int n_detect;
+    int64_t * n_samples;    /* Samples of each level */
+    double * sum;           /* Sum of the samples of each detector and level,
+                             * n_detect x n_levels */
+    double * sum_sq;        /* Sum of their squares */
+    double * time;          /* Time spent on each level in seconds */
+    double * fine_sum;      /* Sum of the counts of the rays on the finest mesh
+                             * alone, from the samples of the finest level */
+    double * fine_sum_sq;   /* Sum of their squares */
+    double fine_time;       /* Time spent tracing those rays */
+} MultilevelStats;
+
+void set_up_multilevel_stats(int n_levels, int n_detect, MultilevelStats * const stats);
+
+void clean_up_multilevel_stats(MultilevelStats * const stats);
+
+/* The bytes set_up_multilevel_stats allocates */
+int64_t multilevel_memory(int n_levels, int n_detect);
+
+/* The mean and variance of a sample of a level for a detector */
+double multilevel_mean(MultilevelStats const * const stats, int level, int detector);
+double multilevel_variance(MultilevelStats const * const stats, int level, int detector);
+
+/* The variance of a ray on the finest mesh alone for a detector */
+double multilevel_fine_variance(MultilevelStats const * const stats, int detector);
+
+/*
+ * The samples of each level that give the variance of n_rays rays on the finest
+ * mesh alone at the least cost, from the statistics of a pilot run. There are
+ * at least min_rays samples of each level.
+ */
+void multilevel_allocate(MultilevelStats const * const pilot, int64_t n_rays,
+        int64_t min_rays, int64_t * const level_rays);
+
+/*
+ * The expected cost of tracing the finest mesh alone over that of the
+ * multilevel estimate, for the same variance, from the statistics of a run.
+ */
+double multilevel_speedup(MultilevelStats const * const stats);
+
+/*
+ * Trace level_rays[l] samples of each level of the meshes levels[0 .. n_levels
+ * - 1], coarsest first. The estimate of the counts and the histogram of the
+ * scattering events for n_rays rays on the finest mesh is added to
+ * cntr_detected and numScattersRay, which may go negative if too few samples
+ * are traced. The estimate of the killed rays is added to killed. If feat is
+ * not NULL the features of the rays of the coarsest level are recorded. If
+ * stats is not NULL the samples are added to it.
+ */
+void generating_rays_multilevel(SourceParam source, int64_t n_rays,
+        int64_t const * const level_rays, int64_t * const killed,
+        double * const cntr_detected, int maxScatters, Surface3D const levels[],
+        int n_levels, NBackWall plate, AnalytSphere the_sphere,
+        RouletteParam const * const roulette, PixelFeatures * const feat,
+        MTRand * const myrng, double * const numScattersRay,
+        MultilevelStats * const stats);
+
+#endif /* MULTILEVEL_H_ */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Features of the first bounce of the rays of a pixel, see pixel_features.h.
+ */
+
+#include "pixel_features.h"
+#include "ray_tracing_core3D.h"
+#include "memory_account.h"
+#include <math.h>
+#include <stdlib.h>
+
+int64_t features_memory(int n_materials) {
+    return (int64_t)(n_materials + 1)*sizeof(int64_t);
+}
+
+void set_up_features(Material const * M, int n_materials, PixelFeatures * const feat) {
+    int k;
+
+    feat->materials = M;
+    feat->n_materials = n_materials;
+    feat->n_rays = 0;
+    feat->n_sample = 0;
+    feat->n_sphere = 0;
+    feat->depth_sum = 0;
+    for (k = 0; k < 3; k++)
+        feat->normal_sum[k] = 0;
+    account_memory(MEM_OUTPUTS, features_memory(n_materials));
+    feat->material_hist = (int64_t*)calloc(n_materials + 1, sizeof(int64_t));
+}
+
+void clean_up_features(PixelFeatures * const feat) {
+    account_memory(MEM_OUTPUTS, -features_memory(feat->n_materials));
+    free(feat->material_hist);
+}
+
+void features_first_hit(PixelFeatures * const feat, Ray3D const * const the_ray,
+        double const start[3], Surface3D const * const sample,
+        AnalytSphere const * const the_sphere) {
+    double n[3];
+    double depth = 0;
+    int k;
+
+    feat->n_rays++;
+    if (the_ray->status != 0)
+        return;
+
+    for (k = 0; k < 3; k++)
+        depth += (the_ray->position[k] - start[k])*(the_ray->position[k] - start[k]);
+    feat->depth_sum += sqrt(depth);
+
+    if (the_ray->on_surface == the_sphere->surf_index) {
+        /* The outward normal of the sphere */
+        for (k = 0; k < 3; k++)
+            n[k] = (the_ray->position[k] - the_sphere->sphere_c[k])/the_sphere->sphere_r;
+        feat->n_sphere++;
+        feat->material_hist[feat->n_materials]++;
+    } else {
+        Material const * comp = map_composition(sample, the_ray->position,
+            element_composition(sample, the_ray->on_element));
+        element_normal(sample, the_ray->on_element, n);
+        feat->n_sample++;
+        if (comp != NULL && comp >= feat->materials &&
+                comp < feat->materials + feat->n_materials)
+            feat->material_hist[comp - feat->materials]++;
+    }
+    for (k = 0; k < 3; k++)
+        feat->normal_sum[k] += n[k];
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Geometric features of the first bounce of the rays of a pixel: what the
+ * primary rays hit (the sample, the sphere or nothing), how far they travelled
+ * to it, the normal there and which material it was made of. They cost a few
+ * additions per ray and describe the part of the sample a pixel sees, so they
+ * can guide the denoising, reconstruction or refinement of images.
+ *
+ * The features are passed to the tracing functions as a pointer, if the
+ * pointer is NULL no features are recorded.
+ */
+
+#ifndef PIXEL_FEATURES_H_
+#define PIXEL_FEATURES_H_
+
+#include "ray_tracing_core3D.h"
+
+typedef struct _pixelFeatures {
+    Material const * materials; /* The materials of the sample, to index the histogram */
+    int n_materials;
+
+    int64_t n_rays;             /* Number of primary rays */
+    int64_t n_sample;           /* Number whose first hit was the sample */
+    int64_t n_sphere;           /* Number whose first hit was the sphere */
+    double depth_sum;           /* Sum of the distances to the first hits */
+    double normal_sum[3];       /* Sum of the normals at the first hits */
+    int64_t * material_hist;    /* First hits on each material, the last is the sphere */
+} PixelFeatures;
+
+/* Allocates the histogram of materials, must call clean_up_features */
+void set_up_features(Material const * M, int n_materials, PixelFeatures * const feat);
+
+void clean_up_features(PixelFeatures * const feat);
+
+/* The bytes set_up_features allocates */
+int64_t features_memory(int n_materials);
+
+/*
+ * Record the first scattering event of a ray that started at start, after
+ * scatterOffSurface. If the ray is still alive it is on the surface it hit.
+ */
+void features_first_hit(PixelFeatures * const feat, Ray3D const * const the_ray,
+        double const start[3], Surface3D const * const sample,
+        AnalytSphere const * const the_sphere);
+
+#endif /* PIXEL_FEATURES_H_ */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * USDT static tracepoints for profiling with perf/bpftrace. The probes are only
+ * compiled in when SHEM_USDT is defined (needs sys/sdt.h, e.g. from the
+ * systemtap-sdt-dev package), otherwise they expand to nothing. When compiled
+ * in a probe that is not attached is a single nop.
+ *
+ * All probes are in the provider "shem":
+ *  mex_entry(name, pixel, n_rays)       - entry to a MEX gateway, pixel is -1
+ *                                         if not known
+ *  mex_exit(name, pixel, n_killed)      - exit of a MEX gateway
+ *  surface_start(surf_index, n_faces)   - start of set_up_surface
+ *  surface_end(surf_index, n_faces)     - end of set_up_surface
+ *  rays_start(name, n_rays)             - start of generating_rays_* and
+ *                                         given_rays_*
+ *  rays_end(name, n_rays, n_killed)     - end of generating_rays_* and
+ *                                         given_rays_*
+ *  ray_batch(i_ray, n_rays)             - every SHEM_PROBE_BATCH rays
+ *
+ * Example bpftrace scripts are in tools/bpftrace.
+ */
+
+#ifndef _shem_probes_h
+#define _shem_probes_h
+
+/* Number of rays between ray_batch probes, must be a power of 2 */
+#define SHEM_PROBE_BATCH 4096
+
+#ifdef SHEM_USDT
+
+#include <sys/sdt.h>
+
+#define SHEM_PROBE2(name, a, b) DTRACE_PROBE2(shem, name, a, b)
+#define SHEM_PROBE3(name, a, b, c) DTRACE_PROBE3(shem, name, a, b, c)
+#define SHEM_PROBE_RAY_BATCH(i, n) \
+    do { \
+        if (((i) & (SHEM_PROBE_BATCH - 1)) == 0) \
+            DTRACE_PROBE2(shem, ray_batch, i, n); \
+    } while (0)
+
+#else
+
+/* The arguments are evaluated (and optimised away) to avoid unused warnings */
+#define SHEM_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define SHEM_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define SHEM_PROBE_RAY_BATCH(i, n) do {} while (0)
+
+#endif /* SHEM_USDT */
+
+#endif /* _shem_probes_h */
@@ -13,6 +13,8 @@
 #include "ray_tracing_core3D.h"
 #include "common_helpers.h"
 #include "distributions3D.h"
+#include "probes.h"
+#include "memory_account.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
@@ -43,17 +45,27 @@ static void get_vertex_ptr(Surface3D const * const s, int ind, double ** v);
 void set_up_surface(double V[], double N[], int32_t F[], char * C[], Material M[],
         int nmaterials, int ntriag, int nvert, int surf_index, Surface3D * const surf) {
 
+    SHEM_PROBE2(surface_start, surf_index, ntriag);
+
     /* Allocate the components of the surface. */
     surf->surf_index = surf_index;
     surf->n_faces = ntriag;
     surf->n_vertices = nvert;
     surf->vertices = V;
     surf->normals = N;
+    surf->vertex_normals = NULL;
     surf->faces = F;
+    surf->offset[0] = 0;
+    surf->offset[1] = 0;
+    surf->offset[2] = 0;
+    surf->voxels = NULL;
+    surf->visibility = NULL;
+    surf->material_map = NULL;
 
     // assign references to the correct material
     // loop through faces and look for the material that fits the name
     surf->compositions = calloc(ntriag, sizeof(Material*));
+    account_memory(MEM_COMPOSITIONS, (int64_t)ntriag*sizeof(Material*));
     
     for (int iface = 0; iface < ntriag; iface++) {
         bool found = false;
@@ -70,19 +82,412 @@ void set_up_surface(double V[], double N[], int32_t F[], char * C[], Material M[
                               "Composition of face %d not resolved.", iface);
         }*/
     }
+
+    // the frame of each face is built once, along with the lattice of
+    // diffracting materials
+    surf->frames = malloc(ntriag*sizeof(SurfaceFrame));
+    account_memory(MEM_GEOMETRY, (int64_t)ntriag*sizeof(SurfaceFrame));
+    for (int iface = 0; iface < ntriag; iface++) {
+        make_frame(&N[3*iface], &surf->frames[iface]);
+        if (surf->compositions[iface] != NULL) {
+            set_frame_lattice(surf->compositions[iface]->func,
+                surf->compositions[iface]->params, &surf->frames[iface]);
+        }
+    }
+
+    // the hierarchy used to find which face a ray hits
+    surf->bvh = build_bvh(V, F, ntriag);
+
+    SHEM_PROBE2(surface_end, surf_index, ntriag);
+}
+
+int set_up_voxel_surface(uint8_t const ids[], const int dims[3], const double origin[3],
+        double voxel_size, int brick_size, int normal_radius, Material M[], int nmaterials,
+        int surf_index, Surface3D * const surf) {
+    int imat;
+
+    surf->surf_index = surf_index;
+    surf->n_faces = 0;
+    surf->n_vertices = 0;
+    surf->vertices = NULL;
+    surf->normals = NULL;
+    surf->vertex_normals = NULL;
+    surf->faces = NULL;
+    surf->frames = NULL;
+    surf->bvh = NULL;
+    surf->visibility = NULL;
+    surf->material_map = NULL;
+    surf->offset[0] = 0;
+    surf->offset[1] = 0;
+    surf->offset[2] = 0;
+
+    // the materials are looked up by the id of the voxel hit
+    surf->compositions = malloc(nmaterials*sizeof(Material*));
+    account_memory(MEM_COMPOSITIONS, (int64_t)nmaterials*sizeof(Material*));
+    for (imat = 0; imat < nmaterials; imat++)
+        surf->compositions[imat] = &M[imat];
+
+    surf->voxels = build_voxel_grid(ids, dims, origin, voxel_size, brick_size,
+        normal_radius, nmaterials);
+    return surf->voxels != NULL;
 }
 
 void clean_up_surface(Surface3D * const surface) {
+    if (surface->voxels != NULL) {
+        account_memory(MEM_COMPOSITIONS,
+            -(int64_t)surface->voxels->n_materials*sizeof(Material*));
+        free(surface->compositions);
+        free_voxel_grid(surface->voxels);
+        surface->voxels = NULL;
+        return;
+    }
+    account_memory(MEM_COMPOSITIONS, -(int64_t)surface->n_faces*sizeof(Material*));
+    account_memory(MEM_GEOMETRY, -(int64_t)surface->n_faces*sizeof(SurfaceFrame));
     free(surface->compositions);
+    free(surface->frames);
+    free_bvh(surface->bvh);
+    if (surface->vertex_normals != NULL) {
+        account_memory(MEM_GEOMETRY, -(int64_t)surface->n_faces*9*sizeof(double));
+        free(surface->vertex_normals);
+        surface->vertex_normals = NULL;
+    }
 }
 
 void clean_up_surface_all_arrays(Surface3D * const surface) {
     clean_up_surface(surface);
+    account_memory(MEM_GEOMETRY, -(int64_t)(sizeof(double)*surface->n_vertices*3 +
+        (sizeof(double) + sizeof(int32_t))*surface->n_faces*3));
     free(surface->vertices);
     free(surface->normals);
     free(surface->faces);
 }
 
+/*
+ * The normal at a vertex of a face is the area weighted mean of the normals of
+ * the faces sharing that vertex that are within crease_angle of the face's own.
+ * The faces around each vertex are listed first, in the compressed form of a
+ * sparse matrix.
+ */
+void smooth_surface_normals(Surface3D * const surf, double crease_angle) {
+    int const n_faces = surf->n_faces;
+    int const n_vert = surf->n_vertices;
+    double const cos_crease = cos(crease_angle);
+    int * start = calloc(n_vert + 1, sizeof(int));
+    int * around = malloc(3*(size_t)n_faces*sizeof(int));
+    double * area = malloc(n_faces*sizeof(double));
+    int i, j, k;
+
+    if (surf->vertex_normals == NULL) {
+        account_memory(MEM_GEOMETRY, (int64_t)n_faces*9*sizeof(double));
+        surf->vertex_normals = malloc(9*(size_t)n_faces*sizeof(double));
+    }
+
+    for (i = 0; i < n_faces; i++) {
+        double v1[3], v2[3], v3[3], n[3], e1[3], e2[3], c[3];
+
+        get_element3D(surf, i, v1, v2, v3, n);
+        for (k = 0; k < 3; k++) {
+            e1[k] = v2[k] - v1[k];
+            e2[k] = v3[k] - v1[k];
+        }
+        cross(e1, e2, c);
+        area[i] = 0.5*sqrt(c[0]*c[0] + c[1]*c[1] + c[2]*c[2]);
+        for (j = 0; j < 3; j++)
+            start[surf->faces[3*i + j] - 1]++;
+    }
+    for (i = 0; i < n_vert; i++)
+        start[i + 1] += start[i];
+    for (i = n_faces - 1; i >= 0; i--)
+        for (j = 0; j < 3; j++)
+            around[--start[surf->faces[3*i + j] - 1]] = i;
+
+    for (i = 0; i < n_faces; i++) {
+        double const * n_i = &surf->normals[3*i];
+
+        for (j = 0; j < 3; j++) {
+            int const v = surf->faces[3*i + j];
+            double * n_v = &surf->vertex_normals[9*i + 3*j];
+            int m;
+
+            n_v[0] = n_v[1] = n_v[2] = 0;
+            for (m = start[v - 1]; m < start[v]; m++) {
+                double const * n_m = &surf->normals[3*around[m]];
+                double cos_m;
+
+                dot(n_i, n_m, &cos_m);
+                if ((around[m] == i) || (cos_m >= cos_crease))
+                    for (k = 0; k < 3; k++)
+                        n_v[k] += area[around[m]]*n_m[k];
+            }
+            if (n_v[0]*n_v[0] + n_v[1]*n_v[1] + n_v[2]*n_v[2] > 0)
+                normalise(n_v);
+            else
+                for (k = 0; k < 3; k++)
+                    n_v[k] = n_i[k];
+        }
+    }
+
+    free(start);
+    free(around);
+    free(area);
+}
+
+SurfaceFrame const * element_frame(Surface3D const * const surf, int idx,
+        const double normal[3], const double dir[3], SurfaceFrame * const shading) {
+    SurfaceFrame const * flat;
+    double cos_in, t;
+    int k;
+
+    /* Voxels have no stored frames, theirs are made from the normal at the hit */
+    if (surf->voxels != NULL) {
+        Material const * const comp = element_composition(surf, idx);
+
+        make_frame(normal, shading);
+        if (comp != NULL)
+            set_frame_lattice(comp->func, comp->params, shading);
+        return shading;
+    }
+
+    flat = &surf->frames[idx];
+    if (surf->vertex_normals == NULL)
+        return flat;
+
+    /* Scattering about a normal the ray arrives from behind is not defined */
+    dot(normal, dir, &cos_in);
+    if (cos_in >= 0)
+        return flat;
+
+    /* Tilt the tangents of the element so the lattice keeps its orientation */
+    *shading = *flat;
+    for (k = 0; k < 3; k++)
+        shading->normal[k] = normal[k];
+    dot(flat->t1, normal, &t);
+    for (k = 0; k < 3; k++)
+        shading->t1[k] = flat->t1[k] - t*normal[k];
+    normalise(shading->t1);
+    cross(normal, shading->t1, shading->t2);
+    return shading;
+}
+
+Material * element_composition(Surface3D const * const surf, int idx) {
+    if (surf->voxels != NULL) {
+        VoxelGrid const * const grid = surf->voxels;
+        int const voxel = idx/6;
+        int const id = voxel_id(grid, voxel % grid->dims[0],
+            (voxel/grid->dims[0]) % grid->dims[1], voxel/(grid->dims[0]*grid->dims[1]));
+
+        return id > 0 && id <= grid->n_materials ? surf->compositions[id - 1] : NULL;
+    }
+    return surf->compositions[idx];
+}
+
+Material * map_composition(Surface3D const * const surf, const double p[3], Material * own) {
+    MaterialMap const * const map = surf->material_map;
+    double q[3];
+    int texel, k;
+
+    if (map == NULL)
+        return own;
+    for (k = 0; k < 3; k++)
+        q[k] = p[k] - surf->offset[k];
+    texel = material_map_texel(map, q);
+    if (texel < 0 || map->ids[texel] == 0)
+        return own;
+    return &map->materials[map->ids[texel] - 1];
+}
+
+Material const * mapped_material(Surface3D const * const surf, const double p[3],
+        Material const * own, SurfaceFrame const ** const frame, SurfaceFrame * const shading,
+        ScaledMaterial * const scaled) {
+    MaterialMap const * const map = surf->material_map;
+    Material const * mat;
+    double q[3];
+    int texel, k;
+
+    for (k = 0; k < 3; k++)
+        q[k] = p[k] - surf->offset[k];
+    texel = material_map_texel(map, q);
+    if (texel < 0)
+        return own;
+    mat = map->ids[texel] == 0 ? own : &map->materials[map->ids[texel] - 1];
+    if (mat == NULL)
+        return own;
+
+    if (map->scales != NULL && map->scaled_param < mat->n_params &&
+            mat->n_params <= MATERIAL_MAP_MAX_PARAMS) {
+        scaled->material = *mat;
+        for (k = 0; k < mat->n_params; k++)
+            scaled->params[k] = mat->params[k];
+        scaled->params[map->scaled_param] *= map->scales[texel];
+        scaled->material.params = scaled->params;
+        mat = &scaled->material;
+    }
+
+    /* The lattice of the element is that of its own material */
+    if (own == NULL || mat->params != own->params) {
+        if (*frame != shading)
+            *shading = **frame;
+        set_frame_lattice(mat->func, mat->params, shading);
+        *frame = shading;
+    }
+    return mat;
+}
+
+void element_normal(Surface3D const * const surf, int idx, double n[3]) {
+    int k;
+
+    if (surf->voxels != NULL) {
+        voxel_face_normal(idx % 6, n);
+        return;
+    }
+    for (k = 0; k < 3; k++)
+        n[k] = surf->normals[3*idx + k];
+}
+
+void keep_above_element(Surface3D const * const surf, int idx, double dir[3]) {
+    double n[3];
+    double cos_out;
+    int k;
+
+    if (surf->vertex_normals == NULL && surf->voxels == NULL)
+        return;
+    element_normal(surf, idx, n);
+    dot(n, dir, &cos_out);
+    if (cos_out < 0)
+        for (k = 0; k < 3; k++)
+            dir[k] -= 2*cos_out*n[k];
+}
+
+/*
+ * Does the path of the ray, from its position to a squared distance dist2 along
+ * its direction, pass through any of the refine regions of the plate.
+ */
+int path_in_refine_region(Ray3D const * const the_ray, double dist2,
+        PlateRefine const * const refine) {
+    int i, k;
+    double len = sqrt(dist2);
+
+    for (i = 0; i < refine->n_regions; i++) {
+        double const * c = &refine->regions[4*i];
+        double t = 0;
+        double d2 = 0;
+
+        /* The closest point of the path to the centre of the region */
+        for (k = 0; k < 3; k++)
+            t += (c[k] - the_ray->position[k])*the_ray->direction[k];
+        if (t < 0)
+            t = 0;
+        if (t > len)
+            t = len;
+        for (k = 0; k < 3; k++) {
+            double x = the_ray->position[k] + t*the_ray->direction[k] - c[k];
+            d2 += x*x;
+        }
+        if (d2 < c[3]*c[3])
+            return 1;
+    }
+    return 0;
+}
+
+int64_t detector_regions_memory(int n_regions, int n_vertices) {
+    return (int64_t)(2*n_regions + 1)*sizeof(int) +
+        (int64_t)(4*n_regions + 4*n_vertices)*sizeof(double);
+}
+
+void set_up_detector_regions(int n_regions, int const * const sizes,
+        double const * const vertices, int const * const ids,
+        int const * const face_detector, int n_faces,
+        int const * const fine_face_detector, int n_fine_faces,
+        DetectorRegions * const regions) {
+    int n_vertices = 0;
+    int i, j, v = 0, e = 0;
+
+    for (i = 0; i < n_regions; i++)
+        n_vertices += sizes[i];
+
+    regions->n_regions = n_regions;
+    regions->detector = (int*)malloc((n_regions > 0 ? n_regions : 1)*sizeof(int));
+    regions->first_edge = (int*)malloc((n_regions + 1)*sizeof(int));
+    regions->bounds = (double*)malloc((n_regions > 0 ? 4*n_regions : 1)*sizeof(double));
+    regions->edges = (double*)malloc((n_vertices > 0 ? 4*n_vertices : 1)*sizeof(double));
+    regions->face_detector = face_detector;
+    regions->fine_face_detector = fine_face_detector;
+
+    regions->n_detect = 0;
+    for (i = 0; i < n_regions; i++) {
+        double * b = &regions->bounds[4*i];
+
+        regions->detector[i] = ids[i];
+        if (ids[i] > regions->n_detect)
+            regions->n_detect = ids[i];
+        regions->first_edge[i] = e;
+        b[0] = b[2] = INFINITY;
+        b[1] = b[3] = -INFINITY;
+        for (j = 0; j < sizes[i]; j++) {
+            double const * p0 = &vertices[2*(v + j)];
+            double const * p1 = &vertices[2*(v + (j + 1) % sizes[i])];
+
+            b[0] = fmin(b[0], p0[0]);
+            b[1] = fmax(b[1], p0[0]);
+            b[2] = fmin(b[2], p0[1]);
+            b[3] = fmax(b[3], p0[1]);
+
+            /* Edges parallel to x are never crossed by the test */
+            if (p0[1] != p1[1]) {
+                regions->edges[4*e] = p0[1];
+                regions->edges[4*e + 1] = p1[1];
+                regions->edges[4*e + 2] = p0[0];
+                regions->edges[4*e + 3] = (p1[0] - p0[0])/(p1[1] - p0[1]);
+                e++;
+            }
+        }
+        v += sizes[i];
+    }
+    regions->first_edge[n_regions] = e;
+    if (e > 0)
+        regions->edges = (double*)realloc(regions->edges, 4*e*sizeof(double));
+    account_memory(MEM_GEOMETRY, detector_regions_memory(n_regions, e));
+
+    for (i = 0; face_detector != NULL && i < n_faces; i++)
+        if (face_detector[i] > regions->n_detect)
+            regions->n_detect = face_detector[i];
+    for (i = 0; fine_face_detector != NULL && i < n_fine_faces; i++)
+        if (fine_face_detector[i] > regions->n_detect)
+            regions->n_detect = fine_face_detector[i];
+}
+
+void clean_up_detector_regions(DetectorRegions * const regions) {
+    account_memory(MEM_GEOMETRY, -detector_regions_memory(regions->n_regions,
+        regions->first_edge[regions->n_regions]));
+    free(regions->detector);
+    free(regions->first_edge);
+    free(regions->bounds);
+    free(regions->edges);
+}
+
+int detector_region_at(DetectorRegions const * const regions, double x, double z) {
+    int i, e;
+
+    for (i = 0; i < regions->n_regions; i++) {
+        double const * b = &regions->bounds[4*i];
+        int inside = 0;
+
+        if (x < b[0] || x > b[1] || z < b[2] || z > b[3])
+            continue;
+
+        /* Count the edges crossed by the line from (x, z) towards -x */
+        for (e = regions->first_edge[i]; e < regions->first_edge[i + 1]; e++) {
+            double const * E = &regions->edges[4*e];
+
+            if ((E[0] > z) != (E[1] > z) && x > E[2] + (z - E[0])*E[3])
+                inside = !inside;
+        }
+        if (inside)
+            return regions->detector[i];
+    }
+    return 0;
+}
+
 /* Set up a Sphere struct */
 void set_up_sphere(int make_sphere, double * const sphere_c, double sphere_r,
         Material M, int surf_index, AnalytSphere * const sph) {
@@ -140,12 +545,13 @@ void compose_rays3D(double const ray_pos[], double const ray_dir[], int nrays, R
 
     /* Allocated the memory to the  */
     rays = (Ray3D*)malloc(nrays * sizeof(*rays));
+    account_memory(MEM_RAYS, rays_memory(nrays));
 
     /* Put the rays defined by the arrays into an array of structs rays */
     for (i = 0; i < nrays; i++) {
-        int n;
+        int64_t n;
 
-        n = i*3;
+        n = (int64_t)i*3;
         rays[i].position[0] = ray_pos[n];
         rays[i].position[1] = ray_pos[n+1];
         rays[i].position[2] = ray_pos[n+2];
@@ -159,6 +565,8 @@ void compose_rays3D(double const ray_pos[], double const ray_dir[], int nrays, R
         rays[i].nScatters = 0;
         rays[i].status = 0;
         rays[i].detector = 0;
+        rays[i].weight = 1;
+        rays[i].score = NULL;
     }
 
     /* Put the data into the struct */
@@ -223,6 +631,7 @@ void get_element3D(Surface3D const * const sample, int idx, double v1[3], double
 
 /* Cleanup a struct of rays */
 void clean_up_rays(Rays3D all_rays) {
+    account_memory(MEM_RAYS, -rays_memory(all_rays.nrays));
     free(all_rays.rays);
 }
 
@@ -237,8 +646,8 @@ void get_positions(Rays3D const * const all_rays, double * const final_pos) {
 
         current_ray = &all_rays->rays[i];
         for (k = 0; k < 3; k++) {
-            int n;
-            n = k + 3*i;
+            int64_t n;
+            n = k + 3*(int64_t)i;
             final_pos[n] = current_ray->position[k];
         }
     }
@@ -255,8 +664,8 @@ void get_directions(Rays3D const * const all_rays, double * const final_dir) {
 
         current_ray = &all_rays->rays[i];
         for (k = 0; k < 3; k++) {
-            int n;
-            n = k + 3*i;
+            int64_t n;
+            n = k + 3*(int64_t)i;
             final_dir[n] = current_ray->direction[k];
         }
     }
@@ -399,41 +808,73 @@ void get_nth_aperture(int n, NBackWall const * const allApertures, BackWall * co
  *  gen_ray - ray3D struct with information on a ray in it
  */
 void create_ray(Ray3D * const gen_ray, SourceParam const * const source, MTRand * const myrng) {
+    double u[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        genRand(myrng, &u[i]);
+
+    /*
+     * The effuse model has always drawn its two direction numbers after a
+     * third one it does not use, keep that order so its rays are unchanged
+     */
+    if (source->source_model == 2) {
+        u[2] = u[3];
+        genRand(myrng, &u[3]);
+    }
+
+    create_ray_from_uniforms(gen_ray, source, u);
+}
+
+/*
+ * Creates a ray according to the model of the source from four numbers in
+ * [0,1), so that the random numbers used can be chosen by the caller.
+ *
+ * INPUTS:
+ *  source - the parameters of the source model
+ *  u      - u[0], u[1] the angle and radius of the position in the pinhole,
+ *           u[2], u[3] the azimuthal and polar angles of the direction
+ *
+ * OUTPUT:
+ *  gen_ray - ray3D struct with information on a ray in it
+ */
+void create_ray_from_uniforms(Ray3D * const gen_ray, SourceParam const * const source,
+        double const u[4]) {
     double r, theta=0, phi;
     double rot_angle;
-    double normal[3];
+    double normal[3] = {0, -1, 0};
+    double t1[3], t2[3];
     double dir[3];
-    
+    double s_theta, c_theta;
+    int k;
+
     /* Generate the position of the ray */
-    double tmp;
-    genRand(myrng, &tmp);
-    phi = 2*M_PI*tmp;
-    genRand(myrng, &tmp);
-    r = source->pinhole_r*sqrt(tmp);
+    phi = 2*M_PI*u[0];
+    r = source->pinhole_r*sqrt(u[1]);
     gen_ray->position[0] = source->pinhole_c[0] + r*cos(phi);
     gen_ray->position[1] = source->pinhole_c[1];
     gen_ray->position[2] = source->pinhole_c[2] + r*sin(phi);
 
     /* Generate the direction of the ray */
-    genRand(myrng, &tmp);
-    phi = 2*M_PI*tmp;
+    phi = 2*M_PI*u[2];
     switch (source->source_model) {
         case 0:
             /* Uniform virtual source model */
-            genRand(myrng, &tmp);
-            theta = source->theta_max*sqrt(tmp);
+            theta = source->theta_max*sqrt(u[3]);
             break;
         case 1:
             /* Gaussian virtual source model */
-            genRand(myrng, &tmp);
-            theta = source->sigma*sqrt(-2*log((1 - tmp/1)));
+            theta = source->sigma*sqrt(-2*log((1 - u[3]/1)));
             break;
         case 2:
-            /* Diffuse cosine model */
-            normal[0] = 0;
-            normal[1] = -1;
-            normal[2] = 0;
-            cosine_scatter(normal, NULL, gen_ray->direction, NULL, myrng);
+            /* Diffuse cosine model, the same as cosine_scatter */
+            perpendicular_plane(normal, t1, t2);
+            s_theta = sqrt(u[3]);
+            c_theta = sqrt(1 - s_theta*s_theta);
+            for (k = 0; k < 3; k++) {
+                gen_ray->direction[k] = t1[k]*cos(phi)*s_theta +
+                    t2[k]*sin(phi)*s_theta + normal[k]*c_theta;
+            }
             break;
     }
 
@@ -459,6 +900,85 @@ void create_ray(Ray3D * const gen_ray, SourceParam const * const source, MTRand
     gen_ray->nScatters = 0;
     gen_ray->status = 0;
     gen_ray->detector = 0;
+    gen_ray->weight = 1;
+    gen_ray->score = NULL;
+}
+
+void source_axis(SourceParam const * const source, double axis[3]) {
+    /* As create_ray_from_uniforms with theta = 0 */
+    if (source->source_model == 2) {
+        axis[0] = 0;
+        axis[1] = -1;
+    } else {
+        axis[0] = sin(source->init_angle);
+        axis[1] = -cos(source->init_angle);
+    }
+    axis[2] = 0;
+}
+
+/*
+ * Creates a bank of rays from the source model, to be reused for every pixel
+ * of a scan. If stratified the four random numbers used to make each ray are
+ * Latin hypercube samples: in each of the four dimensions every one of the
+ * nrays equal strata of [0,1) is used exactly once. At the end of the program,
+ * MUST call clean_up_rays to free the allocated memory.
+ *
+ * INPUTS:
+ *  source     - the parameters of the source model
+ *  nrays      - the number of rays in the bank
+ *  stratified - 0 for independent rays, 1 for Latin hypercube samples
+ *  myrng      - the random number generator
+ *
+ * OUTPUT:
+ *  bank - Rays3D struct with the generated rays in it
+ */
+void create_ray_bank(SourceParam const * const source, int nrays, int stratified,
+        MTRand * const myrng, Rays3D * const bank) {
+    int i, k;
+    int *perm[4];
+    double u[4];
+
+    bank->rays = (Ray3D*)malloc(nrays * sizeof(Ray3D));
+    bank->nrays = nrays;
+    account_memory(MEM_RAYS, rays_memory(nrays));
+
+    if (!stratified) {
+        for (i = 0; i < nrays; i++)
+            create_ray(&bank->rays[i], source, myrng);
+        return;
+    }
+
+    /* A random permutation of the strata in each dimension (Fisher-Yates) */
+    account_memory(MEM_RAYS, 4*(int64_t)nrays*sizeof(int));
+    for (k = 0; k < 4; k++) {
+        perm[k] = (int*)malloc(nrays * sizeof(int));
+        for (i = 0; i < nrays; i++)
+            perm[k][i] = i;
+        for (i = nrays - 1; i > 0; i--) {
+            int j, tmp;
+            unsigned long r;
+
+            genRandLong(myrng, &r);
+            j = (int)(r % (unsigned long)(i + 1));
+            tmp = perm[k][i];
+            perm[k][i] = perm[k][j];
+            perm[k][j] = tmp;
+        }
+    }
+
+    for (i = 0; i < nrays; i++) {
+        for (k = 0; k < 4; k++) {
+            double jitter;
+
+            genRand(myrng, &jitter);
+            u[k] = (perm[k][i] + jitter)/nrays;
+        }
+        create_ray_from_uniforms(&bank->rays[i], source, u);
+    }
+
+    for (k = 0; k < 4; k++)
+        free(perm[k]);
+    account_memory(MEM_RAYS, -4*(int64_t)nrays*sizeof(int));
 }
 
 void new_Ray(Ray3D * const gen_Ray, double const pos[3], double const dir[3]) {
@@ -473,6 +993,14 @@ void new_Ray(Ray3D * const gen_Ray, double const pos[3], double const dir[3]) {
 	gen_Ray->nScatters = 0;
 	gen_Ray->status = 0;
 	gen_Ray->detector = 0;
+	gen_Ray->weight = 1;
+	gen_Ray->score = NULL;
+}
+
+int scatter_bin(int detector, int nScatters, int maxScatters) {
+    int const bin = nScatters > maxScatters ? maxScatters : nScatters - 1;
+
+    return (detector - 1)*SCATTER_BINS(maxScatters) + bin;
 }
 
 /*
@@ -514,6 +1042,8 @@ void make_basic_sample(int sample_index, double size, Surface3D * const sample)
     int32_t FF[9] = {1,2,3, 1,3,4, 3,5,4};
     N = (double *)malloc(sizeof(double)*ntriag_sample*3);
     F = (int32_t *)malloc(sizeof(int32_t)*ntriag_sample*3);
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag_sample*3);
     for (i = 0; i < ntriag_sample*3; i++) {
         N[i] = NN[i];
         F[i] = FF[i];
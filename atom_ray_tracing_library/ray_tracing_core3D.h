@@ -14,6 +14,10 @@
 #include "mtwister.h"
 #include <stdint.h>
 #include "distributions3D.h"
+#include "bvh.h"
+#include "voxel.h"
+#include "visibility.h"
+#include "material_map.h"
 
 /******************************************************************************/
 /*                          Structure declarations                            */
@@ -32,7 +36,8 @@ typedef struct _material {
 
 /*
  * A structure for holding information on a 3D sample surface constructed of
- * planar triangles.
+ * planar triangles, or of a grid of voxels (see voxel.h). A voxel surface has
+ * no faces, its compositions are its materials in the order of their ids.
  */
 typedef struct _surface3d {
     int surf_index;       /* Index of the surface */
@@ -41,9 +46,24 @@ typedef struct _surface3d {
     double * vertices;     /* Vertices of the surface */
     int * faces;           /* Faces of the surface. */
     double * normals;      /* Normals to the elements of the surface */
+    double * vertex_normals; /* Normals at the three vertices of each element (9 x n_faces), NULL for flat elements */
     Material ** compositions; /* The type of scattering off the elements of this surface */
+    SurfaceFrame * frames; /* The frames (normal, tangents, lattice) of the elements */
+    SurfaceBVH * bvh;      /* Hierarchy of the elements, NULL for small surfaces */
+    double offset[3];      /* Translation of the whole surface, see scatterTriag */
+    VoxelGrid * voxels;    /* The voxels of a voxel surface, NULL for triangles */
+    VisibilityMap * visibility; /* Map of the surface seen from the source (see
+                                 * visibility.h), not owned, or NULL */
+    MaterialMap const * material_map; /* Materials of the surface by position
+                                       * (see material_map.h), not owned, or NULL */
 } Surface3D;
 
+/* A material with a parameter scaled by a texel of a material map */
+typedef struct _scaledMaterial {
+    Material material;
+    double params[MATERIAL_MAP_MAX_PARAMS];
+} ScaledMaterial;
+
 /* Information on the flat plate model of detection */
 typedef struct _backWall {
     int surf_index;         /* Index of this surface */
@@ -54,6 +74,41 @@ typedef struct _backWall {
     int plate_represent;    /* Should the plate be scattered off, 0 or 1 */
 } BackWall;
 
+/*
+ * Fine geometry of a CAD pinhole plate around the apertures and edges. A
+ * coarse mesh of the plate is used for most intersections. If the path of a
+ * ray up to its hit on the coarse mesh passes through one of the (spherical)
+ * refine regions the coarse hit is discarded and the ray is intersected with
+ * the fine mesh instead.
+ */
+typedef struct _plateRefine {
+    Surface3D fine;     /* The fine mesh of the plate */
+    int n_regions;      /* The number of refine regions */
+    double * regions;   /* 4 x n_regions, the centre and radius of each region */
+} PlateRefine;
+
+/*
+ * Labelled detector regions of a CAD pinhole plate, the detectors are numbered
+ * from 1. Without them a ray leaving the surfaces towards the back of the plate
+ * is detected if it crosses the back wall inside the backWall rectangle. With
+ * them it is detected by the first of the polygons, in the plane of the back
+ * wall, that holds the crossing, and dies if there is none. A ray that hits a
+ * face of the plate tagged with a detector is detected there instead of
+ * scattering off it.
+ */
+typedef struct _detectorRegions {
+    int n_detect;           /* The number of detectors */
+    int n_regions;          /* The number of polygons */
+    int * detector;         /* The detector of each polygon */
+    int * first_edge;       /* The first edge of each polygon, n_regions + 1 */
+    double * bounds;        /* 4 x n_regions, the x then z range of each polygon */
+    double * edges;         /* 4 x edges, z0, z1, x0 and dx/dz of each edge of
+                             * the polygons that is not parallel to x */
+    int const * face_detector;      /* Detector of each face of the plate, 0 for
+                                     * none, or NULL */
+    int const * fine_face_detector; /* Likewise for the fine plate, or NULL */
+} DetectorRegions;
+
 /* Contains information on a whole series of back wall apertures */
 typedef struct _nBackWall{
     int surf_index;
@@ -92,6 +147,8 @@ typedef struct _ray3d {
     int on_surface;       /* The index of the surface that the ray is on */
     int status;           /* Is the ray alive (0), dead (1), or detected (2) */
     int detector;         /* If the ray is detected, which one? none (0) */
+    double weight;        /* Statistical weight of the ray, changed by roulette */
+    struct _pathScore * score;  /* Score of the path when fitting (fitting.h), or NULL */
 } Ray3D;
 
 /* A structure to hold an array of Ray3D structs */
@@ -110,6 +167,41 @@ typedef struct _sourceParam {
 	double sigma;
 } SourceParam;
 
+/*
+ * Russian roulette termination of long paths. After start scattering events
+ * (sample and pinhole plate) a ray survives each further scattering event with
+ * a probability tied to its expected contribution and its weight is divided by
+ * that probability. The contribution is estimated as the weight of the ray
+ * times the solid angle of the apertures it can see, relative to that seen
+ * from its first bounce off the sample, and is the whole weight of a ray
+ * heading straight for an aperture. The probability is that ratio, at least
+ * survival and at most 1, so rays trapped out of sight of the apertures die
+ * quickly and heavy rays that can still be detected are kept. A start of 0 or
+ * less turns roulette off, rays are then killed after maxScatters sample
+ * scattering events.
+ */
+typedef struct _rouletteParam {
+    int start;
+    double survival;
+} RouletteParam;
+
+/*
+ * With roulette the number of scattering events is not limited by maxScatters.
+ * Rays are still killed after this many in total, a safety limit far above the
+ * paths roulette lets through, which only rays bouncing in sight of the
+ * apertures without being detected could reach.
+ */
+#define ROULETTE_MAX_SCATTERS 1000
+
+/*
+ * The histograms of the number of sample scattering events of the detected
+ * rays (numScattersRay) have SCATTER_BINS(maxScatters) bins for each detector:
+ * one for each number of events 1 ... maxScatters and a last, overflow, bin of
+ * the rays detected after more than maxScatters, which only roulette lets
+ * through. See scatter_bin.
+ */
+#define SCATTER_BINS(maxScatters) ((maxScatters) + 1)
+
 /******************************************************************************/
 /*                           Function declarations                            */
 /******************************************************************************/
@@ -118,10 +210,89 @@ typedef struct _sourceParam {
 void set_up_surface(double V[], double N[], int32_t F[], char * C[], Material M[],
 		int nmaterials, int ntriag, int nvert, int surf_index, Surface3D * const surf);
 
+/*
+ * Set up a surface of voxels from the material of each voxel, ids (dims[0] x
+ * dims[1] x dims[2], x fastest, 0 empty and m the mth material of M), see
+ * build_voxel_grid. Returns 0 if the grid is too large.
+ */
+int set_up_voxel_surface(uint8_t const ids[], const int dims[3], const double origin[3],
+        double voxel_size, int brick_size, int normal_radius, Material M[], int nmaterials,
+        int surf_index, Surface3D * const surf);
+
 void clean_up_surface(Surface3D * const surface);
 
 void clean_up_surface_all_arrays(Surface3D * const surface);
 
+/*
+ * Give the surface normals at the vertices of its elements, interpolated across
+ * each element at a hit, so that a coarse mesh scatters as the curved surface
+ * it approximates. Edges sharper than crease_angle (radians) are kept.
+ */
+void smooth_surface_normals(Surface3D * const surf, double crease_angle);
+
+/*
+ * The frame to scatter from at a hit on element idx of a surface, with the
+ * (interpolated) normal found by scatterTriag and the ray arriving along dir.
+ * For flat elements this is the element's frame, otherwise it is made in
+ * shading, keeping the orientation of the element's tangents and lattice. The
+ * frames of voxels are always made in shading.
+ */
+SurfaceFrame const * element_frame(Surface3D const * const surf, int idx,
+        const double normal[3], const double dir[3], SurfaceFrame * const shading);
+
+/* The material of element idx of a surface, a face or the face of a voxel */
+Material * element_composition(Surface3D const * const surf, int idx);
+
+/*
+ * The material at a hit p (in the frame of the scene) on a surface whose
+ * element has the material own, from the material map of the surface if it has
+ * one, without scaling its parameters.
+ */
+Material * map_composition(Surface3D const * const surf, const double p[3], Material * own);
+
+/*
+ * As map_composition, scaling the parameter of the material that the texel at
+ * p scales, in which case the material is a copy in scaled. A material other
+ * than own is given a frame, in shading, with its own lattice. Only the
+ * materials themselves are fitted, see scatter_scored.
+ */
+Material const * mapped_material(Surface3D const * const surf, const double p[3],
+        Material const * own, SurfaceFrame const ** const frame, SurfaceFrame * const shading,
+        ScaledMaterial * const scaled);
+
+/* The (flat) normal of element idx of a surface */
+void element_normal(Surface3D const * const surf, int idx, double n[3]);
+
+/*
+ * An interpolated normal can send a ray into the element it scattered off,
+ * reflect such a direction in the plane of the element.
+ */
+void keep_above_element(Surface3D const * const surf, int idx, double dir[3]);
+
+/* Does the path from the ray to a squared distance dist2 pass through a refine region */
+int path_in_refine_region(Ray3D const * const the_ray, double dist2,
+        PlateRefine const * const refine);
+
+/* The bytes set_up_detector_regions allocates, at most n_vertices edges */
+int64_t detector_regions_memory(int n_regions, int n_vertices);
+
+/*
+ * Set up the regions from n_regions polygons, sizes[i] corners each, whose (x,
+ * z) are in turn in vertices (2 x the sum of sizes). ids is the detector of
+ * each polygon. The detectors of the faces of the plate and of the fine plate
+ * are not copied, either may be NULL.
+ */
+void set_up_detector_regions(int n_regions, int const * const sizes,
+        double const * const vertices, int const * const ids,
+        int const * const face_detector, int n_faces,
+        int const * const fine_face_detector, int n_fine_faces,
+        DetectorRegions * const regions);
+
+void clean_up_detector_regions(DetectorRegions * const regions);
+
+/* The detector of the first region that holds (x, z), 0 if there is none */
+int detector_region_at(DetectorRegions const * const regions, double x, double z);
+
 /* Set up a Sphere struct */
 void set_up_sphere(int make_sphere, double * const sphere_c, double sphere_r,
         Material M, int surf_index, AnalytSphere * const sph);
@@ -182,8 +353,28 @@ void get_nth_aperture(int n, NBackWall const * const allApertures, BackWall * co
 /* Creates a ray in the pinhole */
 void create_ray(Ray3D * const gen_ray, SourceParam const * const source, MTRand * const myrng);
 
+/* Creates a ray in the pinhole from four given uniform random numbers */
+void create_ray_from_uniforms(Ray3D * const gen_ray, SourceParam const * const source,
+        double const u[4]);
+
+/*
+ * The direction of the axis of the beam, that of a ray at theta = 0. For the
+ * diffuse source model it is the normal of the pinhole.
+ */
+void source_axis(SourceParam const * const source, double axis[3]);
+
+/* Creates a bank of rays in the pinhole, optionally stratified */
+void create_ray_bank(SourceParam const * const source, int nrays, int stratified,
+        MTRand * const myrng, Rays3D * const bank);
+
 void new_Ray(Ray3D * const gen_Ray, double const pos[3], double const dir[3]);
 
+/*
+ * The bin of numScattersRay of a ray detected by detector (from 1) after
+ * nScatters sample scattering events, see SCATTER_BINS.
+ */
+int scatter_bin(int detector, int nScatters, int maxScatters);
+
 // Creates a flat sample with 3 triangles
 void make_basic_sample(int sample_index, double size, Surface3D * const sample);
 
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Symmetry checks of a simulation, see symmetry.h.
+ *
+ * The sample is compared as a surface rather than face by face, so that it may
+ * be triangulated differently from its image (e.g. a rectangle split along
+ * either diagonal): the images of a few points on each face must lie on a face
+ * of the same material and the mirrored normal. As the op is its own inverse
+ * and keeps areas, the image of the sample is then the sample. The reciprocal
+ * lattice of a diffracting face is given in the tangents of its face, so the
+ * mirrored lattice must also be the lattice of the face it lands on.
+ */
+
+#include "symmetry.h"
+#include "intersect_detection3D.h"
+#include <math.h>
+
+/* Normals must agree to within this, as 1 - cos of the angle between them */
+#define NORMAL_TOL 1e-6
+
+/* Lattice coordinates must be integers to within this */
+#define LATTICE_TOL 1e-6
+
+/* Points tested on each face, in barycentric coordinates */
+#define N_FACE_POINTS 4
+static double const face_points[N_FACE_POINTS][3] = {
+    {1.0/3, 1.0/3, 1.0/3}, {0.6, 0.2, 0.2}, {0.2, 0.6, 0.2}, {0.2, 0.2, 0.6}
+};
+
+void apply_symmetry(SymmetryOp op, const double in[3], double out[3]) {
+    out[0] = op == SYM_MIRROR_Z ? in[0] : -in[0];
+    out[1] = in[1];
+    out[2] = op == SYM_MIRROR_X ? in[2] : -in[2];
+}
+
+/* The reciprocal lattice vectors of a frame in the frame of the sample */
+static void lattice_vectors(SurfaceFrame const * const frame, double b[2][3]) {
+    int j, k;
+
+    for (j = 0; j < 2; j++)
+        for (k = 0; k < 3; k++)
+            b[j][k] = frame->lattice[2*j]*frame->t1[k] + frame->lattice[2*j + 1]*frame->t2[k];
+}
+
+/*
+ * Do the vectors b generate the same lattice as the lattice of the frame: both
+ * must be integer combinations of the other, i.e. b in the lattice of the frame
+ * with coordinates of determinant +-1.
+ */
+static int same_lattice(SurfaceFrame const * const frame, double b[2][3]) {
+    double c[2][3];
+    double g11, g12, g22, det;
+    double m[2][2];
+    int j;
+
+    if (!frame->has_lattice)
+        return 0;
+    lattice_vectors(frame, c);
+    dot(c[0], c[0], &g11);
+    dot(c[0], c[1], &g12);
+    dot(c[1], c[1], &g22);
+    det = g11*g22 - g12*g12;
+    if (det <= 0)
+        return 0;
+
+    for (j = 0; j < 2; j++) {
+        double r1, r2;
+
+        dot(b[j], c[0], &r1);
+        dot(b[j], c[1], &r2);
+        m[j][0] = (g22*r1 - g12*r2)/det;
+        m[j][1] = (g11*r2 - g12*r1)/det;
+        if (fabs(m[j][0] - round(m[j][0])) > LATTICE_TOL ||
+                fabs(m[j][1] - round(m[j][1])) > LATTICE_TOL)
+            return 0;
+    }
+    return fabs(fabs(round(m[0][0])*round(m[1][1]) - round(m[0][1])*round(m[1][0])) - 1) < 0.5;
+}
+
+/*
+ * Is the point p, with normal n, on a face of the surface of material
+ * composition with that normal: a ray started a distance delta above p
+ * towards it must first hit such a face at p. If lattice is not NULL the face
+ * must also have that reciprocal lattice.
+ */
+static int on_surface(Surface3D const * const surf, const double p[3], const double n[3],
+        Material const * const composition, double lattice[2][3], double delta) {
+    Ray3D ray;
+    double start[3], dir[3];
+    double nearest_inter[3], nearest_n[3];
+    double min_dist = 4*delta*delta;
+    double cos_n;
+    int meets = 0, tri_hit = -1, which_surface = -1;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        start[k] = p[k] + delta*n[k];
+        dir[k] = -n[k];
+    }
+    new_Ray(&ray, start, dir);
+    scatterTriag(&ray, *surf, &min_dist, nearest_inter, nearest_n, &meets, &tri_hit,
+        &which_surface);
+    if (!meets || tri_hit < 0 || surf->compositions[tri_hit] != composition)
+        return 0;
+    if (lattice != NULL && !same_lattice(&surf->frames[tri_hit], lattice))
+        return 0;
+    dot(surf->frames[tri_hit].normal, n, &cos_n);
+    return fabs(sqrt(min_dist) - delta) <= 0.5*delta && cos_n >= 1 - NORMAL_TOL;
+}
+
+int surface_symmetric(Surface3D const * const surf, SymmetryOp op, double tol) {
+    double size = 0;
+    int i, j, k;
+
+    /* Voxel surfaces are not compared */
+    if (surf->voxels != NULL)
+        return 0;
+
+    for (i = 0; i < 3*surf->n_vertices; i++)
+        size = fmax(size, fabs(surf->vertices[i]));
+    if (size == 0)
+        size = 1;
+
+    for (i = 0; i < surf->n_faces; i++) {
+        double v[3][3], n[3], image_n[3];
+        double lattice[2][3], image_lattice[2][3];
+        int const has_lattice = surf->frames[i].has_lattice;
+
+        get_element3D(surf, i, v[0], v[1], v[2], n);
+        apply_symmetry(op, n, image_n);
+        if (has_lattice) {
+            lattice_vectors(&surf->frames[i], lattice);
+            apply_symmetry(op, lattice[0], image_lattice[0]);
+            apply_symmetry(op, lattice[1], image_lattice[1]);
+        }
+        for (j = 0; j < N_FACE_POINTS; j++) {
+            double p[3], image_p[3];
+
+            for (k = 0; k < 3; k++)
+                p[k] = face_points[j][0]*v[0][k] + face_points[j][1]*v[1][k] +
+                    face_points[j][2]*v[2][k];
+            apply_symmetry(op, p, image_p);
+            if (!on_surface(surf, image_p, image_n, surf->compositions[i],
+                    has_lattice ? image_lattice : NULL, tol*size))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int plate_symmetric(NBackWall const * const plate, SymmetryOp op, double tol,
+        int * const perm) {
+    double const size = fmax(plate->circle_plate_r, 1e-300);
+    int i, j;
+
+    for (i = 0; i < plate->n_detect; i++) {
+        double const * c = &plate->aperture_c[2*i];
+        double const * a = &plate->aperture_axes[2*i];
+        double in[3] = {c[0], 0, c[1]};
+        double out[3];
+
+        apply_symmetry(op, in, out);
+        perm[i] = -1;
+        for (j = 0; j < plate->n_detect; j++) {
+            double const * cj = &plate->aperture_c[2*j];
+            double const * aj = &plate->aperture_axes[2*j];
+
+            if (fabs(cj[0] - out[0]) <= tol*size && fabs(cj[1] - out[2]) <= tol*size &&
+                    fabs(aj[0] - a[0]) <= tol*size && fabs(aj[1] - a[1]) <= tol*size) {
+                perm[i] = j;
+                break;
+            }
+        }
+        if (perm[i] < 0)
+            return 0;
+    }
+
+    /* The apertures must map one to one */
+    for (i = 0; i < plate->n_detect; i++)
+        for (j = i + 1; j < plate->n_detect; j++)
+            if (perm[i] == perm[j])
+                return 0;
+    return 1;
+}
+
+int sphere_symmetric(AnalytSphere const * const the_sphere, SymmetryOp op, double tol) {
+    double image[3];
+    double const size = fmax(the_sphere->sphere_r, 1e-300);
+    int k;
+
+    if (!the_sphere->make_sphere)
+        return 1;
+    apply_symmetry(op, the_sphere->sphere_c, image);
+    for (k = 0; k < 3; k++)
+        if (fabs(image[k] - the_sphere->sphere_c[k]) > tol*size)
+            return 0;
+    return 1;
+}
+
+/*
+ * The source is a disc in the plane y = pinhole_c[1] whose directions are
+ * symmetric about their axis: straight down for the effuse (cosine) model,
+ * otherwise tilted towards +x by the incidence angle.
+ */
+int source_symmetric(SourceParam const * const source, SymmetryOp op, double tol) {
+    double const size = fmax(source->pinhole_r, 1e-300);
+    int const tilted = source->source_model != 2 && fabs(sin(source->init_angle)) > tol;
+
+    if (op != SYM_MIRROR_Z && (fabs(source->pinhole_c[0]) > tol*size || tilted))
+        return 0;
+    if (op != SYM_MIRROR_X && fabs(source->pinhole_c[2]) > tol*size)
+        return 0;
+    return 1;
+}
+
+int scene_symmetric(Surface3D const * const sample, AnalytSphere const * const the_sphere,
+        NBackWall const * const plate, SourceParam const * const source, SymmetryOp op,
+        double tol, int * const perm) {
+    return source_symmetric(source, op, tol) && sphere_symmetric(the_sphere, op, tol) &&
+        plate_symmetric(plate, op, tol, perm) && surface_symmetric(sample, op, tol);
+}
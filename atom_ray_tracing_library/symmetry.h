@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks of the symmetry of a simulation with the simple (N aperture) model of
+ * the pinhole plate. The sample is moved in x and z to scan it, so a mirror in
+ * the plane x = 0 or z = 0, or a rotation by 180 degrees about the y axis,
+ * that leaves the sample, the sphere, the source and the plate unchanged maps
+ * the pixel at (x, z) to the one at its image, with the detectors permuted as
+ * the op permutes their apertures. Only the pixels of a fundamental domain of
+ * a symmetric scan then need to be traced.
+ *
+ * Positions are compared to within tol times the size of the scene, e.g. the
+ * largest coordinate of the sample.
+ */
+
+#ifndef SYMMETRY_H_
+#define SYMMETRY_H_
+
+#include "ray_tracing_core3D.h"
+
+typedef enum _symmetryOp {
+    SYM_MIRROR_X = 0,   /* x -> -x */
+    SYM_MIRROR_Z,       /* z -> -z */
+    SYM_ROTATE_180,     /* (x, z) -> (-x, -z), about the y axis */
+    SYM_N_OPS
+} SymmetryOp;
+
+/* The image of a point or direction under the op */
+void apply_symmetry(SymmetryOp op, const double in[3], double out[3]);
+
+/*
+ * Is the sample unchanged by the op: the image of each face lies on faces of
+ * the same material with its mirrored normal, and the mirrored reciprocal
+ * lattice of a diffracting face is the lattice of the face it lands on. The
+ * image may be triangulated differently and vertices need not be shared between
+ * faces. Voxel surfaces are taken not to be symmetric.
+ */
+int surface_symmetric(Surface3D const * const surf, SymmetryOp op, double tol);
+
+/*
+ * Is the layout of the apertures unchanged by the op, if so perm[i] is the
+ * aperture that aperture i maps onto.
+ */
+int plate_symmetric(NBackWall const * const plate, SymmetryOp op, double tol,
+        int * const perm);
+
+int sphere_symmetric(AnalytSphere const * const the_sphere, SymmetryOp op, double tol);
+
+int source_symmetric(SourceParam const * const source, SymmetryOp op, double tol);
+
+/* All of the above, perm is as for plate_symmetric */
+int scene_symmetric(Surface3D const * const sample, AnalytSphere const * const the_sphere,
+        NBackWall const * const plate, SourceParam const * const source, SymmetryOp op,
+        double tol, int * const perm);
+
+#endif /* SYMMETRY_H_ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Wall-clock budgets for anytime tracing, see time_budget.h.
+ */
+
+#include "time_budget.h"
+#include <signal.h>
+#include <sys/time.h>
+#include <stddef.h>
+
+/* The signal being caught, 0 for none, and whether it has arrived */
+static int caught_signal = 0;
+static void (*previous_handler)(int);
+static volatile sig_atomic_t signal_arrived = 0;
+
+static void on_budget_signal(int signum) {
+    (void)signum;
+    signal_arrived = 1;
+}
+
+double budget_clock(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+void set_up_time_budget(double seconds, int (*cancelled)(void), TimeBudget * const budget) {
+    budget->deadline = seconds > 0 ? budget_clock() + seconds : 0;
+    budget->cancelled = cancelled;
+    budget->stopped = 0;
+}
+
+int budget_exhausted(TimeBudget * const budget) {
+    if (budget->stopped)
+        return 1;
+    if (signal_arrived || (budget->deadline > 0 && budget_clock() >= budget->deadline) ||
+            (budget->cancelled != NULL && budget->cancelled()))
+        budget->stopped = 1;
+    return budget->stopped;
+}
+
+int64_t budget_chunk(int64_t remaining) {
+    return remaining < BUDGET_CHUNK ? remaining : BUDGET_CHUNK;
+}
+
+int budget_catch_signal(int signum) {
+    void (*previous)(int);
+
+    if (caught_signal != 0)
+        budget_release_signal();
+    signal_arrived = 0;
+    previous = signal(signum, on_budget_signal);
+    if (previous == SIG_ERR)
+        return 0;
+    caught_signal = signum;
+    previous_handler = previous;
+    return 1;
+}
+
+void budget_release_signal(void) {
+    if (caught_signal != 0)
+        signal(caught_signal, previous_handler);
+    caught_signal = 0;
+    signal_arrived = 0;
+}
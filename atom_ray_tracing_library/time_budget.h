@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Wall-clock budgets for anytime tracing. A call with a budget traces its rays
+ * in chunks and checks the budget between them, stopping once its deadline has
+ * passed or it has been cancelled: by a function polled between the chunks
+ * (e.g. one that checks for an interrupt from MATLAB) or by a signal caught
+ * with budget_catch_signal. The rays traced so far are kept and the caller
+ * counts them, so the counts of a call that stopped early can be normalised by
+ * the rays actually traced and merged with those of other calls.
+ *
+ * The rays of a chunk are traced whatever happens, so a call stops at most a
+ * chunk after its budget runs out.
+ */
+
+#ifndef TIME_BUDGET_H_
+#define TIME_BUDGET_H_
+
+#include <stdint.h>
+
+/* Number of rays traced between checks of the budget */
+#define BUDGET_CHUNK 4096
+
+typedef struct _timeBudget {
+    double deadline;        /* Time to stop at (see budget_clock), 0 for none */
+    int (*cancelled)(void); /* Polled between chunks, non-zero to stop, or NULL */
+    int stopped;            /* Has the budget run out, it then stays so */
+} TimeBudget;
+
+/* Wall-clock time in seconds */
+double budget_clock(void);
+
+/*
+ * Set up a budget of seconds from now, 0 (or less) for no deadline, cancelled
+ * may be NULL.
+ */
+void set_up_time_budget(double seconds, int (*cancelled)(void), TimeBudget * const budget);
+
+/*
+ * Has the budget run out: its deadline has passed, cancelled returns non-zero
+ * or a caught signal has arrived. Sets stopped.
+ */
+int budget_exhausted(TimeBudget * const budget);
+
+/* The rays to trace before the budget is next checked, of remaining */
+int64_t budget_chunk(int64_t remaining);
+
+/*
+ * Exhaust every budget when the signal signum arrives, until
+ * budget_release_signal. Only one signal is caught at a time. Returns 0 if
+ * the handler could not be installed.
+ */
+int budget_catch_signal(int signum);
+
+/* Restore the handler of the caught signal, and forget whether it arrived */
+void budget_release_signal(void);
+
+#endif /* TIME_BUDGET_H_ */
@@ -7,23 +7,124 @@
 
 #include "trace_ray.h"
 #include "tracing_functions.h"
+#include "intersect_detection3D.h"
 #include "ray_tracing_core3D.h"
 #include "common_helpers.h"
+#include "diagnostics.h"
+#include "pixel_features.h"
 #include <math.h>
 #include <stdlib.h>
 #include "mtwister.h"
 
+/*
+ * Does the ray, ignoring anything in its way, go into one of the apertures of
+ * the plate? Such a ray is likely to be detected next, it carries all of its
+ * weight as expected contribution.
+ */
+static int heads_for_aperture(Ray3D * the_ray, NBackWall plate) {
+    double min_dist = 10.0e10;
+    double inter[3];
+    double normal[3];
+    int meets;
+    int tri_hit;
+    int which_surface;
+    int aperture = 0;
+
+    multiBackWall(the_ray, plate, &min_dist, inter, normal, &meets, &tri_hit,
+        &which_surface, &aperture);
+    return aperture;
+}
+
+/*
+ * The solid angle of the apertures seen from the position of the ray, as a
+ * fraction of the hemisphere. If occluded the apertures whose centre is hidden
+ * by the sample or the sphere are left out. An estimate of the chance that the
+ * ray is detected after its next scattering event, for roulette.
+ */
+static double aperture_fraction(Ray3D const * const the_ray, NBackWall plate,
+        Surface3D sample, AnalytSphere the_sphere, int occluded) {
+    double fraction = 0;
+    int i;
+
+    for (i = 0; i < plate.n_detect; i++) {
+        double const * const c = &plate.aperture_c[2*i];
+        double const * const axes = &plate.aperture_axes[2*i];
+        double v[3] = {c[0] - the_ray->position[0], -the_ray->position[1],
+            c[1] - the_ray->position[2]};
+        double const dist2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+
+        /* The plate is the plane y = 0, seen only from below */
+        if (v[1] <= 0)
+            continue;
+        if (occluded) {
+            Ray3D ray;
+            double nearest_n[3];
+            double nearest_inter[3];
+            int tri_hit = -1;
+            int which_surface = -1;
+            int meets = 0;
+            double const limit = dist2*(1 - 2e-7);
+            double min_dist = limit;
+
+            new_Ray(&ray, the_ray->position, v);
+            normalise(ray.direction);
+            ray.on_element = the_ray->on_element;
+            ray.on_surface = the_ray->on_surface;
+            scatterTriag(&ray, sample, &min_dist, nearest_inter, nearest_n, &meets,
+                &tri_hit, &which_surface);
+            if (the_sphere.make_sphere && (the_ray->on_surface != the_sphere.surf_index))
+                scatterSphere(&ray, the_sphere, &min_dist, nearest_inter, nearest_n,
+                    &tri_hit, &which_surface, &meets);
+            if (min_dist < limit)
+                continue;
+        }
+        /* An ellipse of these (full) axes, tilted by the angle to the y axis */
+        fraction += 0.25*M_PI*axes[0]*axes[1]*(v[1]/sqrt(dist2))/dist2/(2*M_PI);
+    }
+    return fraction < 1 ? fraction : 1;
+}
+
+/*
+ * The probability that a ray survives roulette, its estimated contribution
+ * relative to reference, the contribution of a ray of weight 1 at its first
+ * bounce, see RouletteParam.
+ */
+static double roulette_survival(Ray3D * const the_ray, NBackWall plate, Surface3D sample,
+        AnalytSphere the_sphere, RouletteParam const * const roulette, double reference) {
+    double ratio;
+
+    if (heads_for_aperture(the_ray, plate))
+        return 1;
+    ratio = aperture_fraction(the_ray, plate, sample, the_sphere, 1);
+    if (ratio > 0)
+        ratio = reference > 0 ? the_ray->weight*ratio/reference : 1;
+    if (ratio < roulette->survival)
+        return roulette->survival;
+    return ratio < 1 ? ratio : 1;
+}
+
 /*
  * For a simple model of the pinhole plate as a circle with multiple detectors.
  *
  * Traces a single ray
  *
+ * If roulette is given (not NULL) and turned on then long paths are terminated
+ * by Russian roulette rather than being killed after maxScatters sample
+ * scattering events, the ray weight compensates so the results are unbiased.
+ * Such rays may then have nScatters greater than maxScatters, only the safety
+ * limit of ROULETTE_MAX_SCATTERS scattering events in total kills them rather
+ * than the 50 without roulette.
+ *
+ * If diag is given (not NULL) the path and time of the ray are recorded. If
+ * feat is given (not NULL) the first bounce of the ray is added to the features.
+ *
  * NOTE: This function run by itself does cause seg faults
  * TODO: find the basterd pointer that causes this!
  */
 void trace_ray_simple_multi(Ray3D *the_ray,
         int maxScatters, Surface3D sample, NBackWall plate,
-		AnalytSphere the_sphere, MTRand * const myrng) {
+		AnalytSphere the_sphere, RouletteParam const * const roulette,
+		RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng) {
     /*
      * The total number of scattering events undergone (sample and pinhole
      * plate) 1000 events are allowed in total. A separate limit is placed
@@ -31,6 +132,11 @@ void trace_ray_simple_multi(Ray3D *the_ray,
      */
     int n_allScatters = 0;
     int detector = 0;
+    int use_roulette = (roulette != NULL) && (roulette->start > 0);
+    double reference = 0;   /* Contribution at the first bounce, for roulette */
+
+    if (diag != NULL)
+        diag_start_ray(diag, the_ray);
 
     /*
      * Keep propagating the ray until it is deemed 'dead', by either not
@@ -47,21 +153,53 @@ void trace_ray_simple_multi(Ray3D *the_ray,
         * If the ray has not hit the sample then it is immediately dead.
         */
         if (the_ray->nScatters == 0) {
+            double start[3] = {the_ray->position[0], the_ray->position[1],
+                the_ray->position[2]};
+
             scatterOffSurface(the_ray, sample, the_sphere, myrng);
+            if (feat != NULL)
+                features_first_hit(feat, the_ray, start, &sample, &the_sphere);
             if (!the_ray->status) {
                 /* Hit the sample */
                 the_ray->nScatters += 1;
                 n_allScatters++;
+                if (diag != NULL)
+                    diag_add_vertex(diag, the_ray);
+                if (use_roulette)
+                    reference = aperture_fraction(the_ray, plate, sample, the_sphere, 0);
             } else {
                 /* Move onto the next ray */
                 continue;
             }
         }
 
-        /* The number of scattering events is set to -1 if we exceed the overall
-         * number of scattering events. */
-        if ((the_ray->nScatters > maxScatters) || (n_allScatters > 50)) {
-            /* Ray has exceeded the maximum number of scatters, kill it */
+        if (use_roulette) {
+            if (n_allScatters > ROULETTE_MAX_SCATTERS) {
+                /* The safety limit, see ROULETTE_MAX_SCATTERS */
+                the_ray->nScatters = -1;
+                the_ray->status = -1;
+                break;
+            }
+            if (n_allScatters >= roulette->start) {
+                double const survival = roulette_survival(the_ray, plate, sample,
+                    the_sphere, roulette, reference);
+
+                if (survival < 1) {
+                    double xi;
+
+                    genRand(myrng, &xi);
+                    if (xi >= survival) {
+                        /* Terminated by roulette, the ray dies */
+                        the_ray->status = 1;
+                        break;
+                    }
+                    the_ray->weight /= survival;
+                }
+            }
+        } else if ((the_ray->nScatters > maxScatters) || (n_allScatters > 50)) {
+            /* The number of scattering events is set to -1 if we exceed the
+             * overall number of scattering events.
+             * Ray has exceeded the maximum number of scatters, kill it */
             the_ray->nScatters = -1;
             the_ray->status = -1;
             break;
@@ -81,6 +219,8 @@ void trace_ray_simple_multi(Ray3D *the_ray,
         if (the_ray->status == 0) {
             /* Hit a surface */
             n_allScatters++;
+            if (diag != NULL)
+                diag_add_vertex(diag, the_ray);
 
             /* Hit the sample */
             if ((the_ray->on_surface == sample.surf_index) ||
@@ -89,16 +229,28 @@ void trace_ray_simple_multi(Ray3D *the_ray,
             }
         }
     }
+
+    if (diag != NULL)
+        diag_end_ray(diag, the_ray, n_allScatters);
 }
 
 /*
  * For representing the pinhole plate as a triangulated surface.
  *
  * Trace a single ray
+ *
+ * If refine is given (not NULL) the fine model of the plate is used near the
+ * apertures. If regions is given (not NULL) the ray is detected by the labelled
+ * detector regions and its detector is set. If diag is given (not NULL) the path and time of the ray are
+ * recorded. If feat is given (not NULL) the first bounce of the ray is added to
+ * the features.
  */
 void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
-        Surface3D sample, Surface3D plate, AnalytSphere the_sphere,
-        double const backWall[], MTRand * const myrng) {
+        Surface3D sample, Surface3D plate, PlateRefine const * const refine,
+        AnalytSphere the_sphere,
+        double const backWall[], DetectorRegions const * const regions,
+        RayDiagnostics * const diag, PixelFeatures * const feat,
+        MTRand * const myrng) {
     int n_allScatters;
 
     /*
@@ -108,6 +260,9 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
      */
     n_allScatters = 0;
 
+    if (diag != NULL)
+        diag_start_ray(diag, the_ray);
+
     // Keep propagating the ray until it doesn't hit something
     while (!(the_ray->status)) {
         /* The ray is dead unless we hit something */
@@ -120,12 +275,19 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
         * If the ray has not hit the sample then it is immediately dead.
         */
         if (the_ray->nScatters == 0) {
+            double start[3] = {the_ray->position[0], the_ray->position[1],
+                the_ray->position[2]};
+
             scatterOffSurface(the_ray, sample, the_sphere, myrng);
+            if (feat != NULL)
+                features_first_hit(feat, the_ray, start, &sample, &the_sphere);
 
             if (!(the_ray->status)) {
                 /* Hit the sample */
                 the_ray->nScatters++;
                 n_allScatters++;
+                if (diag != NULL)
+                    diag_add_vertex(diag, the_ray);
             } else {
                 /* Move onto the next ray */
                 break;
@@ -142,7 +304,8 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
         }
 
         /* Try to scatter of both surfaces. */
-        scatterSurfaces(the_ray, sample, plate, the_sphere, backWall, myrng);
+        scatterSurfaces(the_ray, sample, plate, refine, the_sphere, backWall, regions,
+            myrng);
 
         /******************************************************************/
         /* Update counters */
@@ -150,6 +313,8 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
         if (the_ray->status == 0) {
             /* Hit a surface */
             n_allScatters++;
+            if (diag != NULL)
+                diag_add_vertex(diag, the_ray);
 
             /* Hit the sample */
             if ((the_ray->on_surface == sample.surf_index) ||
@@ -158,6 +323,9 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
             }
         }
     }
+
+    if (diag != NULL)
+        diag_end_ray(diag, the_ray, n_allScatters);
 }
 
 /*
@@ -168,7 +336,7 @@ void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters,
  *
  * TODO: change to use the new ray status inside the struct
  */
-void trace_ray_just_sample(Ray3D * the_ray, int * const killed, int maxScatters,
+void trace_ray_just_sample(Ray3D * the_ray, int64_t * const killed, int maxScatters,
         Surface3D sample, AnalytSphere the_sphere, MTRand * const myrng) {
 
     while (!(the_ray->status)) {
@@ -13,17 +13,23 @@
 #define _trace_ray_h
 
 #include "ray_tracing_core3D.h"
+#include "diagnostics.h"
+#include "pixel_features.h"
 #include "mtwister.h"
 #include <stdint-gcc.h>
 
 
 void trace_ray_simple_multi(Ray3D *the_ray, int maxScatters, Surface3D sample,
-        NBackWall plate, AnalytSphere the_sphere, MTRand * const myrng);
+        NBackWall plate, AnalytSphere the_sphere, RouletteParam const * const roulette,
+        RayDiagnostics * const diag, PixelFeatures * const feat, MTRand * const myrng);
 
 void trace_ray_triag_plate(Ray3D * the_ray, int maxScatters, Surface3D sample,
-        Surface3D plate, AnalytSphere the_sphere, double const backWall[], MTRand * const myrng);
+        Surface3D plate, PlateRefine const * const refine, AnalytSphere the_sphere,
+        double const backWall[], DetectorRegions const * const regions,
+        RayDiagnostics * const diag,
+        PixelFeatures * const feat, MTRand * const myrng);
 
-void trace_ray_just_sample(Ray3D * the_ray, int * const killed, int maxScatters,
+void trace_ray_just_sample(Ray3D * the_ray, int64_t * const killed, int maxScatters,
         Surface3D sample, AnalytSphere the_sphere, MTRand * const myrng);
 
 #endif
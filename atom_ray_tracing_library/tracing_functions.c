@@ -12,10 +12,82 @@
 #include "ray_tracing_core3D.h"
 #include "intersect_detection3D.h"
 #include "distributions3D.h"
+#include "fitting.h"
 #include <math.h>
 #include "mtwister.h"
 #include <stdbool.h>
 
+/* Scatter a ray off a material, recording the score of its path if it has one */
+static void scatter_material(Ray3D const * const the_ray, Material const * const composition,
+        SurfaceFrame const * const frame, double new_direction[3], MTRand * const myrng) {
+    if (the_ray->score != NULL)
+        scatter_scored(the_ray->score, composition, frame, the_ray->direction,
+            new_direction, myrng);
+    else
+        composition->func(frame, the_ray->direction, new_direction,
+            composition->params, myrng);
+}
+
+/*
+ * Is a ray that has not hit any surface detected behind a CAD pinhole plate,
+ * backWall[0] is the y coordinate of the back of the plate. It must be moving
+ * towards +y. Without regions it is detected if it crosses the back of the
+ * plate inside the rectangle backWall[1] (in x) by backWall[2] (in z) centred
+ * on the origin, with them if it crosses inside one of the regions. A detected
+ * ray is moved to the crossing, keeping its direction, and its status and
+ * detector are set.
+ */
+static int detect_behind_plate(Ray3D * the_ray, double const backWall[],
+        DetectorRegions const * const regions) {
+    double alpha;
+    double wall_hit[3];
+    int detector;
+
+    if (the_ray->direction[1] <= 0)
+        return 0;
+
+    alpha = (backWall[0] - the_ray->position[1])/the_ray->direction[1];
+    propagate(the_ray->position, the_ray->direction, alpha, wall_hit);
+
+    if (regions == NULL)
+        detector = (fabs(wall_hit[0]) < (backWall[1]/2)) &&
+            (fabs(wall_hit[2]) < (backWall[2]/2));
+    else
+        detector = detector_region_at(regions, wall_hit[0], wall_hit[2]);
+    if (!detector)
+        return 0;
+
+    update_ray_position(the_ray, wall_hit);
+    the_ray->status = 2;
+    the_ray->detector = detector;
+    return 1;
+}
+
+/*
+ * Is a ray that hits a face of the plate, or of the fine plate in refine (may be
+ * NULL), at hit detected by the face. If it is the ray is moved there and its
+ * status and detector are set.
+ */
+static int detect_on_plate_face(Ray3D * the_ray, DetectorRegions const * const regions,
+        Surface3D const * const plate, PlateRefine const * const refine,
+        int which_surface, int tri_hit, double const hit[3]) {
+    int detector = 0;
+
+    if (regions == NULL)
+        return 0;
+    if (which_surface == plate->surf_index && regions->face_detector != NULL)
+        detector = regions->face_detector[tri_hit];
+    else if (refine != NULL && which_surface == refine->fine.surf_index &&
+            regions->fine_face_detector != NULL)
+        detector = regions->fine_face_detector[tri_hit];
+    if (!detector)
+        return 0;
+
+    update_ray_position(the_ray, hit);
+    the_ray->status = 2;
+    the_ray->detector = detector;
+    return 1;
+}
 
 /*
  * Scatters the given ray off a single triangulated surface, the sample, and an
@@ -64,17 +136,28 @@ void scatterOffSurface(Ray3D * the_ray, Surface3D sample, AnalytSphere the_spher
     /* If we have met a triangle/sphere we must scatter off of it */
     if (meets || meets_sphere) {
         Material const * composition;
+        SurfaceFrame const * frame;
+        SurfaceFrame sphere_frame;
+        ScaledMaterial scaled;
 
         if (meets_sphere) {
-            /* sphere is defined to be uniform */
+            /* sphere is defined to be uniform, its frame is made on the fly */
             composition = &(the_sphere.material);
+            make_frame(nearest_n, &sphere_frame);
+            frame = &sphere_frame;
         } else {
-            composition = sample.compositions[tri_hit];
+            composition = element_composition(&sample, tri_hit);
+            frame = element_frame(&sample, tri_hit, nearest_n, the_ray->direction,
+                &sphere_frame);
+            if (sample.material_map != NULL)
+                composition = mapped_material(&sample, nearest_inter, composition, &frame,
+                    &sphere_frame, &scaled);
         }
 
         /* Find the new direction and update position*/
-        composition->func(nearest_n, the_ray->direction,
-            new_direction, composition->params, myrng);
+        scatter_material(the_ray, composition, frame, new_direction, myrng);
+        if (!meets_sphere)
+            keep_above_element(&sample, tri_hit, new_direction);
         update_ray_direction(the_ray, new_direction);
         update_ray_position(the_ray, nearest_inter);
 
@@ -98,7 +181,7 @@ void scatterOffSurface(Ray3D * the_ray, Surface3D sample, AnalytSphere the_spher
  *         surface)
  */
 void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, double const backWall[],
-        MTRand * const myrng) {
+        DetectorRegions const * const regions, MTRand * const myrng) {
 
     double min_dist;
     int meets;
@@ -124,6 +207,11 @@ void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, double const backWa
     scatterTriag(the_ray, plate, &min_dist, nearest_inter, nearest_n, &meets,
         &tri_hit, &which_surface);
 
+    /* A tagged face of the plate detects the ray */
+    if (meets && detect_on_plate_face(the_ray, regions, &plate, NULL, which_surface,
+            tri_hit, nearest_inter))
+        return;
+
     /* Update position/direction etc. */
     if (meets) {
         Material * composition;
@@ -132,8 +220,8 @@ void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, double const backWa
         composition = plate.compositions[tri_hit];
 
         /* Update the direction and position of the ray */
-        composition->func(nearest_n, the_ray->direction,
-            new_direction, composition->params, myrng);
+        scatter_material(the_ray, composition, &plate.frames[tri_hit], new_direction,
+            myrng);
         update_ray_direction(the_ray, new_direction);
         update_ray_position(the_ray, nearest_inter);
 
@@ -147,47 +235,64 @@ void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, double const backWa
          * We must consider if the ray has been detected if it hasn't hit
          * either surface
          */
-
-        /* First consider if the ray is propagating in the +ve y direction */
-        if (the_ray->direction[1] > 0) {
-            double alpha;
-            double wall_hit[3];
-
-            /* Find where, just behind the pinhole plate, the ray will hit,
-             * backWall[0] is the y coordinate of the back of the pinhole plate
-             */
-            alpha = (backWall[0] - the_ray->position[1])/the_ray->direction[1];
-
-            propagate(the_ray->position, the_ray->direction, alpha, wall_hit);
-
-            /*
-             * Now find if this point is covered by the plate, if it is then the
-             * ray must be detected, if it is not, then the ray must be dead.
-             * backWall[1] and backWall[2] are the depth in x and z of the
-             * pinhole plate
-             */
-            if ((fabs(wall_hit[0]) < (backWall[1]/2)) && (fabs(wall_hit[2]) <
-                    (backWall[2]/2))) {
-                /* We update position only and keep the direction the same */
-                update_ray_position(the_ray, wall_hit);
-
-                // Detection is status = 2
-                the_ray->status = 2;
-                return;
-            }
-        } else {
-            /* Ray be dead */
-            meets = 0;
-        }
+        if (detect_behind_plate(the_ray, backWall, regions))
+            return;
     }
 
     the_ray->status = !meets;
 }
 
+/*
+ * The coarse and fine models of the plate overlap, a ray on a face of one of
+ * them is also on the face of the other underneath it and must not hit that
+ * face again straight away. If the ray is on a face of the surface from, moved
+ * is the ray marked as on the face of the surface to that is found by looking
+ * down the normal of its face, within the size of its face. Otherwise moved is
+ * the ray unchanged.
+ */
+static void on_other_plate(Ray3D const * const the_ray, Surface3D const * const from,
+        Surface3D const * const to, Ray3D * const moved) {
+    Ray3D probe;
+    double a[3], b[3], c[3];
+    double normal[3];
+    double size2 = 0;
+    double dist;
+    double inter[3];
+    double inter_n[3];
+    int meets = 0;
+    int face = -1;
+    int surface = -1;
+    int k;
+
+    *moved = *the_ray;
+    if (the_ray->on_surface != from->surf_index || the_ray->on_element < 0)
+        return;
+
+    probe = *the_ray;
+    get_element3D(from, the_ray->on_element, a, b, c, normal);
+    for (k = 0; k < 3; k++) {
+        double ab = b[k] - a[k], ac = c[k] - a[k], bc = c[k] - b[k];
+
+        size2 += ab*ab + ac*ac + bc*bc;
+        probe.direction[k] = -normal[k];
+    }
+    /* On no face of to, which also avoids any visibility map */
+    probe.on_surface = to->surf_index;
+    probe.on_element = -1;
+
+    dist = size2;
+    scatterTriag(&probe, *to, &dist, inter, inter_n, &meets, &face, &surface);
+    if (meets) {
+        moved->on_surface = to->surf_index;
+        moved->on_element = face;
+    }
+}
 
 /*
  * Scatters the ray off of two surfaces, one of the sample and one of the
- * pinhole plate. The pinhole plate surface includes a detection surface.
+ * pinhole plate. The pinhole plate surface includes a detection surface. If
+ * refine is not NULL the plate is the coarse model and rays whose path passes
+ * through one of its regions are intersected with the fine model instead.
  *
  * INPUTS:
  *
@@ -197,7 +302,9 @@ void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, double const backWa
  *         surface)
  */
 void scatterSurfaces(Ray3D * the_ray, Surface3D sample, Surface3D plate,
-		AnalytSphere the_sphere, double const backWall[], MTRand * const myrng) {
+		PlateRefine const * const refine, AnalytSphere the_sphere,
+		double const backWall[], DetectorRegions const * const regions,
+		MTRand * const myrng) {
 
     double min_dist;
     int meets;
@@ -225,9 +332,45 @@ void scatterSurfaces(Ray3D * the_ray, Surface3D sample, Surface3D plate,
     scatterTriag(the_ray, sample, &min_dist, nearest_inter, nearest_n, &meets,
         &tri_hit, &which_surface);
 
-    /* Try to scatter off the pinhole plate */
-    scatterTriag(the_ray, plate, &min_dist, nearest_inter, nearest_n, &meets,
-        &tri_hit, &which_surface);
+    if (refine == NULL) {
+        /* Try to scatter off the pinhole plate */
+        scatterTriag(the_ray, plate, &min_dist, nearest_inter, nearest_n, &meets,
+            &tri_hit, &which_surface);
+    } else {
+        /*
+         * Try the coarse model of the pinhole plate first, if the path of the
+         * ray up to where it would hit the coarse plate passes near an aperture
+         * the coarse hit is discarded and the fine model is used instead.
+         */
+        double plate_dist = min_dist;
+        double plate_inter[3];
+        double plate_n[3];
+        int plate_meets = 0;
+        int plate_tri = -1;
+        int plate_surface = -1;
+        Ray3D moved;
+
+        /* plate_tri is only set if the plate is hit before the sample */
+        on_other_plate(the_ray, &refine->fine, &plate, &moved);
+        scatterTriag(&moved, plate, &plate_dist, plate_inter, plate_n, &plate_meets,
+            &plate_tri, &plate_surface);
+        if (path_in_refine_region(the_ray, plate_dist, refine)) {
+            on_other_plate(the_ray, &plate, &refine->fine, &moved);
+            scatterTriag(&moved, refine->fine, &min_dist, nearest_inter, nearest_n,
+                &meets, &tri_hit, &which_surface);
+        } else if (plate_tri >= 0) {
+            min_dist = plate_dist;
+            nearest_inter[0] = plate_inter[0];
+            nearest_inter[1] = plate_inter[1];
+            nearest_inter[2] = plate_inter[2];
+            nearest_n[0] = plate_n[0];
+            nearest_n[1] = plate_n[1];
+            nearest_n[2] = plate_n[2];
+            meets = 1;
+            tri_hit = plate_tri;
+            which_surface = plate_surface;
+        }
+    }
 
     /* Should the sphere be represented */
     if (the_sphere.make_sphere) {
@@ -238,24 +381,44 @@ void scatterSurfaces(Ray3D * the_ray, Surface3D sample, Surface3D plate,
         }
     }
 
+    /* A tagged face of the plate detects the ray */
+    if (meets && !meets_sphere && detect_on_plate_face(the_ray, regions, &plate, refine,
+            which_surface, tri_hit, nearest_inter))
+        return;
+
     /* Update position/direction etc. */
     if (meets || meets_sphere) {
         Material const * composition;
+        SurfaceFrame const * frame;
+        SurfaceFrame sphere_frame;
+        ScaledMaterial scaled;
 
         if (meets_sphere) {
-            /* sphere is defined to be uniform */
+            /* sphere is defined to be uniform, its frame is made on the fly */
             composition = &(the_sphere.material);
+            make_frame(nearest_n, &sphere_frame);
+            frame = &sphere_frame;
         } else {
             if (which_surface == plate.surf_index) {
                 composition = plate.compositions[tri_hit];
+                frame = &plate.frames[tri_hit];
+            } else if ((refine != NULL) && (which_surface == refine->fine.surf_index)) {
+                composition = refine->fine.compositions[tri_hit];
+                frame = &refine->fine.frames[tri_hit];
             } else {
-                composition = sample.compositions[tri_hit];
+                composition = element_composition(&sample, tri_hit);
+                frame = element_frame(&sample, tri_hit, nearest_n, the_ray->direction,
+                    &sphere_frame);
+                if (sample.material_map != NULL)
+                    composition = mapped_material(&sample, nearest_inter, composition,
+                        &frame, &sphere_frame, &scaled);
             }
         }
 
         /* Find the new direction and update position*/
-        composition->func(nearest_n, the_ray->direction,
-            new_direction, composition->params, myrng);
+        scatter_material(the_ray, composition, frame, new_direction, myrng);
+        if (!meets_sphere && which_surface == sample.surf_index)
+            keep_above_element(&sample, tri_hit, new_direction);
         update_ray_direction(the_ray, new_direction);
         update_ray_position(the_ray, nearest_inter);
 
@@ -267,36 +430,8 @@ void scatterSurfaces(Ray3D * the_ray, Surface3D sample, Surface3D plate,
          * We must consider if the ray has been detected if it hasn't hit
          * either surface
          */
-        /* First consider if the ray is propagating in the +ve y direction */
-        if (the_ray->direction[1] > 0) {
-            double alpha;
-            double wall_hit[3];
-
-            /* Find where, just behind the pinhole plate, the ray will hit,
-             * backWall[0] is the y coordinate of the back of the pinhole plate
-             */
-            alpha = (backWall[0] - the_ray->position[1])/the_ray->direction[1];
-
-            propagate(the_ray->position, the_ray->direction, alpha, wall_hit);
-
-            /*
-             * Now find if this point is covered by the plate, if it is then the
-             * ray must be detected, if it is not, then the ray must be dead.
-             * backWall[1] and backWall[2] are the depth in x and z of the
-             * pinhole plate
-             */
-            if ((fabs(wall_hit[0]) < (backWall[1]/2)) && (fabs(wall_hit[2]) <
-                    (backWall[2]/2))) {
-                /* We update position only and keep the direction the same */
-                update_ray_position(the_ray, wall_hit);
-
-                the_ray->status = 2;
-                return;
-            }
-        } else {
-            /* Ray be dead */
-            meets = 0;
-        }
+        if (detect_behind_plate(the_ray, backWall, regions))
+            return;
     }
 
     the_ray->status = !(meets || meets_sphere);
@@ -375,20 +510,31 @@ void scatterSimpleMulti(Ray3D * the_ray, Surface3D sample, NBackWall plate,
     /* Update position/direction etc. */
     if (meets || meets_sphere) {
         Material const * composition;
-
-        if (meets_sphere) {
-            /* sphere is defined to be uniform */
-            composition = &(the_sphere.material);
-        } else {
-            if (which_surface == plate.surf_index)
-                composition = &(plate.material);
+        SurfaceFrame const * frame;
+        SurfaceFrame analyt_frame;
+        ScaledMaterial scaled;
+
+        if (meets_sphere || which_surface == plate.surf_index) {
+            /* The sphere and the simple plate have their frames made on the fly */
+            if (meets_sphere)
+                composition = &(the_sphere.material);
             else
-                composition = sample.compositions[tri_hit];
+                composition = &(plate.material);
+            make_frame(nearest_n, &analyt_frame);
+            frame = &analyt_frame;
+        } else {
+            composition = element_composition(&sample, tri_hit);
+            frame = element_frame(&sample, tri_hit, nearest_n, the_ray->direction,
+                &analyt_frame);
+            if (sample.material_map != NULL)
+                composition = mapped_material(&sample, nearest_inter, composition, &frame,
+                    &analyt_frame, &scaled);
         }
 
         /* Find the new direction and update position*/
-        composition->func(nearest_n, the_ray->direction,
-            new_direction, composition->params, myrng);
+        scatter_material(the_ray, composition, frame, new_direction, myrng);
+        if (!meets_sphere && which_surface == sample.surf_index)
+            keep_above_element(&sample, tri_hit, new_direction);
         /* Updates the current triangle and surface the ray is on */
         the_ray->on_element = tri_hit;
         the_ray->on_surface = which_surface;
@@ -25,17 +25,22 @@ void scatterOffSurface(Ray3D * the_ray, Surface3D sample, AnalytSphere the_spher
 
 /*
  *  Finds the intersection, normal at the point of intersection and distance to
- *  the intersection between the ray and a triangulated surface.
+ *  the intersection between the ray and a triangulated surface. The rays are
+ *  detected by the labelled regions if regions is not NULL (see
+ *  DetectorRegions), otherwise by the backWall rectangle.
  */
 void scatterPinholeSurface(Ray3D * the_ray, Surface3D plate, const double backWall[],
-        MTRand * const myrng);
+        DetectorRegions const * const regions, MTRand * const myrng);
 
 /*
  *  Scatters a ray off two triangulared surfaces, and an analytic sphere if
- *  desired.
+ *  desired. The fine model of the plate in refine (may be NULL) is used near
+ *  the apertures. The rays are detected as for scatterPinholeSurface.
  */
 void scatterSurfaces(Ray3D * the_ray, Surface3D sample, Surface3D plate,
-		AnalytSphere the_sphere, const double backWall[], MTRand * const myrng);
+		PlateRefine const * const refine, AnalytSphere the_sphere,
+		const double backWall[], DetectorRegions const * const regions,
+		MTRand * const myrng);
 
 /*
  *  Scatters a ray off a triangulated surface, and a simple model of the pinhole plate
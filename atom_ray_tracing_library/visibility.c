@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Visibility maps of surfaces seen along the beam, see visibility.h.
+ */
+
+#include "visibility.h"
+#include "memory_account.h"
+#include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Most cells crossed on the way back from a hit before it is given up on */
+#define VISIBILITY_MAX_STEPS 64
+
+/* A face projected onto the map */
+typedef struct _projectedFace {
+    double s[3], t[3];      /* (u, v) of the vertices, relative to the origin */
+    double w0;              /* Depth of the first vertex */
+    double w_min, w_max;    /* Range of the depth of the vertices */
+    double gs, gt;          /* Gradient of the depth in the plane of the face */
+    double n[3][2];         /* Unit outward normal of each edge, in (u, v) */
+    int flat;               /* Is the face edge on to the beam */
+} ProjectedFace;
+
+static double visibility_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+static inline double dot3(const double a[3], const double b[3]) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+/* The bytes of the cells of a map */
+static int64_t map_bytes(int64_t n_cells) {
+    return n_cells*(int64_t)sizeof(VisibilityCell);
+}
+
+int64_t visibility_map_memory(int64_t n_cells) {
+    return map_bytes(n_cells) + n_cells*(int64_t)sizeof(double);
+}
+
+static void project_face(VisibilityMap const * const map, double const V[],
+        int32_t const F[], int j, ProjectedFace * const pf) {
+    double w[3], area2, scale = 0;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        double const * const p = &V[3*(F[3*j + k] - 1)];
+
+        pf->s[k] = dot3(p, map->axes[0]) - map->origin[0];
+        pf->t[k] = dot3(p, map->axes[1]) - map->origin[1];
+        w[k] = dot3(p, map->beam);
+    }
+    pf->w0 = w[0];
+    pf->w_min = fmin(w[0], fmin(w[1], w[2]));
+    pf->w_max = fmax(w[0], fmax(w[1], w[2]));
+
+    for (k = 0; k < 3; k++) {
+        int const k1 = (k + 1) % 3;
+        double const ds = pf->s[k1] - pf->s[k];
+        double const dt = pf->t[k1] - pf->t[k];
+        scale = fmax(scale, ds*ds + dt*dt);
+    }
+    area2 = (pf->s[1] - pf->s[0])*(pf->t[2] - pf->t[0]) -
+        (pf->s[2] - pf->s[0])*(pf->t[1] - pf->t[0]);
+    pf->flat = fabs(area2) <= 1e-9*scale;
+    if (pf->flat)
+        return;
+
+    pf->gs = ((w[1] - w[0])*(pf->t[2] - pf->t[0]) - (w[2] - w[0])*(pf->t[1] - pf->t[0]))/area2;
+    pf->gt = ((pf->s[1] - pf->s[0])*(w[2] - w[0]) - (pf->s[2] - pf->s[0])*(w[1] - w[0]))/area2;
+
+    /* The outward normal is to the right of the edges of an anticlockwise face */
+    for (k = 0; k < 3; k++) {
+        int const k1 = (k + 1) % 3;
+        double const sgn = area2 > 0 ? 1 : -1;
+        double ns = sgn*(pf->t[k1] - pf->t[k]);
+        double nt = -sgn*(pf->s[k1] - pf->s[k]);
+        double const len = sqrt(ns*ns + nt*nt);
+
+        pf->n[k][0] = ns/len;
+        pf->n[k][1] = nt/len;
+    }
+}
+
+/*
+ * The bounds on the depth of a face over a cell and how the face meets it:
+ * 0 if it does not, 1 if it overlaps it and 2 if it covers the whole cell,
+ * with a margin of tol. Faces are only said not to meet a cell with the margin
+ * to spare.
+ */
+static int face_in_cell(ProjectedFace const * const pf, double s0, double t0,
+        double h, double tol, double * const lower, double * const upper) {
+    double const cs[4] = {s0, s0 + h, s0, s0 + h};
+    double const ct[4] = {t0, t0, t0 + h, t0 + h};
+    int covers = 1;
+    int c, k;
+
+    if (pf->flat) {
+        *lower = pf->w_min;
+        *upper = pf->w_max;
+        return 1;
+    }
+
+    for (k = 0; k < 3; k++) {
+        double f_min = 1e300, f_max = -1e300;
+
+        for (c = 0; c < 4; c++) {
+            double const f = pf->n[k][0]*(cs[c] - pf->s[k]) + pf->n[k][1]*(ct[c] - pf->t[k]);
+            f_min = fmin(f_min, f);
+            f_max = fmax(f_max, f);
+        }
+        if (f_min > tol)
+            return 0;
+        if (f_max >= -tol)
+            covers = 0;
+    }
+
+    /* The depth is linear, so it is bounded by its values at the corners */
+    *lower = 1e300;
+    *upper = -1e300;
+    for (c = 0; c < 4; c++) {
+        double const w = pf->w0 + pf->gs*(cs[c] - pf->s[0]) + pf->gt*(ct[c] - pf->t[0]);
+        *lower = fmin(*lower, w);
+        *upper = fmax(*upper, w);
+    }
+    *lower = fmax(*lower, pf->w_min);
+    *upper = fmin(*upper, pf->w_max);
+    return covers ? 2 : 1;
+}
+
+/* The range of cells along an axis the range [lo, hi] of a face is over */
+static void cell_range(double lo, double hi, double h, double tol, int dim,
+        int * const i0, int * const i1) {
+    double const a = floor((lo - tol)/h);
+    double const b = floor((hi + tol)/h);
+
+    *i0 = a < 0 ? 0 : (a > dim - 1 ? dim - 1 : (int)a);
+    *i1 = b < 0 ? 0 : (b > dim - 1 ? dim - 1 : (int)b);
+}
+
+VisibilityMap * build_visibility_map(double const V[], int32_t const F[], double const N[],
+        int ntriag, const double beam[3], double cell_size) {
+    double const t0 = visibility_now();
+    VisibilityMap * map;
+    ProjectedFace pf;
+    double * upper;
+    double lo[3] = {1e300, 1e300, 1e300};
+    double hi[3] = {-1e300, -1e300, -1e300};
+    double helper[3] = {0, 0, 0};
+    double len, extent, tol, n_u, n_v;
+    int64_t n_cells, c;
+    int j, k, a;
+
+    len = sqrt(dot3(beam, beam));
+    if (ntriag <= 0 || cell_size <= 0 || len <= 0)
+        return NULL;
+
+    map = malloc(sizeof(VisibilityMap));
+    for (k = 0; k < 3; k++)
+        map->beam[k] = beam[k]/len;
+
+    /* The axis of the map is the coordinate axis least along the beam made
+     * perpendicular to it */
+    a = 0;
+    for (k = 1; k < 3; k++)
+        if (fabs(map->beam[k]) < fabs(map->beam[a]))
+            a = k;
+    helper[a] = 1;
+    for (k = 0; k < 3; k++)
+        map->axes[0][k] = helper[k] - map->beam[a]*map->beam[k];
+    len = sqrt(dot3(map->axes[0], map->axes[0]));
+    for (k = 0; k < 3; k++)
+        map->axes[0][k] /= len;
+    map->axes[1][0] = map->beam[1]*map->axes[0][2] - map->beam[2]*map->axes[0][1];
+    map->axes[1][1] = map->beam[2]*map->axes[0][0] - map->beam[0]*map->axes[0][2];
+    map->axes[1][2] = map->beam[0]*map->axes[0][1] - map->beam[1]*map->axes[0][0];
+
+    /* The map covers the projection of the faces with a cell to spare */
+    for (j = 0; j < ntriag; j++) {
+        for (k = 0; k < 3; k++) {
+            double const * const p = &V[3*(F[3*j + k] - 1)];
+            double const x[3] = {dot3(p, map->axes[0]), dot3(p, map->axes[1]),
+                dot3(p, map->beam)};
+
+            for (a = 0; a < 3; a++) {
+                lo[a] = fmin(lo[a], x[a]);
+                hi[a] = fmax(hi[a], x[a]);
+            }
+        }
+    }
+    n_u = floor((hi[0] - lo[0])/cell_size) + 3;
+    n_v = floor((hi[1] - lo[1])/cell_size) + 3;
+    if (n_u*n_v > VISIBILITY_MAX_CELLS) {
+        free(map);
+        return NULL;
+    }
+    map->cell_size = cell_size;
+    map->dims[0] = (int)n_u;
+    map->dims[1] = (int)n_v;
+    map->origin[0] = lo[0] - cell_size;
+    map->origin[1] = lo[1] - cell_size;
+    extent = fmax(fmax(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]) + cell_size;
+    tol = 1e-9*extent;
+    map->tolerance = tol;
+    map->n_queries = 0;
+    map->n_resolved = 0;
+
+    n_cells = (int64_t)map->dims[0]*map->dims[1];
+    account_memory(MEM_GEOMETRY, visibility_map_memory(n_cells));
+    map->cells = malloc(n_cells*sizeof(VisibilityCell));
+    upper = malloc(n_cells*sizeof(double));
+    for (c = 0; c < n_cells; c++) {
+        map->cells[c].face = -1;
+        map->cells[c].top = VISIBILITY_FAR;
+        upper[c] = VISIBILITY_FAR;
+    }
+
+    /* The face facing the beam that covers each cell and is nearest at its
+     * furthest over it */
+    for (j = 0; j < ntriag; j++) {
+        int i0, i1, k0, k1, i;
+
+        if (dot3(&N[3*j], map->beam) >= 0)
+            continue;
+        project_face(map, V, F, j, &pf);
+        if (pf.flat)
+            continue;
+        cell_range(fmin(pf.s[0], fmin(pf.s[1], pf.s[2])), fmax(pf.s[0], fmax(pf.s[1], pf.s[2])),
+            cell_size, tol, map->dims[0], &i0, &i1);
+        cell_range(fmin(pf.t[0], fmin(pf.t[1], pf.t[2])), fmax(pf.t[0], fmax(pf.t[1], pf.t[2])),
+            cell_size, tol, map->dims[1], &k0, &k1);
+        for (k = k0; k <= k1; k++) {
+            for (i = i0; i <= i1; i++) {
+                int64_t const cell = i + (int64_t)map->dims[0]*k;
+                double l, u;
+
+                if (face_in_cell(&pf, i*cell_size, k*cell_size, cell_size, tol,
+                        &l, &u) == 2 && u < upper[cell]) {
+                    upper[cell] = u;
+                    map->cells[cell].face = j;
+                }
+            }
+        }
+    }
+
+    /* Every face over a cell bounds its depth, and hides the face of the cell
+     * unless it is behind it */
+    for (j = 0; j < ntriag; j++) {
+        int i0, i1, k0, k1, i;
+
+        project_face(map, V, F, j, &pf);
+        cell_range(fmin(pf.s[0], fmin(pf.s[1], pf.s[2])), fmax(pf.s[0], fmax(pf.s[1], pf.s[2])),
+            cell_size, tol, map->dims[0], &i0, &i1);
+        cell_range(fmin(pf.t[0], fmin(pf.t[1], pf.t[2])), fmax(pf.t[0], fmax(pf.t[1], pf.t[2])),
+            cell_size, tol, map->dims[1], &k0, &k1);
+        for (k = k0; k <= k1; k++) {
+            for (i = i0; i <= i1; i++) {
+                int64_t const cell = i + (int64_t)map->dims[0]*k;
+                double l, u;
+
+                if (!face_in_cell(&pf, i*cell_size, k*cell_size, cell_size, tol, &l, &u))
+                    continue;
+                if (l < map->cells[cell].top) {
+                    float top = (float)l;
+                    if (top > l)
+                        top = nextafterf(top, -VISIBILITY_FAR);
+                    map->cells[cell].top = top;
+                }
+                if (map->cells[cell].face >= 0 && map->cells[cell].face != j &&
+                        l <= upper[cell] + tol)
+                    map->cells[cell].face = -1;
+            }
+        }
+    }
+
+    map->min_top = VISIBILITY_FAR;
+    map->n_seen = 0;
+    for (c = 0; c < n_cells; c++) {
+        if (map->cells[c].top < map->min_top)
+            map->min_top = map->cells[c].top;
+        if (map->cells[c].face >= 0)
+            map->n_seen++;
+    }
+
+    free(upper);
+    account_memory(MEM_GEOMETRY, -(visibility_map_memory(n_cells) - map_bytes(n_cells)));
+    map->build_time = visibility_now() - t0;
+    return map;
+}
+
+void free_visibility_map(VisibilityMap * const map) {
+    if (map == NULL)
+        return;
+    account_memory(MEM_GEOMETRY, -map_bytes((int64_t)map->dims[0]*map->dims[1]));
+    free(map->cells);
+    free(map);
+}
+
+/* The cell (i, j) that p is in, returns 0 if it is outside the map */
+static int cell_of(VisibilityMap const * const map, const double p[3], int * const i,
+        int * const j) {
+    double const s = (dot3(p, map->axes[0]) - map->origin[0])/map->cell_size;
+    double const t = (dot3(p, map->axes[1]) - map->origin[1])/map->cell_size;
+
+    if (s < 0 || t < 0 || s >= map->dims[0] || t >= map->dims[1])
+        return 0;
+    *i = (int)s;
+    *j = (int)t;
+    return 1;
+}
+
+int visibility_face(VisibilityMap const * const map, const double e[3], const double d[3]) {
+    double const db = dot3(d, map->beam);
+    double const ew = dot3(e, map->beam);
+    double q[3], lambda;
+    VisibilityCell const * cell;
+    int i, j, k;
+
+    if (db <= 0)
+        return -1;
+
+    /* Where the ray comes level with the nearest of the surface */
+    lambda = ew < map->min_top ? (map->min_top - ew)/db : 0;
+    for (k = 0; k < 3; k++)
+        q[k] = e[k] + lambda*d[k];
+    if (!cell_of(map, q, &i, &j))
+        return -1;
+    cell = &map->cells[i + map->dims[0]*j];
+    if (cell->face < 0)
+        return -1;
+
+    /* Then where it comes level with the face of that cell */
+    if (cell->top > ew) {
+        lambda = (cell->top - ew)/db;
+        for (k = 0; k < 3; k++)
+            q[k] = e[k] + lambda*d[k];
+        if (!cell_of(map, q, &i, &j))
+            return -1;
+    }
+    return map->cells[i + map->dims[0]*j].face;
+}
+
+int visibility_path_clear(VisibilityMap const * const map, const double e[3],
+        const double d[3], const double p[3], int face) {
+    double const db = dot3(d, map->beam);
+    double const h = map->cell_size;
+    double pos[2], back[2], next[2], delta[2];
+    double pw, lambda_end;
+    int ij[2], step[2];
+    int a, n;
+
+    if (db <= 0 || !cell_of(map, p, &ij[0], &ij[1]) ||
+            map->cells[ij[0] + map->dims[0]*ij[1]].face != face)
+        return 0;
+
+    /* March back from the hit towards the source through the cells, lambda is
+     * the distance back along the ray in units of |d| */
+    pw = dot3(p, map->beam);
+    lambda_end = (pw - dot3(e, map->beam))/db;
+    for (a = 0; a < 2; a++) {
+        pos[a] = dot3(p, map->axes[a]) - map->origin[a];
+        back[a] = -dot3(d, map->axes[a]);
+        if (back[a] > 0) {
+            step[a] = 1;
+            next[a] = ((ij[a] + 1)*h - pos[a])/back[a];
+            delta[a] = h/back[a];
+        } else if (back[a] < 0) {
+            step[a] = -1;
+            next[a] = (ij[a]*h - pos[a])/back[a];
+            delta[a] = -h/back[a];
+        } else {
+            step[a] = 0;
+            next[a] = VISIBILITY_FAR;
+            delta[a] = 0;
+        }
+    }
+
+    for (n = 0; n < VISIBILITY_MAX_STEPS; n++) {
+        double lambda, w;
+
+        a = next[0] < next[1] ? 0 : 1;
+        lambda = next[a];
+        if (lambda >= lambda_end)
+            return 1;
+
+        /* The ray enters the next cell at its deepest in it */
+        w = pw - lambda*db;
+        if (w < map->min_top - map->tolerance)
+            return 1;
+        ij[a] += step[a];
+        if (ij[a] < 0 || ij[a] >= map->dims[a])
+            return 1;
+        next[a] += delta[a];
+        if (w >= map->cells[ij[0] + map->dims[0]*ij[1]].top - map->tolerance)
+            return 0;
+    }
+    return 0;
+}
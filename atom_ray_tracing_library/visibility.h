@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A visibility map of a triangulated surface seen along the beam, used to find
+ * the first hit of the rays from the source without traversing the hierarchy.
+ * Over a raster scan the source is fixed and the sample only translates, so
+ * one map in the frame of the sample serves every pixel.
+ *
+ * The map is a grid of square cells in the plane perpendicular to the beam,
+ * covering the projection of the whole surface. Each cell holds a lower bound
+ * on the depth (distance along the beam) of every face over it, and the face
+ * seen in it if there is one that covers the whole cell with every other face
+ * over the cell entirely behind it. Cells that hold an edge, or faces that
+ * overlap in depth, are flagged (-1) and are always intersected in full.
+ *
+ * A ray is looked up at the cell where it reaches the surface, and tested
+ * against the face of that cell alone. Rays are not exactly along the beam, so
+ * the hit is only accepted if it lies in a cell of that face and the ray, on
+ * its way there, passes above the lower bounds of every other cell it crosses;
+ * the DDA back from the hit stops once the ray is above the whole surface. An
+ * accepted hit is therefore the nearest, as the full intersection would give.
+ */
+
+#ifndef VISIBILITY_H_
+#define VISIBILITY_H_
+
+#include <stdint.h>
+
+/* Most cells a map may have */
+#define VISIBILITY_MAX_CELLS (1 << 24)
+
+/* Depth of the cells that no face is over, -ffast-math does not give inf */
+#define VISIBILITY_FAR 1e30f
+
+/* A cell of the map, the two are read together */
+typedef struct _visibilityCell {
+    int32_t face;           /* Face seen in the cell, -1 if it is flagged */
+    float top;              /* Lower bound on the depth of the faces over the
+                             * cell, rounded down, VISIBILITY_FAR if none */
+} VisibilityCell;
+
+typedef struct _visibilityMap {
+    double beam[3];         /* Unit direction the surface is seen along */
+    double axes[2][3];      /* The axes (u, v) of the map, perpendicular to it */
+    double origin[2];       /* (u, v) of the low corner of cell (0, 0) */
+    double cell_size;
+    int dims[2];            /* Number of cells along u and v */
+    VisibilityCell * cells; /* u fastest */
+    double min_top;         /* Least of top, nothing is nearer the source */
+    double tolerance;       /* Margin on the depths, for rounding */
+    int n_seen;             /* Number of cells that are not flagged */
+    double build_time;      /* Time taken to build the map (s) */
+
+    /* Counted over all lookups, not atomic */
+    int64_t n_queries;      /* Number of rays looked up */
+    int64_t n_resolved;     /* Number resolved without the full intersection */
+} VisibilityMap;
+
+/*
+ * Build the map of the faces given the vertices (3 x nvert), the faces (3 x
+ * ntriag, indices starting at 1) and their normals (3 x ntriag) seen along
+ * beam, with cells of cell_size. Only faces facing the beam are seen. Returns
+ * NULL if there are no faces or the map would have more than
+ * VISIBILITY_MAX_CELLS cells. Must be freed with free_visibility_map.
+ */
+VisibilityMap * build_visibility_map(double const V[], int32_t const F[], double const N[],
+        int ntriag, const double beam[3], double cell_size);
+
+void free_visibility_map(VisibilityMap * const map);
+
+/* The bytes build_visibility_map allocates for a map of n_cells cells */
+int64_t visibility_map_memory(int64_t n_cells);
+
+/*
+ * The face of the cell where the ray from e along d reaches the surface, -1 if
+ * that cell is flagged or the ray does not travel along the beam.
+ */
+int visibility_face(VisibilityMap const * const map, const double e[3], const double d[3]);
+
+/*
+ * Is the hit p of the ray from e along d on face the nearest hit on the
+ * surface, i.e. p is in a cell of face and nothing of the surface is in the
+ * way. Returns 0 if it cannot be shown, the ray must then be intersected in
+ * full.
+ */
+int visibility_path_clear(VisibilityMap const * const map, const double e[3],
+        const double d[3], const double p[3], int face);
+
+#endif /* VISIBILITY_H_ */
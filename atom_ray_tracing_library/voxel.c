@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Voxel grids and the DDA through them, see voxel.h.
+ */
+
+#include "voxel.h"
+#include "memory_account.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Larger than any distance, -ffast-math does not give inf */
+#define VOXEL_FAR 1e300
+
+/* The bytes of the bricks and voxels of a grid */
+static int64_t grid_bytes(VoxelGrid const * const grid) {
+    int64_t const b3 = (int64_t)grid->brick_size*grid->brick_size*grid->brick_size;
+
+    if (grid->bricks == NULL)
+        return (int64_t)grid->dims[0]*grid->dims[1]*grid->dims[2];
+    return (int64_t)grid->brick_dims[0]*grid->brick_dims[1]*grid->brick_dims[2]*sizeof(int32_t) +
+        grid->n_bricks*b3;
+}
+
+VoxelGrid * build_voxel_grid(uint8_t const ids[], const int dims[3], const double origin[3],
+        double voxel_size, int brick_size, int normal_radius, int n_materials) {
+    int64_t const n_voxels = (int64_t)dims[0]*dims[1]*dims[2];
+    VoxelGrid * grid;
+    int64_t v, b3, n_b;
+    int a;
+
+    if (n_voxels <= 0 || 6*n_voxels > INT32_MAX)
+        return NULL;
+
+    grid = malloc(sizeof(VoxelGrid));
+    grid->voxel_size = voxel_size;
+    grid->brick_size = brick_size > 1 ? brick_size : 1;
+    grid->n_materials = n_materials;
+    grid->normal_radius = normal_radius > 0 ? normal_radius : 0;
+    for (a = 0; a < 3; a++) {
+        grid->dims[a] = dims[a];
+        grid->origin[a] = origin[a];
+        grid->brick_dims[a] = (dims[a] + grid->brick_size - 1)/grid->brick_size;
+    }
+
+    /* A dense grid is a copy of the ids */
+    if (grid->brick_size == 1) {
+        grid->bricks = NULL;
+        grid->n_bricks = 0;
+        grid->ids = malloc(n_voxels);
+        memcpy(grid->ids, ids, n_voxels);
+        account_memory(MEM_GEOMETRY, grid_bytes(grid));
+        return grid;
+    }
+
+    /* Number the bricks holding a voxel, then copy the voxels into them */
+    b3 = (int64_t)grid->brick_size*grid->brick_size*grid->brick_size;
+    n_b = (int64_t)grid->brick_dims[0]*grid->brick_dims[1]*grid->brick_dims[2];
+    grid->bricks = malloc(n_b*sizeof(int32_t));
+    for (v = 0; v < n_b; v++)
+        grid->bricks[v] = -1;
+    for (v = 0; v < n_voxels; v++) {
+        if (ids[v]) {
+            int const i = v % dims[0];
+            int const j = (v/dims[0]) % dims[1];
+            int const k = v/((int64_t)dims[0]*dims[1]);
+            int const bs = grid->brick_size;
+
+            grid->bricks[i/bs + grid->brick_dims[0]*(j/bs +
+                (int64_t)grid->brick_dims[1]*(k/bs))] = 0;
+        }
+    }
+    grid->n_bricks = 0;
+    for (v = 0; v < n_b; v++)
+        if (grid->bricks[v] == 0)
+            grid->bricks[v] = grid->n_bricks++;
+        else
+            grid->bricks[v] = -1;
+
+    grid->ids = calloc(grid->n_bricks*b3 > 0 ? grid->n_bricks*b3 : 1, 1);
+    for (v = 0; v < n_voxels; v++) {
+        if (ids[v]) {
+            int const i = v % dims[0];
+            int const j = (v/dims[0]) % dims[1];
+            int const k = v/((int64_t)dims[0]*dims[1]);
+            int const bs = grid->brick_size;
+            int32_t const brick = grid->bricks[i/bs + grid->brick_dims[0]*(j/bs +
+                (int64_t)grid->brick_dims[1]*(k/bs))];
+
+            grid->ids[brick*b3 + i % bs + bs*(j % bs + bs*(k % bs))] = ids[v];
+        }
+    }
+    account_memory(MEM_GEOMETRY, grid_bytes(grid));
+    return grid;
+}
+
+void free_voxel_grid(VoxelGrid * const grid) {
+    if (grid == NULL)
+        return;
+    account_memory(MEM_GEOMETRY, -grid_bytes(grid));
+    free(grid->bricks);
+    free(grid->ids);
+    free(grid);
+}
+
+int64_t voxel_grid_memory(const int dims[3], int brick_size) {
+    int64_t n_b = 1, n_v = 1;
+    int a;
+
+    if (brick_size <= 1)
+        return (int64_t)dims[0]*dims[1]*dims[2] + sizeof(VoxelGrid);
+    for (a = 0; a < 3; a++) {
+        int const nb = (dims[a] + brick_size - 1)/brick_size;
+        n_b *= nb;
+        n_v *= (int64_t)nb*brick_size;
+    }
+    return n_b*sizeof(int32_t) + n_v + sizeof(VoxelGrid);
+}
+
+int voxel_id(VoxelGrid const * const grid, int i, int j, int k) {
+    int const bs = grid->brick_size;
+    int32_t brick;
+
+    if (i < 0 || j < 0 || k < 0 || i >= grid->dims[0] || j >= grid->dims[1] ||
+            k >= grid->dims[2])
+        return 0;
+    if (grid->bricks == NULL)
+        return grid->ids[i + grid->dims[0]*(j + (int64_t)grid->dims[1]*k)];
+    brick = grid->bricks[i/bs + grid->brick_dims[0]*(j/bs + (int64_t)grid->brick_dims[1]*(k/bs))];
+    if (brick < 0)
+        return 0;
+    return grid->ids[brick*(int64_t)bs*bs*bs + i % bs + bs*(j % bs + bs*(k % bs))];
+}
+
+/*
+ * March the ray through the cells lo to hi - 1 of the grid, bricks if bricks
+ * is set otherwise voxels, from a distance t0 to t1. The ray enters the first
+ * cell through its face along axis, -1 if it starts inside it. skip is set
+ * until the cell the ray starts in has been passed. The bricks that hold
+ * voxels are marched through in turn.
+ */
+static int march(VoxelGrid const * const grid, int bricks, const int lo[3], const int hi[3],
+        const double e[3], const double d[3], double t0, double t1, int axis,
+        int * const skip, double * const t, int64_t * const voxel, int * const face) {
+    double const h = bricks ? grid->voxel_size*grid->brick_size : grid->voxel_size;
+    double t_next[3], t_delta[3];
+    double t_cell = t0;
+    int c[3], step[3];
+    int a;
+
+    for (a = 0; a < 3; a++) {
+        double const x = (e[a] + t0*d[a] - grid->origin[a])/h;
+
+        /* The cell entered is on the far side of the boundary crossed */
+        if (a == axis)
+            c[a] = (int)floor(x + 0.5) - (d[a] < 0);
+        else
+            c[a] = (int)floor(x);
+        if (c[a] < lo[a])
+            c[a] = lo[a];
+        if (c[a] > hi[a] - 1)
+            c[a] = hi[a] - 1;
+
+        step[a] = d[a] > 0 ? 1 : -1;
+        if (fabs(d[a]) > 1e-30) {
+            t_next[a] = (grid->origin[a] + (c[a] + (d[a] > 0))*h - e[a])/d[a];
+            t_delta[a] = h/fabs(d[a]);
+        } else {
+            t_next[a] = VOXEL_FAR;
+            t_delta[a] = 0;
+        }
+    }
+
+    for (;;) {
+        int const next = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) :
+            (t_next[1] < t_next[2] ? 1 : 2);
+        double const t_out = t_next[next] < t1 ? t_next[next] : t1;
+
+        if (bricks) {
+            int64_t const b = c[0] + grid->brick_dims[0]*(c[1] +
+                (int64_t)grid->brick_dims[1]*c[2]);
+            if (grid->bricks[b] >= 0) {
+                int v_lo[3], v_hi[3];
+                for (a = 0; a < 3; a++) {
+                    v_lo[a] = c[a]*grid->brick_size;
+                    v_hi[a] = v_lo[a] + grid->brick_size < grid->dims[a] ?
+                        v_lo[a] + grid->brick_size : grid->dims[a];
+                }
+                if (march(grid, 0, v_lo, v_hi, e, d, t_cell, t_out, axis, skip, t, voxel,
+                        face))
+                    return 1;
+            }
+        } else if (!*skip && voxel_id(grid, c[0], c[1], c[2])) {
+            *t = t_cell;
+            *voxel = c[0] + grid->dims[0]*(c[1] + (int64_t)grid->dims[1]*c[2]);
+            *face = 2*axis + (d[axis] < 0);
+            return 1;
+        }
+        *skip = 0;
+
+        if (t_next[next] > t1)
+            return 0;
+        t_cell = t_next[next];
+        c[next] += step[next];
+        if (c[next] < lo[next] || c[next] >= hi[next])
+            return 0;
+        t_next[next] += t_delta[next];
+        axis = next;
+    }
+}
+
+int intersect_voxel_grid(VoxelGrid const * const grid, const double e[3], const double d[3],
+        double t_max, double * const t, int64_t * const voxel, int * const face) {
+    int const bricks = grid->bricks != NULL;
+    int const lo[3] = {0, 0, 0};
+    int const * const hi = bricks ? grid->brick_dims : grid->dims;
+    double const h = bricks ? grid->voxel_size*grid->brick_size : grid->voxel_size;
+    double t0 = 0, t1 = t_max;
+    int axis = -1;
+    int skip;
+    int a;
+
+    /* Clip the ray to the box of the grid */
+    for (a = 0; a < 3; a++) {
+        double const box_lo = grid->origin[a];
+        double const box_hi = grid->origin[a] + hi[a]*h;
+
+        if (fabs(d[a]) > 1e-30) {
+            double ta = (box_lo - e[a])/d[a];
+            double tb = (box_hi - e[a])/d[a];
+            if (ta > tb) {
+                double tmp = ta;
+                ta = tb;
+                tb = tmp;
+            }
+            if (ta > t0) {
+                t0 = ta;
+                axis = a;
+            }
+            if (tb < t1)
+                t1 = tb;
+        } else if (e[a] < box_lo || e[a] > box_hi) {
+            return 0;
+        }
+    }
+    if (t0 > t1)
+        return 0;
+
+    skip = axis < 0;
+    return march(grid, bricks, lo, hi, e, d, t0, t1, axis, &skip, t, voxel, face);
+}
+
+void voxel_face_normal(int face, double n[3]) {
+    n[0] = n[1] = n[2] = 0;
+    n[face/2] = face % 2 ? 1 : -1;
+}
+
+void voxel_normal(VoxelGrid const * const grid, int face, const double p[3], double n[3]) {
+    double const reach = grid->normal_radius + 1;
+    double x[3], f[3], len2, cos_f;
+    int lo[3], hi[3];
+    int i, j, k;
+
+    /*
+     * Minus the first moment of the occupancy about p, with tent weights
+     * falling to 0 at normal_radius + 1 voxels so that it varies smoothly
+     * with p
+     */
+    for (i = 0; i < 3; i++) {
+        x[i] = (p[i] - grid->origin[i])/grid->voxel_size;
+        lo[i] = (int)floor(x[i] - reach);
+        hi[i] = (int)ceil(x[i] + reach);
+    }
+    n[0] = n[1] = n[2] = 0;
+    for (k = lo[2]; k <= hi[2]; k++) {
+        double const dz = k + 0.5 - x[2];
+        double const wz = 1 - fabs(dz)/reach;
+        if (wz <= 0)
+            continue;
+        for (j = lo[1]; j <= hi[1]; j++) {
+            double const dy = j + 0.5 - x[1];
+            double const wy = wz*(1 - fabs(dy)/reach);
+            if (wy <= 0)
+                continue;
+            for (i = lo[0]; i <= hi[0]; i++) {
+                double const dx = i + 0.5 - x[0];
+                double const w = wy*(1 - fabs(dx)/reach);
+                if (w > 0 && voxel_id(grid, i, j, k)) {
+                    n[0] -= w*dx;
+                    n[1] -= w*dy;
+                    n[2] -= w*dz;
+                }
+            }
+        }
+    }
+
+    voxel_face_normal(face, f);
+    len2 = n[0]*n[0] + n[1]*n[1] + n[2]*n[2];
+    cos_f = n[0]*f[0] + n[1]*f[1] + n[2]*f[2];
+    if (len2 == 0 || cos_f <= 0) {
+        n[0] = f[0];
+        n[1] = f[1];
+        n[2] = f[2];
+        return;
+    }
+    len2 = sqrt(len2);
+    n[0] /= len2;
+    n[1] /= len2;
+    n[2] /= len2;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A sample given as a grid of voxels, e.g. a volume from X-ray tomography,
+ * traced directly rather than as the (very many) faces of a triangulation of
+ * it. Each voxel holds the material filling it, 0 for empty.
+ *
+ * Rays are marched through the grid with a 3D DDA (Amanatides & Woo, 1987).
+ * The grid is optionally split into bricks of brick_size^3 voxels of which
+ * only the non-empty ones are stored, the DDA then steps over whole empty
+ * bricks and visits the voxels only inside the others. A hit is on the face
+ * of a voxel the ray enters through, its normal is taken from the gradient of
+ * the occupancy of the voxels around it so that a stair-cased volume scatters
+ * as the smooth surface it samples.
+ *
+ * The element a ray hits is 6*voxel + face, face 2a (2a + 1) is the face of
+ * the voxel at its low (high) side along axis a, voxel is the index of the
+ * voxel in x fastest then y then z.
+ */
+
+#ifndef VOXEL_H_
+#define VOXEL_H_
+
+#include <stdint.h>
+
+typedef struct _voxelGrid {
+    int dims[3];            /* Number of voxels along x, y and z */
+    double origin[3];       /* Low corner of voxel (0, 0, 0) */
+    double voxel_size;      /* Edge length of the (cubic) voxels */
+    int brick_size;         /* Edge of the bricks in voxels, 1 for a dense grid */
+    int brick_dims[3];      /* Number of bricks along x, y and z */
+    int32_t * bricks;       /* Index of the voxels of each brick in ids, -1 if
+                             * empty, NULL for a dense grid */
+    int n_bricks;           /* Number of non-empty bricks stored */
+    uint8_t * ids;          /* Material of each voxel, 0 empty, m for the mth */
+    int n_materials;        /* Number of materials */
+    int normal_radius;      /* Radius in voxels the normals are smoothed over */
+} VoxelGrid;
+
+/*
+ * Build the grid from the material of each voxel (dims[0] x dims[1] x dims[2],
+ * x fastest), bricks are used if brick_size > 1. The normals are smoothed over
+ * normal_radius voxels, see voxel_normal. The ids are copied. Returns
+ * NULL if the grid has too many voxels to label its faces with an int. Must be
+ * freed with free_voxel_grid.
+ */
+VoxelGrid * build_voxel_grid(uint8_t const ids[], const int dims[3], const double origin[3],
+        double voxel_size, int brick_size, int normal_radius, int n_materials);
+
+void free_voxel_grid(VoxelGrid * const grid);
+
+/* The bytes build_voxel_grid allocates, at most, for the grid */
+int64_t voxel_grid_memory(const int dims[3], int brick_size);
+
+/* The material of voxel (i, j, k), 0 if empty or outside the grid */
+int voxel_id(VoxelGrid const * const grid, int i, int j, int k);
+
+/*
+ * The first voxel the ray from e along d enters within a distance t_max (in
+ * units of |d|). The voxel containing e, if any, is skipped as the ray is
+ * leaving it. Returns 1 on a hit, with the distance t, the voxel and the face
+ * it enters through.
+ */
+int intersect_voxel_grid(VoxelGrid const * const grid, const double e[3], const double d[3],
+        double t_max, double * const t, int64_t * const voxel, int * const face);
+
+/* The outward normal of a face of a voxel */
+void voxel_face_normal(int face, double n[3]);
+
+/*
+ * The normal at a hit p on a face of a voxel: minus the gradient of the
+ * occupancy around p, smoothed over normal_radius voxels. A stair-cased slope
+ * has terraces of several voxels, the radius should span a few of them. The
+ * normal of the face is used if the gradient vanishes or is more than 90
+ * degrees from it.
+ */
+void voxel_normal(VoxelGrid const * const grid, int face, const double p[3], double n[3]);
+
+#endif /* VOXEL_H_ */
@@ -0,0 +1,461 @@
+% batchScan.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Runs a batch of rectangular scans, one for each parameter file in a
+% directory. Parameter files have the same format as
+% 'ray_tracing_parameters.txt'. Rather than running performScan.m once per
+% parameter file the scene setup is shared:
+%  - Jobs that use the same sample and pinhole plate geometry are grouped, the
+%    sample and plate are imported once per group and sent to the workers
+%    once per group.
+%  - The pixels of all the scans are split into chunks and placed into a single
+%    queue, in order of the priority of the job (see read_job_parameters.m),
+%    so that idle workers pick up the next chunk from any scan rather than
+%    waiting for a single scan to finish.
+% The results of each scan are saved in their own simulation directory as soon
+% as the last chunk of that scan is finished.
+%
+% The parameters not in the parameter files, and the extra options for the
+% simulation in C, are those of performScan.m (see default_parameters.m). As
+% with rectangularScan, subsampled and symmetric scans trace only some of the
+% pixels, the variance, features and diagnostics of each pixel are kept, and
+% the images are reconstructed or denoised before they are saved.
+%
+% Only 'rectangular' scans are supported, other parameter files are skipped.
+% Jobs that ask not to place the sample automatically (dontMeddle) are skipped
+% too, as they stop for the sample to be placed by hand.
+% In GNU Octave, or if there is no parallel pool available, the chunks are
+% traced one after another in the same order.
+%
+% Calling syntax:
+%  simulationData = batchScan(job_dir)
+%  simulationData = batchScan(job_dir, chunk_size)
+%
+% INPUTS:
+%  job_dir    - Directory containing the parameter files, '*.txt'
+%  chunk_size - Optional, the number of pixels in each chunk of work, default 16
+%
+% OUTPUTS:
+%  simulationData - Cell array of RectangleInfo objects, one for each traced
+%                   job in the order of the parameter files
+function simulationData = batchScan(job_dir, chunk_size)
+    if nargin < 2
+        chunk_size = 16;
+    end
+
+    loadpath
+
+    isOctave = exist('OCTAVE_VERSION', 'builtin') ~= 0;
+    if isOctave
+        pkg load statistics;
+        pkg load image;
+    end
+
+    %% Read all the jobs
+    files = dir(fullfile(job_dir, '*.txt'));
+    jobs = {};
+    for i_=1:length(files)
+        job = read_job_parameters(fullfile(job_dir, files(i_).name));
+        if ~strcmp(job.typeScan, 'rectangular')
+            warning(['Skipping ' files(i_).name ', only rectangular scans ' ...
+                'can be batched.']);
+            continue
+        end
+        if job.dontMeddle
+            warning(['Skipping ' files(i_).name ', the sample must be ' ...
+                'placed automatically in a batch.']);
+            continue
+        end
+        jobs{end+1} = job; %#ok<AGROW>
+    end
+    n_jobs = length(jobs);
+    simulationData = cell(1, n_jobs);
+    if n_jobs == 0
+        warning(['No rectangular scans found in ' job_dir]);
+        return
+    end
+
+    % Compile the mex files if any of the jobs ask for it
+    recompile = false;
+    for i_=1:n_jobs
+        recompile = recompile || jobs{i_}.recompile;
+    end
+    mexCompile(recompile);
+
+    %% Group the jobs by their geometry and import each geometry once
+    keys = cell(1, n_jobs);
+    for i_=1:n_jobs
+        keys{i_} = geometry_key(jobs{i_});
+    end
+    [group_keys, ~, job_group] = unique(keys, 'stable');
+    n_groups = length(group_keys);
+    scenes = cell(1, n_groups);
+    for i_=1:n_groups
+        first_job = jobs{find(job_group == i_, 1)};
+        scenes{i_} = import_scene(first_job);
+    end
+    fprintf('%i jobs sharing %i scene(s).\n', n_jobs, n_groups);
+
+    %% Set up each job and split its pixels into chunks
+    % Each row of work is [priority, job index, first pixel, last pixel], the
+    % pixels counting along the pixels of the job to be traced
+    setups = cell(1, n_jobs);
+    work = zeros(0, 4);
+    for i_=1:n_jobs
+        setups{i_} = setup_job(jobs{i_}, scenes{job_group(i_)});
+        N_pixels = length(setups{i_}.pixels);
+        starts = 1:chunk_size:N_pixels;
+        ends = min(starts + chunk_size - 1, N_pixels);
+        work = [work; repmat([jobs{i_}.priority, i_], length(starts), 1), ...
+            starts', ends']; %#ok<AGROW>
+    end
+    % Highest priority first, keeping the order of the files otherwise
+    [~, order] = sortrows([-work(:,1), work(:,2), work(:,3)]);
+    work = work(order,:);
+    n_work = size(work, 1);
+
+    chunks_left = accumarray(work(:,2), 1, [n_jobs, 1])';
+    for i_=1:n_jobs
+        setups{i_}.t_start = tic;
+    end
+
+    %% Trace all the chunks
+    if ~isOctave && isempty(gcp('nocreate'))
+        try
+            parpool;
+        catch
+            warning('Could not start a parallel pool, tracing in serial.');
+        end
+    end
+    if ~isOctave
+        pool = gcp('nocreate');
+    else
+        pool = [];
+    end
+
+    if ~isempty(pool)
+        % Send each scene to the workers once
+        scene_consts = cell(1, n_groups);
+        for i_=1:n_groups
+            scene_consts{i_} = parallel.pool.Constant(scenes{i_});
+        end
+
+        % The queue of the pool is first in first out so submitting in order
+        % of priority gives the order they are traced in
+        futures = parallel.FevalFuture.empty(0, n_work);
+        for i_=1:n_work
+            j_ = work(i_,2);
+            futures(i_) = parfeval(pool, @trace_chunk, 7, ...
+                scene_consts{job_group(j_)}, setups{j_}.tracing, ...
+                setups{j_}.pixels(work(i_,3):work(i_,4)));
+        end
+
+        for k_=1:n_work
+            [i_, cntr, killed, effuse_cntr, diagnostics, variance, features, ...
+                stopped] = fetchNext(futures);
+            j_ = work(i_,2);
+            [setups{j_}, chunks_left(j_)] = add_chunk(setups{j_}, ...
+                setups{j_}.pixels(work(i_,3):work(i_,4)), cntr, killed, ...
+                effuse_cntr, diagnostics, variance, features, stopped, ...
+                chunks_left(j_));
+            if chunks_left(j_) == 0
+                simulationData{j_} = finish_job(jobs{j_}, setups{j_}, ...
+                    scenes{job_group(j_)});
+            end
+        end
+    else
+        for i_=1:n_work
+            j_ = work(i_,2);
+            pixels = setups{j_}.pixels(work(i_,3):work(i_,4));
+            [cntr, killed, effuse_cntr, diagnostics, variance, features, ...
+                stopped] = trace_chunk(scenes{job_group(j_)}, setups{j_}.tracing, ...
+                pixels);
+            [setups{j_}, chunks_left(j_)] = add_chunk(setups{j_}, pixels, ...
+                cntr, killed, effuse_cntr, diagnostics, variance, features, ...
+                stopped, chunks_left(j_));
+            if chunks_left(j_) == 0
+                simulationData{j_} = finish_job(jobs{j_}, setups{j_}, ...
+                    scenes{job_group(j_)});
+            end
+        end
+    end
+end
+
+% A string identifying the sample and pinhole plate geometry of a job, jobs with
+% the same key can share the imported surfaces.
+function key = geometry_key(job)
+    key = sprintf('%s|%s|%g|%g|%g|%g|%s|%s|%i|%s|%s|%g|%i', job.sample_type, ...
+        job.sample_fname, job.square_size, job.dist_to_sample, job.sphere_r, ...
+        job.working_dist, job.pinhole_model, job.plate_accuracy, ...
+        job.n_detectors, mat2str(job.aperture_axes), mat2str(job.aperture_c), ...
+        job.circle_plate_r, job.plate_represent);
+    % The fine plate and the coarse meshes of the sample are part of the scene
+    key = [key '|' mat2str(job.plate_refine_regions) '|' ...
+        mat2str(job.options.mlmc_fractions)];
+    % As is everything else passed to sample_import
+    key = sprintf('%s|%i|%s', key, job.dontMeddle, job.sample_description);
+end
+
+% Imports the sample and the pinhole plate for a job, without plotting.
+function scene = import_scene(job)
+    sample_inputs.sample_type = job.sample_type;
+    sample_inputs.material = job.material;
+    sample_inputs.dist_to_sample = job.dist_to_sample;
+    sample_inputs.sample_description = job.sample_description;
+    sample_inputs.square_size = job.square_size;
+    sample_inputs.sample_fname = job.sample_fname;
+    sample_inputs.scale = job.scale;
+
+    pinhole_plate_inputs.pinhole_model = job.pinhole_model;
+    pinhole_plate_inputs.working_dist = job.working_dist;
+    pinhole_plate_inputs.plate_accuracy = job.plate_accuracy;
+    pinhole_plate_inputs.refine_regions = job.plate_refine_regions;
+    pinhole_plate_inputs.n_detectors = job.n_detectors;
+    pinhole_plate_inputs.plate_represent = job.plate_represent;
+    pinhole_plate_inputs.aperture_axes = job.aperture_axes;
+    pinhole_plate_inputs.aperture_c = job.aperture_c;
+    pinhole_plate_inputs.circle_plate_r = job.circle_plate_r;
+    pinhole_plate_inputs.aperture_theta = NaN;
+    pinhole_plate_inputs.aperture_phi = NaN;
+    pinhole_plate_inputs.aperture_half_cone = NaN;
+    if any(strcmp(job.pinhole_model, {'stl', 'new'}))
+        pinhole_plate_inputs.n_detectors = 1;
+        pinhole_plate_inputs.plate_represent = 1;
+    elseif strcmp(job.pinhole_model, 'circle')
+        pinhole_plate_inputs.n_detectors = 1;
+    end
+
+    sphere = Sphere(1, job.material, job.sphere_c, job.sphere_r);
+    [scene.sample_surface, scene.sphere] = sample_import(sample_inputs, ...
+        sphere, job.working_dist, job.dontMeddle, job.square_size);
+
+    % The same manipulation as in performScan.m
+    scene.sample_surface.reflect_axis('x');
+
+    % Coarse meshes of the sample for multilevel Monte Carlo
+    scene.mlmc_levels = {};
+    if ~isempty(job.options.mlmc_fractions)
+        if ~strcmp(job.pinhole_model, 'N circle')
+            error('Multilevel Monte Carlo needs the N circle pinhole model.');
+        end
+        scene.mlmc_levels = decimate_sample(scene.sample_surface, ...
+            job.options.mlmc_fractions);
+    end
+
+    [scene.pinhole_surface, scene.thePlate, ~, scene.plate_refine] = pinhole_import( ...
+        pinhole_plate_inputs, scene.sample_surface, false);
+end
+
+% Sets up the beams, raster pattern, output variables and results directory for
+% a job.
+function setup = setup_job(job, scene)
+    direct_beam.n = job.n_rays;
+    direct_beam.pinhole_c = job.pinhole_c;
+    direct_beam.pinhole_r = job.pinhole_r;
+    direct_beam.theta_max = job.theta_max;
+    direct_beam.source_model = job.source_model;
+    direct_beam.init_angle = job.init_angle;
+    direct_beam.sigma_source = job.sigma_source;
+
+    effuse_beam.n = job.n_effuse;
+    effuse_beam.pinhole_c = job.pinhole_c;
+    effuse_beam.pinhole_r = job.pinhole_r;
+    effuse_beam.cosine_n = job.cosine_n;
+
+    if job.init_angle_pattern
+        raster_pattern = generate_raster_pattern('raster_movment2D', ...
+            [job.pixel_seperation, job.pixel_seperation], 'xrange', ...
+            job.xrange, 'zrange', job.zrange, 'init_angle', job.init_angle);
+    else
+        raster_pattern = generate_raster_pattern('raster_movment2D', ...
+            [job.pixel_seperation, job.pixel_seperation], 'xrange', ...
+            job.xrange, 'zrange', job.zrange);
+    end
+
+    % The pixels to trace, as in performScan.m
+    options = job.options;
+    if options.subsample < 1
+        raster_pattern = subsample_raster_pattern(raster_pattern, ...
+            'fraction', options.subsample);
+    end
+    if ~strcmp(options.symmetry, 'none')
+        if ~strcmp(job.pinhole_model, 'N circle')
+            error('Symmetric scans need the N circle pinhole model.');
+        end
+        if ~isempty(options.material_map)
+            error('Scans of samples with a material map cannot be reduced by symmetry.');
+        end
+        raster_pattern = symmetric_raster_pattern(raster_pattern, ...
+            'symmetry', options.symmetry, 'sample', scene.sample_surface, ...
+            'plate', scene.thePlate, 'sphere', scene.sphere, ...
+            'direct_beam', direct_beam, 'effuse_beam', effuse_beam);
+    end
+    if isfield(raster_pattern, 'sampled')
+        setup.pixels = find(raster_pattern.sampled(:))';
+    elseif isfield(raster_pattern, 'symmetry')
+        setup.pixels = find(raster_pattern.symmetry.traced(:))';
+    else
+        setup.pixels = 1:raster_pattern.nx*raster_pattern.nz;
+    end
+
+    % Generate the source rays once for the whole scan
+    if job.ray_bank
+        direct_bank = makeRayBank('which_beam', job.source_model, 'beam', ...
+            direct_beam, 'stratified', job.stratify_bank);
+        effuse_bank = makeRayBank('which_beam', 'Effuse', 'beam', ...
+            effuse_beam, 'stratified', job.stratify_bank);
+    else
+        direct_bank = {};
+        effuse_bank = {};
+    end
+
+    % The parts of the job that are needed on the workers
+    setup.tracing.direct_beam = direct_beam;
+    setup.tracing.effuse_beam = effuse_beam;
+    setup.tracing.x_pattern = raster_pattern.x_pattern;
+    setup.tracing.z_pattern = raster_pattern.z_pattern;
+    setup.tracing.pinhole_model = job.pinhole_model;
+    setup.tracing.max_scatter = job.max_scatter;
+    setup.tracing.ray_model = job.ray_model;
+    setup.tracing.direct_bank = direct_bank;
+    setup.tracing.effuse_bank = effuse_bank;
+    setup.tracing.options = options;
+
+    setup.raster_pattern = raster_pattern;
+    setup.counters = zeros(job.max_scatter + 1, job.n_detectors, ...
+        raster_pattern.nz, raster_pattern.nx);
+    setup.effuse_counters = zeros(job.n_detectors, raster_pattern.nz, ...
+        raster_pattern.nx);
+    setup.num_killed = zeros(raster_pattern.nz, raster_pattern.nx);
+    setup.pixel_variance = zeros(job.n_detectors, raster_pattern.nz, ...
+        raster_pattern.nx);
+    setup.pixel_features = cell(raster_pattern.nz, raster_pattern.nx);
+    setup.pixel_diagnostics = cell(raster_pattern.nz, raster_pattern.nx);
+    setup.n_stopped = 0;
+
+    setup.thePath = simulationDir(job.directory_label);
+    if ~exist(setup.thePath, 'dir')
+        mkdir(setup.thePath)
+    end
+    copyfile(job.param_fname, setup.thePath)
+end
+
+% Traces a chunk of pixels from one job, runs on the workers. stopped marks the
+% pixels that options.time_budget stopped before all their rays were traced.
+function [cntr, killed, effuse_cntr, diagnostics, variance, features, stopped] = ...
+        trace_chunk(scene, tracing, pixels)
+    % Scenes on the workers are passed as a parallel.pool.Constant
+    if isa(scene, 'parallel.pool.Constant')
+        scene = scene.Value;
+    end
+
+    n = length(pixels);
+    cntr = cell(1, n);
+    killed = zeros(1, n);
+    effuse_cntr = cell(1, n);
+    diagnostics = cell(1, n);
+    variance = cell(1, n);
+    features = cell(1, n);
+    stopped = false(1, n);
+    % The fine model of a 'multires' plate and the coarse meshes of the sample
+    % are part of the shared scene
+    if ~isempty(scene.plate_refine)
+        tracing.options.plate_refine = scene.plate_refine;
+    end
+    if ~isempty(scene.mlmc_levels)
+        tracing.options.mlmc_levels = scene.mlmc_levels;
+    end
+    for i_=1:n
+        p_ = pixels(i_);
+        % The pixel index labels the USDT probes of the C code
+        tracing.options.pixel = p_;
+        [cntr{i_}, killed(i_), effuse_cntr{i_}, diagnostics{i_}, ...
+            variance{i_}, features{i_}, traced] = tracePixel( ...
+            'sample_surface', scene.sample_surface, 'sphere', scene.sphere, ...
+            'offset', [tracing.x_pattern(p_), tracing.z_pattern(p_)], ...
+            'pinhole_model', tracing.pinhole_model, ...
+            'pinhole_surface', scene.pinhole_surface, ...
+            'thePlate', scene.thePlate, 'max_scatter', tracing.max_scatter, ...
+            'ray_model', tracing.ray_model, ...
+            'direct_beam', tracing.direct_beam, ...
+            'effuse_beam', tracing.effuse_beam, ...
+            'direct_bank', tracing.direct_bank, ...
+            'effuse_bank', tracing.effuse_bank, ...
+            'options', tracing.options);
+        stopped(i_) = any(traced < [tracing.direct_beam.n, tracing.effuse_beam.n]);
+    end
+end
+
+% Puts the results of a chunk into the output variables of its job.
+function [setup, chunks_left] = add_chunk(setup, pixels, cntr, killed, ...
+        effuse_cntr, diagnostics, variance, features, stopped, chunks_left)
+    for i_=1:length(pixels)
+        setup.counters(:,:,pixels(i_)) = cntr{i_};
+        setup.num_killed(pixels(i_)) = killed(i_);
+        setup.effuse_counters(:,pixels(i_)) = effuse_cntr{i_}';
+        setup.pixel_variance(:,pixels(i_)) = variance{i_}';
+        setup.pixel_features{pixels(i_)} = features{i_};
+        if setup.tracing.options.diagnostics
+            setup.pixel_diagnostics{pixels(i_)} = diagnostics{i_};
+        end
+    end
+    setup.n_stopped = setup.n_stopped + sum(stopped);
+    chunks_left = chunks_left - 1;
+end
+
+% Creates the RectangleInfo of a finished job, saves the data and images.
+function simulationData = finish_job(job, setup, scene)
+    t = toc(setup.t_start);
+    fprintf('Finished %s in %f s\n', job.param_fname, t);
+    if setup.n_stopped > 0
+        fprintf(['%i pixels ran out of time before all their rays were ' ...
+            'traced, their counts are of fewer rays\n'], setup.n_stopped);
+    end
+
+    raster_pattern = setup.raster_pattern;
+    if isfield(raster_pattern, 'symmetry')
+        [setup.counters, setup.num_killed, setup.effuse_counters, ...
+            setup.pixel_variance, setup.pixel_features] = copy_symmetric_pixels( ...
+            raster_pattern.symmetry, setup.counters, setup.num_killed, ...
+            setup.effuse_counters, setup.pixel_variance, setup.pixel_features);
+    end
+
+    simulationData = RectangleInfo(setup.counters, setup.num_killed, ...
+        scene.sample_surface, setup.raster_pattern.xrange, ...
+        setup.raster_pattern.zrange, setup.raster_pattern.movement_x, ...
+        setup.raster_pattern.movement_z, setup.tracing.direct_beam.n, ...
+        setup.tracing.effuse_beam.n, t, 0, setup.effuse_counters, ...
+        job.n_detectors, job.max_scatter, job.dist_to_sample, ...
+        setup.tracing.direct_beam, setup.raster_pattern);
+
+    if strcmp(job.pinhole_model, 'N circle')
+        simulationData.addDetectorInfo(scene.thePlate.aperture_c, ...
+            scene.thePlate.aperture_axes)
+    end
+    simulationData.addVariance(setup.pixel_variance);
+    if ~any(cellfun(@isempty, setup.pixel_features(:)))
+        simulationData.addFeatures(setup.pixel_features);
+    end
+
+    % Reconstruct the images of a subsampled scan, or denoise them, as in
+    % rectangularScan
+    if isfield(raster_pattern, 'sampled')
+        simulationData.reconstruct();
+    elseif setup.tracing.options.denoise
+        simulationData.denoise();
+    end
+
+    save(fullfile(setup.thePath, 'scatteringData.mat'), 'simulationData', 'job');
+    simulationData.formatOutput(setup.thePath);
+    simulationData.produceImages(setup.thePath);
+
+    % Save the diagnostics of trapped rays if they were recorded
+    if setup.tracing.options.diagnostics
+        pixel_diagnostics = setup.pixel_diagnostics;
+        save(fullfile(setup.thePath, 'diagnostics.mat'), 'pixel_diagnostics');
+    end
+end
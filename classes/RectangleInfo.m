@@ -8,7 +8,10 @@
 %
 % PROPERTIES:
 %  counters         - Contains the number of detected rays that had undergone
-%                     1,2,3,4,etc. scatters for each pixel
+%                     1,2,3,4,etc. scatters for each pixel, as doubles so that
+%                     counts above 2^31 are exact (up to 2^53), max_scatter + 1
+%                     rows, the last (overflow) of the rays that scattered more
+%                     than max_scatter times, which only roulette lets through
 %  cntrSum          - A matrix of the number of all detected rays for each pixel
 %  counter_effusive - A matrix of the number of detected rays from the effuse
 %                     beam
@@ -24,6 +27,18 @@
 %  time             - the time in seconds the simulation took
 %  time_estimate    - the initial estimate of how long the simulation
 %                     would take, in seconds
+%  variance         - The estimated variance of cntrSum for each detector,
+%                     empty if it was not recorded
+%  denoised         - cntrSum after denoising (see denoise), empty if the
+%                     images have not been denoised
+%  denoised_variance - The variance of denoised
+%  features         - struct of the features of the first bounce of the direct
+%                     beam in each pixel (see addFeatures), empty if they were
+%                     not recorded
+%  reconstructed    - cntrSum reconstructed from the traced pixels of a
+%                     subsampled scan (see reconstruct), empty otherwise
+%  reconstruction_error - Estimated root mean square error of reconstructed
+%                     for each detector
 %
 % METHODS:
 %  TODO
@@ -53,6 +68,12 @@ classdef RectangleInfo < handle
         aperture_c;
         dist_to_sample;
         raster_pattern;
+        variance = {};
+        denoised = {};
+        denoised_variance = {};
+        features = [];
+        reconstructed = {};
+        reconstruction_error = [];
     end % End properties
     
     methods
@@ -72,7 +93,7 @@ classdef RectangleInfo < handle
                 obj.xrange = xrange;
                 obj.zrange = zrange;
                 for i_=1:obj.n_detector
-                    obj.counters{i_} = reshape(counters(:,i_,:,:), maxScatter, ...
+                    obj.counters{i_} = reshape(counters(:,i_,:,:), maxScatter + 1, ...
                         obj.nz_pixels, obj.nx_pixels);
                 end
                 obj.raster_movment_x = raster_movment_x;
@@ -165,10 +186,92 @@ classdef RectangleInfo < handle
             obj.aperture_axes = aperture_axes;
         end
         
+        function addVariance(obj, variance)
+        % Adds the estimated variance of the total counts of each pixel,
+        % variance is n_detector x nz x nx as gathered by rectangularScan.
+            for i_=1:obj.n_detector
+                obj.variance{i_} = reshape(variance(i_,:,:), obj.nz_pixels, ...
+                    obj.nx_pixels);
+            end
+        end
+
+        function addFeatures(obj, pixel_features)
+        % Adds the features of the first bounce of the direct beam of each
+        % pixel, pixel_features is a nz x nx cell array of the structs given
+        % by tracingMultiGenMex/tracingGenMex. They are stored as images:
+        %  depth    - nz x nx mean distance travelled to the first hit
+        %  normal   - nz x nx x 3 mean normal at the first hit
+        %  material - nz x nx x (n_materials + 1) fraction of the first hits
+        %             on each material, the last is the sphere
+        %  material_names - the names of the materials of material
+        %  frac_sample, frac_sphere, frac_miss - nz x nx fraction of the rays
+        %             whose first hit was the sample, the sphere or nothing
+            f = [pixel_features{:}];
+            sz = [obj.nz_pixels, obj.nx_pixels];
+            n_hit = reshape([f.frac_sample] + [f.frac_sphere], sz).* ...
+                reshape([f.n_rays], sz);
+            obj.features.depth = reshape([f.depth], sz);
+            obj.features.normal = reshape(vertcat(f.normal), [sz, 3]);
+            obj.features.material = reshape(vertcat(f.material_hist), ...
+                [sz, length(f(1).material_hist)])./max(n_hit, 1);
+            obj.features.material_names = f(1).material_names;
+            obj.features.frac_sample = reshape([f.frac_sample], sz);
+            obj.features.frac_sphere = reshape([f.frac_sphere], sz);
+            obj.features.frac_miss = reshape([f.frac_miss], sz);
+        end
+
+        function denoise(obj, varargin)
+        % Denoises the images of all the contributions of each detector using
+        % the variance of each pixel, keeping the raw images in cntrSum. See
+        % denoise_image for the options, which are passed on to it. If the
+        % features of the pixels were recorded and no guides are given the
+        % normal, depth and materials seen by each pixel guide the filter, so
+        % that pixels are not averaged across geometric or material edges.
+        %
+        % Calling syntax:
+        %  obj.denoise('name', value, ...)
+            if isempty(obj.variance)
+                error('The variance of the pixels is needed to denoise the images.');
+            end
+            if ~isempty(obj.features) && ~any(strcmp(varargin(1:2:end), 'guides'))
+                varargin = [varargin, {'guides', obj.featureGuides()}];
+            end
+            for i_=1:obj.n_detector
+                [obj.denoised{i_}, obj.denoised_variance{i_}] = denoise_image( ...
+                    obj.cntrSum{i_}, obj.variance{i_}, varargin{:});
+            end
+        end
+
+        function reconstruct(obj, varargin)
+        % Reconstructs the images of each detector of a subsampled scan, in
+        % which only the pixels in raster_pattern.sampled were traced (see
+        % subsample_raster_pattern), keeping the raw images in cntrSum. The
+        % variance of the pixels weights them if it was recorded, otherwise
+        % the counts are taken as Poisson distributed. See tv_reconstruct for
+        % the options, which are passed on to it.
+        %
+        % Calling syntax:
+        %  obj.reconstruct('name', value, ...)
+            if ~isfield(obj.raster_pattern, 'sampled')
+                error('Only a subsampled scan can be reconstructed.');
+            end
+            obj.reconstruction_error = zeros(1, obj.n_detector);
+            for i_=1:obj.n_detector
+                if isempty(obj.variance)
+                    variance = obj.cntrSum{i_};
+                else
+                    variance = obj.variance{i_};
+                end
+                [obj.reconstructed{i_}, obj.reconstruction_error(i_)] = ...
+                    tv_reconstruct(obj.cntrSum{i_}, obj.raster_pattern.sampled, ...
+                    variance, varargin{:});
+            end
+        end
+
         function maxScatter = getMaxScatter(obj)
         % Gets the maximum number of scattering events that were allowed in the
-        % simulation.
-            maxScatter = size(obj.counters{1}, 1);
+        % simulation, the last row of the counters is the overflow bin.
+            maxScatter = size(obj.counters{1}, 1) - 1;
         end
         
         function cnts = countScattering(obj, n, detector)
@@ -184,7 +287,8 @@ classdef RectangleInfo < handle
                 lims = n;
             elseif length(n) == 2
                 if n(2) == Inf
-                    lims = n(1):obj.getMaxScatter;
+                    % Including the overflow bin
+                    lims = n(1):(obj.getMaxScatter + 1);
                 else
                     lims = n(1):n(2);
                 end
@@ -742,6 +846,16 @@ classdef RectangleInfo < handle
                     title(['Detector ' num2str(i_)]);pause(0.1);
                     imwrite(I, [thePath '/noEffuse' num2str(i_) '.png']);
                 end
+                if ~isempty(obj.denoised)
+                    I = obj.generalImage('im', obj.denoised{i_}, 'scale', 'auto');
+                    title(['Detector ' num2str(i_) ', denoised']);pause(0.1);
+                    imwrite(I, [thePath '/denoised' num2str(i_) '.png']);
+                end
+                if ~isempty(obj.reconstructed)
+                    I = obj.generalImage('im', obj.reconstructed{i_}, 'scale', 'auto');
+                    title(['Detector ' num2str(i_) ', reconstructed']);pause(0.1);
+                    imwrite(I, [thePath '/reconstructed' num2str(i_) '.png']);
+                end
             end
 
             %obj.contourImage(30);
@@ -870,6 +984,18 @@ classdef RectangleInfo < handle
     end % End public methods
     
     methods (Access = private)
+        function guides = featureGuides(obj)
+        % The features as guides for denoise_image. Pixels that saw nothing
+        % have no depth or normal and are given 0. The depth is compared on
+        % the scale of a tenth of its range.
+            depth = obj.features.depth;
+            depth(isnan(depth)) = 0;
+            normal = obj.features.normal;
+            normal(isnan(normal)) = 0;
+            sigma_depth = max(0.1*(max(depth(:)) - min(depth(:))), eps);
+            guides = {normal, 0.2, depth, sigma_depth, obj.features.material, 0.3};
+        end
+
         function I = generalImage(obj, varargin)
         % A general image constructing function, not to be called directly.
         % This function is called by all the other image generating
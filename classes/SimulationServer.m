@@ -0,0 +1,331 @@
+% SimulationServer.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% A connection to the simulation server (server/shem_server.c). Scenes are
+% loaded into the server once and kept there with their surfaces set up, so
+% that pixels can be re-traced, e.g. after changing a material, without
+% setting the simulation up again. The messages are described in
+% server/protocol.h, the socket is handled by serverClientMex.
+%
+% EXAMPLE:
+%  srv = SimulationServer();
+%  srv.loadScene(1, sample, plate, sphere);
+%  res = srv.trace(1, beam, 'Uniform', 100, [xs(:), zs(:)]);
+%  srv.setMaterial(1, 'default', 'cosine', []);
+%  res2 = srv.trace(1, beam, 'Uniform', 100, [xs(:), zs(:)]);
+%
+% PROPERTIES:
+%  fd        - The connection to the server
+%  materials - A map from scene id to the names of the materials of the scene
+%  pending   - Replies received while waiting for another
+classdef SimulationServer < handle
+
+    properties (SetAccess = private)
+        fd
+        materials
+        pending     % Replies that arrived before they were waited for
+    end
+
+    properties (Constant)
+        PING = 1
+        LOAD_SCENE = 2
+        SET_MATERIAL = 3
+        TRACE = 4
+        CANCEL = 5
+        DROP_SCENE = 6
+        FIT = 7
+        ERROR = 65535
+        ERR_CANCELLED = 3
+    end
+
+    methods
+        function obj = SimulationServer(path)
+        % INPUTS:
+        %  path - Optional, the socket of the server, default
+        %         /tmp/shem_server.sock. Start the server with
+        %         server/bin/shem_server first.
+            if nargin == 0
+                path = '/tmp/shem_server.sock';
+            end
+            obj.fd = serverClientMex('connect', path);
+            obj.materials = containers.Map('KeyType', 'double', 'ValueType', 'any');
+            obj.pending = containers.Map('KeyType', 'double', 'ValueType', 'any');
+        end
+
+        function delete(obj)
+            if ~isempty(obj.fd)
+                serverClientMex('close', obj.fd);
+            end
+        end
+
+        function info = ping(obj)
+        % The number of worker threads, scenes and queued requests of the
+        % server and the bytes of memory it has allocated.
+            p = obj.request(obj.PING, uint8([]));
+            x = typecast(p(1:12), 'uint32');
+            info.n_threads = double(x(1));
+            info.n_scenes = double(x(2));
+            info.n_queued = double(x(3));
+            info.memory = typecast(p(13:20), 'double');
+        end
+
+        function t = loadScene(obj, id, sample, plate, sphere, back_wall)
+        % Load a scene into the server, replacing any with the same id.
+        %
+        % INPUTS:
+        %  id        - Integer id of the scene
+        %  sample    - TriagSurface of the sample
+        %  plate     - PinholeModel for a simple model of the plate, which
+        %              scatters with the first material of the sample, or a
+        %              TriagSurface of a CAD model of the plate
+        %  sphere    - Sphere
+        %  back_wall - Needed with a CAD plate, as for traceRaysGen
+        %
+        % OUTPUTS:
+        %  t - The time taken by the server to set up the scene (s)
+            names = sample.materials.keys;
+            if isa(plate, 'TriagSurface')
+                plate_names = plate.materials.keys;
+                names = [names, plate_names(~ismember(plate_names, names))];
+            end
+            % The sphere is given a material of its own
+            names{end+1} = 'sphere';
+            mats = cell(1, length(names));
+            for i_=1:length(names)-1
+                if sample.materials.isKey(names{i_})
+                    mats{i_} = sample.materials(names{i_});
+                else
+                    mats{i_} = plate.materials(names{i_});
+                end
+            end
+            mats{end} = sphere.material;
+
+            p = [u32(id), u32(length(names))];
+            for i_=1:length(names)
+                p = [p, str(names{i_}), str(mats{i_}.function), ...
+                    u32(length(mats{i_}.params)), f64(mats{i_}.params)]; %#ok<AGROW>
+            end
+            p = [p, surface(sample, names)];
+            if isa(plate, 'TriagSurface')
+                p = [p, u32(1), surface(plate, names), f64(back_wall)];
+            else
+                s = plate.to_struct();
+                p = [p, u32(2), i32(s.n_detectors), f64(s.circle_plate_r), ...
+                    i32(s.plate_represent), f64(s.aperture_c), f64(s.aperture_axes)];
+            end
+            p = [p, i32(sphere.make), f64(sphere.centre), f64(sphere.radius), ...
+                u32(length(names) - 1)];
+
+            t = typecast(obj.request(obj.LOAD_SCENE, p), 'double');
+            obj.materials(id) = names;
+        end
+
+        function setMaterial(obj, id, name, func, params)
+        % Change the scattering distribution of a material of a scene.
+            idx = find(strcmp(obj.materials(id), name)) - 1;
+            if isempty(idx)
+                error(['Material ' name ' is not in scene ' num2str(id)]);
+            end
+            obj.request(obj.SET_MATERIAL, [u32(id), u32(idx), str(func), ...
+                u32(length(params)), f64(params)]);
+        end
+
+        function rid = submitTrace(obj, id, beam, which_beam, max_scatter, offsets, seed)
+        % Submit a trace without waiting for it, see traceResult.
+        %
+        % INPUTS:
+        %  id          - The scene
+        %  beam, which_beam - As for traceSimpleMultiGen, beam.n rays are
+        %                traced for each pixel
+        %  max_scatter - The maximum allowed scattering events
+        %  offsets     - n_pixels x 2 scan positions [x, z], or n_pixels x 3
+        %                translations of the sample
+        %  seed        - Optional, seed of the random numbers
+            if nargin < 7
+                seed = randi(2^31);
+            end
+            rid = obj.send(obj.TRACE, trace_payload(id, beam, which_beam, ...
+                max_scatter, offsets, seed));
+        end
+
+        function res = traceResult(obj, rid)
+        % Wait for a trace. res has the fields counted (n_pixels x n_detect),
+        % killed (n_pixels x 1) and numScattersRay
+        % (max_scatter + 1 x n_detect x n_pixels, the last the overflow bin, see
+        % traceSimpleMultiGen).
+            p = obj.wait(rid);
+            hdr = typecast(p(1:12), 'uint32');
+            n_pixels = double(hdr(1));
+            n_detect = double(hdr(2));
+            max_scatter = double(typecast(p(9:12), 'int32'));
+            data = reshape(typecast(p(13:end), 'double'), [], n_pixels);
+            res.killed = data(1,:)';
+            res.counted = data(2:1+n_detect,:)';
+            res.numScattersRay = reshape(data(2+n_detect:end,:), max_scatter + 1, ...
+                n_detect, n_pixels);
+        end
+
+        function res = trace(obj, varargin)
+            res = obj.traceResult(obj.submitTrace(varargin{:}));
+        end
+
+        function rid = submitFit(obj, id, beam, which_beam, max_scatter, ...
+                offsets, measured, detector, params, max_evals, tolerance, seed)
+        % Submit a fit of parameters of the materials of a scene with a circle
+        % plate to a measured image without waiting for it, see fitResult. The
+        % materials of the scene are not changed.
+        %
+        % INPUTS:
+        %  id, beam, which_beam, max_scatter, offsets - As for submitTrace
+        %  measured  - The measured counts of each pixel, in any units
+        %  detector  - The detector measured, from 1, or 0 for their sum
+        %  params    - Struct array of the parameters to fit, with the fields
+        %              material (name), param (index into its params, from 1),
+        %              start, lower and upper (finite bounds)
+        %  max_evals - The most images to trace
+        %  tolerance - Relative change in the loss or the parameters at which
+        %              to stop
+        %  seed      - Optional, seed of the random numbers, the same for
+        %              every image
+            if nargin < 12
+                seed = randi(2^31);
+            end
+            p = [trace_payload(id, beam, which_beam, max_scatter, offsets, seed), ...
+                u32(detector), f64(measured), u32(length(params))];
+            for i_=1:length(params)
+                idx = find(strcmp(obj.materials(id), params(i_).material)) - 1;
+                if isempty(idx)
+                    error(['Material ' params(i_).material ' is not in scene ' ...
+                        num2str(id)]);
+                end
+                p = [p, u32(idx), u32(params(i_).param - 1), ...
+                    f64([params(i_).start, params(i_).lower, params(i_).upper])]; %#ok<AGROW>
+            end
+            p = [p, u32(max_evals), f64(tolerance)];
+            rid = obj.send(obj.FIT, p);
+        end
+
+        function res = fitResult(obj, rid)
+        % Wait for a fit. res has the fields params (the best parameters, in
+        % the order given), loss (the sum of squared residuals), scale (of
+        % the counts to the measurements) and history (n_evals x n_params+1,
+        % the parameters and loss of each image traced).
+            p = obj.wait(rid);
+            hdr = double(typecast(p(1:8), 'uint32'));
+            n_evals = hdr(1);
+            n_fit = hdr(2);
+            data = typecast(p(9:end), 'double');
+            res.loss = data(1);
+            res.scale = data(2);
+            res.params = data(3:2+n_fit);
+            res.history = reshape(data(3+n_fit:end), n_fit + 1, n_evals)';
+        end
+
+        function res = fit(obj, varargin)
+            res = obj.fitResult(obj.submitFit(varargin{:}));
+        end
+
+        function state = cancel(obj, rid)
+        % Cancel a trace or a fit, 0 if it was not found, 1 if it was queued, 2 if it
+        % was running. Waiting for the trace then gives an error.
+            state = double(typecast(obj.request(obj.CANCEL, u32(rid)), 'uint32'));
+        end
+
+        function dropScene(obj, id)
+            obj.request(obj.DROP_SCENE, u32(id));
+            obj.materials.remove(id);
+        end
+    end
+
+    methods (Access = private)
+        function rid = send(obj, type, payload)
+            rid = randi(2^32 - 1);
+            serverClientMex('send', obj.fd, type, rid, payload);
+        end
+
+        function payload = wait(obj, rid)
+        % The server answers out of order, replies to other requests are kept
+        % until they are asked for.
+            while ~obj.pending.isKey(rid)
+                [type, id, p] = serverClientMex('recv', obj.fd);
+                obj.pending(id) = {type, p};
+            end
+            reply = obj.pending(rid);
+            obj.pending.remove(rid);
+            payload = reply{2};
+            if reply{1} == obj.ERROR
+                code = typecast(payload(1:4), 'int32');
+                msg = char(payload(9:end));
+                if code == obj.ERR_CANCELLED
+                    error('AtomRayTracing:SimulationServer:cancelled', msg);
+                end
+                error('AtomRayTracing:SimulationServer:error', msg);
+            end
+        end
+
+        function payload = request(obj, type, payload)
+            payload = obj.wait(obj.send(type, payload));
+        end
+    end
+end
+
+% The scene, source and pixels of a TRACE or FIT request
+function p = trace_payload(id, beam, which_beam, max_scatter, offsets, seed)
+    switch which_beam
+        case 'Uniform'
+            source_model = 0;
+            theta_max = beam.theta_max;
+            sigma_source = 0;
+            init_angle = pi*beam.init_angle/180;
+        case 'Gaussian'
+            source_model = 1;
+            theta_max = 0;
+            init_angle = pi*beam.init_angle/180;
+            sigma_source = beam.sigma_source;
+        case 'Effuse'
+            source_model = 2;
+            theta_max = 0;
+            sigma_source = 0;
+            init_angle = 0;
+    end
+    source_parameters = [beam.pinhole_r, ...
+        beam.pinhole_c(1), beam.pinhole_c(2), beam.pinhole_c(3), ...
+        theta_max, init_angle, sigma_source];
+    if size(offsets, 2) == 2
+        offsets = [offsets(:,1), zeros(size(offsets, 1), 1), offsets(:,2)];
+    end
+
+    p = [u32(id), typecast(uint64(seed), 'uint8'), ...
+        typecast(int64(beam.n), 'uint8'), i32(max_scatter), ...
+        i32(source_model), f64(source_parameters), ...
+        u32(size(offsets, 1)), f64(offsets')];
+end
+
+function b = u32(x)
+    b = typecast(uint32(x(:)'), 'uint8');
+end
+
+function b = i32(x)
+    b = typecast(int32(x(:)'), 'uint8');
+end
+
+function b = f64(x)
+    b = typecast(double(x(:)'), 'uint8');
+end
+
+function b = str(s)
+    b = [u32(length(s)), uint8(s)];
+end
+
+% The vertices, faces, normals and material index of each face of a surface
+function b = surface(surf, names)
+    [~, mat] = ismember(surf.compositions, names);
+    V = surf.vertices';
+    F = surf.faces';
+    N = surf.normals';
+    b = [u32(surf.nVertices), u32(surf.nTriag), f64(V), i32(F), f64(N), u32(mat - 1)];
+end
@@ -0,0 +1,189 @@
+% VoxelSurface.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Contains a sample given as a grid of cubic voxels, e.g. a volume from X-ray
+% tomography, that is traced directly in C rather than as a triangulation (see
+% atom_ray_tracing_library/voxel.h). Each voxel holds the index of the material
+% filling it, 0 for empty. Can be used in place of a TriagSurface for the
+% sample with the 'N circle' model of the pinhole plate.
+%
+% PROPERTIES:
+%  ids            - nx x ny x nz uint8 array of the material of each voxel, 0
+%                   for empty and m for material_names{m}
+%  origin         - 1x3, the low corner of voxel (1, 1, 1)
+%  voxel_size     - The edge length of the voxels
+%  material_names - Cell array of the names of the materials in the voxels
+%  materials      - A map from material names to their properties:
+%                   color, scattering function and its parameters
+%  brick_size     - The edge of the bricks of the sparse grid in voxels, 1 for
+%                   a dense grid
+%  normal_radius  - The radius in voxels the normals are smoothed over
+classdef VoxelSurface < handle
+
+    properties (SetAccess = private)
+        ids             % Material of each voxel
+        origin          % Low corner of the grid
+        voxel_size      % Edge length of the voxels
+        material_names  % Name of the material of each index
+        materials       % The material library
+    end % End properties
+
+    properties
+        brick_size = 8      % Edge of the bricks in voxels
+        normal_radius = 2   % Radius in voxels the normals are smoothed over
+    end
+
+    methods
+        function obj = VoxelSurface(ids, origin, voxel_size, material_names, materials)
+        % Constructor for VoxelSurface class. Can be called with 0 or 5
+        % arguments. 0 arguments creats an empty object.
+        %
+        % INPUTS:
+        %  ids            - The material index of each voxel, 0 for empty.
+        %  origin         - The low corner of the grid [x y z].
+        %  voxel_size     - The edge length of the voxels.
+        %  material_names - The name of the material of each index.
+        %  materials      - the materials library
+        %
+        % OUTPUT:
+        %  obj - A VoxelSurface object that contains the sample.
+            if (nargin == 0)
+                % Default, creates an empty object
+            elseif (nargin == 5)
+                if ndims(ids) > 3
+                    error('The voxels must be a 3D array')
+                end
+                if ~isequal(size(origin), [1 3])
+                    error('The origin of the voxels must be [x y z]')
+                end
+                if max(ids(:)) > length(material_names)
+                    error('Each voxel index must name a material')
+                end
+                for idx = 1:length(material_names)
+                    if ~isKey(materials, material_names{idx})
+                        error(['Material ' material_names{idx} ' is not in the library'])
+                    end
+                end
+                obj.ids = uint8(ids);
+                obj.origin = origin;
+                obj.voxel_size = voxel_size;
+                obj.material_names = material_names;
+                obj.materials = materials;
+            else
+                error('Wrong number of input arguments');
+            end
+        end % End constructor
+
+        function newobj = copy(obj)
+        % Copys the object and returns the copy.
+            newobj = VoxelSurface(obj.ids, obj.origin, obj.voxel_size, ...
+                                  obj.material_names, obj.materials);
+            newobj.brick_size = obj.brick_size;
+            newobj.normal_radius = obj.normal_radius;
+        end % End copy method
+
+        function moveBy(obj, x)
+        % Moves the VoxelSurface object by the specidfed amount.
+        %
+        % INPUT:
+        %  x - a 3 element row vector
+            if ~isequal(size(x), [1 3])
+                error(['Can only move a sample by an amount [x y z]. ' x ' is invalid'])
+            end
+            obj.origin = obj.origin + x;
+        end % End move function
+
+        function reflect_axis(obj, axis_name)
+            % reflect the coordinates on one axis
+            % axis_name should be 'x', 'y' or 'z'
+            switch axis_name
+            case 'x'
+                idx = 1;
+            case 'y'
+                idx = 2;
+            case 'z'
+                idx = 3;
+            otherwise
+                error('Axis name must be x, y or z');
+            end
+
+            % The far corner becomes the low corner
+            obj.origin(idx) = -(obj.origin(idx) + size(obj.ids, idx)*obj.voxel_size);
+            obj.ids = flip(obj.ids, idx);
+        end
+
+        function options = to_options(obj, options)
+        % Adds the fields that pass the voxels to C to a struct of simulation
+        % options, see tracingMultiGenMex.
+            options.voxel_ids = obj.ids;
+            options.voxel_origin = obj.origin;
+            options.voxel_size = obj.voxel_size;
+            options.voxel_brick = obj.brick_size;
+            options.voxel_normal_radius = obj.normal_radius;
+        end
+
+        function patchPlot(obj, new_fig, fname)
+        % Produces a plot of the isosurface of the voxels of each material, if
+        % a file name is provided then the plot is saved to that file.
+        %
+        % INPUTS:
+        %  new_fig - bool, true => make a new figure, false => overlay on last
+        %            used. If not provided defaults to true.
+        %  fname   - file to save the figure to, if this is not provided then
+        %            the figure is not saved
+            if nargin == 1
+                new_fig = true;
+            end
+
+            if new_fig
+                figure
+            end
+
+            % Coordinates of the voxel centres, isosurface takes y then x
+            sz = [size(obj.ids), 1, 1];
+            h = obj.voxel_size;
+            xs = obj.origin(1) + ((1:sz(1)) - 0.5)*h;
+            ys = obj.origin(2) + ((1:sz(2)) - 0.5)*h;
+            zs = obj.origin(3) + ((1:sz(3)) - 0.5)*h;
+            [X, Y, Z] = meshgrid(xs, ys, zs);
+
+            for idx = 1:length(obj.material_names)
+                occupied = permute(double(obj.ids == idx), [2 1 3]);
+                if ~any(occupied(:))
+                    continue
+                end
+                C = obj.materials(obj.material_names{idx});
+                patch(isosurface(X, Y, Z, occupied, 0.5), 'FaceColor', C.color, ...
+                  'EdgeColor',       'none',        ...
+                  'FaceLighting',    'gouraud',     ...
+                  'AmbientStrength', 0.15);
+            end
+
+            % Add a camera light, and tone down the specular highlighting
+            if ~new_fig
+                camlight('headlight');
+            end
+            material('dull');
+
+            % Fix the axes scaling, and set a nice view angle
+            axis('image');
+            xlabel('x/mm')
+            ylabel('y/mm')
+            zlabel('z/mm')
+            view([-5 5 5]);
+
+            if nargin > 2
+                saveas(gcf, fname, 'epsc');
+            end
+        end % End plotting function.
+
+        function delete(obj)
+            delete(obj);
+        end % End delete function
+    end % End methods
+
+end % End classdef
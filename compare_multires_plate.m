@@ -0,0 +1,101 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Script for comparing the multi-resolution ('multires') model of the CAD
+% pinhole plate with the 'high' accuracy plate, which is used as the baseline,
+% and the 'low' accuracy plate. A single pixel over a flat sample is simulated
+% several times with each plate and the number of detected rays, the error
+% relative to the baseline and the time taken are reported. The error of the
+% 'multires' plate should be comparable to the statistical error if the refine
+% regions cover the parts of the plate the detected rays interact with.
+
+%% Parameters
+
+% The number of rays per simulation and the number of repeats of each
+% simulation
+n_rays = 1e5;
+n_repeats = 5;
+
+% The refine regions, n x 4 [x y z r] (mm), see performScan.m
+depth = (0:2:14)';
+refine_regions = [-2.12 - depth, depth, 0*depth, 3 + 0*depth; ...
+                   2.12 + depth, depth, 0*depth, 3 + 0*depth];
+
+% Geometry and source, as in performScan.m
+working_dist = 2.121;
+init_angle = 45;
+dist_to_sample = 1;
+square_size = 10;
+max_scatter = 20;
+direct_beam.n = n_rays;
+direct_beam.pinhole_c = [-working_dist*tand(init_angle), 0, 0];
+direct_beam.pinhole_r = 0.001;
+direct_beam.init_angle = init_angle;
+direct_beam.sigma_source = 0.0005;
+
+% Should the mex files be recompiled
+recompile = false;
+
+%% Set up the sample and the three plates
+
+loadpath
+mexCompile(recompile);
+
+defMaterial.function = 'cosine';
+defMaterial.params = 0;
+defMaterial.color = [0.8 0.8 1.0];
+
+sample_inputs.sample_type = 'flat';
+sample_inputs.material = defMaterial;
+sample_inputs.dist_to_sample = dist_to_sample;
+[sample_surface, sphere] = sample_import(sample_inputs, ...
+    Sphere(0, defMaterial), working_dist, false, square_size);
+sample_surface.reflect_axis('x');
+
+pinhole_plate_inputs.pinhole_model = 'stl';
+pinhole_plate_inputs.working_dist = working_dist;
+pinhole_plate_inputs.refine_regions = refine_regions;
+
+plate_names = {'high', 'multires', 'low'};
+plates = cell(1, 3);
+refines = cell(1, 3);
+for i_=1:3
+    pinhole_plate_inputs.plate_accuracy = plate_names{i_};
+    [plates{i_}, ~, ~, refines{i_}] = pinhole_import(pinhole_plate_inputs, ...
+        sample_surface, false);
+end
+
+%% Simulate
+
+cntr = zeros(3, n_repeats);
+times = zeros(3, n_repeats);
+for i_=1:3
+    options = struct();
+    if ~isempty(refines{i_})
+        options.plate_refine = refines{i_};
+    end
+    for j_=1:n_repeats
+        tic
+        cntr(i_, j_) = traceRaysGen('sample', sample_surface, 'max_scatter', ...
+            max_scatter, 'plate', plates{i_}, 'sphere', sphere, 'source', ...
+            'Gaussian', 'beam', direct_beam, 'options', options);
+        times(i_, j_) = toc;
+    end
+end
+
+%% Report
+
+% The statistical error of the baseline, the standard error of the mean
+baseline = mean(cntr(1,:));
+baseline_err = std(cntr(1,:))/sqrt(n_repeats);
+
+fprintf('%-10s %12s %12s %12s %10s\n', 'plate', 'detected', 'rel. error', ...
+    'stat. error', 'time (s)');
+for i_=1:3
+    fprintf('%-10s %12.1f %12.4f %12.4f %10.2f\n', plate_names{i_}, ...
+        mean(cntr(i_,:)), (mean(cntr(i_,:)) - baseline)/baseline, ...
+        sqrt(baseline_err^2 + var(cntr(i_,:))/n_repeats)/baseline, ...
+        mean(times(i_,:)));
+end
@@ -54,14 +54,14 @@ function outData = combineRectangle(data1, data2)
         counters{i_} = data1.counters{i_} + data2.counters{i_};
         cntr_effuse{i_} = data1.counter_effusive{i_} + data2.counter_effusive{i_};
     end
-    maxScatter = size(data1.counters{1}, 1);
+    maxScatter = data1.getMaxScatter;
     num_killed = data1.num_killed + data2.num_killed;
     
     % The RectangleInfo constructor function expects multi dimensional arrays
     % not cell array... do some data jiggery pokery
     % NOTE: something is wrong with the array shaping, we only get data out for
     % the first detector
-    counters2 = zeros(maxScatter, data1.n_detector, data1.nz_pixels, data1.nx_pixels);
+    counters2 = zeros(maxScatter + 1, data1.n_detector, data1.nz_pixels, data1.nx_pixels);
     effuse_counters = zeros(data1.n_detector, data1.nz_pixels, data1.nx_pixels);
     for i_=1:data1.n_detector
         counters2(:,i_,:,:) = counters{i_};
@@ -0,0 +1,45 @@
+% copy_symmetric_pixels.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Fills in the pixels of a symmetric scan that were not traced by copying them
+% from their images, with the detectors permuted and the normals of the features
+% reflected (see symmetric_raster_pattern). Used by rectangularScan and
+% batchScan.
+%
+% Calling syntax:
+%  [counters, num_killed, effuse_counters, pixel_variance, pixel_features] = ...
+%      copy_symmetric_pixels(symmetry, counters, num_killed, effuse_counters, ...
+%      pixel_variance, pixel_features)
+%
+% INPUTS:
+%  symmetry        - the symmetry field of the raster pattern
+%  counters        - max_scatter + 1 x n_detectors x nz x nx counts of the pixels
+%  num_killed      - nz x nx number of killed rays
+%  effuse_counters - n_detectors x nz x nx counts of the effuse beam
+%  pixel_variance  - n_detectors x nz x nx variance of the pixels
+%  pixel_features  - nz x nx cell array of the features of the pixels, the
+%                    empty ones are not copied
+%
+% OUTPUTS:
+%  The same, with the pixels that were not traced filled in
+function [counters, num_killed, effuse_counters, pixel_variance, pixel_features] = ...
+        copy_symmetric_pixels(symmetry, counters, num_killed, effuse_counters, ...
+        pixel_variance, pixel_features)
+    for i_=find(~symmetry.traced(:))'
+        s_ = symmetry.image_of(i_);
+        perm = symmetry.detector_perm(:,i_);
+        counters(:,:,i_) = counters(:,perm,s_);
+        num_killed(i_) = num_killed(s_);
+        effuse_counters(:,i_) = effuse_counters(perm,s_);
+        pixel_variance(:,i_) = pixel_variance(perm,s_);
+        if ~isempty(pixel_features{s_})
+            features = pixel_features{s_};
+            features.normal = features.normal.*symmetry.normal_sign(i_,:);
+            pixel_features{i_} = features;
+        end
+    end
+end
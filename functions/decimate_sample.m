@@ -0,0 +1,56 @@
+% decimate_sample.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Makes coarse meshes of a sample for multilevel Monte Carlo (see
+% atom_ray_tracing_library/multilevel.h) by reducing the number of its faces
+% with reducepatch. Each face of a coarse mesh takes the material of the
+% nearest face of the sample, and its normal points the same side.
+%
+% Calling syntax:
+%  levels = decimate_sample(sample_surface, fractions)
+%
+% INPUTS:
+%  sample_surface - TriagSurface of the sample, in place
+%  fractions      - The fraction of the faces of the sample to keep in each
+%                   coarse mesh, each in (0, 1)
+%
+% OUTPUTS:
+%  levels - Cell array of the TriagSurfaces of the coarse meshes, coarsest
+%           first
+function levels = decimate_sample(sample_surface, fractions)
+
+    if any(fractions <= 0 | fractions >= 1)
+        error('The fractions of the faces to keep must be in (0, 1).');
+    end
+    fractions = sort(fractions);
+
+    V0 = sample_surface.vertices;
+    F0 = sample_surface.faces;
+    centres = (V0(F0(:,1),:) + V0(F0(:,2),:) + V0(F0(:,3),:))/3;
+
+    levels = cell(1, length(fractions));
+    for i_=1:length(fractions)
+        [F, V] = reducepatch(F0, V0, fractions(i_));
+
+        % Drop the faces reducing the mesh collapsed
+        N = cross(V(F(:,2),:) - V(F(:,1),:), V(F(:,3),:) - V(F(:,1),:), 2);
+        area = sqrt(sum(N.^2, 2));
+        keep = area > 0;
+        F = F(keep,:);
+        N = N(keep,:)./area(keep);
+
+        % Material and side of the nearest face of the sample
+        c = (V(F(:,1),:) + V(F(:,2),:) + V(F(:,3),:))/3;
+        nearest = dsearchn(centres, c);
+        flip = sum(N.*sample_surface.normals(nearest,:), 2) < 0;
+        N(flip,:) = -N(flip,:);
+        C = sample_surface.compositions(nearest);
+
+        levels{i_} = TriagSurface(V, F, N, C(:), sample_surface.materials);
+        fprintf('Level %i of the sample: %i faces\n', i_, size(F, 1));
+    end
+end
@@ -0,0 +1,156 @@
+% default_parameters.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% The simulation parameters that are not in the parameter file, along with the
+% extra options passed to C (sim_options) and what each of them does. Both
+% performScan.m and read_job_parameters.m (for batchScan.m) take them from here
+% so that a single scan and a batch of scans are simulated the same way, change
+% them here.
+%
+% Calling syntax:
+%  defaults = default_parameters()
+%
+% OUTPUT:
+%  defaults - struct of the parameters, with the fields max_scatter, ray_model,
+%             ray_bank, stratify_bank, sim_options, cosine_n, plate_accuracy,
+%             plate_refine_regions, circle_plate_r, plate_represent, scale and
+%             material
+function defaults = default_parameters()
+    % The maximum number of sample scatters per ray. There is a hard-coded total
+    % maximum number of scattering events of 1000 (sample and pinhole plate). Making
+    % this uneccaserily large will increase the memory requirments of the
+    % simulation.
+    defaults.max_scatter = 20;
+
+    % Do we want to generate rays in Matlab (more flexibility, more output options)
+    % or in C (much lower memory requirments and slightly faster), 'C' or 'MATLAB'
+    % In general stick to 'C' unless your own source model is being used
+    defaults.ray_model = 'MATLAB';
+
+    % Generate one bank of source rays for a scan and use it for every pixel. The
+    % pixels then share the same source rays, which reduces pixel to pixel noise
+    % and removes the cost of generating rays for each pixel. The bank can be
+    % stratified (Latin hypercube samples of the source). The bank is traced as given
+    % rays, with roulette and batches but without the options that need the rays
+    % to be generated in C (see sim_options below).
+    defaults.ray_bank = false;
+    defaults.stratify_bank = true;
+
+    % Extra options for the simulation in C. The estimators, the diagnostics and the
+    % time budget need the rays to be generated in C ('C' ray_model and no ray
+    % bank), setting them with given rays is an error.
+    %  Russian roulette termination of long paths, 'N circle' pinhole plate only:
+    %  after roulette_start scattering events rays survive each further
+    %  scattering event with a probability tied to their expected contribution,
+    %  the solid angle of the apertures they can see times their weight, and
+    %  carry a compensating weight. roulette_survival is the least probability.
+    %  This removes the bias of killing rays after max_scatter sample scattering
+    %  events, only a safety limit of 1000 scattering events in total remains,
+    %  and rays detected after more than max_scatter sample scattering events
+    %  are counted in the last (overflow) row of the histograms of scattering
+    %  events. roulette_start = 0 turns it off.
+    defaults.sim_options.roulette_start = 0;
+    defaults.sim_options.roulette_survival = 0.5;
+    %  Bidirectional estimator, 'N circle' pinhole plate only: each ray from the
+    %  source is joined to paths traced back from the apertures, which counts deep
+    %  trenches and holes far more efficiently. Cannot be used with roulette or the
+    %  diagnostics.
+    defaults.sim_options.bidirectional = false;
+    %  Metropolis sampling of the detected paths: chains of detected paths, started
+    %  from a short forward run, explore nearby paths by perturbing the random
+    %  numbers that made them. The forward run and the chains' large steps give the
+    %  total counts, the chains split them between detectors and numbers of
+    %  scattering events. Cannot be used with roulette, bidirectional or the
+    %  diagnostics. mlt_forward, mlt_mutations, mlt_chains and mlt_large_step may
+    %  also be set, see tracingMultiGenMex.
+    defaults.sim_options.metropolis = false;
+    %  Diagnostics of trapped rays: the paths of rays with at least diag_bounces
+    %  scattering events or taking at least diag_time seconds are recorded (up to
+    %  diag_capacity paths of diag_max_path vertices per pixel) along with a
+    %  histogram of the time per ray, saved to diagnostics.mat.
+    defaults.sim_options.diagnostics = false;
+    defaults.sim_options.diag_bounces = 20;
+    defaults.sim_options.diag_time = 0;
+    defaults.sim_options.diag_capacity = 100;
+    defaults.sim_options.diag_max_path = 64;
+    %  Hierarchies of the triangulated surfaces: bvh_treelet restructures them,
+    %  which takes longer to build but is quicker to trace on large meshes, and
+    %  bvh_report prints their build time and traversal cost for each pixel.
+    defaults.sim_options.bvh_treelet = false;
+    defaults.sim_options.bvh_report = false;
+    %  Smooth normals of the sample: with smooth_normals > 0 the normal at a hit is
+    %  interpolated from normals at the vertices of the triangle, averaged over the
+    %  triangles meeting there, except across edges sharper than smooth_normals
+    %  degrees. Curved samples can then be meshed far more coarsely. Cannot be used
+    %  with bidirectional.
+    defaults.sim_options.smooth_normals = 0;
+    %  Memory budget in bytes for each pixel, 0 for none. The simulation stops with
+    %  an error before allocating more than this, see MemoryAccount.
+    defaults.sim_options.mem_budget = 0;
+    %  Denoising of rectangular scans: the rays of each pixel are traced in
+    %  n_batches batches to estimate the variance of each pixel (with 1 the counts
+    %  are taken as Poisson distributed) and if denoise is true the images are
+    %  also denoised, guided by the variance, and saved as denoised<n>.png.
+    defaults.sim_options.n_batches = 8;
+    defaults.sim_options.denoise = false;
+    %  Subsampled rectangular scans: with subsample < 1 only that fraction of the
+    %  pixels, a blue noise random subset, is traced and the images are
+    %  reconstructed from them with a total variation prior, saved as
+    %  reconstructed<n>.png along with an estimate of their error.
+    defaults.sim_options.subsample = 1;
+    %  Symmetric rectangular scans: 'auto' traces only a fundamental domain of the
+    %  scan if the sample, the sphere, the beams, the apertures and the raster are
+    %  symmetric under mirrors in x or z or a rotation by 180 degrees, and copies
+    %  the other pixels. 'mirror_x', 'mirror_z', 'rotate' or 'mirror_xz' demand that
+    %  symmetry, 'none' traces every pixel. Only with the 'N circle' pinhole model.
+    defaults.sim_options.symmetry = 'none';
+    %  Multilevel Monte Carlo, 'N circle' pinhole plate only: with mlmc_fractions,
+    %  e.g. [0.01 0.1], coarse meshes keeping those fractions of the faces of the
+    %  sample are made and most rays are traced on them, with few rays traced on
+    %  both successive meshes to correct the counts to those of the sample.
+    %  mlmc_report prints the variance and cost of each level and the expected
+    %  speedup, below 1 the sample is better traced alone. Cannot be used with
+    %  bidirectional or metropolis.
+    defaults.sim_options.mlmc_fractions = [];
+    defaults.sim_options.mlmc_report = false;
+    %  Material map, 'N circle' pinhole plate only: a pattern of materials (stripes,
+    %  a checkerboard or an image) projected onto the sample, which then needs no
+    %  faces along the boundaries between its materials, see materialMapOptions.
+    %  Cannot be used with bidirectional or reduced by symmetry.
+    defaults.sim_options.material_map = [];
+
+    % Exponant of the cosine in the effuse beam model
+    defaults.cosine_n = 1;
+
+    % In the case of the predefined CAD model, specify the accuraccy of the
+    % triangulation, 'low', 'medium', 'high' (use 'low'), or 'multires'.
+    %  'multires' uses the 'low' accuracy plate except for rays that pass through
+    %  one of the plate_refine_regions, which use the 'high' accuracy plate. Each
+    %  row is a sphere [x y z r] (mm) in the coordinates of the plate, the default
+    %  covers the two apertures and the channels leading away from them.
+    defaults.plate_accuracy = 'low';
+    refine_depth = (0:2:14)';
+    defaults.plate_refine_regions = [-2.12 - refine_depth, refine_depth, 0*refine_depth, 3 + 0*refine_depth; ...
+                                      2.12 + refine_depth, refine_depth, 0*refine_depth, 3 + 0*refine_depth];
+
+    % In the case of 'circle', specify the radius of the circle (mm).
+    defaults.circle_plate_r = 4;
+
+    % Should a flat pinhole plate be modelled (with 'N circle'). not including may
+    % speed up the simulation but won't model the effuse and multiple scattering
+    % backgrounds properly.
+    defaults.plate_represent = 0;
+
+    % Scaling of the sample model (Inventor exports in cm by default...)
+    defaults.scale = 1;
+
+    % Parameters of the default material, to use for faces where no material is
+    % specified
+    defaults.material.function = 'cosine';
+    defaults.material.params = 0;
+    defaults.material.color = [0.8 0.8 1.0];
+end
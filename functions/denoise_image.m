@@ -0,0 +1,95 @@
+% denoise_image.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Edge preserving denoising of a simulated image using the variance of each
+% pixel, by non-local means with the patch distances normalised by the
+% variance (Rousselle, Knaus and Zwicker, 2012). Two pixels are averaged
+% together only if their patches differ by no more than their noise explains,
+% so flat areas are smoothed while edges with real contrast are kept. Optional
+% guide images (e.g. the surface normal or material seen by each pixel) make it
+% a joint filter: pixels are only averaged if their guides are also similar.
+%
+% Calling syntax:
+%  [im_out, var_out] = denoise_image(im, variance, 'name', value, ...)
+%
+% INPUTS:
+%  im       - nz x nx image of counts
+%  variance - nz x nx estimated variance of each pixel of im
+%  window   - Optional, radius of the search window in pixels, default 5
+%  patch    - Optional, radius of the patches compared, default 2
+%  k        - Optional, strength of the filter, larger smooths more, default
+%             0.45
+%  guides   - Optional, cell array of {guide, sigma} pairs, guide is a nz x nx
+%             x c image and pixels whose guides differ by sigma are given
+%             exp(-1/2) of the weight
+%
+% OUTPUTS:
+%  im_out  - The denoised image
+%  var_out - The variance of the denoised image, assuming independent pixels
+function [im_out, var_out] = denoise_image(im, variance, varargin)
+
+    window = 5;
+    patch = 2;
+    k = 0.45;
+    guides = {};
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'window'
+                window = varargin{i_+1};
+            case 'patch'
+                patch = varargin{i_+1};
+            case 'k'
+                k = varargin{i_+1};
+            case 'guides'
+                guides = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    if ~isequal(size(im), size(variance))
+        error('The image and its variance must be the same size');
+    end
+
+    % Loop over the offsets in the window rather than the pixels, the
+    % distances of every pixel to its neighbour at one offset are found at once
+    box = ones(2*patch + 1)/(2*patch + 1)^2;
+    numer = zeros(size(im));
+    numer_var = zeros(size(im));
+    denom = zeros(size(im));
+    for dz=-window:window
+        for dx=-window:window
+            im_q = shift_image(im, dz, dx);
+            var_q = shift_image(variance, dz, dx);
+
+            % Squared difference less the part of it due to the noise
+            d2 = ((im - im_q).^2 - (variance + min(variance, var_q))) ./ ...
+                (1e-10 + k^2*(variance + var_q));
+            w = exp(-max(0, conv2(d2, box, 'same')));
+
+            for j_=1:2:length(guides)
+                g = guides{j_};
+                g_q = shift_image(g, dz, dx);
+                w = w.*exp(-sum((g - g_q).^2, 3)/(2*guides{j_+1}^2));
+            end
+
+            numer = numer + w.*im_q;
+            numer_var = numer_var + w.^2.*var_q;
+            denom = denom + w;
+        end
+    end
+
+    im_out = numer./denom;
+    var_out = numer_var./denom.^2;
+end
+
+% Image of the pixels at offset (dz, dx) of each pixel, repeating the edges
+function A_q = shift_image(A, dz, dx)
+    rows = min(max((1:size(A, 1)) + dz, 1), size(A, 1));
+    cols = min(max((1:size(A, 2)) + dx, 1), size(A, 2));
+    A_q = A(rows, cols, :);
+end
@@ -1,11 +1,27 @@
-function [pinhole_surface, thePlate, aperture_abstract] = pinhole_import(pinhole_plate_inputs, sample_surface)
+function [pinhole_surface, thePlate, aperture_abstract, plate_refine] = ...
+        pinhole_import(pinhole_plate_inputs, sample_surface, do_plot)
     isOctave = exist('OCTAVE_VERSION', 'builtin') ~= 0;
+    % Plotting can be turned off, e.g. when importing for a batch of scans
+    if nargin < 3
+        do_plot = true;
+    end
+    % With the 'multires' accuracy the 'low' accuracy plate is used away from
+    % the refine regions and the 'high' accuracy plate within them
+    plate_refine = [];
     switch pinhole_plate_inputs.pinhole_model
         case 'stl'
-            pinhole_surface = import_plate(pinhole_plate_inputs.plate_accuracy);
+            if strcmp(pinhole_plate_inputs.plate_accuracy, 'multires')
+                pinhole_surface = import_plate('low');
+                plate_refine.surface = import_plate('high');
+                plate_refine.regions = refine_regions(pinhole_plate_inputs);
+            else
+                pinhole_surface = import_plate(pinhole_plate_inputs.plate_accuracy);
+            end
 
             % Plot if using a graphical window
-            if ~isOctave
+            if ~do_plot
+                % Do not plot
+            elseif ~isOctave
                 if feature('ShowFigureWindows')
                     sample_surface.patchPlot(true);
                     pinhole_surface.patchPlot(false);
@@ -21,10 +37,18 @@ function [pinhole_surface, thePlate, aperture_abstract] = pinhole_import(pinhole
             thePlate = PinholeModel();
             aperture_abstract = 0;
         case 'new'
-            pinhole_surface = import_newPlate(pinhole_plate_inputs.plate_accuracy);
+            if strcmp(pinhole_plate_inputs.plate_accuracy, 'multires')
+                pinhole_surface = import_newPlate('low');
+                plate_refine.surface = import_newPlate('high');
+                plate_refine.regions = refine_regions(pinhole_plate_inputs);
+            else
+                pinhole_surface = import_newPlate(pinhole_plate_inputs.plate_accuracy);
+            end
 
             % Plot if using a graphical window
-            if ~isOctave
+            if ~do_plot
+                % Do not plot
+            elseif ~isOctave
                 if feature('ShowFigureWindows')
                     sample_surface.patchPlot(true);
                     pinhole_surface.patchPlot(false);
@@ -57,4 +81,17 @@ function [pinhole_surface, thePlate, aperture_abstract] = pinhole_import(pinhole
             aperture_abstract = {pinhole_plate_inputs.aperture_theta, ...
                 pinhole_plate_inputs.aperture_phi, pinhole_plate_inputs.aperture_half_cone};
     end
-end
\ No newline at end of file
+end
+
+% The refine regions of a 'multires' plate, n x 4 [x y z r] (mm). If they are
+% not given the two apertures and the channels leading away from them are
+% covered.
+function regions = refine_regions(pinhole_plate_inputs)
+    if isfield(pinhole_plate_inputs, 'refine_regions')
+        regions = pinhole_plate_inputs.refine_regions;
+    else
+        depth = (0:2:14)';
+        regions = [-2.12 - depth, depth, 0*depth, 3 + 0*depth; ...
+                    2.12 + depth, depth, 0*depth, 3 + 0*depth];
+    end
+end
@@ -0,0 +1,105 @@
+% read_job_parameters.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Reads a parameter file of the same format as 'ray_tracing_parameters.txt'
+% and puts the parameters into a struct, along with the parameters that
+% performScan.m derives from them and the defaults it shares (see
+% default_parameters.m). Used by batchScan.m so that many parameter files can be
+% read without running performScan.m for each.
+%
+% An optional extra line may be added to the end of the parameter file:
+%  Batch priority: 2
+% jobs with a higher priority are traced first by batchScan. Defaults to 0.
+%
+% Calling syntax:
+%  job = read_job_parameters(param_fname)
+%
+% INPUT:
+%  param_fname - path to the parameter file
+%
+% OUTPUT:
+%  job - struct of the simulation parameters
+function job = read_job_parameters(param_fname)
+    param_list = read_parameters(param_fname);
+
+    if length(param_list) < 31
+        error(['Parameter file ' param_fname ' has too few parameters.']);
+    end
+
+    job.param_fname = param_fname;
+
+    % Virtual microscope
+    job.working_dist = str2double(param_list{1});
+    job.init_angle = str2double(param_list{2});
+    job.typeScan = strtrim(param_list{3});
+    job.n_detectors = str2double(param_list{4});
+    job.aperture_axes = parse_list_input(param_list{5});
+    job.aperture_c = parse_list_input(param_list{6});
+    job.rot_angles = parse_list_input(param_list{7});
+    job.pinhole_model = parse_pinhole(param_list{8});
+
+    % Source
+    job.n_rays = str2double(param_list{9});
+    job.pinhole_r = str2double(param_list{10});
+    job.source_model = strtrim(param_list{11});
+    job.theta_max = str2double(param_list{12});
+    job.sigma_source = str2double(param_list{13});
+    if ~parse_yes_no(param_list{14})
+        job.effuse_size = 0;
+    else
+        job.effuse_size = str2double(param_list{15});
+    end
+
+    % Sample
+    job.sample_type = strtrim(param_list{16});
+    job.diffuse = parse_scattering(strtrim(param_list{17}), ...
+        str2double(param_list{18}), str2double(param_list{19}));
+    job.sample_description = param_list{20};
+    job.dist_to_sample = str2double(param_list{21});
+    job.sphere_r = str2double(param_list{22});
+    job.square_size = str2double(param_list{23});
+    job.sample_fname = strtrim(param_list{24});
+    job.dontMeddle = parse_yes_no(param_list{25});
+
+    % Scan
+    job.pixel_seperation = str2double(param_list{26});
+    job.range_x = str2double(param_list{27});
+    job.range_z = str2double(param_list{28});
+    job.init_angle_pattern = ~parse_yes_no(param_list{29});
+
+    % Other
+    job.directory_label = strtrim(param_list{30});
+    job.recompile = parse_yes_no(param_list{31});
+    if length(param_list) >= 32
+        job.priority = str2double(param_list{32});
+    else
+        job.priority = 0;
+    end
+
+    % Parameters that performScan.m derives, keep them the same
+    job.pinhole_c = [-job.working_dist*tand(job.init_angle), 0, 0];
+    job.n_effuse = job.n_rays*job.effuse_size;
+    job.xrange = [-job.range_x/2, job.range_x/2];
+    job.zrange = [-job.range_z/2, job.range_z/2];
+    job.sphere_c = [0, -job.dist_to_sample + job.sphere_r, 0];
+
+    % The parameters not in the parameter file, the same as performScan.m
+    defaults = default_parameters();
+    job.max_scatter = defaults.max_scatter;
+    job.ray_model = defaults.ray_model;
+    job.ray_bank = defaults.ray_bank;
+    job.stratify_bank = defaults.stratify_bank;
+    job.options = defaults.sim_options;
+    job.cosine_n = defaults.cosine_n;
+    job.plate_accuracy = defaults.plate_accuracy;
+    job.plate_refine_regions = defaults.plate_refine_regions;
+    job.circle_plate_r = defaults.circle_plate_r;
+    job.plate_represent = defaults.plate_represent;
+    job.scale = defaults.scale;
+    job.material = defaults.material;
+end
+
@@ -26,7 +26,7 @@ function line_scan_info = lineScan(sample_surface, scan_range, direct_beam, ...
     n_pixels = length(sample_xs);
 
     % Create variables for output data
-    counters = zeros(maxScatter, n_pixels);
+    counters = zeros(maxScatter + 1, n_pixels);
     num_killed = zeros(n_pixels, 1);
     cntr_effuse_single = zeros(n_pixels, 1);
     counter_effuse_multiple = zeros(n_pixels, 1);
@@ -12,12 +12,35 @@
 % Calling syntax:
 %
 % INPUTS:
+%  ray_bank   - Optional, generate one bank of source rays that is used for
+%               every pixel, default false
+%  stratified - Optional, use Latin hypercube samples for the ray bank,
+%               default true
+%  options    - Optional, struct of extra simulation options passed to C, if
+%               options.diagnostics is true the ray diagnostics of each pixel
+%               are saved to diagnostics.mat in thePath. options.n_batches > 1
+%               estimates the variance of each pixel from batches of rays, if
+%               options.denoise is true the images are also denoised (see
+%               RectangleInfo.denoise) before they are produced. The features
+%               of the first bounce of the direct beam in each pixel are
+%               stored (see RectangleInfo.addFeatures) unless
+%               options.features is false
+%
+% If raster_pattern has the field sampled (see subsample_raster_pattern) only
+% those pixels are traced and the images are reconstructed from them (see
+% RectangleInfo.reconstruct), options.denoise is then ignored. If it has the
+% field symmetry (see symmetric_raster_pattern) only the pixels of a
+% fundamental domain are traced and the rest are copied from their images, with
+% the detectors permuted. The diagnostics of the copied pixels are left empty.
 %
 % OUTPUTS:
 %  square_scan_info - An object of class RectangleInfo that contains all
 %                     the results and information about the simulation
 function square_scan_info = rectangularScan(varargin)
     
+    ray_bank = false;
+    stratified = true;
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'sample_surface'
@@ -48,6 +71,12 @@ function square_scan_info = rectangularScan(varargin)
                 ray_model = varargin{i_+1};
             case 'n_detector'
                 n_detector = varargin{i_+1};
+            case 'ray_bank'
+                ray_bank = varargin{i_+1};
+            case 'stratified'
+                stratified = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 error(['input ' num2str(i_) ' not recognised:']);
         end
@@ -57,14 +86,37 @@ function square_scan_info = rectangularScan(varargin)
     % TODO
     
     % Create the variables for output data
-    counters = zeros(max_scatter, n_detector, raster_pattern.nz, raster_pattern.nx);
+    % The last of the max_scatter + 1 bins is the overflow, see traceSimpleMultiGen
+    counters = zeros(max_scatter + 1, n_detector, raster_pattern.nz, raster_pattern.nx);
     effuse_counters = zeros(n_detector, raster_pattern.nz, raster_pattern.nx);
     num_killed = zeros(raster_pattern.nz, raster_pattern.nx);
+    record_diag = isfield(options, 'diagnostics') && options.diagnostics;
+    pixel_diagnostics = cell(raster_pattern.nz, raster_pattern.nx);
+    pixel_variance = zeros(n_detector, raster_pattern.nz, raster_pattern.nx);
+    record_feat = ~isfield(options, 'features') || options.features;
+    pixel_features = cell(raster_pattern.nz, raster_pattern.nx);
+    % The pixels that ran out of time before all their rays were traced
+    budgeted = isfield(options, 'time_budget') && options.time_budget > 0;
+    pixel_stopped = false(raster_pattern.nz, raster_pattern.nx);
 
     % Produce a time estimage for the simulation and print it out. This is
     % nessacerily a rough estimate.
     N_pixels = raster_pattern.nx*raster_pattern.nz;
 
+    % Pixels to trace, all of them unless the scan is subsampled
+    subsampled = isfield(raster_pattern, 'sampled');
+    symmetric = isfield(raster_pattern, 'symmetry');
+    if subsampled
+        sampled = raster_pattern.sampled;
+        fprintf('Tracing %i of %i pixels\n', nnz(sampled), N_pixels);
+    elseif symmetric
+        sampled = raster_pattern.symmetry.traced;
+        fprintf('Tracing %i of %i pixels, the rest by symmetry\n', ...
+            nnz(sampled), N_pixels);
+    else
+        sampled = true(raster_pattern.nz, raster_pattern.nx);
+    end
+
     % Estimate of the time for the simulation
     % t_estimate = time_estimate('n_rays', direct_beam.n, 'n_effuse', ...
     %     effuse_beam.n, 'sample_surface', sample_surface,...
@@ -102,6 +154,17 @@ function square_scan_info = rectangularScan(varargin)
         h = 0;
     end
 
+    % Generate the source rays once and use the same rays for every pixel
+    if ray_bank
+        direct_bank = makeRayBank('which_beam', direct_beam.source_model, ...
+            'beam', direct_beam, 'stratified', stratified);
+        effuse_bank = makeRayBank('which_beam', 'Effuse', 'beam', ...
+            effuse_beam, 'stratified', stratified);
+    else
+        direct_bank = {};
+        effuse_bank = {};
+    end
+
     xx = raster_pattern.x_pattern;
     zz = raster_pattern.z_pattern;
     
@@ -111,29 +174,43 @@ function square_scan_info = rectangularScan(varargin)
     % TODO: make this parallel in Octave
     % TODO: Make each iteration loop over multiple pixels so that the parfor is
     % more optimal
-    % NOTE: could use parfeval?
+    % NOTE: see batchScan.m for a parfeval version over several scans
     % TODO: consider moving this loop into C?
     parfor i_=1:N_pixels
-        % Place the sample into the right position for this pixel
-        this_surface = copy(sample_surface);
-        this_surface.moveBy([xx(i_), 0, zz(i_)]);
-        this_sphere = sphere;
-        this_sphere.centre(1) = this_sphere.centre(1) + xx(i_);
-        this_sphere.centre(3) = this_sphere.centre(3) + zz(i_);
-
-        % Direct beam
-        [~, killed, numScattersRay] = switch_plate('plate_represent', ...
-            plate_represent, 'sample', this_surface, 'max_scatter', max_scatter, ...
-            'pinhole_surface', pinhole_surface, 'thePlate', thePlate, ...
-            'sphere', this_sphere, 'ray_model', ...
-            ray_model, 'which_beam', direct_beam.source_model, 'beam', direct_beam);
+        if ~sampled(i_)
+            if progressBar && ~isOctave
+                ppm.increment();
+            end
+            continue
+        end
 
-        % Effuse beam
-        [effuse_cntr, ~, ~] = switch_plate('plate_represent', ...
-            plate_represent, 'sample', this_surface, 'max_scatter', max_scatter, ...
+        % The pixel index labels the USDT probes of the C code
+        pixel_options = options;
+        pixel_options.pixel = i_;
+        pixel_options.diagnostics = record_diag;
+        pixel_args = {'sample_surface', sample_surface, 'sphere', sphere, ...
+            'offset', [xx(i_), zz(i_)], 'pinhole_model', plate_represent, ...
             'pinhole_surface', pinhole_surface, 'thePlate', thePlate, ...
-            'sphere', this_sphere, 'ray_model', ...
-            ray_model, 'which_beam', 'Effuse', 'beam', effuse_beam);
+            'max_scatter', max_scatter, 'ray_model', ray_model, ...
+            'direct_beam', direct_beam, 'effuse_beam', effuse_beam, ...
+            'direct_bank', direct_bank, 'effuse_bank', effuse_bank, ...
+            'options', pixel_options};
+        if budgeted
+            [numScattersRay, killed, effuse_cntr, diagnostics, variance, ...
+                features, traced] = tracePixel(pixel_args{:});
+            pixel_features{i_} = features;
+            pixel_stopped(i_) = any(traced < [direct_beam.n, effuse_beam.n]);
+        elseif record_feat
+            [numScattersRay, killed, effuse_cntr, diagnostics, variance, ...
+                features] = tracePixel(pixel_args{:});
+            pixel_features{i_} = features;
+        else
+            [numScattersRay, killed, effuse_cntr, diagnostics, variance] = ...
+                tracePixel(pixel_args{:});
+        end
+        if record_diag
+            pixel_diagnostics{i_} = diagnostics;
+        end
 
         % Update the progress bar if we are working in the MATLAB GUI.
         if progressBar && ~isOctave
@@ -145,11 +222,7 @@ function square_scan_info = rectangularScan(varargin)
         counters(:,:,i_) = numScattersRay;
         num_killed(i_) = killed;
         effuse_counters(:,i_) = effuse_cntr';
-
-        % Delete the surface object for this iteration
-        if ~isOctave
-            delete(this_surface);
-        end
+        pixel_variance(:,i_) = variance';
     end
 
     % Close the parallel pool
@@ -161,6 +234,18 @@ function square_scan_info = rectangularScan(varargin)
     if progressBar && ~isOctave
         delete(ppm);
     end
+
+    if any(pixel_stopped(:))
+        fprintf(['%i pixels ran out of time before all their rays were ' ...
+            'traced, their counts are of fewer rays\n'], sum(pixel_stopped(:)));
+    end
+
+    % Copy the pixels of a symmetric scan from their images
+    if symmetric
+        [counters, num_killed, effuse_counters, pixel_variance, pixel_features] = ...
+            copy_symmetric_pixels(raster_pattern.symmetry, counters, ...
+            num_killed, effuse_counters, pixel_variance, pixel_features);
+    end
     
     t = toc;
 
@@ -184,6 +269,24 @@ function square_scan_info = rectangularScan(varargin)
     if strcmp(pinhole_model, 'N circle')
         square_scan_info.addDetectorInfo(thePlate.aperture_c, thePlate.aperture_axes)
     end
+    square_scan_info.addVariance(pixel_variance);
+    if record_feat && ~any(cellfun(@isempty, pixel_features(:)))
+        square_scan_info.addFeatures(pixel_features);
+    end
+
+    % Reconstruct the images of a subsampled scan, or denoise the images
+    % guided by the variance of each pixel
+    if subsampled
+        square_scan_info.reconstruct();
+        for i_=1:n_detector
+            fprintf('Detector %i: estimated reconstruction error %.3g counts (%.2g%%)\n', ...
+                i_, square_scan_info.reconstruction_error(i_), ...
+                100*square_scan_info.reconstruction_error(i_)/ ...
+                mean(square_scan_info.cntrSum{i_}(sampled)));
+        end
+    elseif isfield(options, 'denoise') && options.denoise
+        square_scan_info.denoise();
+    end
 
     % Draw and save images
     % All the images are saved giving maximum contrast in the images:
@@ -192,6 +295,11 @@ function square_scan_info = rectangularScan(varargin)
     % Only draws them if there is a GUI.
     square_scan_info.produceImages(thePath);
 
+    % Save the diagnostics of trapped rays if they were recorded
+    if record_diag
+        save(fullfile(thePath, 'diagnostics.mat'), 'pixel_diagnostics');
+    end
+
     % Also save a reduced set of formatted data
     %formatOutput(square_scan_info, thePath);
 end
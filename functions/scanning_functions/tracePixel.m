@@ -0,0 +1,178 @@
+% tracePixel.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Traces the direct and effuse beams for a single pixel of a 2D scan. The
+% sample (and sphere) are moved into position for the pixel, the original
+% sample surface is not altered.
+%
+% Calling syntax:
+%  [numScattersRay, killed, effuse_cntr, diagnostics, variance, features, ...
+%      traced] = tracePixel('name', value, ...)
+%
+% INPUTS:
+%  sample_surface  - TriagSurface of the sample, centred
+%  sphere          - Sphere object of the analytic sphere, centred
+%  offset          - [x, z] movement of the sample for this pixel
+%  pinhole_model   - How the pinhole plate is being represented
+%  pinhole_surface - TriagSurface of the pinhole plate
+%  thePlate        - PinholeModel of the simple model of the pinhole plate
+%  max_scatter     - The maximum allowed number of sample scattering events
+%  ray_model       - Are the rays being generated in 'C' or 'MATLAB'
+%  direct_beam     - struct of the direct beam parameters
+%  effuse_beam     - struct of the effuse beam parameters
+%  direct_bank     - Optional, bank of direct beam rays from makeRayBank
+%  effuse_bank     - Optional, bank of effuse beam rays from makeRayBank
+%  options         - Optional, struct of extra simulation options passed to C,
+%                    with n_batches > 1 the variance is estimated from batches
+%                    of rays. The coarse meshes in mlmc_levels and the
+%                    material_map are moved with the sample
+%
+% OUTPUTS:
+%  numScattersRay - Histogram of the number of scattering events of the
+%                   detected direct beam rays, for each detector
+%  killed         - The number of artificially stopped direct beam rays
+%  effuse_cntr    - The number of detected effuse beam rays, for each detector
+%  diagnostics    - Optional, ray path and timing diagnostics of the direct
+%                   beam, see tracingMultiGenMex
+%  variance       - Optional, estimated variance of the total (direct and
+%                   effuse) counts of each detector. From the spread of the
+%                   counts per ray of the complete batches if there are more
+%                   than one (options.n_batches > 1), otherwise the counts
+%                   themselves (Poisson statistics).
+%  features       - Optional, features of the first bounce of the direct beam
+%                   rays (see traceRaysGen), empty unless the rays are
+%                   generated in C
+%  traced         - Optional, [direct, effuse] the number of rays traced of each
+%                   beam, fewer than asked for if options.time_budget ran out
+function [numScattersRay, killed, effuse_cntr, diagnostics, variance, features, traced] = tracePixel(varargin)
+
+    direct_bank = {};
+    effuse_bank = {};
+    options = struct();
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'sample_surface'
+                sample_surface = varargin{i_+1};
+            case 'sphere'
+                sphere = varargin{i_+1};
+            case 'offset'
+                offset = varargin{i_+1};
+            case 'pinhole_model'
+                pinhole_model = varargin{i_+1};
+            case 'pinhole_surface'
+                pinhole_surface = varargin{i_+1};
+            case 'thePlate'
+                thePlate = varargin{i_+1};
+            case 'max_scatter'
+                max_scatter = varargin{i_+1};
+            case 'ray_model'
+                ray_model = varargin{i_+1};
+            case 'direct_beam'
+                direct_beam = varargin{i_+1};
+            case 'effuse_beam'
+                effuse_beam = varargin{i_+1};
+            case 'direct_bank'
+                direct_bank = varargin{i_+1};
+            case 'effuse_bank'
+                effuse_bank = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    % Place the sample into the right position for this pixel
+    this_surface = copy(sample_surface);
+    this_surface.moveBy([offset(1), 0, offset(2)]);
+    if isfield(options, 'mlmc_levels')
+        for i_=1:length(options.mlmc_levels)
+            options.mlmc_levels{i_} = copy(options.mlmc_levels{i_});
+            options.mlmc_levels{i_}.moveBy([offset(1), 0, offset(2)]);
+        end
+    end
+    if isfield(options, 'material_map') && ~isempty(options.material_map)
+        options.material_map.origin = options.material_map.origin + ...
+            [offset(1), 0, offset(2)];
+    end
+    this_sphere = sphere;
+    this_sphere.centre(1) = this_sphere.centre(1) + offset(1);
+    this_sphere.centre(3) = this_sphere.centre(3) + offset(2);
+
+    % Direct beam
+    direct_args = {'plate_represent', ...
+        pinhole_model, 'sample', this_surface, 'max_scatter', max_scatter, ...
+        'pinhole_surface', pinhole_surface, 'thePlate', thePlate, ...
+        'sphere', this_sphere, 'ray_model', ray_model, ...
+        'which_beam', direct_beam.source_model, 'beam', direct_beam, ...
+        'ray_bank', direct_bank, 'options', options};
+    if nargout > 4
+        [direct_cntr, killed, numScattersRay, diagnostics, direct_batches, features, ...
+            direct_traced] = switch_plate(direct_args{:});
+    elseif nargout > 3
+        [~, killed, numScattersRay, diagnostics] = switch_plate(direct_args{:});
+    else
+        [~, killed, numScattersRay] = switch_plate(direct_args{:});
+    end
+
+    % Effuse beam
+    effuse_args = {'plate_represent', ...
+        pinhole_model, 'sample', this_surface, 'max_scatter', max_scatter, ...
+        'pinhole_surface', pinhole_surface, 'thePlate', thePlate, ...
+        'sphere', this_sphere, 'ray_model', ray_model, ...
+        'which_beam', 'Effuse', 'beam', effuse_beam, ...
+        'ray_bank', effuse_bank, 'options', options};
+    if nargout > 4
+        % The diagnostics of the effuse beam are not kept
+        effuse_args{end}.diagnostics = false;
+        [effuse_cntr, ~, ~, ~, effuse_batches, ~, effuse_traced] = ...
+            switch_plate(effuse_args{:});
+        variance = batch_variance(direct_cntr, direct_batches, direct_traced, ...
+            beam_rays(direct_beam, direct_bank)) + batch_variance(effuse_cntr, ...
+            effuse_batches, effuse_traced, beam_rays(effuse_beam, effuse_bank));
+        traced = [sum(direct_traced), sum(effuse_traced)];
+    else
+        [effuse_cntr, ~, ~] = switch_plate(effuse_args{:});
+    end
+
+    % Delete the surface object for this pixel
+    isOctave = exist('OCTAVE_VERSION', 'builtin') ~= 0;
+    if ~isOctave
+        delete(this_surface);
+        if isfield(options, 'mlmc_levels')
+            cellfun(@delete, options.mlmc_levels);
+        end
+    end
+end
+
+% The variance of the total counts cntr of each detector given the counts of
+% each batch (batches x detectors) and the rays traced in each batch. The rays
+% are independent so the variance of the total is the number of rays traced
+% times the variance per ray, estimated from the spread of the counts per ray of
+% the batches. A call stopped by options.time_budget leaves a partial batch
+% followed by empty ones, so only the batches traced in full, split as
+% tracingMultiGenMex splits the n_rays rays, are used.
+function v = batch_variance(cntr, batches, traced, n_rays)
+    n_batches = size(batches, 1);
+    batch_size = floor(n_rays/n_batches) + ((1:n_batches)' <= mod(n_rays, n_batches));
+    complete = traced == batch_size & batch_size > 0;
+    if sum(complete) > 1
+        per_ray = batches(complete,:)./traced(complete);
+        v = sum(traced)*mean(traced(complete))*var(per_ray, 0, 1);
+    else
+        v = cntr;
+    end
+end
+
+% The number of rays asked for of a beam, the size of its bank if given
+function n = beam_rays(beam, bank)
+    if isempty(bank)
+        n = beam.n;
+    else
+        n = size(bank{1}, 1);
+    end
+end
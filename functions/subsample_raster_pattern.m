@@ -0,0 +1,112 @@
+% subsample_raster_pattern.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Selects a random subset of the pixels of a raster pattern to be traced, the
+% rest are reconstructed afterwards (see tv_reconstruct). The subset is blue
+% noise, chosen by Mitchell's best candidate algorithm: each new pixel is the
+% one, of a few random candidates, furthest from the pixels already chosen.
+% The pixels are spread out more evenly than uniformly random ones without
+% the aliasing of a regular subgrid, so no part of the image is left with a
+% large gap to fill.
+%
+% Calling syntax:
+%  raster_pattern = subsample_raster_pattern(raster_pattern, 'name', value, ...)
+%
+% INPUTS:
+%  raster_pattern - struct of the raster pattern, see generate_raster_pattern
+%  fraction       - Optional, fraction of the pixels to trace, default 0.25
+%  candidates     - Optional, number of candidates for each pixel, more gives
+%                   a more even spread, default 10
+%
+% OUTPUTS:
+%  raster_pattern - The raster pattern with the extra field sampled, a nz x nx
+%                   logical of the pixels to be traced
+function raster_pattern = subsample_raster_pattern(raster_pattern, varargin)
+
+    fraction = 0.25;
+    candidates = 10;
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'fraction'
+                fraction = varargin{i_+1};
+            case 'candidates'
+                candidates = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    if fraction <= 0 || fraction > 1
+        error('The fraction of pixels traced must be in (0, 1].');
+    end
+
+    nz = raster_pattern.nz;
+    nx = raster_pattern.nx;
+    n_sampled = max(1, round(fraction*nz*nx));
+
+    % The chosen pixels are kept in a grid of cells about the size of the gaps
+    % between them, the nearest one to a candidate is then found in the few
+    % cells around it rather than over the whole image
+    h = max(1, floor(sqrt(nz*nx/n_sampled)));
+    cells = cell(ceil(nz/h), ceil(nx/h));
+
+    % The pixels not yet chosen
+    free = 1:nz*nx;
+    sampled = false(nz, nx);
+    for i_=1:n_sampled
+        cand = randi(length(free), 1, min(candidates, length(free)));
+        best = 1;
+        best_d2 = -1;
+        for j_=1:length(cand)
+            [z, x] = ind2sub([nz, nx], free(cand(j_)));
+            d2 = nearest_dist2(cells, h, z, x);
+            if d2 > best_d2
+                best = j_;
+                best_d2 = d2;
+            end
+        end
+        ind = free(cand(best));
+        free(cand(best)) = free(end);
+        free(end) = [];
+
+        sampled(ind) = true;
+        [z, x] = ind2sub([nz, nx], ind);
+        cells{ceil(z/h), ceil(x/h)}(end+1,:) = [z, x];
+    end
+
+    raster_pattern.sampled = sampled;
+end
+
+% The squared distance from pixel (z, x) to the nearest chosen pixel, inf if
+% there are none. The rings of cells around its cell are searched outwards
+% until the next ring can hold no nearer pixel.
+function d2 = nearest_dist2(cells, h, z, x)
+    [gnz, gnx] = size(cells);
+    cz = ceil(z/h);
+    cx = ceil(x/h);
+    d2 = inf;
+    for k=0:max(gnz, gnx)
+        % A pixel in ring k is at least (k - 1)*h + 1 away in z or x
+        if k > 0 && d2 <= ((k - 1)*h + 1)^2
+            return
+        end
+        for gz=max(1, cz - k):min(gnz, cz + k)
+            if abs(gz - cz) == k
+                gxs = max(1, cx - k):min(gnx, cx + k);
+            else
+                gxs = [cx - k, cx + k];
+                gxs = gxs(gxs >= 1 & gxs <= gnx);
+            end
+            for gx=gxs
+                p = cells{gz, gx};
+                if ~isempty(p)
+                    d2 = min(d2, min((p(:,1) - z).^2 + (p(:,2) - x).^2));
+                end
+            end
+        end
+    end
+end
@@ -12,7 +12,8 @@
 % simulaitons then the gateway function should be used directly.
 %
 % Calling syntax:
-%  [cnt, killed, numScattersRay] = switch_plate('name', value, ...) 
+%  [cnt, killed, numScattersRay, diagnostics, batch_counts, features, ...
+%      traced] = switch_plate('name', value, ...) 
 % 
 % INPUTS:
 %  plate_represent - How is the pinhole plate being represented
@@ -26,14 +27,37 @@
 %  which_beam      - What kind of beam is being moddled, 'Effuse, 'Uniform', or
 %                    'Gaussian'
 %  beam            - Other information on the beam
+%  ray_bank        - Optional, {ray_pos, ray_dir} a bank of rays generated once
+%                    for the scan (see makeRayBank), if given these rays are
+%                    traced instead of generating new ones
+%  options         - Optional, struct of extra simulation options passed to C,
+%                    with given rays (MATLAB or a ray bank) the options only
+%                    used with rays generated in C are an error, see
+%                    givenRayOptions
 %
 % OUTPUTS:
 %  cnt            - The number of detected rays
 %  killed         - The number of artificially stopped rays
 %  numScattersRay - Histogram of the number of scattering events rays have
 %                   undergone before detection
-function [cnt, killed, numScattersRay] = switch_plate(varargin)
+%  diagnostics    - Optional, struct of ray path and timing diagnostics, only
+%                   recorded when the rays are generated in C, otherwise empty
+%  batch_counts   - Optional, the number of detected rays into each detector
+%                   (columns) of each of the options.n_batches batches (rows)
+%  features       - Optional, struct of the features of the first bounce of the
+%                   rays (see traceRaysGen), only when the rays are generated
+%                   in C, otherwise empty
+%  traced         - Optional, the number of rays traced in each of the batches
+%                   (rows), less than the batch holds for the batches after
+%                   options.time_budget ran out, which are filled in order
+function [cnt, killed, numScattersRay, diagnostics, batch_counts, features, traced] = switch_plate(varargin)
     
+    diagnostics = [];
+    batch_counts = [];
+    features = [];
+    traced = [];
+    ray_bank = {};
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'plate_represent'
@@ -54,6 +78,10 @@ function [cnt, killed, numScattersRay] = switch_plate(varargin)
                 which_beam = varargin{i_+1};
             case 'beam'
                 beam = varargin{i_+1};
+            case 'ray_bank'
+                ray_bank = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
@@ -62,7 +90,10 @@ function [cnt, killed, numScattersRay] = switch_plate(varargin)
     % Switch between the two ways of generating the rays, we either generate in
     % Matlab and get the maximum outputs plus flexibility of source properties
     % or in C for minimal memory useage and slight speed up.
-    if strcmp(ray_model, 'MATLAB')
+    if ~isempty(ray_bank)
+        % The rays have already been generated for the whole scan
+        rays = ray_bank;
+    elseif strcmp(ray_model, 'MATLAB')
         % We generate the rays in matlab
         
         % I see no need to keep this part of the code, can abandon it and
@@ -91,35 +122,109 @@ function [cnt, killed, numScattersRay] = switch_plate(varargin)
                 error('Wrong type of beam to simulate.')
         end
         rays = {ray_pos, ray_dir};
+    end
 
+    if ~isempty(ray_bank) || strcmp(ray_model, 'MATLAB')
         % We switch which model of the pinhole plate we are using.
         switch plate_represent
             case 'stl'
-                [cnt, killed, ~, ~, ~, numScattersRay, ~] = ...
-                    traceRays('rays', rays, 'sample', sample, 'max_scatter', ...
-                    max_scatter, 'plate', pinhole_surface, ...
-                    'sphere', sphere);
+                if nargout > 4
+                    [cnt, killed, ~, ~, ~, numScattersRay, ~, ~, batch_counts] = ...
+                        traceRays('rays', rays, 'sample', sample, 'max_scatter', ...
+                        max_scatter, 'plate', pinhole_surface, ...
+                        'sphere', sphere, 'options', options);
+                else
+                    [cnt, killed, ~, ~, ~, numScattersRay, ~] = ...
+                        traceRays('rays', rays, 'sample', sample, 'max_scatter', ...
+                        max_scatter, 'plate', pinhole_surface, ...
+                        'sphere', sphere, 'options', options);
+                end
             case 'N circle'
-                [cnt, killed, ~, numScattersRay] = traceSimpleMulti('rays', rays, ...
-                    'sample', sample', 'max_scatter', max_scatter, ...
-                    'sphere', sphere, 'plate', thePlate);
+                if nargout > 4
+                    [cnt, killed, ~, numScattersRay, batch_counts] = traceSimpleMulti( ...
+                        'rays', rays, 'sample', sample', 'max_scatter', max_scatter, ...
+                        'sphere', sphere, 'plate', thePlate, 'options', options);
+                else
+                    [cnt, killed, ~, numScattersRay] = traceSimpleMulti('rays', rays, ...
+                        'sample', sample', 'max_scatter', max_scatter, ...
+                        'sphere', sphere, 'plate', thePlate, 'options', options);
+                end
             case 'abstract'
                 % TODO
         end
+        if nargout > 6
+            % Given rays are all traced
+            [batch, n_batches] = rayBatches(size(rays{1}, 1), options);
+            traced = accumarray(batch', 1, [n_batches, 1]);
+        end
         
     elseif strcmp(ray_model, 'C')
         % We let C do all the hard work
         switch plate_represent
             case 'stl'
-                [cnt, killed, ~, numScattersRay] = traceRaysGen('sample', ...
-                    sample, 'max_scatter', max_scatter, 'plate', pinhole_surface, ...
-                    'sphere', sphere, 'source', which_beam, 'beam', beam);
+                if nargout > 6
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts, features, ...
+                        ~, traced] = traceRaysGen('sample', sample, 'max_scatter', ...
+                        max_scatter, 'plate', pinhole_surface, 'sphere', sphere, ...
+                        'source', which_beam, 'beam', beam, 'options', options);
+                    batch_counts = batch_counts';
+                    traced = traced';
+                elseif nargout > 5
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts, features] = ...
+                        traceRaysGen('sample', sample, 'max_scatter', max_scatter, ...
+                        'plate', pinhole_surface, 'sphere', sphere, 'source', ...
+                        which_beam, 'beam', beam, 'options', options);
+                    batch_counts = batch_counts';
+                elseif nargout > 4
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts] = traceRaysGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', pinhole_surface, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                    batch_counts = batch_counts';
+                elseif nargout > 3
+                    [cnt, killed, ~, numScattersRay, diagnostics] = traceRaysGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', pinhole_surface, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                else
+                    [cnt, killed, ~, numScattersRay] = traceRaysGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', pinhole_surface, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                end
             case 'abstract'
                 % TODO
             case 'N circle'
-                [cnt, killed, ~, numScattersRay] = traceSimpleMultiGen('sample', ...
-                    sample, 'max_scatter', max_scatter, 'plate', thePlate, ...
-                    'sphere', sphere, 'source', which_beam, 'beam', beam);
+                if nargout > 6
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts, features, ...
+                        ~, ~, traced] = traceSimpleMultiGen('sample', sample, ...
+                        'max_scatter', max_scatter, 'plate', thePlate, 'sphere', sphere, ...
+                        'source', which_beam, 'beam', beam, 'options', options);
+                    batch_counts = batch_counts';
+                    traced = traced';
+                elseif nargout > 5
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts, features] = ...
+                        traceSimpleMultiGen('sample', sample, 'max_scatter', max_scatter, ...
+                        'plate', thePlate, 'sphere', sphere, 'source', which_beam, ...
+                        'beam', beam, 'options', options);
+                    batch_counts = batch_counts';
+                elseif nargout > 4
+                    [cnt, killed, ~, numScattersRay, diagnostics, batch_counts] = traceSimpleMultiGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', thePlate, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                    batch_counts = batch_counts';
+                elseif nargout > 3
+                    [cnt, killed, ~, numScattersRay, diagnostics] = traceSimpleMultiGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', thePlate, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                else
+                    [cnt, killed, ~, numScattersRay] = traceSimpleMultiGen('sample', ...
+                        sample, 'max_scatter', max_scatter, 'plate', thePlate, ...
+                        'sphere', sphere, 'source', which_beam, 'beam', beam, ...
+                        'options', options);
+                end
         end
     end
 end
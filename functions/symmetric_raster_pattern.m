@@ -0,0 +1,150 @@
+% symmetric_raster_pattern.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Selects the pixels of a raster pattern to trace when the simulation is
+% symmetric, the rest are copied from them afterwards (see rectangularScan).
+% A mirror in x (x -> -x), a mirror in z (z -> -z) or a rotation by 180
+% degrees about the y axis that leaves the sample, the sphere, the sources and
+% the apertures unchanged (checked in C, see checkSymmetry) and maps the
+% raster onto itself maps the counts of a pixel onto those of its image, with
+% the detectors permuted. Only one pixel of each orbit, a fundamental domain
+% of half (or a quarter with both mirrors) of the raster, is then traced.
+%
+% Only for the 'N circle' model of the pinhole plate.
+%
+% Calling syntax:
+%  raster_pattern = symmetric_raster_pattern(raster_pattern, 'name', value, ...)
+%
+% INPUTS:
+%  raster_pattern - struct of the raster pattern, see generate_raster_pattern
+%  symmetry       - 'auto' to use the largest symmetry the simulation has, or
+%                   one of 'mirror_x', 'mirror_z', 'rotate' and 'mirror_xz'
+%                   (both mirrors), an error is raised if the simulation does
+%                   not have it
+%  sample, plate, sphere, direct_beam, effuse_beam - the simulation, as for
+%                   rectangularScan
+%  tol            - Optional, see checkSymmetry, default 1e-6
+%
+% OUTPUTS:
+%  raster_pattern - The raster pattern with the extra field symmetry, a struct:
+%                   ops           - cell array of the names of the ops used
+%                   traced        - nz x nx logical of the pixels to be traced
+%                   image_of      - nz x nx index of the traced pixel each
+%                                   pixel is copied from, itself if traced
+%                   detector_perm - n_detectors x nz*nx, the detector of the
+%                                   traced pixel that gives each detector
+%                   normal_sign   - nz*nx x 3, the signs of the components of
+%                                   normals in the traced pixel
+%                   The field is not added if no symmetry is found ('auto').
+function raster_pattern = symmetric_raster_pattern(raster_pattern, varargin)
+
+    tol = 1e-6;
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'symmetry'
+                symmetry = varargin{i_+1};
+            case 'sample'
+                sample_surface = varargin{i_+1};
+            case 'plate'
+                plate = varargin{i_+1};
+            case 'sphere'
+                sphere = varargin{i_+1};
+            case 'direct_beam'
+                direct_beam = varargin{i_+1};
+            case 'effuse_beam'
+                effuse_beam = varargin{i_+1};
+            case 'tol'
+                tol = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    if isfield(raster_pattern, 'sampled')
+        error('A scan cannot be both subsampled and reduced by symmetry.');
+    end
+    if isa(sample_surface, 'VoxelSurface')
+        error('Scans of voxel samples cannot be reduced by symmetry.');
+    end
+
+    names = {'mirror_x', 'mirror_z', 'rotate'};
+    % Signs of x and z under each op
+    signs = [-1, 1; 1, -1; -1, -1];
+
+    % Is the simulation symmetric, for both beams
+    check_args = {'sample', sample_surface, 'plate', plate, 'sphere', sphere, ...
+        'tol', tol};
+    [symmetric, perm] = checkSymmetry(check_args{:}, 'which_beam', ...
+        direct_beam.source_model, 'beam', direct_beam);
+    if effuse_beam.n > 0
+        symmetric = symmetric & checkSymmetry(check_args{:}, ...
+            'which_beam', 'Effuse', 'beam', effuse_beam);
+    end
+
+    % The image of each pixel under each op, if the raster maps onto itself
+    nz = raster_pattern.nz;
+    nx = raster_pattern.nx;
+    xx = reshape(raster_pattern.x_pattern, nz, nx);
+    zz = reshape(raster_pattern.z_pattern, nz, nx);
+    pixel_tol = 1e-3*min(raster_pattern.movement_x, raster_pattern.movement_z);
+    ind = reshape(1:nz*nx, nz, nx);
+    images = {fliplr(ind), flipud(ind), rot90(ind, 2)};
+    for op=1:3
+        img = images{op};
+        symmetric(op) = symmetric(op) && ...
+            all(abs(xx(img) - signs(op,1)*xx) <= pixel_tol, 'all') && ...
+            all(abs(zz(img) - signs(op,2)*zz) <= pixel_tol, 'all');
+    end
+
+    % The ops to use, every op of a group
+    switch symmetry
+        case 'auto'
+            if symmetric(1) && symmetric(2)
+                group = 1:3;
+            else
+                group = find(symmetric, 1);
+            end
+            if isempty(group)
+                fprintf('The simulation has no symmetry, every pixel is traced\n');
+                return
+            end
+        case 'mirror_xz'
+            group = 1:3;
+        case names
+            group = find(strcmp(names, symmetry));
+        otherwise
+            error(['Symmetry ' symmetry ' not recognised.']);
+    end
+    if ~all(symmetric(group))
+        error(['The simulation or the raster pattern is not symmetric under ' ...
+            strjoin(names(group(~symmetric(group))), ', ') '.']);
+    end
+
+    % Trace the pixel of lowest index of each orbit
+    image_of = ind;
+    for op=group
+        image_of = min(image_of, images{op});
+    end
+    n_detectors = size(perm, 1);
+    detector_perm = repmat((1:n_detectors)', 1, nz*nx);
+    normal_sign = ones(nz*nx, 3);
+    for op=group
+        % The ops are their own inverses, the op mapping the traced pixel to
+        % this one also maps this one to the traced pixel
+        copied = images{op}(:) == image_of(:) & image_of(:) ~= ind(:);
+        detector_perm(:, copied) = repmat(perm(:, op), 1, nnz(copied));
+        normal_sign(copied, [1, 3]) = repmat(signs(op,:), nnz(copied), 1);
+    end
+
+    raster_pattern.symmetry.ops = names(group);
+    raster_pattern.symmetry.traced = image_of == ind;
+    raster_pattern.symmetry.image_of = image_of;
+    raster_pattern.symmetry.detector_perm = detector_perm;
+    raster_pattern.symmetry.normal_sign = normal_sign;
+    fprintf('Symmetric under %s, tracing %i of %i pixels\n', ...
+        strjoin(names(group), ', '), nnz(image_of == ind), nz*nx);
+end
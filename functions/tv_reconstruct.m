@@ -0,0 +1,124 @@
+% tv_reconstruct.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Reconstructs a full image from a subset of its pixels with a total variation
+% prior. Finds the image u minimising
+%   sum over the sampled pixels of (u - im).^2./(2 variance) + lambda TV(u)
+% where TV is the isotropic total variation, with the primal-dual algorithm of
+% Chambolle and Pock (2011). The images of SHeM are mostly flat areas between
+% sharp edges, which is what the prior favours, and the sampled pixels are
+% denoised at the same time. The counts are scaled by the typical noise so
+% that lambda does not depend on the number of rays.
+%
+% The error of the reconstruction is estimated by k-fold cross validation:
+% the sampled pixels are split into folds, each fold is reconstructed from the
+% others and compared with its counts, less their noise. Holding out pixels
+% leaves larger gaps, so the estimate is somewhat pessimistic.
+%
+% Calling syntax:
+%  [im_out, rms_error] = tv_reconstruct(im, sampled, variance, 'name', value, ...)
+%
+% INPUTS:
+%  im         - nz x nx image of counts, only the sampled pixels are used
+%  sampled    - nz x nx logical of the pixels that were traced
+%  variance   - nz x nx estimated variance of each pixel of im
+%  lambda     - Optional, strength of the prior, larger gives flatter images,
+%               default 0.5
+%  iterations - Optional, number of iterations, default 300
+%  folds      - Optional, number of folds of the error estimate, default 5
+%
+% OUTPUTS:
+%  im_out    - The reconstructed image
+%  rms_error - Estimated root mean square error of the reconstructed image,
+%              only calculated if asked for
+function [im_out, rms_error] = tv_reconstruct(im, sampled, variance, varargin)
+
+    lambda = 0.5;
+    iterations = 300;
+    folds = 5;
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'lambda'
+                lambda = varargin{i_+1};
+            case 'iterations'
+                iterations = varargin{i_+1};
+            case 'folds'
+                folds = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    if ~isequal(size(im), size(sampled)) || ~isequal(size(im), size(variance))
+        error('The image, the sampled pixels and the variance must be the same size');
+    end
+    sampled = logical(sampled);
+    variance = max(variance, 1);
+
+    im_out = solve_tv(im, sampled, variance, lambda, iterations);
+
+    if nargout > 1
+        fold = randi(folds, size(im));
+        sq_err = [];
+        for k=1:folds
+            held = sampled & fold == k;
+            if ~any(held(:)) || ~any(sampled(:) & ~held(:))
+                continue
+            end
+            u = solve_tv(im, sampled & ~held, variance, lambda, iterations);
+            sq_err = [sq_err; (u(held) - im(held)).^2 - variance(held)]; %#ok<AGROW>
+        end
+        rms_error = sqrt(max(0, mean(sq_err)));
+    end
+end
+
+% Chambolle-Pock iterations for the TV reconstruction from the sampled pixels
+function u = solve_tv(im, sampled, variance, lambda, iterations)
+    % Scale so that the noise is about 1
+    s = sqrt(median(variance(sampled)));
+    y = im/s;
+    w = sampled.*s^2./variance;
+
+    % Start from a normalised convolution of the sampled pixels, which fills
+    % the gaps smoothly so that fewer iterations are needed
+    g = exp(-(-3:3).^2/(2*1.5^2));
+    g = g'*g;
+    u = conv2(y.*sampled, g, 'same')./max(conv2(double(sampled), g, 'same'), eps);
+
+    tau = 1/sqrt(8);
+    sigma = 1/sqrt(8);
+    u_bar = u;
+    px = zeros(size(u));
+    pz = zeros(size(u));
+    for i_=1:iterations
+        % Dual step, projection onto the ball of radius lambda
+        [gx, gz] = grad(u_bar);
+        px = px + sigma*gx;
+        pz = pz + sigma*gz;
+        scale = max(1, sqrt(px.^2 + pz.^2)/lambda);
+        px = px./scale;
+        pz = pz./scale;
+
+        % Primal step, the proximal operator of the data term
+        u_old = u;
+        u = (u + tau*divergence(px, pz) + tau*w.*y)./(1 + tau*w);
+        u_bar = 2*u - u_old;
+    end
+    u = u*s;
+end
+
+% Forward differences with zero gradient across the edges of the image
+function [gx, gz] = grad(u)
+    gx = [diff(u, 1, 2), zeros(size(u, 1), 1)];
+    gz = [diff(u, 1, 1); zeros(1, size(u, 2))];
+end
+
+% The negative adjoint of grad
+function d = divergence(px, pz)
+    d = [px(:,1:end-1), zeros(size(px, 1), 1)] - [zeros(size(px, 1), 1), px(:,1:end-1)] + ...
+        [pz(1:end-1,:); zeros(1, size(pz, 2))] - [zeros(1, size(pz, 2)); pz(1:end-1,:)];
+end
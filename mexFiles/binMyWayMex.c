@@ -19,7 +19,8 @@
  *   maxScatters    - The number to bin up to, must be an integer greater than 1
  * 
  *  OUTPUTS
- *   histRay - 1D row array of the binned variables
+ *   histRay - 1D row array of the binned variables, double so that the counts
+ *             are consistent with the histograms from the tracing MEX files
  * 
  *  EXAMPLE:
  *   % The call
@@ -31,7 +32,7 @@
  */
 #include <mex.h>
 
-void binIt(int numScattersRay[], int histRay[], int maxScatters, int nRays);
+void binIt(int numScattersRay[], double histRay[], int maxScatters, int nRays);
 
 void mexFunction(int nlhs, mxArray *plhs[], 
                  int nrhs, const mxArray *prhs[]) {
@@ -42,7 +43,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     int nRays;
     
     /* Declare output variables */
-    int *histRay;
+    double *histRay;
     
     /* Declare other variables */
     int i;
@@ -95,8 +96,8 @@ void mexFunction(int nlhs, mxArray *plhs[],
     nRays = mxGetN(prhs[0]);
     
     /* Create output varibles */
-    plhs[0] = mxCreateNumericMatrix(1, maxScatters, mxINT32_CLASS, mxREAL);
-    histRay = (int*)mxGetData(plhs[0]); /* Safe to cast */
+    plhs[0] = mxCreateDoubleMatrix(1, maxScatters, mxREAL);
+    histRay = mxGetPr(plhs[0]);
     
     /* Check that non of the numbers in the input array are negative */
     for (i = 0; i < nRays; i++) {
@@ -114,7 +115,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     return;
 }
 
-void binIt(int numScattersRay[], int histRay[], int maxScatters, int nRays) {
+void binIt(int numScattersRay[], double histRay[], int maxScatters, int nRays) {
     int i, j;
     
     for (i = 0; i < nRays; i++) {
@@ -9,6 +9,26 @@
  *
  * The calling syntax is:
  *
+ * [killed, numScattersRay, final_pos, final_dir, memory] = ...
+ *      distributionCalcMex(V, F, N, C, mat_names, mat_functions, mat_params, ...
+ *                          max_scatter, n_rays, start_pos, start_dir, options);
+ *
+ * options is an optional struct, mem_budget is the memory budget in bytes (see
+ * MemoryAccount), dist_binned, mem_fail, dist_theta_bins and dist_phi_bins
+ * control the outputs (see get_distribution_options). memory is an optional
+ * struct of the memory allocated in bytes by kind, its field binned is true
+ * if the outputs are binned.
+ *
+ * The per-ray outputs are the number of sample scatters (1 x n_rays) and the
+ * final positions and directions (3 x n_rays) of each ray. If they do not fit
+ * in the memory budget, or dist_binned is set, the outputs are binned instead:
+ * numScattersRay is a histogram of the number of scatters (1 x max_scatter+1,
+ * element k+1 counts rays that scattered k times), final_pos is empty and
+ * final_dir is a histogram (dist_theta_bins x dist_phi_bins) of the final
+ * directions by the polar angle to the y axis, [0, 180] degrees, and the
+ * azimuthal angle atan2(z, x) + 180, [0, 360) degrees. Killed rays are only
+ * counted in killed, not in the histograms.
+ *
  * This is a MEX file for MATLAB.
  */
 
@@ -44,20 +64,25 @@ void mexFunction(int nlhs, mxArray *plhs[],
     double *N;             /* sample triangle normals 3xM */
     char **C;              /* sample composition */
     Material *M;           /* materials of the sample */
-    int nrays;             /* number of rays */
+    int64_t nrays;         /* number of rays */
     int nvert;             /* number of sample vertices */
     int ntriag_sample;     /* number of sample triangles */
     int maxScatters;       /* Maximum number of scattering events per ray */
+    const mxArray *options; /* Optional struct of simulation options */
     double *start_pos;
     double *start_dir;
     int n_provided_rays;
 
     /* Declare the output variables */
-    int killed = 0;          /* # rays stopped '.' they scattered too many times */
+    int64_t killed = 0;      /* # rays stopped '.' they scattered too many times */
     int32_t *numScattersRay; /* The number of sample scatters that each
                               * ray has undergone */
     double *final_pos;       /* The final positions of the rays */
     double *final_dir;       /* The final directions of the rays */
+    double *scatter_hist = NULL; /* Binned: histogram of the number of scatters */
+    int binned;              /* Are the outputs binned rather than per-ray */
+    int mem_fail;            /* Fail rather than bin if over the memory budget */
+    int n_theta, n_phi;      /* The number of bins of the directions */
 
     // Declare structs
     Surface3D sample;
@@ -66,7 +91,6 @@ void mexFunction(int nlhs, mxArray *plhs[],
     // surface indexing: -1 is no surface, 0 is the sample, etc
     int sample_index = 0;   
     int sphere_index = 1;
-    Rays3D all_rays;
     int gen_rays;
     
     /* For random number generation */
@@ -77,13 +101,13 @@ void mexFunction(int nlhs, mxArray *plhs[],
     /*******************************************************************************/
 
     /* Check for the right number of inputs and outputs */
-    if (nrhs != 11) {
+    if (nrhs != 11 && nrhs != 12) {
         mexErrMsgIdAndTxt("MyToolbox:tracingMex:nrhs",
-                          "11 inputs required for distributionCalcMex.");
+                          "11 or 12 inputs required for distributionCalcMex.");
     }
-    if (nlhs != 4) {
+    if (nlhs != 4 && nlhs != 5) {
         mexErrMsgIdAndTxt("MyToolbox:tracingMex:nrhs",
-                          "4 outpus required for distributionCalcMex.");
+                          "4 or 5 outpus required for distributionCalcMex.");
     }
 
     /**************************************************************************/
@@ -96,11 +120,14 @@ void mexFunction(int nlhs, mxArray *plhs[],
     F = mxGetInt32s(prhs[1]);
     N = mxGetPr(prhs[2]);
     maxScatters = (int)mxGetScalar(prhs[7]); /* mxGetScalar gives a double */
-    nrays = (int)mxGetScalar(prhs[8]);
+    nrays = get_ray_count("distributionCalcMex", prhs[8], MAX_RAY_COUNT);
     start_pos = mxGetPr(prhs[9]);
     start_dir = mxGetPr(prhs[10]);
     nvert = mxGetN(prhs[0]);
     ntriag_sample = mxGetN(prhs[1]);
+    options = nrhs > 11 ? prhs[11] : NULL;
+    get_distribution_options(options, &binned, &mem_fail, &n_theta, &n_phi);
+    reset_memory_account(get_memory_budget(options));
     
     // Get the material keys
     C = mxCalloc(ntriag_sample, sizeof(char*));
@@ -117,14 +144,11 @@ void mexFunction(int nlhs, mxArray *plhs[],
      * ray positions ourselves. */
     n_provided_rays = mxGetN(prhs[9]);
     gen_rays = n_provided_rays == 1;
-    if (nrays != n_provided_rays) {
+    if (!gen_rays && nrays != n_provided_rays) {
         mexErrMsgIdAndTxt("MyToolbox:tracingMex:nrhs",
                           "Provided ray positions is neither 1 or the specified number of rays, for distributionCalcMex.");
     }
-    if (!gen_rays) {
-        compose_rays3D(start_pos, start_dir, n_provided_rays, &all_rays);
-    }
-        
+
     
     /* Seed the random number generator with the current time */
     gettimeofday(&tv, 0);
@@ -134,73 +158,106 @@ void mexFunction(int nlhs, mxArray *plhs[],
     seedRand(t, &myrng);
     
     /* Put the sample into a struct */
+    check_memory_budget("distributionCalcMex", surface_memory(ntriag_sample));
     set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert, sample_index, &sample);
 
     /* Define sphere not to exist */
     // TODO: sphere to be passed in as a struct
     set_up_sphere(0, start_pos, 1, M[0], sphere_index, &the_sphere);
 
+    /*
+     * Bin the outputs if the per-ray outputs do not fit in the memory budget,
+     * or fail now if asked to.
+     */
+    if (!binned && !memory_fits(nrays*(int64_t)(sizeof(int32_t) + 6*sizeof(double)))) {
+        if (mem_fail)
+            check_memory_budget("distributionCalcMex",
+                    nrays*(int64_t)(sizeof(int32_t) + 6*sizeof(double)));
+        binned = 1;
+    }
+
     /*
      * Create the output matrices
      * They need to be created as the transpose of what we want because of the
      * difference in indexing between MATLAB and C.
      */
-    plhs[1] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
-    plhs[2] = mxCreateDoubleMatrix(3, nrays, mxREAL);
-    plhs[3] = mxCreateDoubleMatrix(3, nrays, mxREAL);
+    if (binned) {
+        check_memory_budget("distributionCalcMex",
+                (maxScatters + 1 + (int64_t)n_theta*n_phi)*(int64_t)sizeof(double));
+        plhs[1] = account_output(mxCreateDoubleMatrix(1, maxScatters + 1, mxREAL));
+        plhs[2] = mxCreateDoubleMatrix(3, 0, mxREAL);
+        plhs[3] = account_output(mxCreateDoubleMatrix(n_theta, n_phi, mxREAL));
+    } else {
+        plhs[1] = account_output(mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL));
+        plhs[2] = account_output(mxCreateDoubleMatrix(3, nrays, mxREAL));
+        plhs[3] = account_output(mxCreateDoubleMatrix(3, nrays, mxREAL));
+    }
 
     /* Pointers to the output matrices so we may change them*/
-    numScattersRay = (int32_t*)mxGetData(plhs[1]);
+    if (binned)
+        scatter_hist = mxGetDoubles(plhs[1]);
+    else
+        numScattersRay = (int32_t*)mxGetData(plhs[1]);
     final_pos = mxGetPr(plhs[2]);
     final_dir = mxGetPr(plhs[3]);
 
     /**************************************************************************/
 
-    /* Loop through all the rays, tracing each one */
-    int i, j;
+    /*
+     * Loop through all the rays, tracing each one. The rays are created one at
+     * a time from the inputs so no buffer of rays is needed.
+     */
+    int64_t i;
+    int j;
     for (i = 0; i < nrays; i++) {
         Ray3D the_ray;
-        
-        if (gen_rays) {
-            /* Manually initiate the ray as disired */
-            the_ray.nScatters = 0;
-            the_ray.on_element = -1;
-            the_ray.on_surface = -1;
-            for (j = 0; j < 3; j++) {
-                the_ray.position[j] = start_pos[j];
-                the_ray.direction[j] = start_dir[j];
-            }
-            
-            trace_ray_just_sample(&the_ray, &killed, maxScatters, sample, the_sphere,
-                              &myrng);
+        int64_t k = gen_rays ? 0 : 3*i;
+
+        new_Ray(&the_ray, &start_pos[k], &start_dir[k]);
+        trace_ray_just_sample(&the_ray, &killed, maxScatters, sample, the_sphere,
+                          &myrng);
+
+        if (binned) {
+            /* Killed rays have nScatters -1 and no final direction */
+            if (the_ray.nScatters < 0)
+                continue;
+            double *d = the_ray.direction;
+            double theta = acos(d[1]/sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]));
+            double phi = atan2(d[2], d[0]) + M_PI;
+            int i_theta = (int)(theta/M_PI*n_theta);
+            int i_phi = (int)(phi/(2*M_PI)*n_phi);
+            int n_scat = the_ray.nScatters < maxScatters ? the_ray.nScatters : maxScatters;
+
+            /* Guard the upper edges against rounding */
+            i_theta = i_theta < n_theta ? i_theta : n_theta - 1;
+            i_phi = i_phi < n_phi ? i_phi : n_phi - 1;
+            scatter_hist[n_scat] += 1;
+            final_dir[i_theta + n_theta*i_phi] += 1;
+        } else {
             /* Update final position an directions of ray */
             for (j = 0; j < 3; j++) {
-                int n;
+                int64_t n;
                 n = 3*i + j;
                 final_pos[n] = the_ray.position[j];
                 final_dir[n] = the_ray.direction[j];
             }
             numScattersRay[i] = the_ray.nScatters;
-        } else {
-            trace_ray_just_sample(&all_rays.rays[i], &killed, maxScatters, sample, the_sphere,
-                              &myrng);
         }
     }
-    
+
     /**************************************************************************/
 
-    if (!gen_rays) {
-        get_scatters(&all_rays, numScattersRay);
-        get_positions(&all_rays, final_pos);
-        get_directions(&all_rays, final_dir);
-        clean_up_rays(all_rays);
-    }
-    
     /* Output number of rays went into the detector */
-    plhs[0] = mxCreateDoubleScalar(killed);
+    plhs[0] = mxCreateDoubleScalar((double)killed);
 
     /* Free space */
     mxFree(C);
     mxFree(M);
     clean_up_surface(&sample);
+
+    if (nlhs > 4) {
+        plhs[4] = memory_to_struct();
+        mxAddField(plhs[4], "binned");
+        mxSetField(plhs[4], 0, "binned", mxCreateLogicalScalar(binned));
+    }
 }
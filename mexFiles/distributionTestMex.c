@@ -33,10 +33,11 @@ void mexFunction(int nlhs, mxArray *plhs[],
     const int N_OUTPUTS = 2;
     
     /* Input variables */
-    int n_rays;
+    int64_t n_rays;
     double *direction;
     double *normal;
     Material material;
+    SurfaceFrame frame;     /* The frame of the surface, normal and tangents */
     
     /* Output variables */
     double * thetas;
@@ -45,7 +46,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     /* Other varibles */
     double dir_projection[3];
     double perpendicular[3];
-    int i;
+    int64_t i;
     
     /* For random number generation */
     struct timeval tv;
@@ -74,7 +75,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
                           "initial ray normal should be 3-vector");
     
     /* Get the input variables */
-    n_rays = (int)mxGetScalar(prhs[0]);
+    n_rays = get_ray_count("distributionTestMex", prhs[0], MAX_RAY_COUNT);
     direction = mxGetDoubles(prhs[1]);
     normal = mxGetDoubles(prhs[3]);
     
@@ -84,7 +85,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
     // print parameters
     mexPrintf("Running distribution_test_mex with:\n");
-    mexPrintf("n_rays = %d \t", n_rays);
+    mexPrintf("n_rays = %lld \t", (long long)n_rays);
     mexPrintf("direction = [%.2f %.2f %.2f] \t", direction[0], direction[1],
               direction[2]);
     mexPrintf("normal = [%.2f %.2f %.2f] \n", normal[0], normal[1], normal[2]);
@@ -122,6 +123,9 @@ void mexFunction(int nlhs, mxArray *plhs[],
     // cross(normal, direction, perpendicular);
     // cross(perpendicular, normal, dir_projection);
 
+    /* The frame of the surface is the same for every ray */
+    make_frame(normal, &frame);
+
     mexPrintf("Scattering your rays... ");
     // for the specified number of rays, perform the scattering event
     // and accumulate the angle of (new_dir, normal) in the output array
@@ -131,7 +135,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
         double new_dir_proj[3];
         double new_dir[3] = {0, 1, 0};
 
-        material.func(normal, direction, new_dir, material.params, &myrng);
+        material.func(&frame, direction, new_dir, material.params, &myrng);
         normalise(new_dir);
         double tmp;
         dot(new_dir, normal, &tmp);
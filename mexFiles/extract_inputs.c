@@ -5,6 +5,10 @@
  * GNU/GPL-3.0-or-later.
  */
 #include "extract_inputs.h"
+#include "common_helpers.h"
+#include <stdio.h>
+#include <math.h>
+#include <signal.h>
 
 /*
  * Take the elements from a MATLAB cell array of strings
@@ -236,3 +240,913 @@ NBackWall get_plate(const mxArray * plate_opts, int plate_index) {
 
     return plate;
 }
+
+/*
+ * Extract the Russian roulette parameters from an optional MATLAB struct of
+ * simulation options, fields roulette_start and roulette_survival. Roulette is
+ * turned off if the fields are not present.
+ *
+ * INPUTS:
+ * - options = mxArray containing the options struct
+ */
+void get_roulette(const mxArray * options, RouletteParam * roulette) {
+    mxArray * field;
+
+    roulette->start = 0;
+    roulette->survival = 1;
+
+    if(!mxIsStruct(options))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_roulette:options",
+                          "Options must be a struct. In get_roulette.");
+
+    field = mxGetField(options, 0, "roulette_start");
+    if (field == NULL)
+        return;
+    if (!mxIsScalar(field))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_roulette:options",
+                          "Roulette start must be scalar. In get_roulette.");
+    roulette->start = (int)mxGetScalar(field);
+
+    field = mxGetField(options, 0, "roulette_survival");
+    if (field == NULL || !mxIsScalar(field))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_roulette:options",
+                          "Roulette survival probability must be given as a scalar. In get_roulette.");
+    roulette->survival = mxGetScalar(field);
+    if (roulette->survival <= 0 || roulette->survival > 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_roulette:options",
+                          "Roulette survival probability must be in (0, 1]. In get_roulette.");
+}
+
+/*
+ * Extract the ray diagnostics parameters from an optional MATLAB struct of
+ * simulation options, fields diag_bounces, diag_time, diag_capacity and
+ * diag_max_path. Any field not present takes its default value.
+ */
+void get_diagnostics_options(const mxArray * options, int * bounce_threshold,
+                             double * time_threshold, int * capacity, int * max_path) {
+    mxArray * field;
+
+    *bounce_threshold = 20;
+    *time_threshold = 0;
+    *capacity = 100;
+    *max_path = 64;
+
+    if (options == NULL)
+        return;
+    if(!mxIsStruct(options))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_diagnostics_options:options",
+                          "Options must be a struct. In get_diagnostics_options.");
+
+    field = mxGetField(options, 0, "diag_bounces");
+    if (field != NULL)
+        *bounce_threshold = (int)mxGetScalar(field);
+    field = mxGetField(options, 0, "diag_time");
+    if (field != NULL)
+        *time_threshold = mxGetScalar(field);
+    field = mxGetField(options, 0, "diag_capacity");
+    if (field != NULL)
+        *capacity = (int)mxGetScalar(field);
+    field = mxGetField(options, 0, "diag_max_path");
+    if (field != NULL)
+        *max_path = (int)mxGetScalar(field);
+
+    if (*capacity < 0 || *max_path < 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_diagnostics_options:options",
+                          "Diagnostics capacity must be >= 0 and max path >= 1. In get_diagnostics_options.");
+}
+
+/*
+ * Extract the fine model of a CAD pinhole plate near the apertures from an
+ * optional MATLAB struct of simulation options. Returns 1 if the plate is
+ * refined, 0 otherwise. C_fine must be freed by the caller.
+ */
+int get_plate_refine(const mxArray * options, Material * M, int num_materials,
+                     int surf_index, char *** C_fine, PlateRefine * refine) {
+    mxArray * V, * F, * N, * C, * regions;
+    int ntriag;
+
+    *C_fine = NULL;
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    regions = mxGetField(options, 0, "refine_regions");
+    if (regions == NULL || mxIsEmpty(regions))
+        return 0;
+
+    V = mxGetField(options, 0, "refine_V");
+    F = mxGetField(options, 0, "refine_F");
+    N = mxGetField(options, 0, "refine_N");
+    C = mxGetField(options, 0, "refine_C");
+    if (V == NULL || F == NULL || N == NULL || C == NULL)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_plate_refine:options",
+                          "The fine plate must be given with the refine regions. In get_plate_refine.");
+    if (!mxIsInt32(F))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_plate_refine:options",
+                          "The faces of the fine plate must be int32. In get_plate_refine.");
+    if (mxGetM(regions) != 4)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_plate_refine:options",
+                          "The refine regions must be 4 x n. In get_plate_refine.");
+
+    ntriag = mxGetN(F);
+    *C_fine = calloc(ntriag, sizeof(char*));
+    get_string_cell_arr(C, *C_fine);
+    set_up_surface(mxGetDoubles(V), mxGetDoubles(N), mxGetInt32s(F), *C_fine, M,
+        num_materials, ntriag, mxGetN(V), surf_index, &refine->fine);
+
+    refine->n_regions = mxGetN(regions);
+    refine->regions = mxGetDoubles(regions);
+    return 1;
+}
+
+/*
+ * The detector of each face from a field of the options, NULL if it is not
+ * given, in a newly allocated array.
+ */
+static int * get_face_detectors(const mxArray * options, char const * name, int n_faces) {
+    mxArray * field = mxGetField(options, 0, name);
+    double const * data;
+    int * faces;
+    int i;
+
+    if (field == NULL || mxIsEmpty(field))
+        return NULL;
+    if (!mxIsDouble(field) || (int)mxGetNumberOfElements(field) != n_faces)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                          "%s must give the detector of each face. In get_detector_regions.", name);
+
+    data = mxGetDoubles(field);
+    faces = malloc((n_faces > 0 ? n_faces : 1)*sizeof(int));
+    for (i = 0; i < n_faces; i++) {
+        if (data[i] < 0)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                              "The detectors of the faces must be >= 0. In get_detector_regions.");
+        faces[i] = (int)data[i];
+    }
+    return faces;
+}
+
+int get_detector_regions(const mxArray * options, int n_faces, int n_fine_faces,
+                         DetectorRegions * const regions) {
+    mxArray * polygons, * sizes, * ids;
+    int * faces, * fine_faces;
+    int * n_corners = NULL;
+    int * detector = NULL;
+    int n_regions = 0, n_vertices = 0;
+    int i;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    polygons = mxGetField(options, 0, "detector_polygons");
+    sizes = mxGetField(options, 0, "detector_sizes");
+    ids = mxGetField(options, 0, "detector_ids");
+    faces = get_face_detectors(options, "detector_faces", n_faces);
+    fine_faces = get_face_detectors(options, "detector_fine_faces", n_fine_faces);
+
+    if (ids != NULL && !mxIsEmpty(ids)) {
+        if (polygons == NULL || sizes == NULL || mxGetM(polygons) != 2 ||
+                mxGetNumberOfElements(sizes) != mxGetNumberOfElements(ids))
+            mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                              "detector_polygons (2 x n) and detector_sizes must be given with detector_ids. In get_detector_regions.");
+        n_regions = (int)mxGetNumberOfElements(ids);
+        n_corners = malloc(n_regions*sizeof(int));
+        detector = malloc(n_regions*sizeof(int));
+        for (i = 0; i < n_regions; i++) {
+            n_corners[i] = (int)mxGetDoubles(sizes)[i];
+            detector[i] = (int)mxGetDoubles(ids)[i];
+            if (n_corners[i] < 3 || detector[i] < 1)
+                mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                                  "Each detector polygon needs 3 or more corners and a detector >= 1. In get_detector_regions.");
+            n_vertices += n_corners[i];
+        }
+        if (n_vertices != (int)mxGetN(polygons))
+            mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                              "detector_sizes must add up to the corners in detector_polygons. In get_detector_regions.");
+    } else if (faces == NULL && fine_faces == NULL) {
+        return 0;
+    }
+
+    check_memory_budget("get_detector_regions", detector_regions_memory(n_regions, n_vertices));
+    set_up_detector_regions(n_regions, n_corners, n_regions > 0 ? mxGetDoubles(polygons) : NULL,
+        detector, faces, n_faces, fine_faces, n_fine_faces, regions);
+    free(n_corners);
+    free(detector);
+    if (regions->n_detect < 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_detector_regions:options",
+                          "The detector regions have no detectors. In get_detector_regions.");
+    return 1;
+}
+
+void free_detector_regions(DetectorRegions * const regions) {
+    free((int*)regions->face_detector);
+    free((int*)regions->fine_face_detector);
+    clean_up_detector_regions(regions);
+}
+
+/*
+ * The index of the pixel being simulated from the field pixel of an optional
+ * MATLAB struct of simulation options. Returns -1 if it is not given.
+ */
+int get_pixel_index(const mxArray * options) {
+    mxArray * field;
+
+    if (options == NULL || !mxIsStruct(options))
+        return -1;
+    field = mxGetField(options, 0, "pixel");
+    if (field == NULL || !mxIsScalar(field))
+        return -1;
+    return (int)mxGetScalar(field);
+}
+
+/*
+ * The number of batches the rays are traced in from the field n_batches of an
+ * optional MATLAB struct of simulation options. Returns 1 if it is not given.
+ */
+int get_n_batches(const mxArray * options) {
+    mxArray * field;
+    int n_batches;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 1;
+    field = mxGetField(options, 0, "n_batches");
+    if (field == NULL || mxIsEmpty(field))
+        return 1;
+    n_batches = (int)mxGetScalar(field);
+    if (n_batches < 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_n_batches:options",
+                          "n_batches must be >= 1. In get_n_batches.");
+    return n_batches;
+}
+
+void get_time_budget(const mxArray * options, int (*cancelled)(void),
+                     TimeBudget * const budget) {
+    mxArray * field;
+    double seconds = 0;
+
+    if (options != NULL && mxIsStruct(options)) {
+        field = mxGetField(options, 0, "time_budget");
+        if (field != NULL && !mxIsEmpty(field))
+            seconds = mxGetScalar(field);
+        if (seconds < 0)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_time_budget:options",
+                              "time_budget must be >= 0. In get_time_budget.");
+    }
+
+    /* Without a budget the call is not stopped early, as before */
+    if (!(seconds > 0)) {
+        budget_release_signal();
+        set_up_time_budget(0, NULL, budget);
+        return;
+    }
+    set_up_time_budget(seconds, cancelled, budget);
+#ifdef SIGUSR1
+    /* The handler must not outlive the MEX file if it is cleared after an error */
+    mexAtExit(budget_release_signal);
+    budget_catch_signal(SIGUSR1);
+#endif
+}
+
+int64_t get_ray_count(char const * fn_name, const mxArray * n_rays, int64_t max_rays) {
+    char id[128];
+    double n;
+
+    snprintf(id, sizeof(id), "AtomRayTracing:%s:n_rays", fn_name);
+    if (!mxIsNumeric(n_rays) || mxGetNumberOfElements(n_rays) != 1)
+        mexErrMsgIdAndTxt(id, "The number of rays of %s must be a scalar.", fn_name);
+    n = mxGetScalar(n_rays);
+    if (!(n >= 0) || n > (double)max_rays || n != floor(n))
+        mexErrMsgIdAndTxt(id, "The number of rays of %s must be a whole number in [0, %lld], not %g.",
+                          fn_name, (long long)max_rays, n);
+    return (int64_t)n;
+}
+
+mxArray * traced_to_array(int64_t const * const batch_traced, int n_batches) {
+    mxArray * out = account_output(mxCreateDoubleMatrix(1, n_batches, mxREAL));
+    int i;
+
+    for (i = 0; i < n_batches; i++)
+        mxGetDoubles(out)[i] = (double)batch_traced[i];
+    return out;
+}
+
+/*
+ * Are the diagnostics to be recorded when their output is asked for: true
+ * unless the field diagnostics of the options is present and false.
+ */
+int get_record_diagnostics(const mxArray * options) {
+    mxArray * field;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 1;
+    field = mxGetField(options, 0, "diagnostics");
+    if (field == NULL || mxIsEmpty(field))
+        return 1;
+    return mxGetScalar(field) != 0;
+}
+
+/* Is the logical field name of the options struct present and true */
+static int get_option_flag(const mxArray * options, char const * name) {
+    mxArray * field;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    field = mxGetField(options, 0, name);
+    if (field == NULL || mxIsEmpty(field))
+        return 0;
+    return mxGetScalar(field) != 0;
+}
+
+/*
+ * Is the bidirectional estimator (see bidirectional.h) to be used: the field
+ * bidirectional of the options is present and true. It does not use roulette,
+ * so asking for both is an error.
+ */
+int get_bidirectional(const mxArray * options, RouletteParam const * const roulette) {
+    if (!get_option_flag(options, "bidirectional"))
+        return 0;
+    if (roulette->start > 0)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_bidirectional:options",
+                          "Roulette cannot be used with the bidirectional estimator. In get_bidirectional.");
+    return 1;
+}
+
+/*
+ * Whether the detected paths are sampled with Metropolis chains and their
+ * parameters, from the fields metropolis, mlt_forward, mlt_mutations,
+ * mlt_chains and mlt_large_step of the options.
+ */
+int get_metropolis(const mxArray * options, RouletteParam const * const roulette,
+                   int bidirectional, int64_t n_rays, MetropolisParam * const mlt) {
+    mxArray * field;
+
+    mlt->n_forward = n_rays/10 > 1 ? n_rays/10 : 1;
+    mlt->n_mutations = n_rays;
+    mlt->n_chains = 16;
+    mlt->large_step = 0.3;
+
+    if (!get_option_flag(options, "metropolis"))
+        return 0;
+    if (roulette->start > 0 || bidirectional)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_metropolis:options",
+                          "Roulette and the bidirectional estimator cannot be used with Metropolis sampling. In get_metropolis.");
+
+    field = mxGetField(options, 0, "mlt_forward");
+    if (field != NULL && !mxIsEmpty(field))
+        mlt->n_forward = (int64_t)mxGetScalar(field);
+    field = mxGetField(options, 0, "mlt_mutations");
+    if (field != NULL && !mxIsEmpty(field))
+        mlt->n_mutations = (int64_t)mxGetScalar(field);
+    field = mxGetField(options, 0, "mlt_chains");
+    if (field != NULL && !mxIsEmpty(field))
+        mlt->n_chains = (int)mxGetScalar(field);
+    field = mxGetField(options, 0, "mlt_large_step");
+    if (field != NULL && !mxIsEmpty(field))
+        mlt->large_step = mxGetScalar(field);
+
+    if (mlt->n_forward < 1 || mlt->n_mutations < 0 || mlt->n_chains < 1 ||
+            mlt->large_step < 0 || mlt->large_step > 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_metropolis:options",
+                          "mlt_forward and mlt_chains must be >= 1, mlt_mutations >= 0 and mlt_large_step in [0, 1]. In get_metropolis.");
+    return 1;
+}
+
+/*
+ * The crease angle in radians for smoothing the normals of the sample, from
+ * the field smooth_normals (degrees) of the options, 0 if they are flat.
+ */
+double get_crease_angle(const mxArray * options, int bidirectional) {
+    mxArray * field;
+    double angle;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    field = mxGetField(options, 0, "smooth_normals");
+    if (field == NULL || mxIsEmpty(field))
+        return 0;
+    angle = mxGetScalar(field);
+    if (angle < 0 || angle > 180)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_crease_angle:options",
+                          "smooth_normals must be an angle in [0, 180] degrees. In get_crease_angle.");
+    if (angle > 0 && bidirectional)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_crease_angle:options",
+                          "Smooth normals cannot be used with the bidirectional estimator. In get_crease_angle.");
+    return angle*M_PI/180;
+}
+
+/*
+ * Set up the sample as a grid of voxels if the voxel_ids field of the options
+ * is given, the voxels are checked to be of the given materials.
+ */
+int get_voxels(const mxArray * options, Material * M, int num_materials, int surf_index,
+               int bidirectional, Surface3D * const surf) {
+    mxArray * ids, * origin, * size, * field;
+    mwSize const * sz;
+    uint8_t const * data;
+    int dims[3];
+    int brick_size = 8, normal_radius = 2;
+    int64_t n_voxels, v;
+    int k;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    ids = mxGetField(options, 0, "voxel_ids");
+    if (ids == NULL || mxIsEmpty(ids))
+        return 0;
+
+    origin = mxGetField(options, 0, "voxel_origin");
+    size = mxGetField(options, 0, "voxel_size");
+    if (origin == NULL || size == NULL || mxGetNumberOfElements(origin) != 3)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                          "voxel_origin (1 x 3) and voxel_size must be given with voxel_ids. In get_voxels.");
+    if (!mxIsUint8(ids) || mxGetNumberOfDimensions(ids) > 3)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                          "voxel_ids must be a uint8 array of up to 3 dimensions. In get_voxels.");
+    if (bidirectional)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                          "A voxel sample cannot be used with the bidirectional estimator. In get_voxels.");
+
+    field = mxGetField(options, 0, "voxel_brick");
+    if (field != NULL && !mxIsEmpty(field))
+        brick_size = (int)mxGetScalar(field);
+    field = mxGetField(options, 0, "voxel_normal_radius");
+    if (field != NULL && !mxIsEmpty(field))
+        normal_radius = (int)mxGetScalar(field);
+    if (!(mxGetScalar(size) > 0))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                          "voxel_size must be > 0. In get_voxels.");
+
+    sz = mxGetDimensions(ids);
+    for (k = 0; k < 3; k++)
+        dims[k] = k < (int)mxGetNumberOfDimensions(ids) ? (int)sz[k] : 1;
+    data = mxGetUint8s(ids);
+    n_voxels = (int64_t)mxGetNumberOfElements(ids);
+    for (v = 0; v < n_voxels; v++)
+        if (data[v] > num_materials)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                              "voxel_ids must be 0 or the index of a material. In get_voxels.");
+
+    check_memory_budget("get_voxels", voxel_grid_memory(dims, brick_size));
+    if (!set_up_voxel_surface(data, dims, mxGetDoubles(origin), mxGetScalar(size), brick_size,
+            normal_radius, M, num_materials, surf_index, surf))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_voxels:options",
+                          "Too many voxels, at most %d are allowed. In get_voxels.", INT32_MAX/6);
+    return 1;
+}
+
+/*
+ * The material map of the sample if the material_map_ids field of the options
+ * is given, the texels are checked to be of the given materials and to have
+ * the parameter they scale.
+ */
+MaterialMap * get_material_map(const mxArray * options, Material * M, int num_materials,
+                               int bidirectional) {
+    mxArray * ids, * origin, * axes, * texel, * kind, * scales, * param;
+    MaterialMap * map;
+    uint8_t const * data;
+    int dims[2];
+    int scaled_param = -1;
+    int64_t n_texels, i;
+
+    if (options == NULL || !mxIsStruct(options))
+        return NULL;
+    ids = mxGetField(options, 0, "material_map_ids");
+    if (ids == NULL || mxIsEmpty(ids))
+        return NULL;
+
+    kind = mxGetField(options, 0, "material_map_kind");
+    origin = mxGetField(options, 0, "material_map_origin");
+    axes = mxGetField(options, 0, "material_map_axes");
+    texel = mxGetField(options, 0, "material_map_texel");
+    if (kind == NULL || origin == NULL || axes == NULL || texel == NULL ||
+            mxGetNumberOfElements(origin) != 3 || mxGetNumberOfElements(axes) != 6 ||
+            mxGetNumberOfElements(texel) != 2)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                          "material_map_kind, material_map_origin (1 x 3), material_map_axes (3 x 2) and material_map_texel (1 x 2) must be given with material_map_ids. In get_material_map.");
+    if (!mxIsUint8(ids) || mxGetNumberOfDimensions(ids) > 2)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                          "material_map_ids must be a uint8 matrix. In get_material_map.");
+    if (bidirectional)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                          "A material map cannot be used with the bidirectional estimator. In get_material_map.");
+
+    dims[0] = (int)mxGetM(ids);
+    dims[1] = (int)mxGetN(ids);
+    if ((int)mxGetScalar(kind) != MATERIAL_MAP_IMAGE) {
+        dims[0] *= dims[1];
+        dims[1] = 1;
+    }
+    data = mxGetUint8s(ids);
+    n_texels = (int64_t)mxGetNumberOfElements(ids);
+
+    scales = mxGetField(options, 0, "material_map_scales");
+    if (scales != NULL && mxIsEmpty(scales))
+        scales = NULL;
+    if (scales != NULL) {
+        param = mxGetField(options, 0, "material_map_param");
+        if (param == NULL || !mxIsDouble(scales) ||
+                (int64_t)mxGetNumberOfElements(scales) != n_texels)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                              "material_map_scales must give the scale of each texel, with material_map_param. In get_material_map.");
+        scaled_param = (int)mxGetScalar(param) - 1;
+    }
+    for (i = 0; i < n_texels; i++) {
+        if (data[i] > num_materials)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                              "material_map_ids must be 0 or the index of a material. In get_material_map.");
+        if (scales != NULL && data[i] > 0 && (scaled_param < 0 ||
+                scaled_param >= M[data[i] - 1].n_params ||
+                M[data[i] - 1].n_params > MATERIAL_MAP_MAX_PARAMS))
+            mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                              "The materials of the map must have parameter material_map_param, and at most %d parameters. In get_material_map.",
+                              MATERIAL_MAP_MAX_PARAMS);
+    }
+
+    check_memory_budget("get_material_map", material_map_memory(n_texels, scales != NULL));
+    map = build_material_map((int)mxGetScalar(kind), mxGetDoubles(origin), mxGetDoubles(axes),
+        mxGetDoubles(texel), dims, data, scales != NULL ? mxGetDoubles(scales) : NULL,
+        scaled_param, M, num_materials);
+    if (map == NULL)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_material_map:options",
+                          "The texels of the material map must be of positive size and its axes not parallel. In get_material_map.");
+    return map;
+}
+
+/*
+ * Set up the coarse meshes of the sample for multilevel Monte Carlo if the
+ * mlmc_levels field of the options is given.
+ */
+int get_multilevel(const mxArray * options, Material * M, int num_materials, int surf_index,
+                   int bidirectional, int metropolis, MultilevelParam * const ml,
+                   Surface3D ** const levels) {
+    mxArray * mesh, * field;
+    int n_coarse, l;
+
+    ml->n_pilot = 1000;
+    ml->min_rays = 10;
+    *levels = NULL;
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    mesh = mxGetField(options, 0, "mlmc_levels");
+    if (mesh == NULL || mxIsEmpty(mesh))
+        return 0;
+    if (!mxIsStruct(mesh))
+        mexErrMsgIdAndTxt("AtomRayTracing:get_multilevel:options",
+                          "mlmc_levels must be a struct array of meshes. In get_multilevel.");
+    if (bidirectional || metropolis)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_multilevel:options",
+                          "The bidirectional estimator and Metropolis sampling cannot be used with multilevel Monte Carlo. In get_multilevel.");
+
+    field = mxGetField(options, 0, "mlmc_pilot");
+    if (field != NULL && !mxIsEmpty(field))
+        ml->n_pilot = (int64_t)mxGetScalar(field);
+    field = mxGetField(options, 0, "mlmc_min_rays");
+    if (field != NULL && !mxIsEmpty(field))
+        ml->min_rays = (int64_t)mxGetScalar(field);
+    if (ml->n_pilot < 2 || ml->min_rays < 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_multilevel:options",
+                          "mlmc_pilot must be >= 2 and mlmc_min_rays >= 1. In get_multilevel.");
+
+    n_coarse = mxGetNumberOfElements(mesh);
+    *levels = malloc((n_coarse + 1)*sizeof(Surface3D));
+    for (l = 0; l < n_coarse; l++) {
+        mxArray * V = mxGetField(mesh, l, "V");
+        mxArray * F = mxGetField(mesh, l, "F");
+        mxArray * N = mxGetField(mesh, l, "N");
+        mxArray * C = mxGetField(mesh, l, "C");
+        char ** C_level;
+        int ntriag;
+
+        if (V == NULL || F == NULL || N == NULL || C == NULL)
+            mexErrMsgIdAndTxt("AtomRayTracing:get_multilevel:options",
+                              "Each mesh of mlmc_levels must have the fields V, F, N and C. In get_multilevel.");
+        if (!mxIsInt32(F))
+            mexErrMsgIdAndTxt("AtomRayTracing:get_multilevel:options",
+                              "The faces of the meshes of mlmc_levels must be int32. In get_multilevel.");
+
+        /* The material keys are only needed to set up the surface */
+        ntriag = mxGetN(F);
+        check_memory_budget("get_multilevel", surface_memory(ntriag));
+        C_level = calloc(ntriag, sizeof(char*));
+        get_string_cell_arr(C, C_level);
+        set_up_surface(mxGetDoubles(V), mxGetDoubles(N), mxGetInt32s(F), C_level, M,
+            num_materials, ntriag, mxGetN(V), surf_index, &(*levels)[l]);
+        free(C_level);
+    }
+    return n_coarse;
+}
+
+/*
+ * Print the statistics of the levels of multilevel Monte Carlo if the
+ * mlmc_report field of the options is true.
+ */
+void report_multilevel(const mxArray * options, MultilevelStats const * const stats,
+                       int64_t const * const level_rays) {
+    int l, j;
+
+    if (!get_option_flag(options, "mlmc_report"))
+        return;
+    for (l = 0; l < stats->n_levels; l++) {
+        double var = 0;
+        for (j = 0; j < stats->n_detect; j++)
+            var += multilevel_variance(stats, l, j);
+        mexPrintf("level %d: %lld samples, variance %.3g, %.3g s per sample\n", l,
+                  (long long)level_rays[l], var, stats->n_samples[l] > 0 ?
+                  stats->time[l]/(double)stats->n_samples[l] : 0);
+    }
+    mexPrintf("multilevel speedup %.2f\n", multilevel_speedup(stats));
+}
+
+/*
+ * Restructure the hierarchy of a surface with treelets if the bvh_treelet field
+ * of the options is true. Surfaces without a hierarchy are left alone.
+ */
+void apply_bvh_options(const mxArray * options, Surface3D * const surf) {
+    if (surf->bvh != NULL && get_option_flag(options, "bvh_treelet"))
+        bvh_treelet_optimise(surf->bvh);
+}
+
+/*
+ * Print the build time and traversal cost of the hierarchy of a surface if the
+ * bvh_report field of the options is true. The traversal cost is the average
+ * number of nodes visited and triangles tested per ray-surface query.
+ */
+void report_bvh(const mxArray * options, char const * name, Surface3D const * const surf) {
+    SurfaceBVH const * bvh = surf->bvh;
+
+    if (!get_option_flag(options, "bvh_report"))
+        return;
+    if (bvh == NULL) {
+        mexPrintf("%s: %d faces, no hierarchy\n", name, surf->n_faces);
+        return;
+    }
+    mexPrintf("%s: %d faces, build %.3f s, treelets %.3f s, depth %d, SAH cost %.2f\n",
+              name, bvh->n_faces, bvh->build_time, bvh->treelet_time, bvh->depth,
+              bvh->sah_cost);
+    if (bvh->n_queries > 0)
+        mexPrintf("%s: %lld queries, %.1f nodes visited and %.1f triangles tested per query\n",
+                  name, (long long)bvh->n_queries,
+                  (double)bvh->n_visited/(double)bvh->n_queries,
+                  (double)bvh->n_tested/(double)bvh->n_queries);
+}
+
+/* The memory budget in bytes, the mem_budget field of the options */
+int64_t get_memory_budget(const mxArray * options) {
+    mxArray * field;
+
+    if (options == NULL || !mxIsStruct(options))
+        return 0;
+    field = mxGetField(options, 0, "mem_budget");
+    if (field == NULL || mxIsEmpty(field))
+        return 0;
+    if (!mxIsScalar(field) || mxGetScalar(field) < 0)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_memory_budget:options",
+                          "Memory budget must be a scalar >= 0. In get_memory_budget.");
+    return (int64_t)mxGetScalar(field);
+}
+
+/*
+ * Fail before allocating if the allocation would take the memory account over
+ * its budget.
+ */
+void check_memory_budget(char const * fn_name, int64_t bytes) {
+    MemoryAccount const * account = get_memory_account();
+    char id[128];
+
+    if (memory_fits(bytes))
+        return;
+    snprintf(id, sizeof(id), "AtomRayTracing:%s:memory", fn_name);
+    mexErrMsgIdAndTxt(id, "%s needs %.1f MB on top of %.1f MB in use, over the budget of %.1f MB.",
+                      fn_name, bytes/1048576.0, account->total/1048576.0,
+                      account->budget/1048576.0);
+}
+
+/*
+ * Extract the output options of distributionCalcMex. Any field not present
+ * takes its default value: per-ray outputs that are binned if they exceed the
+ * memory budget, 5 degree bins of the polar and azimuthal angles.
+ */
+void get_distribution_options(const mxArray * options, int * binned, int * fail,
+                              int * n_theta, int * n_phi) {
+    mxArray * field;
+
+    *binned = get_option_flag(options, "dist_binned");
+    *fail = get_option_flag(options, "mem_fail");
+    *n_theta = 36;
+    *n_phi = 72;
+
+    if (options == NULL || !mxIsStruct(options))
+        return;
+    field = mxGetField(options, 0, "dist_theta_bins");
+    if (field != NULL)
+        *n_theta = (int)mxGetScalar(field);
+    field = mxGetField(options, 0, "dist_phi_bins");
+    if (field != NULL)
+        *n_phi = (int)mxGetScalar(field);
+
+    if (*n_theta < 1 || *n_phi < 1)
+        mexErrMsgIdAndTxt("AtomRayTracing:get_distribution_options:options",
+                          "The number of bins must be >= 1. In get_distribution_options.");
+}
+
+mxArray * account_output(mxArray * out) {
+    account_memory(MEM_OUTPUTS, (int64_t)mxGetNumberOfElements(out)*mxGetElementSize(out));
+    return out;
+}
+
+/*
+ * Put the memory account into a MATLAB struct: the current and peak bytes of
+ * each kind of memory, the current and peak total and the budget.
+ */
+mxArray * memory_to_struct(void) {
+    const char * fields[] = {"geometry", "compositions", "rays", "outputs",
+        "peak_geometry", "peak_compositions", "peak_rays", "peak_outputs",
+        "total", "peak", "budget"};
+    MemoryAccount const * account = get_memory_account();
+    mxArray * out;
+    int k;
+
+    out = mxCreateStructMatrix(1, 1, 11, fields);
+    for (k = 0; k < MEM_N_KINDS; k++) {
+        mxSetFieldByNumber(out, 0, k, mxCreateDoubleScalar((double)account->current[k]));
+        mxSetFieldByNumber(out, 0, MEM_N_KINDS + k,
+                           mxCreateDoubleScalar((double)account->peak[k]));
+    }
+    mxSetField(out, 0, "total", mxCreateDoubleScalar((double)account->total));
+    mxSetField(out, 0, "peak", mxCreateDoubleScalar((double)account->total_peak));
+    mxSetField(out, 0, "budget", mxCreateDoubleScalar((double)account->budget));
+    return out;
+}
+
+/*
+ * Put the recorded ray diagnostics into a MATLAB struct. The stored paths are
+ * given oldest first, positions is 3 x max_path x n, faces and surfaces are
+ * max_path x n, vertices beyond the length of a path are NaN/0.
+ */
+mxArray * diagnostics_to_struct(RayDiagnostics const * const diag) {
+    const char * fields[] = {"positions", "faces", "surfaces", "path_length",
+        "status", "path_time", "time_hist", "total_time", "n_rays", "n_recorded"};
+    mwSize dims[3];
+    mxArray * out;
+    mxArray * arr;
+    double * pos;
+    double * faces;
+    double * surfaces;
+    double * path_length;
+    double * status;
+    double * path_time;
+    double * time_hist;
+    int n = diag_n_stored(diag);
+    int i, j, k;
+
+    out = mxCreateStructMatrix(1, 1, 10, fields);
+
+    dims[0] = 3;
+    dims[1] = diag->max_path;
+    dims[2] = n;
+    arr = mxCreateNumericArray(3, dims, mxDOUBLE_CLASS, mxREAL);
+    pos = mxGetDoubles(arr);
+    mxSetField(out, 0, "positions", arr);
+    arr = mxCreateDoubleMatrix(diag->max_path, n, mxREAL);
+    faces = mxGetDoubles(arr);
+    mxSetField(out, 0, "faces", arr);
+    arr = mxCreateDoubleMatrix(diag->max_path, n, mxREAL);
+    surfaces = mxGetDoubles(arr);
+    mxSetField(out, 0, "surfaces", arr);
+    arr = mxCreateDoubleMatrix(1, n, mxREAL);
+    path_length = mxGetDoubles(arr);
+    mxSetField(out, 0, "path_length", arr);
+    arr = mxCreateDoubleMatrix(1, n, mxREAL);
+    status = mxGetDoubles(arr);
+    mxSetField(out, 0, "status", arr);
+    arr = mxCreateDoubleMatrix(1, n, mxREAL);
+    path_time = mxGetDoubles(arr);
+    mxSetField(out, 0, "path_time", arr);
+
+    for (i = 0; i < n; i++) {
+        int ind = diag_stored_index(diag, i);
+        int len = diag->path_length[ind] < diag->max_path ?
+            diag->path_length[ind] : diag->max_path;
+
+        for (j = 0; j < diag->max_path; j++) {
+            for (k = 0; k < 3; k++) {
+                pos[(i*diag->max_path + j)*3 + k] = j < len ?
+                    diag->positions[(ind*diag->max_path + j)*3 + k] : mxGetNaN();
+            }
+            faces[i*diag->max_path + j] = j < len ?
+                diag->faces[ind*diag->max_path + j] + 1 : 0;
+            surfaces[i*diag->max_path + j] = j < len ?
+                diag->surfaces[ind*diag->max_path + j] : 0;
+        }
+        path_length[i] = diag->path_length[ind];
+        status[i] = diag->status[ind];
+        path_time[i] = diag->path_time[ind];
+    }
+
+    arr = mxCreateDoubleMatrix(1, DIAG_TIME_BINS, mxREAL);
+    time_hist = mxGetDoubles(arr);
+    for (i = 0; i < DIAG_TIME_BINS; i++)
+        time_hist[i] = (double)diag->time_hist[i];
+    mxSetField(out, 0, "time_hist", arr);
+    mxSetField(out, 0, "total_time", mxCreateDoubleScalar(diag->total_time));
+    mxSetField(out, 0, "n_rays", mxCreateDoubleScalar((double)diag->n_rays));
+    mxSetField(out, 0, "n_recorded", mxCreateDoubleScalar(diag->n_recorded));
+
+    return out;
+}
+
+/*
+ * Put the features of the first bounce into a MATLAB struct. depth and normal
+ * are the means over the rays that hit something, the normal is not
+ * renormalised so its length falls where the pixel sees several orientations.
+ * material_hist counts the first hits on each material, the last being the
+ * sphere, and material_names labels them. The fractions are of all the rays.
+ */
+mxArray * features_to_struct(PixelFeatures const * const feat) {
+    const char * fields[] = {"n_rays", "depth", "normal", "material_hist",
+        "material_names", "frac_sample", "frac_sphere", "frac_miss"};
+    int64_t n_hit = feat->n_sample + feat->n_sphere;
+    double n_rays = feat->n_rays > 0 ? (double)feat->n_rays : 1;
+    mxArray * out;
+    mxArray * arr;
+    double * data;
+    int k;
+
+    out = mxCreateStructMatrix(1, 1, 8, fields);
+    mxSetField(out, 0, "n_rays", mxCreateDoubleScalar((double)feat->n_rays));
+    mxSetField(out, 0, "depth", mxCreateDoubleScalar(n_hit > 0 ?
+        feat->depth_sum/(double)n_hit : mxGetNaN()));
+
+    arr = mxCreateDoubleMatrix(1, 3, mxREAL);
+    data = mxGetDoubles(arr);
+    for (k = 0; k < 3; k++)
+        data[k] = n_hit > 0 ? feat->normal_sum[k]/(double)n_hit : mxGetNaN();
+    mxSetField(out, 0, "normal", arr);
+
+    arr = mxCreateDoubleMatrix(1, feat->n_materials + 1, mxREAL);
+    data = mxGetDoubles(arr);
+    for (k = 0; k <= feat->n_materials; k++)
+        data[k] = (double)feat->material_hist[k];
+    mxSetField(out, 0, "material_hist", arr);
+
+    arr = mxCreateCellMatrix(1, feat->n_materials + 1);
+    for (k = 0; k < feat->n_materials; k++)
+        mxSetCell(arr, k, mxCreateString(feat->materials[k].name));
+    mxSetCell(arr, feat->n_materials, mxCreateString("sphere"));
+    mxSetField(out, 0, "material_names", arr);
+
+    mxSetField(out, 0, "frac_sample", mxCreateDoubleScalar((double)feat->n_sample/n_rays));
+    mxSetField(out, 0, "frac_sphere", mxCreateDoubleScalar((double)feat->n_sphere/n_rays));
+    mxSetField(out, 0, "frac_miss", mxCreateDoubleScalar(
+        (double)(feat->n_rays - n_hit)/n_rays));
+
+    return out;
+}
+
+/*
+ * Put the statistics of multilevel Monte Carlo into a MATLAB struct: the
+ * samples of each level in the estimate and in the statistics (which include
+ * the pilot run), the mean and variance of a sample of each level for each
+ * detector (n_detect x n_levels), the time per sample of each level, the
+ * variance and time per ray of the finest mesh alone and the expected speedup
+ * over tracing it alone for the same variance.
+ */
+mxArray * multilevel_to_struct(MultilevelStats const * const stats,
+                               int64_t const * const level_rays) {
+    const char * fields[] = {"level_rays", "n_samples", "mean", "variance", "cost",
+        "fine_variance", "fine_cost", "speedup"};
+    int const n_levels = stats->n_levels;
+    int const n_detect = stats->n_detect;
+    int64_t const n_fine = stats->n_samples[n_levels - 1];
+    mxArray * out;
+    double * rays, * samples, * mean, * var, * cost, * fine_var;
+    int l, j;
+
+    out = mxCreateStructMatrix(1, 1, 8, fields);
+    mxSetField(out, 0, "level_rays", mxCreateDoubleMatrix(1, n_levels, mxREAL));
+    mxSetField(out, 0, "n_samples", mxCreateDoubleMatrix(1, n_levels, mxREAL));
+    mxSetField(out, 0, "mean", mxCreateDoubleMatrix(n_detect, n_levels, mxREAL));
+    mxSetField(out, 0, "variance", mxCreateDoubleMatrix(n_detect, n_levels, mxREAL));
+    mxSetField(out, 0, "cost", mxCreateDoubleMatrix(1, n_levels, mxREAL));
+    mxSetField(out, 0, "fine_variance", mxCreateDoubleMatrix(n_detect, 1, mxREAL));
+    rays = mxGetDoubles(mxGetField(out, 0, "level_rays"));
+    samples = mxGetDoubles(mxGetField(out, 0, "n_samples"));
+    mean = mxGetDoubles(mxGetField(out, 0, "mean"));
+    var = mxGetDoubles(mxGetField(out, 0, "variance"));
+    cost = mxGetDoubles(mxGetField(out, 0, "cost"));
+    fine_var = mxGetDoubles(mxGetField(out, 0, "fine_variance"));
+
+    for (l = 0; l < n_levels; l++) {
+        rays[l] = (double)level_rays[l];
+        samples[l] = (double)stats->n_samples[l];
+        cost[l] = stats->n_samples[l] > 0 ? stats->time[l]/(double)stats->n_samples[l] : 0;
+        for (j = 0; j < n_detect; j++) {
+            mean[(size_t)l*n_detect + j] = multilevel_mean(stats, l, j);
+            var[(size_t)l*n_detect + j] = multilevel_variance(stats, l, j);
+        }
+    }
+    for (j = 0; j < n_detect; j++)
+        fine_var[j] = multilevel_fine_variance(stats, j);
+    mxSetField(out, 0, "fine_cost", mxCreateDoubleScalar(n_fine > 0 ?
+        stats->fine_time/(double)n_fine : 0));
+    mxSetField(out, 0, "speedup", mxCreateDoubleScalar(multilevel_speedup(stats)));
+
+    return out;
+}
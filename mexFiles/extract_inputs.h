@@ -14,6 +14,12 @@
 #include <mex.h>
 
 #include "ray_tracing_core3D.h"
+#include "diagnostics.h"
+#include "pixel_features.h"
+#include "memory_account.h"
+#include "metropolis.h"
+#include "multilevel.h"
+#include "time_budget.h"
 
 /*
  * Take the elements from a MATLAB cell array of strings
@@ -55,4 +61,236 @@ void get_source(const mxArray * source, int source_model, SourceParam * Source);
  */
 NBackWall get_plate(const mxArray * plate_opts, int plate_index);
 
+/*
+ * Extract the Russian roulette parameters from an optional MATLAB struct of
+ * simulation options, fields roulette_start and roulette_survival. Roulette is
+ * turned off if the fields are not present.
+ */
+void get_roulette(const mxArray * options, RouletteParam * roulette);
+
+/*
+ * Extract the ray diagnostics parameters from an optional MATLAB struct of
+ * simulation options, fields diag_bounces, diag_time, diag_capacity and
+ * diag_max_path. options may be NULL, in which case the defaults are used.
+ */
+void get_diagnostics_options(const mxArray * options, int * bounce_threshold,
+                             double * time_threshold, int * capacity, int * max_path);
+
+/*
+ * Extract the fine model of a CAD pinhole plate near the apertures from an
+ * optional MATLAB struct of simulation options, fields refine_V, refine_F,
+ * refine_N, refine_C (as for the plate) and refine_regions (4 x n centres and
+ * radii). Returns 1 if the plate is refined, 0 if there are no such fields.
+ * The material keys are put in a newly allocated array C_fine, which the
+ * caller must free, along with clean_up_surface on refine->fine.
+ */
+int get_plate_refine(const mxArray * options, Material * M, int num_materials,
+                     int surf_index, char *** C_fine, PlateRefine * refine);
+
+/*
+ * Labelled detector regions of a CAD pinhole plate (see DetectorRegions) from
+ * the fields of an optional MATLAB struct of simulation options:
+ * detector_polygons, 2 x n the (x, z) of the corners of the polygons in turn,
+ * detector_sizes, the number of corners of each polygon, detector_ids, the
+ * detector of each polygon, and detector_faces and detector_fine_faces, the
+ * detector of each face of the plate and of the fine plate, 0 for none. Any of
+ * them may be left out. Returns 1 if there are regions, 0 if none of the fields
+ * is given. The regions must be freed with free_detector_regions.
+ */
+int get_detector_regions(const mxArray * options, int n_faces, int n_fine_faces,
+                         DetectorRegions * const regions);
+
+void free_detector_regions(DetectorRegions * const regions);
+
+/*
+ * The index of the pixel being simulated from the field pixel of an optional
+ * MATLAB struct of simulation options, used to label the USDT probes. Returns
+ * -1 if options is NULL or has no pixel field.
+ */
+int get_pixel_index(const mxArray * options);
+
+/*
+ * The number of batches the rays are traced in, from the field n_batches of an
+ * optional MATLAB struct of simulation options. The detected rays are counted
+ * for each batch so that the variance of the counts can be estimated. Returns
+ * 1 if options is NULL or has no such field.
+ */
+int get_n_batches(const mxArray * options);
+
+/*
+ * Set up the wall-clock budget of a tracing call (see time_budget.h) from the
+ * field time_budget, in seconds, of an optional MATLAB struct of simulation
+ * options, Inf for no deadline. With a budget the call is also stopped when
+ * cancelled returns non-zero, e.g. on an interrupt from MATLAB, or SIGUSR1
+ * arrives, which is caught until budget_release_signal is called (or the MEX
+ * file is cleared). If time_budget is not given or 0 the call is never
+ * stopped early. options may be NULL.
+ */
+void get_time_budget(const mxArray * options, int (*cancelled)(void),
+                     TimeBudget * const budget);
+
+/* The most rays a double counts exactly, 2^53 */
+#define MAX_RAY_COUNT ((int64_t)1 << 53)
+
+/*
+ * The number of rays given as a MATLAB scalar, as a 64 bit integer. Raises the
+ * error AtomRayTracing:<fn_name>:n_rays unless it is a whole number in
+ * [0, max_rays], max_rays being at most MAX_RAY_COUNT.
+ */
+int64_t get_ray_count(char const * fn_name, const mxArray * n_rays, int64_t max_rays);
+
+/*
+ * Put the number of rays traced in each batch into a new MATLAB array, 1 x
+ * n_batches. The batches after a call has run out of budget have none.
+ */
+mxArray * traced_to_array(int64_t const * const batch_traced, int n_batches);
+
+/*
+ * Whether the diagnostics output, when asked for, is recorded: false only if
+ * the field diagnostics of an optional MATLAB struct of simulation options is
+ * present and false. options may be NULL.
+ */
+int get_record_diagnostics(const mxArray * options);
+
+/*
+ * Whether the rays are traced with the bidirectional estimator: the field
+ * bidirectional of an optional MATLAB struct of simulation options is present
+ * and true. Raises an error if roulette is also asked for. options may be NULL.
+ */
+int get_bidirectional(const mxArray * options, RouletteParam const * const roulette);
+
+/*
+ * Whether the detected paths are sampled with Metropolis chains: the field
+ * metropolis of an optional MATLAB struct of simulation options is present and
+ * true. The parameters of the chains are set from the fields mlt_forward,
+ * mlt_mutations, mlt_chains and mlt_large_step, by default n_rays/10 forward
+ * rays, n_rays steps, 16 chains and a large step probability of 0.3. Raises an
+ * error if roulette or the bidirectional estimator is also asked for. options
+ * may be NULL.
+ */
+int get_metropolis(const mxArray * options, RouletteParam const * const roulette,
+                   int bidirectional, int64_t n_rays, MetropolisParam * const mlt);
+
+/*
+ * The crease angle, in radians, below which the normals of the sample are
+ * smoothed across its edges (see smooth_surface_normals), from the field
+ * smooth_normals, in degrees, of an optional MATLAB struct of simulation
+ * options. 0, flat elements, if there is no such field. Raises an error if the
+ * bidirectional estimator is also asked for. options may be NULL.
+ */
+double get_crease_angle(const mxArray * options, int bidirectional);
+
+/*
+ * Set up the sample as a grid of voxels (see voxel.h) from the fields of an
+ * optional MATLAB struct of simulation options: voxel_ids, a uint8 array of the
+ * material of each voxel (x, y, z), 0 for empty and m for the mth material of
+ * M, voxel_origin, the low corner of the grid, voxel_size, the edge of the
+ * voxels, and optionally voxel_brick, the edge of the bricks in voxels
+ * (default 8, 1 for a dense grid), and voxel_normal_radius, the radius in
+ * voxels the normals are smoothed over (default 2). Returns 1 if the sample
+ * is a voxel grid, 0 if there is no voxel_ids field. Raises an error if the
+ * bidirectional estimator is also asked for. options may be NULL. The surface
+ * must be freed with clean_up_surface.
+ */
+int get_voxels(const mxArray * options, Material * M, int num_materials, int surf_index,
+               int bidirectional, Surface3D * const surf);
+
+/*
+ * The material map of the sample (see material_map.h) from the fields of an
+ * optional MATLAB struct of simulation options, as made by materialMapOptions:
+ * material_map_kind (0 stripes, 1 checker, 2 image), material_map_origin,
+ * material_map_axes (3 x 2, u then v), material_map_texel (1 x 2),
+ * material_map_ids, a uint8 array of the ids of the texels, 0 for the material
+ * of the sample and m for the mth material of M (dims[0] x dims[1] for an
+ * image), and optionally material_map_scales, the scale of parameter
+ * material_map_param (from 1) of the material of each texel. Returns NULL if
+ * there is no material_map_ids field. Raises an error if the bidirectional
+ * estimator is also asked for. options may be NULL. The map must be freed
+ * with free_material_map.
+ */
+MaterialMap * get_material_map(const mxArray * options, Material * M, int num_materials,
+                               int bidirectional);
+
+/*
+ * The coarse meshes of the sample for multilevel Monte Carlo (see multilevel.h)
+ * from the field mlmc_levels of an optional MATLAB struct of simulation
+ * options, a struct array with fields V, F, N and C (as for the sample),
+ * coarsest first. The optional fields mlmc_pilot, the samples of each level in
+ * the pilot run (default 1000), and mlmc_min_rays, the fewest samples of each
+ * level in a batch (default 10), are put in ml. Returns the number of coarse
+ * meshes, 0 if there is no mlmc_levels field. Their surfaces are set up in a
+ * newly allocated array with a further slot for the finest mesh, which the
+ * caller must free along with clean_up_surface on each. Raises an error if
+ * the bidirectional estimator or Metropolis sampling is also asked for.
+ */
+int get_multilevel(const mxArray * options, Material * M, int num_materials, int surf_index,
+                   int bidirectional, int metropolis, MultilevelParam * const ml,
+                   Surface3D ** const levels);
+
+/*
+ * Print the samples, the variance of a sample summed over the detectors and the
+ * time per sample of each level of multilevel Monte Carlo, and the expected
+ * speedup, if the field mlmc_report of an optional MATLAB struct of simulation
+ * options is true. options may be NULL.
+ */
+void report_multilevel(const mxArray * options, MultilevelStats const * const stats,
+                       int64_t const * const level_rays);
+
+/*
+ * Apply the bounding volume hierarchy options from an optional MATLAB struct of
+ * simulation options to a surface: if the field bvh_treelet is true the
+ * hierarchy is restructured with treelets. options may be NULL.
+ */
+void apply_bvh_options(const mxArray * options, Surface3D * const surf);
+
+/*
+ * Print the build time and the traversal cost of the hierarchy of a surface if
+ * the field bvh_report of an optional MATLAB struct of simulation options is
+ * true. options may be NULL.
+ */
+void report_bvh(const mxArray * options, char const * name, Surface3D const * const surf);
+
+/*
+ * The memory budget in bytes from the field mem_budget of an optional MATLAB
+ * struct of simulation options, 0 (no budget) if options is NULL or has no
+ * such field.
+ */
+int64_t get_memory_budget(const mxArray * options);
+
+/*
+ * Raise the error AtomRayTracing:<fn_name>:memory if allocating a further
+ * bytes would exceed the memory budget, see memory_fits.
+ */
+void check_memory_budget(char const * fn_name, int64_t bytes);
+
+/*
+ * Extract the output options of distributionCalcMex from an optional MATLAB
+ * struct of simulation options: dist_binned forces the binned outputs,
+ * mem_fail raises an error rather than switching to the binned outputs when
+ * the per-ray outputs exceed the memory budget, dist_theta_bins and
+ * dist_phi_bins are the number of bins of the directions. options may be NULL,
+ * in which case the defaults are used.
+ */
+void get_distribution_options(const mxArray * options, int * binned, int * fail,
+                              int * n_theta, int * n_phi);
+
+/* Add the bytes of an output array to the memory account, returns out */
+mxArray * account_output(mxArray * out);
+
+/* Put the memory account into a new MATLAB struct, all sizes in bytes */
+mxArray * memory_to_struct(void);
+
+/* Put the recorded ray diagnostics into a new MATLAB struct */
+mxArray * diagnostics_to_struct(RayDiagnostics const * const diag);
+
+/* Put the features of the first bounce of the rays into a new MATLAB struct */
+mxArray * features_to_struct(PixelFeatures const * const feat);
+
+/*
+ * Put the statistics of the levels of multilevel Monte Carlo into a new MATLAB
+ * struct, level_rays are the samples of each level in the estimate.
+ */
+mxArray * multilevel_to_struct(MultilevelStats const * const stats,
+                               int64_t const * const level_rays);
+
 #endif
@@ -0,0 +1,93 @@
+% checkSymmetry.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Gateway function for checking which symmetries a simulation with a simple
+% model of the pinhole plate has, see symmetryMex. The sample, the sphere, the
+% source and the layout of the apertures must all be unchanged.
+%
+% Calling Syntax:
+% [symmetric, perm] = checkSymmetry('name', value, ...)
+%
+% INPUTS:
+%  sample     - TriagSurface of the sample, at the centre of the scan
+%  plate      - Information on the pinhole plate model in a struct
+%  sphere     - Information on the analytic sphere, at the centre of the scan
+%  which_beam - What kind of beam is being moddled, 'Effuse, 'Uniform', or
+%               'Gaussian'
+%  beam       - Information on the beam model in an array
+%  tol        - Optional, positions are compared to within tol times the size
+%               of the sample, default 1e-6
+%
+% OUTPUTS:
+%  symmetric - 1x3 logical, is the simulation unchanged by a mirror in x
+%              (x -> -x), a mirror in z (z -> -z) and a rotation by 180 degrees
+%              about the y axis
+%  perm      - n_detectors x 3, the detector that each detector is mapped onto
+%              by each of them, 0 if the simulation is not symmetric
+function [symmetric, perm] = checkSymmetry(varargin)
+
+    tol = 1e-6;
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'sample'
+                sample_surface = varargin{i_+1};
+            case 'plate'
+                plate = varargin{i_+1};
+            case 'sphere'
+                sphere = varargin{i_+1};
+            case 'which_beam'
+                which_beam = varargin{i_+1};
+            case 'beam'
+                beam = varargin{i_+1};
+            case 'tol'
+                tol = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    % The same inputs as traceSimpleMultiGen
+    V = sample_surface.vertices';
+    F = int32(sample_surface.faces');
+    N = sample_surface.normals';
+    C = sample_surface.compositions';
+
+    mat_names = sample_surface.materials.keys;
+    mat_functions = cell(1, length(mat_names));
+    mat_params = cell(1, length(mat_names));
+    for idx = 1:length(mat_names)
+        mat_functions{idx} = sample_surface.materials(mat_names{idx}).function;
+        mat_params{idx} = sample_surface.materials(mat_names{idx}).params;
+    end
+
+    switch which_beam
+        case 'Uniform'
+            source_model = 0;
+            theta_max = beam.theta_max;
+            sigma_source = 0;
+            init_angle = pi*beam.init_angle/180;
+        case 'Gaussian'
+            source_model = 1;
+            theta_max = 0;
+            init_angle = pi*beam.init_angle/180;
+            sigma_source = beam.sigma_source;
+        case 'Effuse'
+            source_model = 2;
+            theta_max = 0;
+            sigma_source = 0;
+            init_angle = 0;
+    end
+    source_parameters = [beam.pinhole_r, ...
+        beam.pinhole_c(1), beam.pinhole_c(2), beam.pinhole_c(3), ...
+        theta_max, init_angle, sigma_source];
+
+    s = sphere.to_struct();
+    p = plate.to_struct();
+
+    [symmetric, perm] = symmetryMex(V, F, N, C, s, p, mat_names, mat_functions, ...
+        mat_params, source_model, source_parameters, tol);
+end
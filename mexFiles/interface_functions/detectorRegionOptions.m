@@ -0,0 +1,51 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Converts the labelled detector regions of a CAD pinhole plate, the
+% detector_regions field of the simulation options, into the fields that the C
+% code reads.
+%
+% Calling Syntax:
+%  options = detectorRegionOptions(options)
+%
+% INPUTS:
+%  options - struct of extra simulation options, may have the field
+%            detector_regions, a struct with fields polygons (cell array of
+%            k x 2, [x z] of the corners of each polygon in the plane of the
+%            back wall), ids (the detector of each polygon, from 1), and
+%            optionally faces and fine_faces (the detector of each face of the
+%            plate and of the fine plate, 0 for none)
+%
+% OUTPUTS:
+%  options - the options with detector_regions replaced by
+%            detector_polygons, detector_sizes, detector_ids, detector_faces
+%            and detector_fine_faces
+function options = detectorRegionOptions(options)
+    if ~isfield(options, 'detector_regions')
+        return
+    end
+
+    regions = options.detector_regions;
+    options = rmfield(options, 'detector_regions');
+    if isempty(regions)
+        return
+    end
+
+    if isfield(regions, 'polygons') && ~isempty(regions.polygons)
+        if length(regions.polygons) ~= length(regions.ids)
+            error('Each detector polygon needs a detector id.');
+        end
+        % C takes the corners as columns
+        options.detector_polygons = cell2mat(regions.polygons(:))';
+        options.detector_sizes = cellfun(@(p) size(p, 1), regions.polygons(:))';
+        options.detector_ids = double(regions.ids(:))';
+    end
+    if isfield(regions, 'faces')
+        options.detector_faces = double(regions.faces(:))';
+    end
+    if isfield(regions, 'fine_faces')
+        options.detector_fine_faces = double(regions.fine_faces(:))';
+    end
+end
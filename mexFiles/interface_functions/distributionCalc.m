@@ -8,9 +8,15 @@
 % Calling Syntax:
 %
 % INPUTS:
+%  options - Optional, struct of extra options passed to C, mem_budget (bytes)
+%            limits the memory used, if the per-ray outputs would exceed it
+%            they are binned unless mem_fail is true, see distributionCalcMex.c
 %
 % OUTPUTS:
-function [killed, numScattersRay, final_pos, final_dir] = distributionCalc(varargin)
+%  memory  - struct of the memory allocated in bytes by kind, memory.binned is
+%            true if the outputs are binned
+function [killed, numScattersRay, final_pos, final_dir, memory] = distributionCalc(varargin)
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'sample_surface'
@@ -23,6 +29,8 @@ function [killed, numScattersRay, final_pos, final_dir] = distributionCalc(varar
                 start_pos = varargin{i_+1};
             case 'start_dir'
                 start_dir = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise 
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
@@ -54,9 +62,9 @@ function [killed, numScattersRay, final_pos, final_dir] = distributionCalc(varar
     end
     
     
-    [killed, numScattersRay, final_pos, final_dir] = ...
+    [killed, numScattersRay, final_pos, final_dir, memory] = ...
         distributionCalcMex(VT, FT, NT, CT, mat_names, mat_functions, mat_params, ...
-                            maxScatters, nrays, start_pos, start_dir);
+                            maxScatters, nrays, start_pos, start_dir, options);
     
     % Remove the positions and directions of the killed rays
     %ind = numScattersRay == -1;
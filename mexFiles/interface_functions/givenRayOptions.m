@@ -0,0 +1,31 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Checks that the simulation options can be used when tracing given rays (rays
+% generated in MATLAB or a ray bank). The estimators, diagnostics and time
+% budget are only implemented where the rays are generated in C, asking for
+% them with given rays is an error rather than being silently ignored.
+%
+% Calling Syntax:
+%  givenRayOptions(options)
+%
+% INPUTS:
+%  options - struct of extra simulation options, an error is raised if any of
+%            bidirectional, metropolis, diagnostics, mlmc_levels,
+%            material_map, smooth_normals or time_budget is set
+function givenRayOptions(options)
+    c_only = {'bidirectional', 'metropolis', 'diagnostics', 'mlmc_levels', ...
+        'material_map', 'smooth_normals', 'time_budget'};
+    for i_=1:length(c_only)
+        if ~isfield(options, c_only{i_})
+            continue
+        end
+        value = options.(c_only{i_});
+        if ~isempty(value) && (~(isnumeric(value) || islogical(value)) || any(value(:)))
+            error(['The option ' c_only{i_} ' needs the rays to be generated ' ...
+                'in C (ray_model ''C'' and no ray bank).']);
+        end
+    end
+end
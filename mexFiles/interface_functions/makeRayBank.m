@@ -0,0 +1,68 @@
+% makeRayBank.m
+%
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Generates a bank of rays in C from the source model. The bank is generated
+% once for a scan and passed to switch_plate for every pixel, so all the pixels
+% use the same source rays (common random numbers across the image).
+%
+% Calling Syntax:
+%  rays = makeRayBank('name', value, ...)
+%
+% INPUTS:
+%  which_beam - What kind of beam is being moddled, 'Effuse, 'Uniform', or
+%               'Gaussian'
+%  beam       - Information on the beam model in a struct
+%  stratified - Optional, use Latin hypercube samples of the source, default
+%               true
+%
+% OUTPUTS:
+%  rays - {ray_pos, ray_dir}, each beam.n x 3, as used by switch_plate
+function rays = makeRayBank(varargin)
+
+    stratified = true;
+    for i_=1:2:length(varargin)
+        switch varargin{i_}
+            case 'which_beam'
+                which_beam = varargin{i_+1};
+            case 'beam'
+                beam = varargin{i_+1};
+            case 'stratified'
+                stratified = varargin{i_+1};
+            otherwise
+                warning([' Input ' num2str(i_) ' not recognised.'])
+        end
+    end
+
+    % Get the nessacery source information
+    switch which_beam
+        case 'Uniform'
+            source_model = 0;
+            theta_max = beam.theta_max;
+            sigma_source = 0;
+            init_angle = pi*beam.init_angle/180;
+        case 'Gaussian'
+            source_model = 1;
+            theta_max = 0;
+            init_angle = pi*beam.init_angle/180;
+            sigma_source = beam.sigma_source;
+        case 'Effuse'
+            source_model = 2;
+            theta_max = 0;
+            sigma_source = 0;
+            init_angle = 0;
+    end
+
+    source_parameters = [beam.pinhole_r, ...
+        beam.pinhole_c(1), beam.pinhole_c(2), beam.pinhole_c(3), ...
+        theta_max, init_angle, sigma_source];
+
+    [ray_pos, ray_dir] = rayBankMex(beam.n, source_model, source_parameters, ...
+        double(stratified));
+
+    % Transpose to the MATLAB convention of one ray per row
+    rays = {ray_pos', ray_dir'};
+end
@@ -0,0 +1,90 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% Converts the material map of the sample, the material_map field of the
+% simulation options, into the fields that the C code reads (see
+% get_material_map in extract_inputs.h).
+%
+% Calling Syntax:
+%  options = materialMapOptions(options, mat_names)
+%
+% INPUTS:
+%  options   - struct of extra simulation options, may have the field
+%              material_map, a struct with fields:
+%               type      - 'stripes', 'checker' or 'image'
+%               origin    - [x y z] of the low corner of the first texel
+%               u, v      - [x y z] directions of the axes of the pattern, it is
+%                           projected onto the sample along their normal
+%               texel     - [du dv] size of a texel, a stripe or a square
+%               materials - cell array of the names of the materials of the
+%                           pattern, which must be materials of the sample
+%               ids       - the id of each texel, 0 for the material of the
+%                           sample and m for the mth of materials. For stripes
+%                           and checker a vector of ids cycled through, for an
+%                           image a matrix with rows along v and columns along u
+%               scales    - optional, the scale of parameter param of the
+%                           material of each texel, the same size as ids
+%               param     - the index (from 1) of the parameter scaled
+%  mat_names - cell array of the names of the materials passed to C
+%
+% OUTPUTS:
+%  options - the options with material_map replaced by material_map_kind,
+%            material_map_origin, material_map_axes, material_map_texel,
+%            material_map_ids, and material_map_scales and material_map_param
+function options = materialMapOptions(options, mat_names)
+    if ~isfield(options, 'material_map')
+        return
+    end
+
+    map = options.material_map;
+    options = rmfield(options, 'material_map');
+    if isempty(map)
+        return
+    end
+
+    switch map.type
+        case 'stripes'
+            options.material_map_kind = 0;
+        case 'checker'
+            options.material_map_kind = 1;
+        case 'image'
+            options.material_map_kind = 2;
+        otherwise
+            error(['Unknown material map type ' map.type '.']);
+    end
+
+    % The ids of the map are turned into indices of the materials passed to C
+    index = zeros(1, length(map.materials));
+    for idx = 1:length(map.materials)
+        found = find(strcmp(mat_names, map.materials{idx}), 1);
+        if isempty(found)
+            error(['Material ' map.materials{idx} ' of the map is not a material of the sample.']);
+        end
+        index(idx) = found;
+    end
+    ids = double(map.ids);
+    if any(ids(:) < 0 | ids(:) > length(index))
+        error('The ids of the material map must be 0 or the index of one of its materials.');
+    end
+    ids(ids > 0) = index(ids(ids > 0));
+
+    options.material_map_origin = map.origin(:)';
+    options.material_map_axes = [map.u(:), map.v(:)];
+    options.material_map_texel = map.texel(:)';
+    % C takes the texels of an image along u fastest
+    if strcmp(map.type, 'image')
+        options.material_map_ids = uint8(ids');
+    else
+        options.material_map_ids = uint8(ids(:)');
+    end
+    if isfield(map, 'scales') && ~isempty(map.scales)
+        if strcmp(map.type, 'image')
+            options.material_map_scales = double(map.scales');
+        else
+            options.material_map_scales = double(map.scales(:)');
+        end
+        options.material_map_param = map.param;
+    end
+end
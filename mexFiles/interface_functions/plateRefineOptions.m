@@ -0,0 +1,37 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the 
+% GNU/GPL-3.0-or-later.
+%
+% Converts the fine model of a multi-resolution pinhole plate, the plate_refine
+% field of the simulation options, into the fields that the C code reads.
+%
+% Calling Syntax:
+%  options = plateRefineOptions(options)
+%
+% INPUTS:
+%  options - struct of extra simulation options, may have the field
+%            plate_refine, a struct with fields surface (TriagSurface of the
+%            fine plate) and regions (n x 4, [x y z r] of each refine region)
+%
+% OUTPUTS:
+%  options - the options with plate_refine replaced by refine_V, refine_F,
+%            refine_N, refine_C and refine_regions
+function options = plateRefineOptions(options)
+    if ~isfield(options, 'plate_refine')
+        return
+    end
+    
+    plate_refine = options.plate_refine;
+    options = rmfield(options, 'plate_refine');
+    if isempty(plate_refine) || isempty(plate_refine.regions)
+        return
+    end
+    
+    % As for the surfaces, C takes the transpose
+    options.refine_V = plate_refine.surface.vertices';
+    options.refine_F = int32(plate_refine.surface.faces');
+    options.refine_N = plate_refine.surface.normals';
+    options.refine_C = plate_refine.surface.compositions';
+    options.refine_regions = plate_refine.regions';
+end
@@ -0,0 +1,28 @@
+% Copyright (c) 2020, Sam Lambrick.
+% All rights reserved.
+% This file is part of the SHeM Ray Tracing Simulation, subject to the
+% GNU/GPL-3.0-or-later.
+%
+% The batch of each of a number of given rays, the rays are split into
+% options.n_batches batches of consecutive rays as tracingMultiGenMex splits the
+% rays it generates.
+%
+% Calling Syntax:
+%  [batch, n_batches] = rayBatches(n_rays, options)
+%
+% INPUTS:
+%  n_rays  - the number of rays
+%  options - struct of extra simulation options, with the optional field
+%            n_batches (default 1)
+%
+% OUTPUTS:
+%  batch     - 1 x n_rays, the batch of each ray, from 1
+%  n_batches - the number of batches
+function [batch, n_batches] = rayBatches(n_rays, options)
+    n_batches = 1;
+    if isfield(options, 'n_batches')
+        n_batches = options.n_batches;
+    end
+    batch_size = floor(n_rays/n_batches) + ((1:n_batches) <= mod(n_rays, n_batches));
+    batch = repelem(1:n_batches, batch_size);
+end
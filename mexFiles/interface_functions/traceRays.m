@@ -20,20 +20,32 @@
 %  plate      - TraigSurface of the pinhole plate
 %  scan_pos   - [scan_pos_x, scan_pos_z]
 %  sphere     - Information on the analytic sphere in a cell array
+%  options    - Optional, struct of extra simulation options passed to C,
+%               plate_refine for a multi-resolution plate (see
+%               plateRefineOptions), detector_regions for labelled detectors
+%               (see detectorRegionOptions), the options only used with rays
+%               generated in C are an error (see givenRayOptions)
 %
 %
 % OUTPUTS:
-%  cntr           - The number of detected rays
+%  cntr           - The number of detected rays, 1 x n_detectors
 %  killed         - The number of artificailly stopped rays
 %  diedNaturally  - The number of rays that did not get detected naturally
 %  final_pos      - The final positions of all the detected rays
 %  final_dir      - the final directions of all the detected rays
 %  numScattersRay - The number of scattering events each ray has undergone
-%  numScattersRayDetect - The number of scattering events each detected ray
-%                         has undergone
+%  numScattersRayDetect - Histogram of the number of scattering events detected
+%                         rays have undergone, max_scatter + 1 x n_detectors,
+%                         the last (overflow) bin is empty as there is no
+%                         roulette here
+%  detector       - The detector of each detected ray
+%  batch_counts   - Optional, the number of detected rays into each detector
+%                   (columns) of each of the options.n_batches batches of
+%                   consecutive rays (rows), see rayBatches
 function [cntr, killed, diedNaturally, final_pos, final_dir, ...
-          numScattersRayDetect, numScattersRay] = traceRays(varargin)
+          numScattersRayDetect, numScattersRay, detector, batch_counts] = traceRays(varargin)
     
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'rays'
@@ -47,6 +59,8 @@ function [cntr, killed, diedNaturally, final_pos, final_dir, ...
                 pinhole_surface = varargin{i_+1};
             case 'sphere'
                 sphere = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
@@ -65,6 +79,9 @@ function [cntr, killed, diedNaturally, final_pos, final_dir, ...
     FTS = int32(pinhole_surface.faces');
     NTS = pinhole_surface.normals';
     CTS = pinhole_surface.compositions';
+    givenRayOptions(options);
+    options = plateRefineOptions(options);
+    options = detectorRegionOptions(options);
     
     % Need to know how deep the pinhole plate is, how wide it is and how high it
     % is, this is used in determining if rays are detected, this assumes that
@@ -86,11 +103,12 @@ function [cntr, killed, diedNaturally, final_pos, final_dir, ...
     % The calling of the mex function, ...
     [cntr, killed, final_pos, final_dir, numScattersRay, detected]  = ...
         tracingMex(ray_posT, ray_dirT, VT, FT, NT, CT, VTS, FTS, ...
-                   NTS, CTS, s, backWall, mat_names, mat_functions, mat_params, max_scatter);
+                   NTS, CTS, s, backWall, mat_names, mat_functions, mat_params, ...
+                   max_scatter, options);
     
     % The number of rays that died naturally, rather than being 'killed'
     % because they scattered too many times.
-    diedNaturally = size(ray_pos, 1) - cntr - killed;
+    diedNaturally = size(ray_pos, 1) - sum(cntr) - killed;
     
     % Need to transpose the results back into the format we want
     final_pos = final_pos';
@@ -98,11 +116,20 @@ function [cntr, killed, diedNaturally, final_pos, final_dir, ...
     
     % Need to remove the excess zeros from these arrays so we don't include the
     % killed rays
-    detected = logical(detected);
-    final_pos = final_pos(detected,:);
-    final_dir = final_dir(detected,:);
-    numScattersRayDetect = numScattersRay(detected);
+    % detected is the detector of each ray, 0 if it was not detected
+    detector = detected(detected > 0);
+    final_pos = final_pos(detected > 0,:);
+    final_dir = final_dir(detected > 0,:);
     
-    numScattersRayDetect = binMyWay(numScattersRayDetect, max_scatter);
+    numScattersRayDetect = zeros(max_scatter + 1, length(cntr));
+    for i_=1:length(cntr)
+        numScattersRayDetect(:,i_) = binMyWay(numScattersRay(detected == i_), max_scatter + 1);
+    end
+    
+    if nargout > 8
+        [batch, n_batches] = rayBatches(size(ray_pos, 1), options);
+        batch_counts = accumarray([batch(detected > 0)', double(detector(:))], 1, ...
+            [n_batches, length(cntr)]);
+    end
 end
 
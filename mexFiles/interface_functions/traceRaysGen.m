@@ -7,7 +7,8 @@
 % rays in C.
 %
 % Calling Syntax:
-% [cntr, killed, diedNaturally, numScattersRay] = traceRaysGen('name', value, ...)
+% [cntr, killed, diedNaturally, numScattersRay, diagnostics, batch_counts, features, ...
+%     traced] = traceRaysGen('name', value, ...)
 %
 % INPUTS:
 %  sample     - TriagSurface of the sample
@@ -19,15 +20,40 @@
 %  which_beam - What kind of beam is being moddled, 'Effuse, 'Uniform', or
 %               'Gaussian'
 %  beam       - Information on the beam model in an array
+%  options    - Optional, struct of extra simulation options passed to C,
+%               diag_bounces, diag_time, diag_capacity and diag_max_path for
+%               the diagnostics, plate_refine for a multi-resolution plate (see
+%               plateRefineOptions), n_batches to count the rays in batches,
+%               detector_regions for labelled detectors (see
+%               detectorRegionOptions), time_budget to stop tracing after
+%               that many seconds
 %
 % OUTPUTS:
-%  cntr           - The number of detected rays
+%  cntr           - The number of detected rays, 1 x n_detectors
 %  killed         - The number of artificailly stopped rays
 %  diedNaturally  - The number of rays that did not get detected naturally
 %  numScattersRay - Histogram of the number of scattering events detected rays
-%                   have undergone
-function [cntr, killed, diedNaturally, numScattersRay] = traceRaysGen(varargin)
+%                   have undergone, max_scatter + 1 x n_detectors, the last
+%                   (overflow) bin is empty as there is no roulette here
+%  diagnostics    - Optional, struct of the paths of rays that scattered many
+%                   times or took a long time to trace and a histogram of the
+%                   time taken to trace rays, only recorded if requested
+%  batch_counts   - Optional, the number of detected rays in each of the
+%                   options.n_batches batches the rays are traced in,
+%                   n_detectors x n_batches
+%  features       - Optional, struct of the features of the first bounce of the
+%                   rays: mean depth and normal of the first hit, the number of
+%                   first hits on each material (the last is the sphere) and
+%                   the fractions hitting the sample, the sphere and nothing
+%  traced         - Optional, the number of rays traced, less than beam.n if
+%                   options.time_budget ran out or the call was interrupted
+%                   with Ctrl-C, the other outputs count only these rays
+%  batch_traced   - Optional, 1 x n_batches number of rays traced in each
+%                   batch, the batches are filled in order so a call that
+%                   stopped early has a partial batch followed by empty ones
+function [cntr, killed, diedNaturally, numScattersRay, diagnostics, batch_counts, features, traced, batch_traced] = traceRaysGen(varargin)
     
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'sample'
@@ -42,6 +68,8 @@ function [cntr, killed, diedNaturally, numScattersRay] = traceRaysGen(varargin)
                 which_beam = varargin{i_+1};
             case 'beam'
                 beam = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
@@ -58,6 +86,8 @@ function [cntr, killed, diedNaturally, numScattersRay] = traceRaysGen(varargin)
     FTS = int32(pinhole_surface.faces');
     NTS = pinhole_surface.normals';
     CTS = pinhole_surface.compositions';
+    options = plateRefineOptions(options);
+    options = detectorRegionOptions(options);
     
     mat_names = sample_surface.materials.keys;
     mat_functions = cell(1, length(mat_names));
@@ -103,12 +133,43 @@ function [cntr, killed, diedNaturally, numScattersRay] = traceRaysGen(varargin)
     
     % The calling of the mex function, ... here be dragons ... don't meddle
     % unles you know what you're doing
-    [cntr, killed, numScattersRay]  = ...
-        tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
-                mat_functions, mat_params, max_scatter, beam.n, source_model, source_parameters);
+    budgeted = isfield(options, 'time_budget') && options.time_budget > 0;
+    if budgeted && nargout < 5
+        % only the rays traced are needed, not the diagnostics
+        options.diagnostics = false;
+    end
+    batch_traced = beam.n;
+    if nargout > 7 || budgeted
+        [cntr, killed, numScattersRay, diagnostics, ~, batch_counts, features, ...
+            batch_traced] = tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, ...
+                    backWall, mat_names, mat_functions, mat_params, max_scatter, beam.n, ...
+                    source_model, source_parameters, options);
+    elseif nargout > 6
+        [cntr, killed, numScattersRay, diagnostics, ~, batch_counts, features]  = ...
+            tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
+                    mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+                    source_parameters, options);
+    elseif nargout > 5
+        [cntr, killed, numScattersRay, diagnostics, ~, batch_counts]  = ...
+            tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
+                    mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+                    source_parameters, options);
+    elseif nargout > 4
+        [cntr, killed, numScattersRay, diagnostics]  = ...
+            tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
+                    mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+                    source_parameters, options);
+    else
+        [cntr, killed, numScattersRay]  = ...
+            tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
+                    mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+                    source_parameters, options);
+    end
     
     % The number of rays that died naturally, rather than being 'killed'
     % because they scattered too many times.
-    diedNaturally = beam.n - cntr - killed;
+    traced = sum(batch_traced);
+    diedNaturally = traced - sum(cntr) - killed;
+    numScattersRay = reshape(numScattersRay, max_scatter + 1, []);
 end
 
@@ -9,7 +9,8 @@
 % rays in MATLAB.
 %
 % Calling Syntax:
-% [cntr, killed, diedNaturally, numScattersRay] = traceSimpleGen('name', value, ...)
+% [cntr, killed, diedNaturally, numScattersRay, batch_counts] = ...
+%     traceSimpleMulti('name', value, ...)
 %
 % INPUTS:
 %  sample     - TriagSurface of the sample
@@ -17,15 +18,26 @@
 %  plate      - Information on the pinhole plate model in a cell array
 %  scan_pos   - [scan_pos_x, scan_pos_z]
 %  sphere     - Information on the analytic sphere in a cell array
+%  options    - Optional, struct of extra simulation options, roulette_start
+%               and roulette_survival for Russian roulette termination of long
+%               paths and n_batches to count the rays in batches, the options
+%               only used with rays generated in C are an error (see
+%               givenRayOptions)
 %
 % OUTPUTS:
-%  cntr           - The number of detected rays
+%  cntr           - The (weighted) number of detected rays
 %  killed         - The number of artificailly stopped rays
 %  diedNaturally  - The number of rays that did not get detected naturally
 %  numScattersRay - Histogram of the number of scattering events detected rays
-%                   have undergone
-function [cntr, killed, diedNaturally, numScattersRay] = traceSimpleMulti(varargin)
+%                   have undergone, max_scatter + 1 x n_detectors, the last
+%                   (overflow) bin counts the rays that scattered more than
+%                   max_scatter times, which only roulette lets through
+%  batch_counts   - Optional, (weighted) number of detected rays into each
+%                   detector (columns) of each of the options.n_batches
+%                   batches of consecutive rays (rows)
+function [cntr, killed, diedNaturally, numScattersRay, batch_counts] = traceSimpleMulti(varargin)
     
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'rays'
@@ -39,11 +51,15 @@ function [cntr, killed, diedNaturally, numScattersRay] = traceSimpleMulti(vararg
                 plate = varargin{i_+1};
             case 'sphere'
                 sphere = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
     end
     
+    givenRayOptions(options);
+    
     % MATLAB stores matrices by column then row C does row then column. Must
     % take the traspose of the 2D arrays
     % NOTE: it is import these are the right way round
@@ -66,26 +82,28 @@ function [cntr, killed, diedNaturally, numScattersRay] = traceSimpleMulti(vararg
     p = plate.to_struct();
     
     % The calling of the mex function, ...
-    [cntr, killed, numScattersRay, detected, which_detector]  = ...
+    [cntr, killed, numScattersRay, weights, which_detector]  = ...
         tracingMultiMex(ray_posT, ray_dirT, VT, FT, NT, CT, s, p, mat_names, ...
-            mat_functions, mat_params, max_scatter);
+            mat_functions, mat_params, max_scatter, options);
     
     % The number of rays that died naturally, rather than being 'killed'
     % because they scattered too many times.
-    diedNaturally = size(ray_pos, 1) - cntr - killed;
+    detected = weights > 0;
+    diedNaturally = size(ray_pos, 1) - nnz(detected) - killed;
     
     % Need to remove the excess zeros from these arrays so we don't include the
     % killed rays
-    detected = logical(detected);
-    which_detector = which_detector(detected);
-    numScattersRayDetect = numScattersRay(detected);
+    which_detector = double(which_detector(detected));
+    numScattersRayDetect = min(double(numScattersRay(detected)), max_scatter + 1);
+    
+    % Put the number of scattering events into a histogram for each detector,
+    % each ray counted by its weight
+    numScattersRay = accumarray([numScattersRayDetect(:), which_detector(:)], ...
+        weights(detected)', [max_scatter + 1, plate.n_detectors]);
     
-    % Put the number of scattering events into a histogram for each detector
-    numScattersRay = zeros(plate.n_detectors, max_scatter);
-    for i_=1:plate.n_detectors
-        ind = which_detector == i_;
-        numScattersRay(i_,:) = binMyWay(numScattersRayDetect(ind), max_scatter);
+    if nargout > 4
+        [batch, n_batches] = rayBatches(size(ray_pos, 1), options);
+        batch_counts = accumarray([batch(detected)', which_detector(:)], ...
+            weights(detected)', [n_batches, plate.n_detectors]);
     end
-    numScattersRay = numScattersRay';   
 end
-
@@ -9,10 +9,11 @@
 % rays in C.
 %
 % Calling Syntax:
-% [counted, killed, diedNaturally, numScattersRay] = traceSimpleGen('name', value, ...)
+% [counted, killed, diedNaturally, numScattersRay, diagnostics, batch_counts, ...
+%     features, multilevel, traced] = traceSimpleMultiGen('name', value, ...)
 %
 % INPUTS:
-%  sample     - TriagSurface of the sample
+%  sample     - TriagSurface of the sample, or a VoxelSurface
 %  max_scatter - The maximum allowed scattering events
 %  plate      - Information on the pinhole plate model in a struct
 %  scan_pos   - [scan_pos_x, scan_pos_z]
@@ -20,15 +21,51 @@
 %  which_beam - What kind of beam is being moddled, 'Effuse, 'Uniform', or
 %               'Gaussian'
 %  beam       - Information on the beam model in an array
+%  options    - Optional, struct of extra simulation options passed to C, e.g.
+%               roulette_start and roulette_survival for Russian roulette
+%               termination of long paths, diag_bounces, diag_time,
+%               diag_capacity and diag_max_path for the
+%               diagnostics, n_batches to count the rays in batches,
+%               bidirectional to use the bidirectional estimator,
+%               metropolis (and mlt_forward, mlt_mutations, mlt_chains,
+%               mlt_large_step) to sample the detected paths with Metropolis
+%               chains, smooth_normals to interpolate the normals of the
+%               sample (the voxel_ fields are set from a VoxelSurface),
+%               mlmc_levels, a cell array of coarse TriagSurfaces of the sample
+%               (coarsest first) for multilevel Monte Carlo, see
+%               decimate_sample, material_map, a pattern of materials
+%               projected onto the sample, see materialMapOptions,
+%               time_budget to stop tracing after that many seconds
 %
 % OUTPUTS:
-%  counted           - The number of detected rays
+%  counted           - The (weighted) number of detected rays
 %  killed         - The number of artificailly stopped rays
 %  diedNaturally  - The number of rays that did not get detected naturally
 %  numScattersRay - Histogram of the number of scattering events detected rays
-%                   have undergone
-function [counted, killed, diedNaturally, numScattersRay] = traceSimpleMultiGen(varargin)
+%                   have undergone, max_scatter + 1 x n_detectors, the last
+%                   (overflow) bin counts the rays that scattered more than
+%                   max_scatter times, which only roulette lets through
+%  diagnostics    - Optional, struct of the paths of rays that scattered many
+%                   times or took a long time to trace and a histogram of the
+%                   time taken to trace rays, only recorded if requested
+%  batch_counts   - Optional, n_detectors x n_batches (weighted) number of
+%                   detected rays in each of the options.n_batches batches
+%  features       - Optional, struct of the features of the first bounce of the
+%                   rays: mean depth and normal of the first hit, the number of
+%                   first hits on each material (the last is the sphere) and
+%                   the fractions hitting the sample, the sphere and nothing
+%  multilevel     - Optional, struct of the samples, mean, variance and cost of
+%                   each level of multilevel Monte Carlo and its expected
+%                   speedup, empty unless options.mlmc_levels is given
+%  traced         - Optional, the number of rays traced, less than beam.n if
+%                   options.time_budget ran out or the call was interrupted
+%                   with Ctrl-C, the other outputs count only these rays
+%  batch_traced   - Optional, 1 x n_batches number of rays traced in each
+%                   batch, the batches are filled in order so a call that
+%                   stopped early has a partial batch followed by empty ones
+function [counted, killed, diedNaturally, numScattersRay, diagnostics, batch_counts, features, multilevel, traced, batch_traced] = traceSimpleMultiGen(varargin)
 
+    options = struct();
     for i_=1:2:length(varargin)
         switch varargin{i_}
             case 'sample'
@@ -43,6 +80,8 @@ function [counted, killed, diedNaturally, numScattersRay] = traceSimpleMultiGen(
                 which_beam = varargin{i_+1};
             case 'beam'
                 beam = varargin{i_+1};
+            case 'options'
+                options = varargin{i_+1};
             otherwise
                 warning([' Input ' num2str(i_) ' not recognised.'])
         end
@@ -51,12 +90,22 @@ function [counted, killed, diedNaturally, numScattersRay] = traceSimpleMultiGen(
     % MATLAB stores matrices by column then row C does row then column. Must
     % take the traspose of the 2D arrays
     % NOTE: it is import these are the right way round
-    V = sample_surface.vertices';
-    F = int32(sample_surface.faces');
-    N = sample_surface.normals';
-    C = sample_surface.compositions';
+    if isa(sample_surface, 'VoxelSurface')
+        % The voxels are passed in the options, voxel index m is the mth name
+        V = zeros(3, 0);
+        F = zeros(3, 0, 'int32');
+        N = zeros(3, 0);
+        C = cell(1, 0);
+        mat_names = sample_surface.material_names;
+        options = sample_surface.to_options(options);
+    else
+        V = sample_surface.vertices';
+        F = int32(sample_surface.faces');
+        N = sample_surface.normals';
+        C = sample_surface.compositions';
+        mat_names = sample_surface.materials.keys;
+    end
 
-    mat_names = sample_surface.materials.keys;
     mat_functions = cell(1, length(mat_names));
     mat_params = cell(1, length(mat_names));
     for idx = 1:length(mat_names)
@@ -64,6 +113,20 @@ function [counted, killed, diedNaturally, numScattersRay] = traceSimpleMultiGen(
         mat_params{idx} = sample_surface.materials(mat_names{idx}).params;
     end
 
+    options = materialMapOptions(options, mat_names);
+
+    % The coarse meshes are passed to C as structs, as the sample
+    if isfield(options, 'mlmc_levels') && iscell(options.mlmc_levels)
+        meshes = options.mlmc_levels;
+        options.mlmc_levels = struct('V', {}, 'F', {}, 'N', {}, 'C', {});
+        for idx = 1:length(meshes)
+            options.mlmc_levels(idx).V = meshes{idx}.vertices';
+            options.mlmc_levels(idx).F = int32(meshes{idx}.faces');
+            options.mlmc_levels(idx).N = meshes{idx}.normals';
+            options.mlmc_levels(idx).C = meshes{idx}.compositions';
+        end
+    end
+
     % Get the nessacery source information
     switch which_beam
         case 'Uniform'
@@ -94,14 +157,44 @@ function [counted, killed, diedNaturally, numScattersRay] = traceSimpleMultiGen(
     
     % The calling of the mex function, ... here be dragons ... don't meddle
     % unles you know what you're doing
-    [counted, killed, numScattersRay]  = tracingMultiGenMex(V, F, N, C, s, p,...
-        mat_names, mat_functions, mat_params, max_scatter, beam.n, ...
-        source_model, source_parameters);
+    budgeted = isfield(options, 'time_budget') && options.time_budget > 0;
+    if budgeted && nargout < 5
+        % only the rays traced are needed, not the diagnostics
+        options.diagnostics = false;
+    end
+    batch_traced = beam.n;
+    if nargout > 8 || budgeted
+        [counted, killed, numScattersRay, diagnostics, ~, batch_counts, features, ...
+            multilevel, batch_traced] = tracingMultiGenMex(V, F, N, C, s, p, mat_names, ...
+            mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+            source_parameters, options);
+    elseif nargout > 7
+        [counted, killed, numScattersRay, diagnostics, ~, batch_counts, features, ...
+            multilevel] = tracingMultiGenMex(V, F, N, C, s, p, mat_names, mat_functions, ...
+            mat_params, max_scatter, beam.n, source_model, source_parameters, options);
+    elseif nargout > 6
+        [counted, killed, numScattersRay, diagnostics, ~, batch_counts, features] = ...
+            tracingMultiGenMex(V, F, N, C, s, p, mat_names, mat_functions, ...
+            mat_params, max_scatter, beam.n, source_model, source_parameters, options);
+    elseif nargout > 5
+        [counted, killed, numScattersRay, diagnostics, ~, batch_counts] = tracingMultiGenMex(V, F, N, C, s, p,...
+            mat_names, mat_functions, mat_params, max_scatter, beam.n, ...
+            source_model, source_parameters, options);
+    elseif nargout > 4
+        [counted, killed, numScattersRay, diagnostics]  = tracingMultiGenMex(V, F, N, C, s, p,...
+            mat_names, mat_functions, mat_params, max_scatter, beam.n, ...
+            source_model, source_parameters, options);
+    else
+        [counted, killed, numScattersRay]  = tracingMultiGenMex(V, F, N, C, s, p,...
+            mat_names, mat_functions, mat_params, max_scatter, beam.n, ...
+            source_model, source_parameters, options);
+    end
 
-    numScattersRay = reshape(numScattersRay, max_scatter, plate.n_detectors);
+    numScattersRay = reshape(numScattersRay, max_scatter + 1, plate.n_detectors);
 
     % The number of rays that died naturally, rather than being 'killed'
     % because they scattered too many times.
-    diedNaturally = beam.n - sum(counted) - killed;
+    traced = sum(batch_traced);
+    diedNaturally = traced - sum(counted) - killed;
 end
 
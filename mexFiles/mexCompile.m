@@ -90,14 +90,16 @@ function mexCompile(recompile, library)
                 mexFiles/tracingGenMex.c ...
                 mexFiles/extract_inputs.c ...
                 atom_ray_tracing_library/atom_ray_tracing3D.obj ...
-                mtwister/mtwister.obj 
+                mtwister/mtwister.obj ...
+                -lut
         else
             mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
                 -outdir bin ...
                 mexFiles/tracingGenMex.c ...
                 mexFiles/extract_inputs.c ...
                 atom_ray_tracing_library/atom_ray_tracing3D.o ...
-                mtwister/mtwister.o
+                mtwister/mtwister.o ...
+                -lut
         end
     end
     
@@ -136,13 +138,63 @@ function mexCompile(recompile, library)
                 mexFiles/tracingMultiGenMex.c ...
                 mexFiles/extract_inputs.c ...
                 atom_ray_tracing_library/atom_ray_tracing3D.obj ...
-                mtwister/mtwister.obj
+                mtwister/mtwister.obj ...
+                -lut
         else
             mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
                 -outdir bin ...
                 mexFiles/tracingMultiGenMex.c ...
                 mexFiles/extract_inputs.c ...
                 atom_ray_tracing_library/atom_ray_tracing3D.o ...
+                mtwister/mtwister.o ...
+                -lut
+        end
+    end
+    
+    %% For generating a bank of source rays
+    if ispc
+        rayBankMex = 'bin/rayBankMex.mexw64';
+    else
+        rayBankMex = 'bin/rayBankMex.mexa64';
+    end
+    if ~exist(rayBankMex, 'file') || recompile
+        if ispc
+            mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
+                -outdir bin ...
+                mexFiles/rayBankMex.c ...
+                mexFiles/extract_inputs.c ...
+                atom_ray_tracing_library/atom_ray_tracing3D.obj ...
+                mtwister/mtwister.obj
+        else
+            mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
+                -outdir bin ...
+                mexFiles/rayBankMex.c ...
+                mexFiles/extract_inputs.c ...
+                atom_ray_tracing_library/atom_ray_tracing3D.o ...
+                mtwister/mtwister.o
+        end
+    end
+
+    %% For checking the symmetries of a simulation
+    if ispc
+        symmetryMex = 'bin/symmetryMex.mexw64';
+    else
+        symmetryMex = 'bin/symmetryMex.mexa64';
+    end
+    if ~exist(symmetryMex, 'file') || recompile
+        if ispc
+            mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
+                -outdir bin ...
+                mexFiles/symmetryMex.c ...
+                mexFiles/extract_inputs.c ...
+                atom_ray_tracing_library/atom_ray_tracing3D.obj ...
+                mtwister/mtwister.obj
+        else
+            mex -R2018a CFLAGS='$CFLAGS -std=c99 -I mtwister -I atom_ray_tracing_library -Wall -pedantic -Wextra -O3   ' ...
+                -outdir bin ...
+                mexFiles/symmetryMex.c ...
+                mexFiles/extract_inputs.c ...
+                atom_ray_tracing_library/atom_ray_tracing3D.o ...
                 mtwister/mtwister.o
         end
     end
@@ -217,6 +269,16 @@ function mexCompile(recompile, library)
         end
     end
     
+    %% The client of the simulation server, see server/shem_server.c
+    if isunix
+        serverMex = 'bin/serverClientMex.mexa64';
+        if ~exist(serverMex, 'file') || recompile
+            mex -R2018a CFLAGS='$CFLAGS -std=gnu99 -I server -Wall -pedantic -Wextra -O3   ' ...
+                -outdir bin ...
+                mexFiles/serverClientMex.c
+        end
+    end
+    
     %% A binning function I wrote.
     if ispc
         binMex = 'bin/binMyWayMex.mexw64';
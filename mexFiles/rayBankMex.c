@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A MEX function for generating a bank of rays from the source model, the bank
+ * is generated once per scan and reused for every pixel.
+ *
+ * The calling syntax is:
+ *  [ray_pos, ray_dir] = rayBankMex(n_rays, source_model, source_parameters, ...
+ *      stratified);
+ *
+ * INPUTS:
+ *  n_rays            - number of rays in the bank
+ *  source_model      - the source model to use to generate the rays
+ *  source_parameters - array of parameters for the source model
+ *  stratified        - true to use Latin hypercube samples of the source
+ *
+ * OUTPUTS:
+ *  ray_pos - 3xn_rays array of the initial positions of the rays
+ *  ray_dir - 3xn_rays array of the initial directions of the rays
+ *
+ * This is a MEX file for MATLAB.
+ */
+
+#include <mex.h>
+#include <matrix.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "mtwister.h"
+#include "atom_ray_tracing3D.h"
+#include "extract_inputs.h"
+
+
+/*
+ * The gateway function.
+ * lhs = left-hand-side, outputs
+ * rhs = right-hand-side, inputs
+ */
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+    /* Expected number of inputs and outputs */
+    int const NINPUTS = 4;
+    int const NOUTPUTS = 2;
+
+    /* Declare the input variables */
+    int64_t n_rays;
+    int stratified;
+    SourceParam source;
+
+    /* Declare the output variables */
+    double *ray_pos;
+    double *ray_dir;
+
+    /* Declare other variables */
+    Rays3D bank;
+
+    /* For random number generation */
+    struct timeval tv;
+    unsigned long t;
+    MTRand myrng;
+
+    /**************************************************************************/
+
+    /* Check for the right number of inputs and outputs */
+    if (nrhs != NINPUTS) {
+        mexErrMsgIdAndTxt("AtomRayTracing:rayBankMex:nrhs",
+                "%d inputs required for rayBankMex.", NINPUTS);
+    }
+    if (nlhs != NOUTPUTS) {
+        mexErrMsgIdAndTxt("AtomRayTracing:rayBankMex:nrhs",
+                "%d outputs required for rayBankMex.", NOUTPUTS);
+    }
+
+    /**************************************************************************/
+
+    /* Read the input variables */
+    /* The bank is a Rays3D, which counts its rays in an int */
+    n_rays = get_ray_count("rayBankMex", prhs[0], INT_MAX);
+    get_source(prhs[2], (int)mxGetScalar(prhs[1]), &source);
+    stratified = (int)mxGetScalar(prhs[3]);
+
+    /**************************************************************************/
+
+    // Seed the random number generator with the current time
+    gettimeofday(&tv, 0);
+    t = (unsigned long)tv.tv_sec + (unsigned long)tv.tv_usec;
+
+    // Set up the MTwister random number generator
+    seedRand(t, &myrng);
+
+    /**************************************************************************/
+
+    /* Create the output matrices */
+    plhs[0] = mxCreateDoubleMatrix(3, n_rays, mxREAL);
+    plhs[1] = mxCreateDoubleMatrix(3, n_rays, mxREAL);
+    ray_pos = mxGetDoubles(plhs[0]);
+    ray_dir = mxGetDoubles(plhs[1]);
+
+    /**************************************************************************/
+
+    create_ray_bank(&source, (int)n_rays, stratified, &myrng, &bank);
+
+    get_positions(&bank, ray_pos);
+    get_directions(&bank, ray_dir);
+
+    /**************************************************************************/
+
+    /* Free space */
+    clean_up_rays(bank);
+
+    return;
+}
+
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * The socket side of the MATLAB client of the simulation server, see
+ * server/protocol.h and classes/SimulationServer.m. MATLAB has no Unix domain
+ * sockets of its own, this only frames messages, the payloads are put
+ * together and taken apart in SimulationServer.m.
+ *
+ * The calling syntax is:
+ *
+ *  fd = serverClientMex('connect', path)
+ *  serverClientMex('send', fd, type, request_id, payload)
+ *  [type, request_id, payload] = serverClientMex('recv', fd)
+ *  serverClientMex('close', fd)
+ *
+ *  INPUTS:
+ *   path       - char array, path of the socket of the server
+ *   fd         - the connection, as returned by 'connect'
+ *   type       - the SHEM_MSG_* type of the message
+ *   request_id - the id of the request, echoed in its reply
+ *   payload    - uint8 array of the payload of the message
+ *
+ *  OUTPUTS:
+ *   fd         - the connection
+ *   type, request_id, payload - the next message from the server, waits for
+ *                one to arrive
+ *
+ * This is a MEX file for MATLAB.
+ */
+
+#include "mex.h"
+#include "protocol.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int write_all(int fd, void const * buf, size_t n) {
+    uint8_t const * p = buf;
+
+    while (n > 0) {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0)
+            return -1;
+        p += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void * buf, size_t n) {
+    uint8_t * p = buf;
+
+    while (n > 0) {
+        ssize_t k = recv(fd, p, n, 0);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return -1;
+        p += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static int get_fd(const mxArray * arr) {
+    if (!mxIsScalar(arr) || !mxIsNumeric(arr))
+        mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:fd",
+                          "The connection must be a scalar.");
+    return (int)mxGetScalar(arr);
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    char mode[16];
+
+    if (nrhs < 2 || !mxIsChar(prhs[0]))
+        mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:nrhs",
+                          "A mode and at least one argument required for serverClientMex.");
+    mxGetString(prhs[0], mode, sizeof(mode));
+
+    if (strcmp(mode, "connect") == 0) {
+        struct sockaddr_un addr;
+        int fd;
+
+        if (nrhs != 2 || !mxIsChar(prhs[1]) || nlhs > 1)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:connect",
+                              "fd = serverClientMex('connect', path).");
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (mxGetString(prhs[1], addr.sun_path, sizeof(addr.sun_path)) != 0)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:connect",
+                              "Socket path too long.");
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            if (fd >= 0)
+                close(fd);
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:connect",
+                              "Could not connect to %s: %s.", addr.sun_path, strerror(errno));
+        }
+        plhs[0] = mxCreateDoubleScalar(fd);
+    } else if (strcmp(mode, "send") == 0) {
+        ShemMsgHeader head;
+        int fd;
+
+        if (nrhs != 5 || !mxIsUint8(prhs[4]))
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:send",
+                              "serverClientMex('send', fd, type, request_id, uint8 payload).");
+        fd = get_fd(prhs[1]);
+        head.magic = SHEM_MAGIC;
+        head.version = SHEM_PROTOCOL_VERSION;
+        head.type = (uint16_t)mxGetScalar(prhs[2]);
+        head.request_id = (uint32_t)mxGetScalar(prhs[3]);
+        head.reserved = 0;
+        head.length = mxGetNumberOfElements(prhs[4]);
+        if (write_all(fd, &head, SHEM_HEADER_SIZE) != 0 ||
+                write_all(fd, mxGetData(prhs[4]), head.length) != 0)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:send",
+                              "Could not send to the server: %s.", strerror(errno));
+    } else if (strcmp(mode, "recv") == 0) {
+        ShemMsgHeader head;
+        int fd;
+
+        if (nrhs != 2 || nlhs != 3)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:recv",
+                              "[type, request_id, payload] = serverClientMex('recv', fd).");
+        fd = get_fd(prhs[1]);
+        if (read_all(fd, &head, SHEM_HEADER_SIZE) != 0 || head.magic != SHEM_MAGIC)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:recv",
+                              "Lost the connection to the server.");
+        plhs[0] = mxCreateDoubleScalar(head.type);
+        plhs[1] = mxCreateDoubleScalar(head.request_id);
+        plhs[2] = mxCreateNumericMatrix(1, (mwSize)head.length, mxUINT8_CLASS, mxREAL);
+        if (read_all(fd, mxGetData(plhs[2]), head.length) != 0)
+            mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:recv",
+                              "Lost the connection to the server.");
+    } else if (strcmp(mode, "close") == 0) {
+        close(get_fd(prhs[1]));
+    } else {
+        mexErrMsgIdAndTxt("AtomRayTracing:serverClientMex:mode",
+                          "Unknown mode %s.", mode);
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A MEX function checking which symmetries a simulation with the simple
+ * (N aperture) model of the pinhole plate has, see symmetry.h.
+ *
+ * The calling syntax is:
+ *  [symmetric, perm] = symmetryMex(V, F, N, C, sphere, plate, mat_names, ...
+ *      mat_functions, mat_params, source_model, source_parameters, tol);
+ *
+ * INPUTS:
+ *  V, F, N, C, sphere, plate, mat_names, mat_functions, mat_params,
+ *  source_model, source_parameters - as for tracingMultiGenMex
+ *  tol - positions are compared to within tol times the size of the sample,
+ *        the plate or the sphere
+ *
+ * OUTPUTS:
+ *  symmetric - 1x3 logical, is the simulation unchanged by a mirror in x
+ *              (x -> -x), a mirror in z (z -> -z) and a rotation by 180
+ *              degrees about the y axis ((x, z) -> (-x, -z))
+ *  perm      - n_detect x 3, the detector that each detector maps onto under
+ *              each of them, 0 if the simulation is not symmetric
+ *
+ * This is a MEX file for MATLAB.
+ */
+
+#include <mex.h>
+#include <matrix.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "mtwister.h"
+#include "atom_ray_tracing3D.h"
+#include "extract_inputs.h"
+
+
+/*
+ * The gateway function.
+ * lhs = left-hand-side, outputs
+ * rhs = right-hand-side, inputs
+ */
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+    /* Expected number of inputs and outputs */
+    int const NINPUTS = 12;
+    int const NOUTPUTS = 2;
+
+    /* Declare the input variables */
+    double * V;
+    int32_t * F;
+    double * N;
+    char ** C;
+    Material * M;
+    int ntriag_sample, nvert, num_materials;
+    double tol;
+
+    /* Declare the output variables */
+    mxLogical * symmetric;
+    double * perm_out;
+
+    /* Declare other variables */
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    SourceParam source;
+    int * perm;
+    int op, j;
+
+    /* Indexing the surfaces, as tracingMultiGenMex */
+    int sample_index = 0, plate_index = 1, sphere_index = 2;
+
+    /**************************************************************************/
+
+    /* Check for the right number of inputs and outputs */
+    if (nrhs != NINPUTS) {
+        mexErrMsgIdAndTxt("AtomRayTracing:symmetryMex:nrhs",
+                "%d inputs required for symmetryMex.", NINPUTS);
+    }
+    if (nlhs != NOUTPUTS) {
+        mexErrMsgIdAndTxt("AtomRayTracing:symmetryMex:nrhs",
+                "%d outputs required for symmetryMex.", NOUTPUTS);
+    }
+
+    /**************************************************************************/
+
+    /* Read the input variables */
+    nvert = mxGetN(prhs[0]);
+    V = mxGetDoubles(prhs[0]);
+    ntriag_sample = mxGetN(prhs[1]);
+    F = mxGetInt32s(prhs[1]);
+    N = mxGetDoubles(prhs[2]);
+
+    C = calloc(ntriag_sample, sizeof(char*));
+    get_string_cell_arr(prhs[3], C);
+
+    sphere = get_sphere(prhs[4], sphere_index);
+    plate = get_plate(prhs[5], plate_index);
+
+    num_materials = mxGetN(prhs[6]);
+    M = calloc(num_materials, sizeof(Material));
+    get_materials_array(prhs[6], prhs[7], prhs[8], M);
+
+    get_source(prhs[10], (int)mxGetScalar(prhs[9]), &source);
+    tol = mxGetScalar(prhs[11]);
+
+    set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert, sample_index, &sample);
+
+    /**************************************************************************/
+
+    plhs[0] = mxCreateLogicalMatrix(1, SYM_N_OPS);
+    plhs[1] = mxCreateDoubleMatrix(plate.n_detect, SYM_N_OPS, mxREAL);
+    symmetric = mxGetLogicals(plhs[0]);
+    perm_out = mxGetDoubles(plhs[1]);
+    perm = malloc((plate.n_detect + 1)*sizeof(int));
+
+    for (op = 0; op < SYM_N_OPS; op++) {
+        symmetric[op] = scene_symmetric(&sample, &sphere, &plate, &source,
+                (SymmetryOp)op, tol, perm);
+        if (symmetric[op])
+            for (j = 0; j < plate.n_detect; j++)
+                perm_out[op*plate.n_detect + j] = perm[j] + 1;
+    }
+
+    /* Free space */
+    free(perm);
+    free(C);
+    free(M);
+    clean_up_surface(&sample);
+
+    return;
+}
@@ -9,15 +9,49 @@
  *
  * The calling syntax is:
  *
- * [cntr, killed, numScattersRay]  = ...
+ * [cntr, killed, numScattersRay, diagnostics, memory, batch_counts, features, traced] = ...
  *        tracingGenMex(VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, backWall, mat_names, ...
- *                mat_functions, mat_params, max_scatter, beam.n, source_model, source_parameters);
+ *                mat_functions, mat_params, max_scatter, beam.n, source_model, ...
+ *                source_parameters, options);
  *
  *  INPUTS:
- *   -
+ *   - options, optional struct, fields diag_bounces, diag_time, diag_capacity
+ *     and diag_max_path control which rays the diagnostics record, pixel is
+ *     the index of the pixel used to label the USDT probes, refine_V,
+ *     refine_F, refine_N, refine_C and refine_regions give the fine model of
+ *     the plate near the apertures (see PlateRefine), bvh_treelet restructures
+ *     the hierarchies of the surfaces and bvh_report prints their build time
+ *     and traversal cost (see SurfaceBVH), mem_budget is the memory budget in
+ *     bytes, exceeding it raises an error before allocating (see MemoryAccount),
+ *     n_batches traces the rays in that many batches (see batch_counts),
+ *     diagnostics false stops the diagnostics being recorded even if their
+ *     output is asked for and detector_polygons, detector_sizes, detector_ids,
+ *     detector_faces and detector_fine_faces label detector regions of the
+ *     plate (see get_detector_regions), which are all counted in one pass.
+ *     time_budget stops tracing after that many seconds, Inf for no deadline
+ *     (see get_time_budget), with a budget the call also stops early on Ctrl-C
+ *     or SIGUSR1 and the outputs count only the rays traced so far (see traced)
  *
  *  OUTPUTS:
- *   -
+ *   - cntr, 1 x n_detect detected rays of each detector, n_detect is 1 unless
+ *     there are detector regions.
+ *   - numScattersRay, 1 x (max_scatter + 1)*n_detect histogram of the sample
+ *     scattering events of the detected rays, a row of max_scatter + 1 for
+ *     each detector in turn, the last bin always empty as there is no
+ *     roulette here, see SCATTER_BINS.
+ *   - diagnostics, optional struct of the paths of rays that scattered many
+ *     times or took a long time and a histogram of the time taken to trace
+ *     the rays. Only recorded if requested.
+ *   - memory, optional struct of the memory allocated in bytes by kind, see
+ *     memory_to_struct.
+ *   - batch_counts, optional, n_detect x n_batches number of detected rays in
+ *     each batch, for estimating the variance of cntr.
+ *   - features, optional struct of the features of the first bounce of the
+ *     rays: mean depth and normal of the first hit, histogram of the materials
+ *     hit and the fractions hitting the sample, the sphere and nothing, see
+ *     features_to_struct.
+ *   - traced, optional, 1 x n_batches number of rays traced in each batch,
+ *     less than asked for if the call ran out of time or was interrupted.
  *
  * This is a MEX file for MATLAB.
  */
@@ -25,12 +59,30 @@
 #include <mex.h>
 #include <matrix.h>
 #include <stdint-gcc.h>
+#include <stdbool.h>
 #include <math.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mtwister.h"
 #include "extract_inputs.h"
 #include "atom_ray_tracing3D.h"
+#include "probes.h"
+
+/* From libut, whether Ctrl-C has been pressed in MATLAB, and clearing it */
+extern bool utIsInterruptPending(void);
+extern bool utSetInterruptPending(bool);
+
+/*
+ * Ctrl-C ends the budget of the call. It is cleared so that MATLAB returns the
+ * partial counts rather than interrupting the caller.
+ */
+static int matlab_interrupted(void) {
+    if (!utIsInterruptPending())
+        return 0;
+    utSetInterruptPending(false);
+    return 1;
+}
 
 /*
  * The gateway function.
@@ -50,7 +102,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     double *N;              /* sample triangle normals 3xM */
     char **C;               /* sample triangle diffuse level, length M */
     Material *M;            /* sample scattering parameters */
-    int n_rays;              /* number of rays */
+    int64_t n_rays;          /* number of rays */
     int nvert_sample;       /* number of vertices in the sample */
     int nvert_plate;        /* number of vertices in the plate */
     int ntriag_sample;      /* number of sample triangles */
@@ -63,19 +115,37 @@ void mexFunction(int nlhs, mxArray *plhs[],
     double *backWall;
 
     /* Declare the output variables */
-    int cntr_detected;        /* The number of detected rays */
-    int killed;               /* The number of killed rays */
-    int32_t * numScattersRay; /* The number of sample scatters that each
+    int64_t * cntr_detected;  /* The number of detected rays of each detector */
+    int64_t killed;           /* The number of killed rays */
+    double * numScattersRay;  /* The number of sample scatters that each
                               * ray has undergone */
 
     /* Indexing the surfaces, -1 refers to no surface */
-    int sample_index = 0, plate_index = 1, sphere_index = 2;
+    int sample_index = 0, plate_index = 1, sphere_index = 2, fine_index = 3;
 
     /* Declare structs */
     Surface3D sample;
     Surface3D plate;
     AnalytSphere sphere;
     SourceParam source;
+    RayDiagnostics diag;
+    PlateRefine refine;
+    int use_refine;
+    DetectorRegions regions;    /* Labelled detector regions of the plate */
+    int use_regions;
+    int n_detect;
+    char **C_fine;          /* fine pinhole plate triangle materials */
+    int diag_bounces, diag_capacity, diag_max_path;
+    double diag_time;
+    int pixel;              /* The pixel being simulated, for the probes */
+    int record_diag;        /* Are the diagnostics recorded */
+    int n_batches;          /* Number of batches the rays are traced in */
+    PixelFeatures feat;     /* Features of the first bounce, if asked for */
+    int record_feat;
+    double * batch_counts;  /* Detected rays of each batch */
+    TimeBudget budget;      /* When to stop tracing */
+    int64_t * batch_traced; /* Rays traced in each batch */
+    int i;
 
     /* For random number generation */
     struct timeval tv;
@@ -86,13 +156,13 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
     // TODO: improve the input checking
     /* Check for the right number of inputs and outputs */
-    if (nrhs != NINPUTS) {
+    if (nrhs != NINPUTS && nrhs != NINPUTS + 1) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingGenMex:nrhs",
-        		"%d inputs required for tracingGenMex.", NINPUTS);
+        		"%d or %d inputs required for tracingGenMex.", NINPUTS, NINPUTS + 1);
     }
-    if (nlhs != NOUTPUTS) {
+    if (nlhs < NOUTPUTS || nlhs > NOUTPUTS + 5) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingGenMex:nrhs",
-        		"%d outputs required for tracingGenMex.", NOUTPUTS);
+        		"%d to %d outputs required for tracingGenMex.", NOUTPUTS, NOUTPUTS + 5);
     }
 
     /**************************************************************************/
@@ -132,19 +202,33 @@ void mexFunction(int nlhs, mxArray *plhs[],
     get_materials_array(prhs[10], prhs[11], prhs[12], M);
 
     maxScatters = (int)mxGetScalar(prhs[13]); /* mxGetScalar gives a double */
-    n_rays = (int)mxGetScalar(prhs[14]);
+    n_rays = get_ray_count("tracingGenMex", prhs[14], MAX_RAY_COUNT);
 
     // TODO: pass through source as a struct?
     get_source(prhs[16], (int)mxGetScalar(prhs[15]), &source);
+    pixel = get_pixel_index(nrhs > NINPUTS ? prhs[17] : NULL);
+    SHEM_PROBE3(mex_entry, "tracingGenMex", pixel, n_rays);
+    reset_memory_account(get_memory_budget(nrhs > NINPUTS ? prhs[17] : NULL));
+
+    // diagnostics are only recorded if they are asked for
+    record_diag = nlhs > NOUTPUTS && get_record_diagnostics(nrhs > NINPUTS ? prhs[17] : NULL);
+    n_batches = get_n_batches(nrhs > NINPUTS ? prhs[17] : NULL);
+    if (record_diag) {
+        get_diagnostics_options(nrhs > NINPUTS ? prhs[17] : NULL, &diag_bounces,
+                &diag_time, &diag_capacity, &diag_max_path);
+        check_memory_budget("tracingGenMex", diagnostics_memory(diag_capacity, diag_max_path));
+        set_up_diagnostics(diag_bounces, diag_time, diag_capacity, diag_max_path, &diag);
+    }
+
+    // the features of the first bounce are only recorded if they are asked for
+    record_feat = nlhs > NOUTPUTS + 3;
+    if (record_feat) {
+        check_memory_budget("tracingGenMex", features_memory(num_materials));
+        set_up_features(M, num_materials, &feat);
+    }
     
     /**************************************************************************/
 
-    /*
-     * Number of rays that enter the detector and those that go into the detector
-     * after a single scatter
-     */
-    cntr_detected = 0;
-
     /* Number of rays that are killed as they have scattered too many times */
     killed = 0;
 
@@ -156,30 +240,94 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
     /* Put the sample and pinhole plate surface into structs */
     // TODO: can we make a sample struct that can be passed from Matlab to C?
+    check_memory_budget("tracingGenMex", surface_memory(ntriag_sample) +
+            surface_memory(ntriag_plate));
     set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert_sample, sample_index, &sample);
     set_up_surface(VS, NS, FS, CS, M, num_materials, ntriag_plate, nvert_plate, plate_index, &plate);
+    use_refine = get_plate_refine(nrhs > NINPUTS ? prhs[17] : NULL, M, num_materials,
+            fine_index, &C_fine, &refine);
+    apply_bvh_options(nrhs > NINPUTS ? prhs[17] : NULL, &sample);
+    apply_bvh_options(nrhs > NINPUTS ? prhs[17] : NULL, &plate);
+    if (use_refine)
+        apply_bvh_options(nrhs > NINPUTS ? prhs[17] : NULL, &refine.fine);
+    use_regions = get_detector_regions(nrhs > NINPUTS ? prhs[17] : NULL, ntriag_plate,
+            use_refine ? refine.fine.n_faces : 0, &regions);
+    n_detect = use_regions ? regions.n_detect : 1;
 
     /*
      * Create the output matrices
      * They need to be created as the transpose of what we want because of the
      * difference in indexing between MATLAB and C.
      */
-    plhs[2] = mxCreateNumericMatrix(1, maxScatters, mxINT32_CLASS, mxREAL);
+    check_memory_budget("tracingGenMex", (int64_t)n_detect*(SCATTER_BINS(maxScatters) +
+            2*(int64_t)n_batches + 1)*sizeof(double));
+    plhs[2] = account_output(mxCreateDoubleMatrix(1, (size_t)n_detect*SCATTER_BINS(maxScatters),
+            mxREAL));
+    batch_counts = calloc((size_t)n_detect*n_batches, sizeof(double));
+    cntr_detected = calloc(n_detect, sizeof(int64_t));
+    batch_traced = calloc(n_batches, sizeof(int64_t));
 
     //make_basic_sample(sample_index, 10, &sample);
     /* Pointers to the output matrices so we may change them*/
-    numScattersRay = (int32_t*)mxGetData(plhs[2]);
+    numScattersRay = mxGetDoubles(plhs[2]);
 
     /**************************************************************************/
 
-    /* Main implementation of the ray tracing */
-    generating_rays_cad_pinhole(source, n_rays, &killed, &cntr_detected,
-            maxScatters, sample, plate, sphere, backWall, &myrng, numScattersRay);
+    /*
+     * Main implementation of the ray tracing, the rays are split as evenly as
+     * possible between the batches. The budget starts after the set up and is
+     * checked before each chunk of rays.
+     */
+    get_time_budget(nrhs > NINPUTS ? prhs[17] : NULL, matlab_interrupted, &budget);
+    for (i = 0; i < n_batches && !budget_exhausted(&budget); i++) {
+        int64_t n_batch = n_rays/n_batches + (i < n_rays % n_batches);
+        int64_t * detected = calloc(n_detect, sizeof(int64_t));
+        int j;
+
+        batch_traced[i] = budgeted_rays_cad_pinhole(source, n_batch, &budget, &killed,
+                detected, maxScatters, sample, plate, use_refine ? &refine : NULL,
+                sphere, backWall, use_regions ? &regions : NULL,
+                record_diag ? &diag : NULL, record_feat ? &feat : NULL, &myrng,
+                numScattersRay);
+        for (j = 0; j < n_detect; j++) {
+            batch_counts[(size_t)i*n_detect + j] = (double)detected[j];
+            cntr_detected[j] += detected[j];
+        }
+        free(detected);
+    }
+
+    budget_release_signal();
 
     /**************************************************************************/
 
-    plhs[0] = mxCreateDoubleScalar(cntr_detected);
-    plhs[1] = mxCreateDoubleScalar(killed);
+    report_bvh(nrhs > NINPUTS ? prhs[17] : NULL, "sample", &sample);
+    report_bvh(nrhs > NINPUTS ? prhs[17] : NULL, "plate", &plate);
+    if (use_refine)
+        report_bvh(nrhs > NINPUTS ? prhs[17] : NULL, "fine plate", &refine.fine);
+
+    plhs[0] = mxCreateDoubleMatrix(1, n_detect, mxREAL);
+    for (i = 0; i < n_detect; i++)
+        mxGetDoubles(plhs[0])[i] = (double)cntr_detected[i];
+    free(cntr_detected);
+    plhs[1] = mxCreateDoubleScalar((double)killed);
+    if (record_diag) {
+        plhs[3] = diagnostics_to_struct(&diag);
+        clean_up_diagnostics(&diag);
+    } else if (nlhs > NOUTPUTS) {
+        plhs[3] = mxCreateDoubleMatrix(0, 0, mxREAL);
+    }
+    if (record_feat) {
+        plhs[6] = features_to_struct(&feat);
+        clean_up_features(&feat);
+    }
+    if (nlhs > NOUTPUTS + 2) {
+        plhs[5] = account_output(mxCreateDoubleMatrix(n_detect, n_batches, mxREAL));
+        memcpy(mxGetDoubles(plhs[5]), batch_counts, (size_t)n_detect*n_batches*sizeof(double));
+    }
+    free(batch_counts);
+    if (nlhs > NOUTPUTS + 4)
+        plhs[7] = traced_to_array(batch_traced, n_batches);
+    free(batch_traced);
 
     /* Free space */
     free(C);
@@ -187,6 +335,16 @@ void mexFunction(int nlhs, mxArray *plhs[],
     free(M);
     clean_up_surface(&sample);
     clean_up_surface(&plate);
+    if (use_refine)
+        clean_up_surface(&refine.fine);
+    free(C_fine);
+    if (use_regions)
+        free_detector_regions(&regions);
+
+    if (nlhs > NOUTPUTS + 1)
+        plhs[4] = memory_to_struct();
+
+    SHEM_PROBE3(mex_exit, "tracingGenMex", pixel, killed);
 
     return;
 }
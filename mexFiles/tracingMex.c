@@ -9,6 +9,21 @@
  *
  * The calling syntax is:
  *
+ * [cntr, killed, final_pos, final_dir, numScattersRay, detected, memory] = ...
+ *     tracingMex(ray_pos, ray_dir, VT, FT, NT, CT, VTS, FTS, NTS, CTS, s, ...
+ *                backWall, mat_names, mat_functions, mat_params, max_scatter, ...
+ *                options);
+ *
+ * options is an optional struct, refine_V, refine_F, refine_N, refine_C and
+ * refine_regions give the fine model of the plate near the apertures (see
+ * PlateRefine), bvh_treelet and bvh_report restructure and report on the
+ * hierarchies of the surfaces (see SurfaceBVH), mem_budget is the memory budget
+ * in bytes, exceeding it raises an error before allocating (see MemoryAccount),
+ * detector_polygons, detector_sizes, detector_ids, detector_faces and
+ * detector_fine_faces label detector regions of the plate (see
+ * get_detector_regions). cntr is 1 x n_detect, the detected rays of each
+ * detector, and detected the detector of each ray, 0 if it was not detected.
+ * memory is an optional struct of the memory allocated in bytes by kind.
  *
  * This is a MEX file for MATLAB.
  */
@@ -22,6 +37,7 @@
 #include "mtwister.h"
 #include "extract_inputs.h"
 #include "atom_ray_tracing3D.h"
+#include "probes.h"
 
 /*
  * The gateway function.
@@ -56,16 +72,27 @@ void mexFunction(int nlhs, mxArray *plhs[],
     double *backWall;
 
     /* Declare the output variables */
-    int cntr_detected;       /* The number of detected rays */
-    int killed;              /* The number of killed rays */
+    int64_t * cntr_detected; /* The number of detected rays of each detector */
+    int64_t killed;          /* The number of killed rays */
     double *final_pos;       /* The final positions of the detected rays */
     double *final_dir;       /* The final directions of the detected rays */
     int *numScattersRay; /* The number of sample scatters that each
                               * ray has undergone */
-    int *detected;       /* Logical array, detected? */
+    int *detected;       /* The detector of each ray, 0 if not detected */
 
     /* Indexing the surfaces, -1 refers to no surface */
-    int sample_index = 0, plate_index = 1, sphere_index = 2;
+    int sample_index = 0, plate_index = 1, sphere_index = 2, fine_index = 3;
+
+    /* The fine model of the plate near the apertures */
+    PlateRefine refine;
+    int use_refine;
+    char **C_fine;
+
+    /* Labelled detector regions of the plate */
+    DetectorRegions regions;
+    int use_regions;
+    int n_detect;
+    int i;
 
     /* Declare structs */
     Surface3D sample;
@@ -81,13 +108,13 @@ void mexFunction(int nlhs, mxArray *plhs[],
     /**************************************************************************/
 
     /* Check for the right number of inputs and outputs */
-    if (nrhs != NINPUTS) {
+    if (nrhs != NINPUTS && nrhs != NINPUTS + 1) {
         mexErrMsgIdAndTxt("MyToolbox:tracingMex:nrhs",
-                          "Sizteen inputs required for tracingMex.");
+                          "Sixteen or seventeen inputs required for tracingMex.");
     }
-    if (nlhs != NOUTPUTS) {
+    if (nlhs != NOUTPUTS && nlhs != NOUTPUTS + 1) {
         mexErrMsgIdAndTxt("MyToolbox:tracingMex:nrhs",
-                          "Six outpus required for tracingMex.");
+                          "Six or seven outpus required for tracingMex.");
     }
 
     /**************************************************************************/
@@ -97,6 +124,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
      *       MATLAB were of type int it is safe to cast from double to int here.
      */
     nrays = mxGetN(prhs[0]);
+    SHEM_PROBE3(mex_entry, "tracingMex", -1, nrays);
     ray_pos = mxGetPr(prhs[0]);
     ray_dir = mxGetPr(prhs[1]);
     nvert_sample = mxGetN(prhs[2]);
@@ -133,12 +161,6 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
     /**************************************************************************/
 
-    /*
-     * Number of rays that enter the detector and those that go into the detector
-     * after a single scatter
-     */
-    cntr_detected = 0;
-
     /* Number of rays that are killed as they have scattered too many times */
     killed = 0;
 
@@ -149,27 +171,42 @@ void mexFunction(int nlhs, mxArray *plhs[],
     seedRand(t, &myrng);
 
     /* Put the rays into a struct */
+    reset_memory_account(get_memory_budget(nrhs > NINPUTS ? prhs[16] : NULL));
+    check_memory_budget("tracingMex", rays_memory(nrays) + surface_memory(ntriag_sample)
+            + surface_memory(ntriag_plate));
     compose_rays3D(ray_pos, ray_dir, nrays, &all_rays);
 
     /* Put the sample and pinhole plate surface into structs */
     set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert_sample, sample_index, &sample);
     set_up_surface(VS, NS, FS, CS, M, num_materials, ntriag_plate, nvert_plate, plate_index, &plate);
-
-    plhs[2] = mxCreateDoubleMatrix(3, nrays, mxREAL);
+    use_refine = get_plate_refine(nrhs > NINPUTS ? prhs[16] : NULL, M, num_materials,
+            fine_index, &C_fine, &refine);
+    apply_bvh_options(nrhs > NINPUTS ? prhs[16] : NULL, &sample);
+    apply_bvh_options(nrhs > NINPUTS ? prhs[16] : NULL, &plate);
+    if (use_refine)
+        apply_bvh_options(nrhs > NINPUTS ? prhs[16] : NULL, &refine.fine);
+    use_regions = get_detector_regions(nrhs > NINPUTS ? prhs[16] : NULL, ntriag_plate,
+            use_refine ? refine.fine.n_faces : 0, &regions);
+    n_detect = use_regions ? regions.n_detect : 1;
+    cntr_detected = calloc(n_detect, sizeof(int64_t));
+
+    check_memory_budget("tracingMex", nrays*(int64_t)(6*sizeof(double) + 2*sizeof(int32_t)));
+    plhs[2] = account_output(mxCreateDoubleMatrix(3, nrays, mxREAL));
     final_pos = (double *)mxGetData(plhs[2]);
-    plhs[3] = mxCreateDoubleMatrix(3, nrays, mxREAL);
+    plhs[3] = account_output(mxCreateDoubleMatrix(3, nrays, mxREAL));
     final_dir = (double *)mxGetPr(plhs[3]);
-    plhs[4] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
+    plhs[4] = account_output(mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL));
     numScattersRay  = (int32_t *)mxGetData(plhs[4]);
 
-    plhs[5] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
+    plhs[5] = account_output(mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL));
     detected = (int32_t *)mxGetData(plhs[5]);
 
     /**************************************************************************/
 
     /* Main implementation of the ray tracing */
-    given_rays_cad_pinhole(&all_rays, &killed, &cntr_detected, sample, plate,
-            the_sphere, backWall, maxScatters, detected, &myrng);
+    given_rays_cad_pinhole(&all_rays, &killed, cntr_detected, sample, plate,
+            use_refine ? &refine : NULL, the_sphere, backWall,
+            use_regions ? &regions : NULL, maxScatters, detected, &myrng);
 
     /**************************************************************************/
 
@@ -178,17 +215,34 @@ void mexFunction(int nlhs, mxArray *plhs[],
     get_directions(&all_rays, final_dir);
     get_scatters(&all_rays, numScattersRay);
 
+    report_bvh(nrhs > NINPUTS ? prhs[16] : NULL, "sample", &sample);
+    report_bvh(nrhs > NINPUTS ? prhs[16] : NULL, "plate", &plate);
+    if (use_refine)
+        report_bvh(nrhs > NINPUTS ? prhs[16] : NULL, "fine plate", &refine.fine);
+
     /* Free space */
     free(C);
     free(CS);
     free(M);
     clean_up_surface(&sample);
     clean_up_surface(&plate);
+    if (use_refine)
+        clean_up_surface(&refine.fine);
+    free(C_fine);
+    if (use_regions)
+        free_detector_regions(&regions);
     clean_up_rays(all_rays);
+    if (nlhs > NOUTPUTS)
+        plhs[6] = memory_to_struct();
 
     /* Output number of rays went into the detector */
-    plhs[0] = mxCreateDoubleScalar(cntr_detected);
-    plhs[1] = mxCreateDoubleScalar(killed);
+    plhs[0] = mxCreateDoubleMatrix(1, n_detect, mxREAL);
+    for (i = 0; i < n_detect; i++)
+        mxGetDoubles(plhs[0])[i] = (double)cntr_detected[i];
+    free(cntr_detected);
+    plhs[1] = mxCreateDoubleScalar((double)killed);
+
+    SHEM_PROBE3(mex_exit, "tracingMex", -1, killed);
 
     return;
 }
@@ -8,9 +8,11 @@
  * A main MEX function for performing the SHeM Simulation.
  *
  * The calling syntax is:
- *  [counted, killed, numScattersRay]  = tracingMultiGenMex(V, F, N, C, sphere, ...
+ *  [counted, killed, numScattersRay, diagnostics, memory, batch_counts, features, ...
+ *      multilevel, traced] = ...
+ *      tracingMultiGenMex(V, F, N, C, sphere, ...
  *  	plate, mat_names, mat_functions, mat_params, max_scatter, n_rays, ...
- *      source_model, source_parameters);
+ *      source_model, source_parameters, options);
  * 
  * INPUTS:
  *  V - Vertices of the sample
@@ -26,11 +28,82 @@
  *  n_rays - number of rays to simulate
  *  source_model - string, the source model to use to generate the rays
  *  source_parameter - array of parameters for the source model
+ *  options - optional struct of extra simulation options:
+ *            roulette_start, roulette_survival - Russian roulette
+ *            termination of long paths, see RouletteParam
+ *            diag_bounces, diag_time, diag_capacity, diag_max_path - which
+ *            rays the diagnostics record, see RayDiagnostics
+ *            pixel - the index of the pixel, used to label the USDT probes
+ *            bvh_treelet, bvh_report - restructure the hierarchy of the sample
+ *            with treelets and print its build time and traversal cost, see
+ *            SurfaceBVH
+ *            mem_budget - memory budget in bytes, exceeding it raises an
+ *            error before allocating, see MemoryAccount
+ *            n_batches - trace the rays in this many batches and count the
+ *            detected rays of each, see batch_counts
+ *            diagnostics - if false the diagnostics are not recorded even if
+ *            their output is asked for
+ *            bidirectional - if true the rays are traced with the
+ *            bidirectional estimator, which also traces paths back from the
+ *            apertures, see bidirectional.h. Roulette cannot be used with it
+ *            and the diagnostics are not recorded
+ *            metropolis - if true the detected paths are sampled with
+ *            Metropolis chains in primary sample space, see metropolis.h.
+ *            mlt_forward, mlt_mutations, mlt_chains, mlt_large_step - the
+ *            rays of the forward run, the steps and number of the chains and
+ *            the probability of a large step, shared between the batches.
+ *            Roulette and the bidirectional estimator cannot be used with it
+ *            and the diagnostics are not recorded
+ *            smooth_normals - if > 0, the normals of the sample are
+ *            interpolated across its elements from normals at their vertices,
+ *            smoothed across edges sharper than this angle in degrees, see
+ *            smooth_surface_normals. Cannot be used with bidirectional
+ *            voxel_ids, voxel_origin, voxel_size, voxel_brick,
+ *            voxel_normal_radius - the sample is a grid of voxels of these
+ *            materials rather than V, F, N and C (which may be empty), see
+ *            get_voxels. Cannot be used with bidirectional
+ *            mlmc_levels, mlmc_pilot, mlmc_min_rays - coarse meshes of the
+ *            sample, coarsest first, for multilevel Monte Carlo with V, F, N
+ *            and C as the finest mesh, see multilevel.h and get_multilevel.
+ *            The diagnostics are not recorded and the features are of the
+ *            coarsest level. Cannot be used with bidirectional or metropolis
+ *            mlmc_report - print the statistics of the levels, see
+ *            report_multilevel
+ *            material_map_kind, material_map_origin, material_map_axes,
+ *            material_map_texel, material_map_ids, material_map_scales,
+ *            material_map_param - the material of the sample at each point
+ *            is given by a pattern projected onto it, see get_material_map.
+ *            Cannot be used with bidirectional
+ *            time_budget - stop tracing after this many seconds, Inf for no
+ *            deadline, see get_time_budget. With a budget the call also stops
+ *            early on Ctrl-C or SIGUSR1, and the outputs count only the rays
+ *            traced so far, see traced. The multilevel and Metropolis estimators stop only
+ *            between batches
  * 
  * OUTPUTS:
- *  counted - number of detected rays into each detector
+ *  counted - (weighted) number of detected rays into each detector
  *  killed  - number of rays that had to be stopped
- *  numScattesRay - number of scattering events each detected ray underwent
+ *  numScattesRay - (weighted) histogram of the number of sample scattering
+ *                  events of the detected rays, max_scatter + 1 bins for each
+ *                  detector in turn, the last (overflow) of the rays that
+ *                  scattered more than max_scatter times, which only roulette
+ *                  lets through, see SCATTER_BINS
+ *  diagnostics - optional, struct of the paths of rays that scattered many
+ *                times or took a long time and a histogram of the time taken
+ *                to trace the rays. Only recorded if requested.
+ *  memory - optional, struct of the memory allocated in bytes by kind, see
+ *           memory_to_struct
+ *  batch_counts - optional, n_detect x n_batches (weighted) number of detected
+ *                 rays in each batch, for estimating the variance of counted
+ *  features - optional, struct of the features of the first bounce of the
+ *             rays: mean depth and normal of the first hit, histogram of the
+ *             materials hit and the fractions hitting the sample, the sphere
+ *             and nothing, see features_to_struct
+ *  multilevel - optional, struct of the samples, mean, variance and cost of
+ *               each level of multilevel Monte Carlo, see
+ *               multilevel_to_struct. Empty unless mlmc_levels is given
+ *  traced - optional, 1 x n_batches number of rays traced in each batch, less
+ *           than asked for if the call ran out of time or was interrupted
  *
  * This is a MEX file for MATLAB.
  */
@@ -38,13 +111,30 @@
 #include <mex.h>
 #include <matrix.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <math.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mtwister.h"
 #include "atom_ray_tracing3D.h"
 #include "extract_inputs.h"
+#include "probes.h"
 
+/* From libut, whether Ctrl-C has been pressed in MATLAB, and clearing it */
+extern bool utIsInterruptPending(void);
+extern bool utSetInterruptPending(bool);
+
+/*
+ * Ctrl-C ends the budget of the call. It is cleared so that MATLAB returns the
+ * partial counts rather than interrupting the caller.
+ */
+static int matlab_interrupted(void) {
+    if (!utIsInterruptPending())
+        return 0;
+    utSetInterruptPending(false);
+    return 1;
+}
 
 /*
  * The gateway function.
@@ -64,13 +154,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     double *N;             /* sample triangle normals 3xM */
     char **C;              /* sample material keys, length M */
     Material *M;           /* materials of the sample */
-    int n_rays;            /* number of rays */
+    int64_t n_rays;        /* number of rays */
     int maxScatters;       /* Maximum number of scattering events per ray */
     
     /* Declare the output variables */
-    int32_t * cntr_detected;       /* The number of detected rays */
-    int killed = 0;                /* The number of killed rays */
-    int32_t * numScattersRay;      /* The number of sample scatters that each
+    double * cntr_detected;        /* The number of detected rays */
+    int64_t killed = 0;            /* The number of killed rays */
+    double * numScattersRay;       /* The number of sample scatters that each
                                     * ray has undergone */
 
     /* Declare other variables */
@@ -79,6 +169,31 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     NBackWall plate;
     AnalytSphere sphere;
     SourceParam source;
+    RouletteParam roulette;
+    RayDiagnostics diag;
+    int diag_bounces, diag_capacity, diag_max_path;
+    double diag_time;
+    int pixel;              /* The pixel being simulated, for the probes */
+    int record_diag;        /* Are the diagnostics recorded */
+    int n_batches;          /* Number of batches the rays are traced in */
+    PixelFeatures feat;     /* Features of the first bounce, if asked for */
+    int record_feat;
+    int bidirectional;      /* Is the bidirectional estimator used */
+    int metropolis;         /* Are the detected paths sampled with Metropolis chains */
+    MetropolisParam mlt;
+    double crease_angle;    /* Normals are smoothed across edges sharper than this */
+    int voxels;             /* Is the sample a grid of voxels */
+    MaterialMap * material_map; /* Materials of the sample by position, or NULL */
+    int n_coarse;           /* Coarse meshes of the sample for multilevel Monte Carlo */
+    Surface3D * levels;     /* The meshes of each level, the sample last */
+    MultilevelParam ml;
+    MultilevelStats ml_stats;
+    int64_t * level_rays;   /* Samples of each level in the estimate */
+    int64_t * batch_rays;   /* and in a batch */
+    double * batch_counts;  /* Detected rays of each batch */
+    TimeBudget budget;      /* When to stop tracing */
+    int64_t * batch_traced; /* Rays traced in each batch */
+    int i, j;
 
     /* Indexing the surfaces, -1 refers to no surface */
     int sample_index = 0, plate_index = 1, sphere_index = 2;
@@ -92,13 +207,15 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
     // TODO: improve the input checking
     /* Check for the right number of inputs and outputs */
-    if (nrhs != NINPUTS) {
+    if (nrhs != NINPUTS && nrhs != NINPUTS + 1) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingMultiGenMex:nrhs",
-        		"%d inputs required for tracingMultiGenMex.", NINPUTS);
+        		"%d or %d inputs required for tracingMultiGenMex.", NINPUTS,
+        		NINPUTS + 1);
     }
-    if (nlhs != NOUTPUTS) {
+    if (nlhs < NOUTPUTS || nlhs > NOUTPUTS + 6) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingMultiGenMex:nrhs",
-        		"%d outputs required for tracingMultiGenMex.", NOUTPUTS);
+        		"%d to %d outputs required for tracingMultiGenMex.", NOUTPUTS,
+        		NOUTPUTS + 6);
     }
 
     /**************************************************************************/
@@ -130,11 +247,46 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     
     // simulation parameters
     maxScatters = (int)mxGetScalar(prhs[9]);
-    n_rays = (int)mxGetScalar(prhs[10]);
+    n_rays = get_ray_count("tracingMultiGenMex", prhs[10], MAX_RAY_COUNT);
     
     // TODO: pass through source as a struct?
     get_source(prhs[12], (int)mxGetScalar(prhs[11]), &source);
 
+    // optional simulation options
+    roulette.start = 0;
+    roulette.survival = 1;
+    if (nrhs > NINPUTS)
+        get_roulette(prhs[13], &roulette);
+    pixel = get_pixel_index(nrhs > NINPUTS ? prhs[13] : NULL);
+    SHEM_PROBE3(mex_entry, "tracingMultiGenMex", pixel, n_rays);
+    reset_memory_account(get_memory_budget(nrhs > NINPUTS ? prhs[13] : NULL));
+
+    bidirectional = get_bidirectional(nrhs > NINPUTS ? prhs[13] : NULL, &roulette);
+    metropolis = get_metropolis(nrhs > NINPUTS ? prhs[13] : NULL, &roulette, bidirectional,
+            n_rays, &mlt);
+    crease_angle = get_crease_angle(nrhs > NINPUTS ? prhs[13] : NULL, bidirectional);
+    n_coarse = get_multilevel(nrhs > NINPUTS ? prhs[13] : NULL, M, num_materials,
+            sample_index, bidirectional, metropolis, &ml, &levels);
+
+    // diagnostics are only recorded if they are asked for
+    record_diag = nlhs > NOUTPUTS && !bidirectional && !metropolis && !n_coarse &&
+        get_record_diagnostics(nrhs > NINPUTS ? prhs[13] : NULL);
+    n_batches = get_n_batches(nrhs > NINPUTS ? prhs[13] : NULL);
+    if (record_diag) {
+        get_diagnostics_options(nrhs > NINPUTS ? prhs[13] : NULL, &diag_bounces,
+                &diag_time, &diag_capacity, &diag_max_path);
+        check_memory_budget("tracingMultiGenMex", diagnostics_memory(diag_capacity,
+                diag_max_path));
+        set_up_diagnostics(diag_bounces, diag_time, diag_capacity, diag_max_path, &diag);
+    }
+
+    // the features of the first bounce are only recorded if they are asked for
+    record_feat = nlhs > NOUTPUTS + 3;
+    if (record_feat) {
+        check_memory_budget("tracingMultiGenMex", features_memory(num_materials));
+        set_up_features(M, num_materials, &feat);
+    }
+
     /**************************************************************************/
         
     // Seed the random number generator with the current time
@@ -146,7 +298,37 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
     // Put the sample and pinhole plate surface into structs
     // TODO: can we make a sample struct that can be passed from Matlab to C?
-    set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert, sample_index, &sample);
+    voxels = get_voxels(nrhs > NINPUTS ? prhs[13] : NULL, M, num_materials, sample_index,
+            bidirectional, &sample);
+    if (!voxels) {
+        check_memory_budget("tracingMultiGenMex", surface_memory(ntriag_sample));
+        set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert, sample_index,
+                &sample);
+        apply_bvh_options(nrhs > NINPUTS ? prhs[13] : NULL, &sample);
+    }
+    if (crease_angle > 0 && !voxels) {
+        check_memory_budget("tracingMultiGenMex", (int64_t)ntriag_sample*9*sizeof(double));
+        smooth_surface_normals(&sample, crease_angle);
+    }
+
+    // the coarse meshes are treated as the sample, which is the finest level
+    for (i = 0; i < n_coarse; i++) {
+        apply_bvh_options(nrhs > NINPUTS ? prhs[13] : NULL, &levels[i]);
+        if (crease_angle > 0) {
+            check_memory_budget("tracingMultiGenMex",
+                    (int64_t)levels[i].n_faces*9*sizeof(double));
+            smooth_surface_normals(&levels[i], crease_angle);
+        }
+    }
+
+    // the material map is in the frame of the sample, shared by its levels
+    material_map = get_material_map(nrhs > NINPUTS ? prhs[13] : NULL, M, num_materials,
+            bidirectional);
+    sample.material_map = material_map;
+    for (i = 0; i < n_coarse; i++)
+        levels[i].material_map = material_map;
+    if (n_coarse)
+        levels[n_coarse] = sample;
 
     /**************************************************************************/
     
@@ -155,28 +337,133 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
      * They need to be created as the transpose of what we want because of the
      * difference in indexing between MATLAB and C.
      */
-    plhs[0] = mxCreateNumericMatrix(1, plate.n_detect, mxINT32_CLASS, mxREAL);
-    plhs[2] = mxCreateNumericMatrix(1, plate.n_detect*maxScatters, mxINT32_CLASS,
-                                    mxREAL);
+    check_memory_budget("tracingMultiGenMex",
+            plate.n_detect*(SCATTER_BINS(maxScatters) + 1 + 2*(int64_t)n_batches)*sizeof(double));
+    plhs[0] = account_output(mxCreateDoubleMatrix(1, plate.n_detect, mxREAL));
+    plhs[2] = account_output(mxCreateDoubleMatrix(1, plate.n_detect*SCATTER_BINS(maxScatters),
+            mxREAL));
+    batch_counts = calloc((size_t)plate.n_detect*n_batches, sizeof(double));
+    batch_traced = calloc(n_batches, sizeof(int64_t));
+    if (bidirectional)
+        check_memory_budget("tracingMultiGenMex", bidir_paths_memory(plate.n_detect));
+    if (metropolis)
+        check_memory_budget("tracingMultiGenMex", metropolis_memory(mlt.n_chains,
+                plate.n_detect, maxScatters));
+    if (n_coarse)
+        check_memory_budget("tracingMultiGenMex", multilevel_memory(n_coarse + 1,
+                plate.n_detect) + 2*(int64_t)(n_coarse + 1)*sizeof(int64_t));
 
     /* Pointers to the output matrices so we may change them*/
-    cntr_detected = (int32_t*)mxGetData(plhs[0]);
-    numScattersRay = (int32_t*)mxGetData(plhs[2]);
+    cntr_detected = mxGetDoubles(plhs[0]);
+    numScattersRay = mxGetDoubles(plhs[2]);
 
     /**************************************************************************/
 
-    /* Main implementation of the ray tracing */
-    generating_rays_simple_pinhole(source, n_rays, &killed, cntr_detected,
-            maxScatters, sample, plate, sphere, &myrng, numScattersRay);
+    /*
+     * The samples of each level of multilevel Monte Carlo are chosen from a
+     * pilot run, which adds nothing to the estimate
+     */
+    level_rays = NULL;
+    batch_rays = NULL;
+    if (n_coarse) {
+        set_up_multilevel_stats(n_coarse + 1, plate.n_detect, &ml_stats);
+        level_rays = malloc((n_coarse + 1)*sizeof(int64_t));
+        batch_rays = malloc((n_coarse + 1)*sizeof(int64_t));
+        for (j = 0; j <= n_coarse; j++)
+            level_rays[j] = ml.n_pilot;
+        generating_rays_multilevel(source, 0, level_rays, &killed, cntr_detected,
+                maxScatters, levels, n_coarse + 1, plate, sphere, &roulette, NULL, &myrng,
+                numScattersRay, &ml_stats);
+        multilevel_allocate(&ml_stats, n_rays, ml.min_rays*n_batches, level_rays);
+    }
+
+    /*
+     * Main implementation of the ray tracing, the rays are split as evenly as
+     * possible between the batches. The budget starts after the set up and is
+     * checked before each chunk of rays, or each batch for the multilevel and
+     * Metropolis estimators, whose samples are chosen for a whole batch.
+     */
+    get_time_budget(nrhs > NINPUTS ? prhs[13] : NULL, matlab_interrupted, &budget);
+    for (i = 0; i < n_batches && !budget_exhausted(&budget); i++) {
+        int64_t n_batch = n_rays/n_batches + (i < n_rays % n_batches);
+        if (n_coarse) {
+            for (j = 0; j <= n_coarse; j++)
+                batch_rays[j] = level_rays[j]/n_batches + (i < level_rays[j] % n_batches);
+            generating_rays_multilevel(source, n_batch, batch_rays, &killed,
+                    &batch_counts[(size_t)i*plate.n_detect], maxScatters, levels,
+                    n_coarse + 1, plate, sphere, &roulette, record_feat ? &feat : NULL,
+                    &myrng, numScattersRay, &ml_stats);
+        } else if (metropolis) {
+            MetropolisParam batch_mlt = mlt;
+            batch_mlt.n_forward = mlt.n_forward/n_batches + (i < mlt.n_forward % n_batches);
+            batch_mlt.n_mutations = mlt.n_mutations/n_batches + (i < mlt.n_mutations % n_batches);
+            generating_rays_metropolis(source, n_batch, &batch_mlt, &killed,
+                    &batch_counts[(size_t)i*plate.n_detect], maxScatters, sample, plate,
+                    sphere, record_feat ? &feat : NULL, &myrng, numScattersRay, NULL);
+        }
+        if (n_coarse || metropolis)
+            batch_traced[i] = n_batch;
+        else
+            batch_traced[i] = budgeted_rays_simple_pinhole(source, n_batch, &budget,
+                    bidirectional, &killed, &batch_counts[(size_t)i*plate.n_detect],
+                    maxScatters, sample, plate, sphere, &roulette,
+                    record_diag ? &diag : NULL, record_feat ? &feat : NULL, &myrng,
+                    numScattersRay);
+        for (j = 0; j < plate.n_detect; j++)
+            cntr_detected[j] += batch_counts[(size_t)i*plate.n_detect + j];
+    }
+
+    budget_release_signal();
 
     /**************************************************************************/
 
-    plhs[1] = mxCreateDoubleScalar(killed);
+    report_bvh(nrhs > NINPUTS ? prhs[13] : NULL, "sample", &sample);
+    if (n_coarse)
+        report_multilevel(nrhs > NINPUTS ? prhs[13] : NULL, &ml_stats, level_rays);
+
+    plhs[1] = mxCreateDoubleScalar((double)killed);
+    if (record_diag) {
+        plhs[3] = diagnostics_to_struct(&diag);
+        clean_up_diagnostics(&diag);
+    } else if (nlhs > NOUTPUTS) {
+        plhs[3] = mxCreateDoubleMatrix(0, 0, mxREAL);
+    }
+    if (record_feat) {
+        plhs[6] = features_to_struct(&feat);
+        clean_up_features(&feat);
+    }
+    if (nlhs > NOUTPUTS + 4)
+        plhs[7] = n_coarse ? multilevel_to_struct(&ml_stats, level_rays) :
+            mxCreateDoubleMatrix(0, 0, mxREAL);
+    if (n_coarse) {
+        clean_up_multilevel_stats(&ml_stats);
+        for (i = 0; i < n_coarse; i++)
+            clean_up_surface(&levels[i]);
+        free(levels);
+        free(level_rays);
+        free(batch_rays);
+    }
 
     /* Free space */
     free(C);
     free(M);
     clean_up_surface(&sample);
+    free_material_map(material_map);
+
+    if (nlhs > NOUTPUTS + 2) {
+        plhs[5] = account_output(mxCreateDoubleMatrix(plate.n_detect, n_batches, mxREAL));
+        memcpy(mxGetDoubles(plhs[5]), batch_counts,
+                (size_t)plate.n_detect*n_batches*sizeof(double));
+    }
+    free(batch_counts);
+    if (nlhs > NOUTPUTS + 5)
+        plhs[8] = traced_to_array(batch_traced, n_batches);
+    free(batch_traced);
+
+    if (nlhs > NOUTPUTS + 1)
+        plhs[4] = memory_to_struct();
+
+    SHEM_PROBE3(mex_exit, "tracingMultiGenMex", pixel, killed);
 
     return;
 }
@@ -9,6 +9,15 @@
  *
  * The calling syntax is:
  *
+ *  [counted, killed, numScattersRay, weights, which_detector] = ...
+ *      tracingMultiMex(ray_pos, ray_dir, V, F, N, C, sphere, plate, mat_names,
+ *          mat_functions, mat_params, maxScatters, options)
+ *
+ * options is an optional struct, roulette_start and roulette_survival turn on
+ * Russian roulette termination of long paths, see RouletteParam. weights is the
+ * weight of each detected ray, 0 for the rest, counted is the weighted number
+ * of detected rays of each detector.
+ *
  * This is a MEX file for MATLAB.
  */
 
@@ -21,6 +30,7 @@
 #include "mtwister.h"
 #include "extract_inputs.h"
 #include "atom_ray_tracing3D.h"
+#include "probes.h"
 
 /* 
  * The gateway function.
@@ -47,11 +57,11 @@ void mexFunction(int nlhs, mxArray *plhs[],
     int maxScatters;         /* Maximum number of scattering events per ray */
     
     /* Declare the output variables */
-    int32_t * cntr_detected; /* The number of detected rays */
-    int killed;              /* The number of killed rays */
+    double * cntr_detected;  /* The number of detected rays */
+    int64_t killed;          /* The number of killed rays */
     int32_t * numScattersRay;/* The number of sample scatters that each
                               * ray has undergone */
-    int * detected;          /* Logical array, detected? */
+    double * weights;        /* Weight of each detected ray, 0 if not detected */
     int * which_detector;    /* Which detector was the ray detected in */
 
     /* Declare other variables */
@@ -62,6 +72,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     NBackWall plate;
     AnalytSphere sphere;
     Rays3D all_rays;
+    RouletteParam roulette;
     
     /* For random number generation */
     struct timeval tv;
@@ -72,9 +83,9 @@ void mexFunction(int nlhs, mxArray *plhs[],
     
     // TODO: improve the input checking
     /* Check for the right number of inputs and outputs */
-    if (nrhs != NINPUTS) {
+    if (nrhs != NINPUTS && nrhs != NINPUTS + 1) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingMultiMex:nrhs",
-        		"%d inputs required for tracingMultiMex.", NINPUTS);
+        		"%d or %d inputs required for tracingMultiMex.", NINPUTS, NINPUTS + 1);
     }
     if (nlhs != NOUTPUTS) {
         mexErrMsgIdAndTxt("AtomRayTracing:tracingMultiMex:nrhs",
@@ -88,6 +99,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
      *       MATLAB were of type int it is safe to cast from double to int here.
      */
     nrays = mxGetN(prhs[0]);
+    SHEM_PROBE3(mex_entry, "tracingMultiMex", -1, nrays);
     ray_pos = mxGetDoubles(prhs[0]);
     ray_dir = mxGetDoubles(prhs[1]);
     nvert = mxGetN(prhs[2]);
@@ -113,6 +125,12 @@ void mexFunction(int nlhs, mxArray *plhs[],
     
     // simulation parameters
     maxScatters = (int)mxGetScalar(prhs[11]); /* mxGetScalar gives a double */
+
+    // optional simulation options
+    roulette.start = 0;
+    roulette.survival = 1;
+    if (nrhs > NINPUTS)
+        get_roulette(prhs[12], &roulette);
     
     /**************************************************************************/
 
@@ -132,12 +150,12 @@ void mexFunction(int nlhs, mxArray *plhs[],
     set_up_surface(V, N, F, C, M, num_materials, ntriag_sample, nvert, sample_index, &sample);
 
     /* Output matrix for total number of counts */
-    plhs[0] = mxCreateNumericMatrix(1, plate.n_detect, mxINT32_CLASS, mxREAL);
-    cntr_detected = (int32_t*)mxGetData(plhs[0]);
+    plhs[0] = mxCreateDoubleMatrix(1, plate.n_detect, mxREAL);
+    cntr_detected = mxGetDoubles(plhs[0]);
     
-    /* Output matrix for which rays were detected */
-    plhs[3] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
-    detected = (int32_t*)mxGetData(plhs[3]);
+    /* Output matrix for the weights of the detected rays */
+    plhs[3] = mxCreateDoubleMatrix(1, nrays, mxREAL);
+    weights = mxGetDoubles(plhs[3]);
     
     /* Output matrix for which detector the rays went into */
     plhs[4] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
@@ -147,12 +165,12 @@ void mexFunction(int nlhs, mxArray *plhs[],
     
     /* Main implementation of the ray tracing */
     given_rays_simple_pinhole(&all_rays, &killed, cntr_detected, sample, plate, sphere,
-            maxScatters, detected, which_detector, &myrng);
+            maxScatters, &roulette, weights, which_detector, &myrng);
     
     /**************************************************************************/
     
     /* Output the number of rays we forcefully stopped */
-    plhs[1] = mxCreateDoubleScalar(killed);
+    plhs[1] = mxCreateDoubleScalar((double)killed);
     
     /* Output matrix for the number of scattering events that each ray underwent */
     plhs[2] = mxCreateNumericMatrix(1, nrays, mxINT32_CLASS, mxREAL);
@@ -165,5 +183,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     free(M);
     clean_up_surface(&sample);
     
+    SHEM_PROBE3(mex_exit, "tracingMultiMex", -1, killed);
+
     return;
 }
@@ -74,36 +74,28 @@ sphere_c = [0, -dist_to_sample + sphere_r, 0];
 
 %% Define remaining parameters
 
-% The maximum number of sample scatters per ray. There is a hard-coded total
-% maximum number of scattering events of 1000 (sample and pinhole plate). Making
-% this uneccaserily large will increase the memory requirments of the
-% simulation.
-max_scatter = 20;
+% The parameters that are not in the parameter file, and the extra options for
+% the simulation in C (sim_options), are shared with batchScan.m, see
+% default_parameters.m for what each of them does. Change them there or
+% override them here.
+defaults = default_parameters();
+max_scatter = defaults.max_scatter;
+ray_model = defaults.ray_model;
+ray_bank = defaults.ray_bank;
+stratify_bank = defaults.stratify_bank;
+sim_options = defaults.sim_options;
+cosine_n = defaults.cosine_n;
+plate_accuracy = defaults.plate_accuracy;
+plate_refine_regions = defaults.plate_refine_regions;
+circle_plate_r = defaults.circle_plate_r;
+plate_represent = defaults.plate_represent;
+scale = defaults.scale;
+defMaterial = defaults.material;
 
 % If rotations are present the scan pattern can be regular or be adjusted to
 % match the rotation of the sample
 scan_pattern = 'regular';
 
-% Do we want to generate rays in Matlab (more flexibility, more output options)
-% or in C (much lower memory requirments and slightly faster), 'C' or 'MATLAB'
-% In general stick to 'C' unless your own source model is being used
-ray_model = 'MATLAB';
-
-% Exponant of the cosine in the effuse beam model
-cosine_n = 1;
-
-% In the case of the predefined CAD model, specify the accuraccy of the
-% triangulation, 'low', 'medium', or 'high' (use 'low').
-plate_accuracy = 'low';
-
-% In the case of 'circle', specify the radius of the circle (mm).
-circle_plate_r = 4;
-
-% Should a flat pinhole plate be modelled (with 'N circle'). not including may
-% speed up the simulation but won't model the effuse and multiple scattering
-% backgrounds properly.
-plate_represent = 0;
-
 % In the case of 'abstract', specify the two angles of the location of the
 % detector aperture and the half cone angle of its extent. Note that the
 % aperture can only be placed in the hemisphere facing the sample. All
@@ -124,22 +116,10 @@ raster_movment1D = 0.02;        % movement increment
 range1D = [-1 4];               % range
 Direction = 'y';                % 'x', 'y' or 'z' - along which direction to move
 
-% make the model 10 times smaller (Inventor exports in cm by default...).
-scale = 2;
-%  'strips' - Two parallel series of strips with varying parameters
-% make the model 10 times larger (Inventor exports in cm by default...).
-scale = 1;
-
 % A string giving a brief description of the sample, for use with
 % sample_type = 'custom'
 sample_description = 'Sample with series of diffractive peaks.';
 
-%% Parameters of the default material, to use for faces where no material is specified
-defMaterial.function = 'cosine';
-defMaterial.params = 0;
-defMaterial.color = [0.8 0.8 1.0];
-
-
 %% Output and plotting parameters
 
 % Which figures to plot
@@ -249,6 +229,7 @@ pinhole_plate_inputs.working_dist = working_dist;
 switch pinhole_model
     case {'stl', 'new'}
         pinhole_plate_inputs.plate_accuracy = plate_accuracy;
+        pinhole_plate_inputs.refine_regions = plate_refine_regions;
         pinhole_plate_inputs.n_detectors = 1;
         pinhole_plate_inputs.plate_represent = 1;
         pinhole_plate_inputs.aperture_axes = NaN;
@@ -397,6 +378,15 @@ if true
     sample_surface.reflect_axis('x');
 end
 
+% Coarse meshes of the sample for multilevel Monte Carlo
+if ~isempty(sim_options.mlmc_fractions)
+    if ~strcmp(pinhole_model, 'N circle')
+        error('Multilevel Monte Carlo needs the N circle pinhole model.');
+    end
+    sim_options.mlmc_levels = decimate_sample(sample_surface, ...
+        sim_options.mlmc_fractions);
+end
+
 % Plot the sample surface in 3D space, if we are using a graphical window
 % TODO: put in a seperate
 if feature('ShowFigureWindows')
@@ -427,7 +417,11 @@ if feature('ShowFigureWindows')
 end
 
 %% Pinhole plate import and plotting
-[pinhole_surface, thePlate, aperture_abstract] = pinhole_import(pinhole_plate_inputs, sample_surface);
+[pinhole_surface, thePlate, aperture_abstract, plate_refine] = ...
+    pinhole_import(pinhole_plate_inputs, sample_surface);
+if ~isempty(plate_refine)
+    sim_options.plate_refine = plate_refine;
+end
 
 %% Compile the mex files
 
@@ -449,13 +443,31 @@ switch typeScan
                 [raster_movment2D_x, raster_movment2D_z], 'xrange', xrange, ...
                 'zrange', zrange);
         end
+        if sim_options.subsample < 1
+            raster_pattern = subsample_raster_pattern(raster_pattern, ...
+                'fraction', sim_options.subsample);
+        end
+        if ~strcmp(sim_options.symmetry, 'none')
+            if ~strcmp(pinhole_model, 'N circle')
+                error('Symmetric scans need the N circle pinhole model.');
+            end
+            if ~isempty(sim_options.material_map)
+                error('Scans of samples with a material map cannot be reduced by symmetry.');
+            end
+            raster_pattern = symmetric_raster_pattern(raster_pattern, ...
+                'symmetry', sim_options.symmetry, 'sample', sample_surface, ...
+                'plate', thePlate, 'sphere', sphere, 'direct_beam', direct_beam, ...
+                'effuse_beam', effuse_beam);
+        end
         simulationData = rectangularScan('sample_surface', sample_surface, ...
             'raster_pattern', raster_pattern,'direct_beam', direct_beam, ...
             'max_scatter', max_scatter,      'pinhole_surface', pinhole_surface, ...
             'effuse_beam', effuse_beam,      'dist_to_sample', dist_to_sample, ...
             'sphere', sphere,                'thePath', thePath, ...
             'pinhole_model', pinhole_model,  'thePlate', thePlate, ...
-            'ray_model', ray_model,          'n_detector', n_detectors);
+            'ray_model', ray_model,          'n_detector', n_detectors, ...
+            'ray_bank', ray_bank,            'stratified', stratify_bank, ...
+            'options', sim_options);
     case 'multiple_rectangular'
         % TODO: check this works and then make it work with the new parameter
         % specification file
@@ -502,7 +514,9 @@ switch typeScan
                 'effuse_beam', effuse_beam,      'dist_to_sample', y_distance, ...
                 'sphere', sphere,                'thePath', subPath, ...
                 'pinhole_model', pinhole_model,  'thePlate', thePlate, ...
-                'ray_model', ray_model,          'n_detector', n_detectors); %#ok<SAGROW>
+                'ray_model', ray_model,          'n_detector', n_detectors, ...
+            'ray_bank', ray_bank,            'stratified', stratify_bank, ...
+            'options', sim_options); %#ok<SAGROW>
             waitbar(i_/ny, h);
         end
 
@@ -571,7 +585,9 @@ switch typeScan
                 'effuse_beam', effuse_beam,      'dist_to_sample', dist_to_sample, ...
                 'sphere', sphere,                'thePath', subPath, ...
                 'pinhole_model', pinhole_model,  'thePlate', thePlate, ...
-                'ray_model', ray_model,          'n_detector', n_detectors); %#ok<SAGROW>
+                'ray_model', ray_model,          'n_detector', n_detectors, ...
+            'ray_bank', ray_bank,            'stratified', stratify_bank, ...
+            'options', sim_options); %#ok<SAGROW>
             
             waitbar(i_/N, h);
             
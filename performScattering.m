@@ -23,6 +23,10 @@ maxScatter = 1000;
 % spot.
 sample_fname = 'samples/deep_trench_sample.stl';
 
+% Memory budget in bytes, 0 for none. If the per-ray outputs do not fit they
+% are binned in 5 degree bins of the outgoing direction.
+options.mem_budget = 0;
+
 % Should the mex files be recompiled
 recompile = true;
 
@@ -53,19 +57,29 @@ init_pos = repmat(init_pos', 1, n_rays);
 init_dir = repmat(init_dir', 1, n_rays);
 
 % Main computation
-[killed, numScattersRay, final_pos, final_dir] = ...
+[killed, numScattersRay, final_pos, final_dir, memory] = ...
     distributionCalc('sample_surface', sample_surface, 'maxScatter', maxScatter, ...
-                     'nrays', n_rays, 'start_pos', init_pos, 'start_dir', init_dir);
+                     'nrays', n_rays, 'start_pos', init_pos, 'start_dir', init_dir, ...
+                     'options', options);
+fprintf('Peak memory %.1f MB\n', memory.peak/2^20);
 
 %% Analyse results
 
 % Get the outgoing directions
-ind = numScattersRay > 0;
-[az, el, r] = cart2sph(final_dir(1,ind), final_dir(3,ind), final_dir(2,ind));
-
-% Select the multiply scattered outgoing directions
-th = (pi/2 - el)*180/pi;
-[n, c] = hist3([th', az'*180/pi + 180], {2.5:5:87.5, 2.5:5:357.5}, 'Normalization', 'pdf');
+if memory.binned
+    % The polar angle of the bins is from the y axis, the first 18 bins are
+    % the directions leaving the sample, the unscattered rays go downwards
+    n = final_dir(1:18,:);
+    n = n/(sum(n(:))*25);
+    c = {2.5:5:87.5, 2.5:5:357.5};
+else
+    ind = numScattersRay > 0;
+    [az, el, r] = cart2sph(final_dir(1,ind), final_dir(3,ind), final_dir(2,ind));
+
+    % Select the multiply scattered outgoing directions
+    th = (pi/2 - el)*180/pi;
+    [n, c] = hist3([th', az'*180/pi + 180], {2.5:5:87.5, 2.5:5:357.5}, 'Normalization', 'pdf');
+end
 n2 = zeros(size(n));
 for i_=1:length(c{1})
     if c{1}(i_) ~= 0
@@ -78,21 +92,23 @@ n2 = n2/max(n2(:));
 figure
 polarPcolor(90*(c{1} - 2.5)/max(c{1} - 2.5), 360*(c{2} - 2.5)/max(c{2} - 2.5), n2', 'colBar', false)
 
-% 2D plot of the outgoing angle as a graph
-ind2 = abs(final_dir(3,:)) < 0.1; 
-theta_2D = atand(final_dir(1,ind & ind2)./final_dir(2,ind & ind2));
-figure
-histogram(theta_2D, 50, 'Normalization', 'pdf')
-hold on
-xs = -90:0.1:90;
-plot(xs, cosd(xs)/integral(@(x) cosd(x), -90, 90))
-xlabel('Angle in scattering plane/^\circ')
-ylabel('Probability density')
-xlim([-90,90])
-plot([30.5, 30.5], [0, 0.01], 'm', 'Linewidth', 2)
-plot([44.7, 44.7], [0, 0.01], 'm', 'Linewidth', 2)
-hold off
-legend('Trench distribution', 'Random scattering', 'Detector', 'Location', 'NorthOutside')
+% 2D plot of the outgoing angle as a graph, needs the per-ray directions
+if ~memory.binned
+    ind2 = abs(final_dir(3,:)) < 0.1; 
+    theta_2D = atand(final_dir(1,ind & ind2)./final_dir(2,ind & ind2));
+    figure
+    histogram(theta_2D, 50, 'Normalization', 'pdf')
+    hold on
+    xs = -90:0.1:90;
+    plot(xs, cosd(xs)/integral(@(x) cosd(x), -90, 90))
+    xlabel('Angle in scattering plane/^\circ')
+    ylabel('Probability density')
+    xlim([-90,90])
+    plot([30.5, 30.5], [0, 0.01], 'm', 'Linewidth', 2)
+    plot([44.7, 44.7], [0, 0.01], 'm', 'Linewidth', 2)
+    hold off
+    legend('Trench distribution', 'Random scattering', 'Detector', 'Location', 'NorthOutside')
+end
 
 % Polar density plot from the function
 figure
@@ -106,8 +122,12 @@ polarPcolor((th*180/pi - 2.5)*90/max(th*180/pi - 2.5), (phi*180/pi + 180 - 2.5)*
 
 % Histogram of number of scatters
 figure
-histogram(numScattersRay(ind), 'normalization', 'probability', ...
-    'BinWidth', 1, 'BinEdges', 0.5:1:(maxScatter + 0.5))
+if memory.binned
+    bar(1:maxScatter, numScattersRay(2:end)/sum(numScattersRay(2:end)), 1)
+else
+    histogram(numScattersRay(ind), 'normalization', 'probability', ...
+        'BinWidth', 1, 'BinEdges', 0.5:1:(maxScatter + 0.5))
+end
 xlabel('Number of scattering events')
 ylabel('Probability')
 xlim([0, 50])
@@ -0,0 +1,258 @@
+"""
+Client for the SHeM simulation server (../shem_server.c).
+
+The protocol is described in ../protocol.h. Only the standard library is
+needed; numpy arrays may be passed wherever a sequence of numbers is expected.
+
+Example:
+
+    from shem_client import ShemClient
+
+    with ShemClient() as srv:
+        srv.load_scene(1, materials, sample, plate)
+        res = srv.trace(1, n_rays=100000, source=source, offsets=[(0, 0, 0)])
+        print(res[0]['counts'])
+"""
+
+import os
+import socket
+import struct
+
+MAGIC = 0x4D454853
+VERSION = 1
+DEFAULT_SOCKET = "/tmp/shem_server.sock"
+
+PING, LOAD_SCENE, SET_MATERIAL, TRACE, CANCEL, DROP_SCENE, FIT = 1, 2, 3, 4, 5, 6, 7
+REPLY = 0x8000
+ERROR = 0xFFFF
+
+PLATE_CAD, PLATE_CIRCLE = 1, 2
+
+ERR_BAD_REQUEST, ERR_NO_SCENE, ERR_CANCELLED, ERR_SHUTDOWN = 1, 2, 3, 4
+CANCEL_NOT_FOUND, CANCEL_QUEUED, CANCEL_RUNNING = 0, 1, 2
+
+_HEADER = struct.Struct("<IHHIIQ")
+
+
+class ShemError(Exception):
+    """A request the server answered with an error."""
+
+    def __init__(self, code, message):
+        Exception.__init__(self, "%s (code %d)" % (message, code))
+        self.code = code
+
+
+class ShemCancelled(ShemError):
+    """A trace that was cancelled before it finished."""
+
+
+def _f64(values):
+    values = [float(v) for v in values]
+    return struct.pack("<%dd" % len(values), *values)
+
+
+def _str(s):
+    b = s.encode()
+    return struct.pack("<I", len(b)) + b
+
+
+def _surface(surf):
+    """
+    surf is a dict with 'vertices' (n x 3), 'faces' (m x 3, indices from 1),
+    'normals' (m x 3) and 'materials' (m material indices).
+    """
+    V = [x for v in surf["vertices"] for x in v]
+    F = [int(x) for f in surf["faces"] for x in f]
+    N = [x for n in surf["normals"] for x in n]
+    M = [int(x) for x in surf["materials"]]
+    return (struct.pack("<II", len(V) // 3, len(F) // 3) + _f64(V)
+            + struct.pack("<%di" % len(F), *F) + _f64(N)
+            + struct.pack("<%dI" % len(M), *M))
+
+
+def _trace_payload(scene_id, n_rays, source, offsets, max_scatter, source_model, seed):
+    if seed is None:
+        seed = struct.unpack("<Q", os.urandom(8))[0]
+    offsets = [x for o in offsets for x in o]
+    return (struct.pack("<IQqii", scene_id, seed, n_rays, max_scatter, source_model)
+            + _f64(source) + struct.pack("<I", len(offsets) // 3) + _f64(offsets))
+
+
+class ShemClient(object):
+    """A connection to the server. Requests may be submitted without waiting
+    for their replies, replies that arrive out of order are kept until asked
+    for."""
+
+    def __init__(self, path=DEFAULT_SOCKET):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self._replies = {}
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    # Messages
+
+    def submit(self, msg_type, payload=b""):
+        """Send a request, returns its id."""
+        request_id = struct.unpack("<I", os.urandom(4))[0]
+        self.sock.sendall(_HEADER.pack(MAGIC, VERSION, msg_type, request_id, 0,
+                                       len(payload)) + payload)
+        return request_id
+
+    def _recv_exact(self, n):
+        buf = bytearray()
+        while len(buf) < n:
+            chunk = self.sock.recv(n - len(buf))
+            if not chunk:
+                raise ConnectionError("The server closed the connection")
+            buf.extend(chunk)
+        return bytes(buf)
+
+    def wait(self, request_id):
+        """Wait for the reply to a request, returns (type, payload)."""
+        while request_id not in self._replies:
+            magic, _, msg_type, rid, _, length = _HEADER.unpack(
+                self._recv_exact(_HEADER.size))
+            if magic != MAGIC:
+                raise ConnectionError("Bad reply from the server")
+            self._replies[rid] = (msg_type, self._recv_exact(length))
+        msg_type, payload = self._replies.pop(request_id)
+        if msg_type == ERROR:
+            code, n = struct.unpack_from("<iI", payload)
+            message = payload[8:8 + n].decode()
+            if code == ERR_CANCELLED:
+                raise ShemCancelled(code, message)
+            raise ShemError(code, message)
+        return msg_type, payload
+
+    def request(self, msg_type, payload=b""):
+        return self.wait(self.submit(msg_type, payload))[1]
+
+    # Requests
+
+    def ping(self):
+        n_threads, n_scenes, n_queued, memory = struct.unpack(
+            "<IIId", self.request(PING))
+        return {"n_threads": n_threads, "n_scenes": n_scenes,
+                "n_queued": n_queued, "memory": memory}
+
+    def load_scene(self, scene_id, materials, sample, plate, sphere=None):
+        """
+        materials: list of (name, function, params), the first is used for a
+                   circle plate
+        sample:    a surface dict, see _surface
+        plate:     a surface dict with 'back_wall' for a CAD plate, or a dict
+                   with 'circle_plate_r', 'aperture_c' (n_detect x 2),
+                   'aperture_axes' (n_detect x 2) and 'plate_represent'
+        sphere:    a dict with 'centre', 'radius' and 'material', or None
+        Returns the time taken by the server to set up the scene.
+        """
+        p = struct.pack("<II", scene_id, len(materials))
+        for name, func, params in materials:
+            p += _str(name) + _str(func) + struct.pack("<I", len(params)) + _f64(params)
+        p += _surface(sample)
+        if "faces" in plate:
+            p += struct.pack("<I", PLATE_CAD) + _surface(plate) + _f64(plate["back_wall"])
+        else:
+            c = [x for a in plate["aperture_c"] for x in a]
+            axes = [x for a in plate["aperture_axes"] for x in a]
+            p += (struct.pack("<Iid", PLATE_CIRCLE, len(c) // 2, plate["circle_plate_r"])
+                  + struct.pack("<i", int(plate.get("plate_represent", 1)))
+                  + _f64(c) + _f64(axes))
+        if sphere is None:
+            sphere = {"make": 0, "centre": (0, 0, 0), "radius": 0, "material": 0}
+        p += (struct.pack("<i", int(sphere.get("make", 1))) + _f64(sphere["centre"])
+              + _f64([sphere["radius"]]) + struct.pack("<I", sphere["material"]))
+        return struct.unpack("<d", self.request(LOAD_SCENE, p))[0]
+
+    def set_material(self, scene_id, index, function, params):
+        self.request(SET_MATERIAL, struct.pack("<II", scene_id, index) + _str(function)
+                     + struct.pack("<I", len(params)) + _f64(params))
+
+    def submit_trace(self, scene_id, n_rays, source, offsets, max_scatter=100,
+                     source_model=0, seed=None, visibility_cell=0):
+        """
+        source is [r, cx, cy, cz, theta_max, init_angle, sigma] as for
+        get_source, offsets is a list of (x, y, z) translations of the sample,
+        one per pixel. A visibility_cell > 0 finds the first hits of the rays
+        with a visibility map of the sample with cells of that size. Returns
+        the id of the request, see trace_result.
+        """
+        p = _trace_payload(scene_id, n_rays, source, offsets, max_scatter,
+                           source_model, seed)
+        if visibility_cell > 0:
+            p += _f64((visibility_cell,))
+        return self.submit(TRACE, p)
+
+    def trace_result(self, request_id):
+        """Wait for a trace, returns a dict of 'killed', 'counts' and 'hist'
+        (n_detect lists of max_scatter + 1, the last the overflow bin) for each
+        pixel."""
+        payload = self.wait(request_id)[1]
+        n_pixels, n_detect, max_scatter = struct.unpack_from("<IIi", payload)
+        n_bins = max_scatter + 1
+        stride = 1 + n_detect + n_detect*n_bins
+        data = struct.unpack_from("<%dd" % (stride*n_pixels), payload, 12)
+        pixels = []
+        for i in range(n_pixels):
+            d = data[i*stride:(i + 1)*stride]
+            pixels.append({
+                "killed": d[0],
+                "counts": list(d[1:1 + n_detect]),
+                "hist": [list(d[1 + n_detect + j*n_bins:1 + n_detect + (j + 1)*n_bins])
+                         for j in range(n_detect)]})
+        return pixels
+
+    def trace(self, scene_id, n_rays, source, offsets, **kwargs):
+        return self.trace_result(self.submit_trace(scene_id, n_rays, source, offsets,
+                                                   **kwargs))
+
+    def submit_fit(self, scene_id, n_rays, source, offsets, measured, params,
+                   detector=0, max_evals=20, tolerance=1e-3, max_scatter=100,
+                   source_model=0, seed=None):
+        """
+        Fit parameters of the materials of a circle plate scene to the measured
+        counts of each pixel, of one detector (from 1) or of their sum (0).
+        params is a list of (material index, param index, start, lower, upper).
+        The arguments are otherwise as for submit_trace. Returns the id of the
+        request, see fit_result.
+        """
+        p = (_trace_payload(scene_id, n_rays, source, offsets, max_scatter,
+                            source_model, seed)
+             + struct.pack("<I", detector) + _f64(measured)
+             + struct.pack("<I", len(params)))
+        for material, param, start, lower, upper in params:
+            p += struct.pack("<II", material, param) + _f64((start, lower, upper))
+        p += struct.pack("<Id", max_evals, tolerance)
+        return self.submit(FIT, p)
+
+    def fit_result(self, request_id):
+        """Wait for a fit, returns a dict of the best 'params', their 'loss',
+        the 'scale' of the counts to the measurements and the 'history' of
+        (params, loss) of each evaluation."""
+        payload = self.wait(request_id)[1]
+        n_evals, n_fit, loss, scale = struct.unpack_from("<IIdd", payload)
+        data = struct.unpack_from("<%dd" % (n_fit + (n_fit + 1)*n_evals), payload, 24)
+        history = [(list(data[n_fit + i*(n_fit + 1):n_fit + i*(n_fit + 1) + n_fit]),
+                    data[n_fit + i*(n_fit + 1) + n_fit]) for i in range(n_evals)]
+        return {"params": list(data[:n_fit]), "loss": loss, "scale": scale,
+                "history": history}
+
+    def fit(self, scene_id, n_rays, source, offsets, measured, params, **kwargs):
+        return self.fit_result(self.submit_fit(scene_id, n_rays, source, offsets,
+                                               measured, params, **kwargs))
+
+    def cancel(self, request_id):
+        """Cancel a trace or a fit, returns CANCEL_NOT_FOUND, CANCEL_QUEUED or
+        CANCEL_RUNNING. The trace itself raises ShemCancelled."""
+        return struct.unpack("<I", self.request(CANCEL, struct.pack("<I", request_id)))[0]
+
+    def drop_scene(self, scene_id):
+        self.request(DROP_SCENE, struct.pack("<I", scene_id))
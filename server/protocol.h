@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * The binary protocol of the simulation server (shem_server.c), shared with
+ * the MATLAB (serverClientMex.c, SimulationServer.m) and Python
+ * (clients/shem_client.py) clients.
+ *
+ * Every message, in either direction, is a ShemMsgHeader followed by length
+ * bytes of payload. All values are little endian and packed without padding,
+ * the server and the clients run on the same machine. In the payloads:
+ *  u32/i32/u64/i64/f64 - unsigned/signed integers and doubles
+ *  str                 - u32 length then that many bytes, not terminated
+ *  surface             - u32 n_vert, u32 n_faces, f64 V[3 n_vert],
+ *                        i32 F[3 n_faces] (vertex indices from 1),
+ *                        f64 N[3 n_faces], u32 material index of each face
+ *
+ * Requests and the payloads of their replies:
+ *
+ *  PING         -> u32 n_threads, u32 n_scenes, u32 n_queued, f64 bytes of
+ *                  memory allocated (see MemoryAccount)
+ *
+ *  LOAD_SCENE   u32 scene_id,
+ *               u32 n_materials, each: str name, str function, u32 n_params,
+ *                                      f64 params[n_params],
+ *               surface sample,
+ *               u32 plate kind, SHEM_PLATE_CAD: surface plate, f64 back_wall[3]
+ *                               SHEM_PLATE_CIRCLE: i32 n_detect,
+ *                               f64 circle_plate_r, i32 plate_represent,
+ *                               f64 aperture_c[2 n_detect],
+ *                               f64 aperture_axes[2 n_detect]
+ *               i32 make_sphere, f64 sphere_c[3], f64 sphere_r,
+ *               u32 sphere material index
+ *               -> f64 time taken to set up the scene (s)
+ *               Replaces any scene with the same id. The surfaces and their
+ *               hierarchies are kept until the scene is dropped. Each material
+ *               must have at least the parameters its function reads (see
+ *               distribution_n_params). A circle plate is made of the first
+ *               material.
+ *
+ *  SET_MATERIAL u32 scene_id, u32 material index, str function, u32 n_params,
+ *               f64 params[n_params]
+ *               -> empty
+ *               Changes the scattering distribution of a material in place,
+ *               waits for running traces of the scene to finish. There must be
+ *               at least the parameters the function reads.
+ *
+ *  TRACE        u32 scene_id, u64 seed, i64 n_rays per pixel, i32 max_scatter,
+ *               i32 source_model, f64 source[7] (as for get_source),
+ *               u32 n_pixels, f64 offsets[3 n_pixels],
+ *               optionally f64 visibility cell size
+ *               -> u32 n_pixels, u32 n_detect, i32 max_scatter, then for each
+ *                  pixel: f64 killed, f64 counts[n_detect],
+ *                  f64 hist[n_detect (max_scatter + 1)]
+ *               hist has max_scatter + 1 bins for each detector in turn, the
+ *               last counts rays detected after more scattering events, which
+ *               only roulette lets through, so it is empty here (see
+ *               SCATTER_BINS).
+ *               Each pixel translates the sample and sphere by its offset. The
+ *               pixels are shared out between the worker threads, each pixel
+ *               has its own random numbers seeded from seed and its index.
+ *               With a cell size > 0 the rays from the source find the sample
+ *               by a visibility map of it with cells of that size, see
+ *               atom_ray_tracing_library/visibility.h, which is kept with the
+ *               scene for later traces with the same beam. The counts are the
+ *               same as without it. max_scatter may be at most
+ *               SHEM_MAX_SCATTER (100000) and the results at most 1 GiB, larger
+ *               traces are bad requests.
+ *
+ *  FIT          u32 scene_id, u64 seed, i64 n_rays per pixel, i32 max_scatter,
+ *               i32 source_model, f64 source[7], u32 n_pixels,
+ *               f64 offsets[3 n_pixels] (as for TRACE), u32 detector (from 1,
+ *               0 for the sum of them), f64 measured[n_pixels],
+ *               u32 n_fit, each: u32 material index, u32 param index,
+ *               f64 start, f64 lower, f64 upper,
+ *               u32 max_evals, f64 tolerance
+ *               -> u32 n_evals, u32 n_fit, f64 loss, f64 scale,
+ *                  f64 params[n_fit], then for each evaluation:
+ *                  f64 params[n_fit], f64 loss
+ *               Fits parameters of the materials to the measured counts of the
+ *               pixels by least squares, see atom_ray_tracing_library/fitting.h.
+ *               Every evaluation traces all the pixels, with the same random
+ *               numbers, and the derivatives of their counts. The params are
+ *               the best found and scale the factor from the counts to the
+ *               measurements. The materials of the scene are not changed.
+ *               Only for scenes with a circle plate.
+ *
+ *  CANCEL       u32 request_id of a TRACE or FIT
+ *               -> u32 SHEM_CANCEL_NOT_FOUND, _QUEUED or _RUNNING
+ *               The cancelled request is answered with SHEM_ERR_CANCELLED.
+ *
+ *  DROP_SCENE   u32 scene_id -> empty
+ *
+ * A reply has the type of its request | SHEM_MSG_REPLY and the request_id of
+ * the request. A failed request is answered with SHEM_MSG_ERROR and the
+ * payload i32 error code, str message. Replies to requests on the same
+ * connection may arrive in any order.
+ */
+
+#ifndef SHEM_PROTOCOL_H_
+#define SHEM_PROTOCOL_H_
+
+#include <stdint.h>
+
+#define SHEM_MAGIC 0x4d454853u      /* "SHEM" */
+#define SHEM_PROTOCOL_VERSION 1
+
+/* Default path of the socket */
+#define SHEM_DEFAULT_SOCKET "/tmp/shem_server.sock"
+
+/* Message types */
+#define SHEM_MSG_PING 1
+#define SHEM_MSG_LOAD_SCENE 2
+#define SHEM_MSG_SET_MATERIAL 3
+#define SHEM_MSG_TRACE 4
+#define SHEM_MSG_CANCEL 5
+#define SHEM_MSG_DROP_SCENE 6
+#define SHEM_MSG_FIT 7
+#define SHEM_MSG_REPLY 0x8000
+#define SHEM_MSG_ERROR 0xffff
+
+/* Kinds of pinhole plate */
+#define SHEM_PLATE_CAD 1
+#define SHEM_PLATE_CIRCLE 2
+
+/* Error codes */
+#define SHEM_ERR_BAD_REQUEST 1
+#define SHEM_ERR_NO_SCENE 2
+#define SHEM_ERR_CANCELLED 3
+#define SHEM_ERR_SHUTDOWN 4
+
+/* Replies to CANCEL */
+#define SHEM_CANCEL_NOT_FOUND 0
+#define SHEM_CANCEL_QUEUED 1
+#define SHEM_CANCEL_RUNNING 2
+
+typedef struct _shemMsgHeader {
+    uint32_t magic;         /* SHEM_MAGIC */
+    uint16_t version;       /* SHEM_PROTOCOL_VERSION */
+    uint16_t type;          /* SHEM_MSG_* */
+    uint32_t request_id;    /* Chosen by the client, echoed in the reply */
+    uint32_t reserved;      /* 0 */
+    uint64_t length;        /* Bytes of payload that follow */
+} ShemMsgHeader;
+
+#define SHEM_HEADER_SIZE 24
+
+#endif /* SHEM_PROTOCOL_H_ */
@@ -0,0 +1,1518 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * A long running simulation server. Scenes (a sample, a pinhole plate, a
+ * sphere and their materials) are loaded once and kept, along with the
+ * hierarchies of their surfaces, so that repeated small simulations, e.g.
+ * re-imaging a few pixels after changing a material, do not pay for starting
+ * MATLAB, a parallel pool or setting up the surfaces each time.
+ *
+ * Requests are read from a Unix domain socket, see protocol.h for the format.
+ * Scene changes and traces go into a single queue served by a pool of worker
+ * threads, the pixels of a trace are shared out between the workers. Pings
+ * and cancellations are answered straight away by the thread that reads the
+ * sockets, which never waits for the rest of a message from a client. A trace checks whether it has been cancelled every
+ * SHEM_CHUNK rays. A fit is traced as a trace for each of its evaluations, the
+ * worker finishing the last pixel of one works out the next and queues it
+ * again.
+ *
+ * Usage:
+ *  shem_server [-s socket_path] [-t n_threads]
+ *
+ * The socket is only accessible to the user running the server. A socket left
+ * at socket_path by a server that died is replaced; if a server is listening
+ * there, or it is any other file, the server exits.
+ */
+
+#include "protocol.h"
+#include "atom_ray_tracing3D.h"
+#include "mtwister.h"
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Number of rays traced between checks for cancellation */
+#define SHEM_CHUNK 8192
+
+/* Maximum number of client connections */
+#define SHEM_MAX_CLIENTS 64
+
+/* Seconds a reply may wait for a client to read, after which it is dropped */
+#define SHEM_SEND_TIMEOUT 10
+
+/* Most visibility maps of the sample kept with a scene */
+#define SHEM_MAX_MAPS 4
+
+/* Largest max_scatter of a trace and bytes of results of a trace */
+#define SHEM_MAX_SCATTER 100000
+#define SHEM_MAX_RESULTS ((size_t)1 << 30)
+
+/* Surface indices, as in the MEX files */
+#define SAMPLE_INDEX 0
+#define PLATE_INDEX 1
+#define SPHERE_INDEX 2
+
+/******************************************************************************/
+/*                        Reading and writing payloads                        */
+/******************************************************************************/
+
+typedef struct _reader {
+    uint8_t const * p;
+    size_t left;
+    int bad;            /* Set if the payload was too short */
+} Reader;
+
+typedef struct _writer {
+    uint8_t * data;
+    size_t len;
+    size_t cap;
+} Writer;
+
+static void rd_bytes(Reader * const r, void * dst, size_t n) {
+    if (r->bad || n > r->left) {
+        r->bad = 1;
+        memset(dst, 0, n);
+        return;
+    }
+    memcpy(dst, r->p, n);
+    r->p += n;
+    r->left -= n;
+}
+
+static uint32_t rd_u32(Reader * const r) {
+    uint32_t x;
+    rd_bytes(r, &x, sizeof(x));
+    return x;
+}
+
+static int32_t rd_i32(Reader * const r) {
+    int32_t x;
+    rd_bytes(r, &x, sizeof(x));
+    return x;
+}
+
+static uint64_t rd_u64(Reader * const r) {
+    uint64_t x;
+    rd_bytes(r, &x, sizeof(x));
+    return x;
+}
+
+static int64_t rd_i64(Reader * const r) {
+    int64_t x;
+    rd_bytes(r, &x, sizeof(x));
+    return x;
+}
+
+static double rd_f64(Reader * const r) {
+    double x;
+    rd_bytes(r, &x, sizeof(x));
+    return x;
+}
+
+/* A newly allocated copy of n elements of size bytes, NULL if too short */
+static void * rd_array(Reader * const r, size_t n, size_t size) {
+    void * dst;
+
+    if (r->bad || (size != 0 && n > r->left/size)) {
+        r->bad = 1;
+        return NULL;
+    }
+    dst = malloc(n*size > 0 ? n*size : 1);
+    rd_bytes(r, dst, n*size);
+    return dst;
+}
+
+/* A newly allocated NUL terminated string */
+static char * rd_str(Reader * const r) {
+    uint32_t n = rd_u32(r);
+    char * s;
+
+    if (r->bad || n > r->left) {
+        r->bad = 1;
+        return NULL;
+    }
+    s = malloc(n + 1);
+    rd_bytes(r, s, n);
+    s[n] = '\0';
+    return s;
+}
+
+static void wr_bytes(Writer * const w, void const * src, size_t n) {
+    if (w->len + n > w->cap) {
+        w->cap = 2*(w->len + n);
+        w->data = realloc(w->data, w->cap);
+    }
+    memcpy(w->data + w->len, src, n);
+    w->len += n;
+}
+
+static void wr_u32(Writer * const w, uint32_t x) {
+    wr_bytes(w, &x, sizeof(x));
+}
+
+static void wr_i32(Writer * const w, int32_t x) {
+    wr_bytes(w, &x, sizeof(x));
+}
+
+static void wr_f64(Writer * const w, double x) {
+    wr_bytes(w, &x, sizeof(x));
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+/******************************************************************************/
+/*                                  State                                     */
+/******************************************************************************/
+
+typedef struct _connection {
+    int fd;
+    int refs;                   /* Held by the reader and by each job */
+    int closed;                 /* The client has gone, replies are dropped */
+    pthread_mutex_t write_lock; /* Whole replies are written at a time */
+
+    /* The message being read, only used by the thread reading the sockets */
+    uint8_t head[SHEM_HEADER_SIZE];
+    size_t head_got;            /* Bytes of the header read */
+    uint8_t * payload;          /* Allocated once the header is read */
+    size_t payload_got;
+} Connection;
+
+typedef struct _scene {
+    uint32_t id;
+    int refs;                   /* Held by the registry and by each job */
+    pthread_rwlock_t lock;      /* Traces read, material changes write */
+
+    int n_materials;
+    Material * materials;
+    uint32_t n_changes;         /* Of the materials, for fits to notice */
+
+    Surface3D sample;
+    int plate_kind;             /* SHEM_PLATE_CAD or SHEM_PLATE_CIRCLE */
+    Surface3D plate;            /* CAD plate */
+    double back_wall[3];
+    NBackWall circle;           /* Circle plate */
+    AnalytSphere sphere;
+    double sphere_c[3];
+
+    pthread_mutex_t vis_lock;   /* Guards the maps */
+    int n_maps;
+    VisibilityMap * maps[SHEM_MAX_MAPS]; /* Of the sample, for the beams traced */
+
+    struct _scene * next;
+} Scene;
+
+typedef struct _job {
+    uint16_t type;
+    uint32_t request_id;
+    Connection * conn;
+    uint8_t * payload;
+    size_t length;
+
+    /* Traces */
+    Scene * scene;
+    uint64_t seed;
+    int64_t n_rays;
+    int max_scatter;
+    SourceParam source;
+    int n_pixels;
+    double * offsets;
+    double vis_cell;            /* Cells of the visibility map, 0 for none */
+    int n_detect;
+    size_t stride;              /* Doubles of results per pixel */
+    double * results;
+    int next_pixel;             /* Next pixel to hand out */
+    int n_done;                 /* Pixels finished */
+    int running;                /* Pixels being traced */
+    int queued;                 /* Is the job in the queue */
+    int cancelled;
+
+    /* Fits */
+    int detector;               /* Detector fitted, from 1, 0 for their sum */
+    double * measured;          /* n_pixels */
+    int n_fit;
+    FitParam * fit;
+    int * fit_material;         /* Index of the material of each parameter */
+    double ** fit_values;       /* The params traced for the material of each,
+                                 * owned by the first with the material */
+    uint32_t n_changes;         /* Of the materials of the scene at the start */
+    FitState state;
+
+    struct _job * next;
+} Job;
+
+static struct {
+    pthread_mutex_t lock;       /* Guards everything below and the jobs */
+    pthread_cond_t work;        /* Signalled when a job is queued */
+    Job * head;
+    Job * tail;
+    int n_queued;
+    Job * running;              /* Jobs taken off the queue, for cancelling */
+    Scene * scenes;
+    int n_scenes;
+    int n_threads;
+    int stop;
+    pthread_mutex_t load_lock;  /* Serialises the memory account */
+} server;
+
+static volatile sig_atomic_t got_signal = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    got_signal = 1;
+}
+
+/******************************************************************************/
+/*                                 Replies                                    */
+/******************************************************************************/
+
+static int write_all(int fd, void const * buf, size_t n) {
+    uint8_t const * p = buf;
+
+    while (n > 0) {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static void send_msg(Connection * const conn, uint16_t type, uint32_t request_id,
+        void const * payload, size_t length) {
+    ShemMsgHeader head;
+
+    head.magic = SHEM_MAGIC;
+    head.version = SHEM_PROTOCOL_VERSION;
+    head.type = type;
+    head.request_id = request_id;
+    head.reserved = 0;
+    head.length = length;
+
+    pthread_mutex_lock(&conn->write_lock);
+    if (!conn->closed) {
+        if (write_all(conn->fd, &head, SHEM_HEADER_SIZE) != 0 ||
+                write_all(conn->fd, payload, length) != 0)
+            conn->closed = 1;
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+static void send_error(Connection * const conn, uint32_t request_id, int32_t code,
+        char const * message) {
+    Writer w = {NULL, 0, 0};
+
+    wr_i32(&w, code);
+    wr_u32(&w, (uint32_t)strlen(message));
+    wr_bytes(&w, message, strlen(message));
+    send_msg(conn, SHEM_MSG_ERROR, request_id, w.data, w.len);
+    free(w.data);
+}
+
+/* Must hold server.lock */
+static void release_conn(Connection * const conn) {
+    if (--conn->refs > 0)
+        return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+/******************************************************************************/
+/*                                  Scenes                                    */
+/******************************************************************************/
+
+static void free_scene(Scene * const s) {
+    int i;
+
+    pthread_mutex_lock(&server.load_lock);
+    clean_up_surface(&s->sample);
+    if (s->plate_kind == SHEM_PLATE_CAD)
+        clean_up_surface(&s->plate);
+    for (i = 0; i < s->n_maps; i++)
+        free_visibility_map(s->maps[i]);
+    pthread_mutex_unlock(&server.load_lock);
+    free(s->sample.vertices);
+    free(s->sample.normals);
+    free(s->sample.faces);
+    if (s->plate_kind == SHEM_PLATE_CAD) {
+        free(s->plate.vertices);
+        free(s->plate.normals);
+        free(s->plate.faces);
+    } else {
+        free(s->circle.aperture_c);
+        free(s->circle.aperture_axes);
+    }
+    for (i = 0; i < s->n_materials; i++) {
+        free(s->materials[i].name);
+        free(s->materials[i].func_name);
+        free(s->materials[i].params);
+    }
+    free(s->materials);
+    pthread_rwlock_destroy(&s->lock);
+    pthread_mutex_destroy(&s->vis_lock);
+    free(s);
+}
+
+/* Must hold server.lock */
+static void release_scene(Scene * const s) {
+    if (--s->refs == 0)
+        free_scene(s);
+}
+
+/* Take a reference to a scene, NULL if there is none with the id */
+static Scene * get_scene(uint32_t id) {
+    Scene * s;
+
+    pthread_mutex_lock(&server.lock);
+    for (s = server.scenes; s != NULL; s = s->next) {
+        if (s->id == id) {
+            s->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return s;
+}
+
+/* Remove a scene from the registry, returns 1 if there was one */
+static int unlink_scene(uint32_t id) {
+    Scene ** p;
+    int found = 0;
+
+    pthread_mutex_lock(&server.lock);
+    for (p = &server.scenes; *p != NULL; p = &(*p)->next) {
+        if ((*p)->id == id) {
+            Scene * s = *p;
+            *p = s->next;
+            server.n_scenes--;
+            release_scene(s);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return found;
+}
+
+/*
+ * Read a surface from the payload and set it up. The material index of each
+ * face is turned into the name of the material for set_up_surface. Returns 0
+ * if the payload is malformed.
+ */
+static int read_surface(Reader * const r, Scene * const s, int surf_index,
+        Surface3D * const surf) {
+    uint32_t nvert = rd_u32(r);
+    uint32_t ntriag = rd_u32(r);
+    double * V = rd_array(r, 3*(size_t)nvert, sizeof(double));
+    int32_t * F = rd_array(r, 3*(size_t)ntriag, sizeof(int32_t));
+    double * N = rd_array(r, 3*(size_t)ntriag, sizeof(double));
+    uint32_t * mat = rd_array(r, ntriag, sizeof(uint32_t));
+    char ** C;
+    uint32_t i;
+
+    if (r->bad || ntriag == 0) {
+        free(V);
+        free(F);
+        free(N);
+        free(mat);
+        return 0;
+    }
+    for (i = 0; i < 3*ntriag; i++) {
+        if (F[i] < 1 || (uint32_t)F[i] > nvert)
+            r->bad = 1;
+    }
+    C = malloc(ntriag*sizeof(char*));
+    for (i = 0; i < ntriag; i++) {
+        if (mat[i] >= (uint32_t)s->n_materials) {
+            r->bad = 1;
+            C[i] = s->materials[0].name;
+        } else {
+            C[i] = s->materials[mat[i]].name;
+        }
+    }
+    if (r->bad) {
+        free(V);
+        free(F);
+        free(N);
+        free(mat);
+        free(C);
+        return 0;
+    }
+
+    pthread_mutex_lock(&server.load_lock);
+    set_up_surface(V, N, F, C, s->materials, s->n_materials, (int)ntriag, (int)nvert,
+            surf_index, surf);
+    pthread_mutex_unlock(&server.load_lock);
+    free(mat);
+    free(C);
+    return 1;
+}
+
+static void do_load_scene(Job * const job) {
+    Reader r = {job->payload, job->length, 0};
+    Scene * s = calloc(1, sizeof(Scene));
+    double t0 = now();
+    uint32_t i, n_materials;
+    int ok = 0;
+
+    s->id = rd_u32(&r);
+    s->refs = 1;
+    pthread_rwlock_init(&s->lock, NULL);
+    pthread_mutex_init(&s->vis_lock, NULL);
+
+    /* The materials */
+    n_materials = rd_u32(&r);
+    if (!r.bad && n_materials > 0 && n_materials <= r.left) {
+        s->materials = calloc(n_materials, sizeof(Material));
+        s->n_materials = (int)n_materials;
+        ok = 1;
+        for (i = 0; i < n_materials && ok; i++) {
+            Material * m = &s->materials[i];
+            m->name = rd_str(&r);
+            m->func_name = rd_str(&r);
+            m->n_params = (int)rd_u32(&r);
+            m->params = rd_array(&r, (size_t)m->n_params, sizeof(double));
+            ok = !r.bad && (m->func = distribution_by_name(m->func_name)) != NULL &&
+                m->n_params >= distribution_n_params(m->func);
+        }
+    }
+
+    /* The sample and the plate */
+    s->plate_kind = SHEM_PLATE_CIRCLE;
+    ok = ok && read_surface(&r, s, SAMPLE_INDEX, &s->sample);
+    if (ok) {
+        s->plate_kind = (int)rd_u32(&r);
+        if (s->plate_kind == SHEM_PLATE_CAD) {
+            ok = read_surface(&r, s, PLATE_INDEX, &s->plate);
+            for (i = 0; i < 3; i++)
+                s->back_wall[i] = rd_f64(&r);
+        } else if (s->plate_kind == SHEM_PLATE_CIRCLE) {
+            s->circle.surf_index = PLATE_INDEX;
+            s->circle.n_detect = rd_i32(&r);
+            s->circle.circle_plate_r = rd_f64(&r);
+            s->circle.plate_represent = rd_i32(&r);
+            s->circle.material = s->materials[0];
+            ok = s->circle.n_detect > 0;
+            if (ok) {
+                s->circle.aperture_c = rd_array(&r, 2*(size_t)s->circle.n_detect,
+                    sizeof(double));
+                s->circle.aperture_axes = rd_array(&r, 2*(size_t)s->circle.n_detect,
+                    sizeof(double));
+            }
+        } else {
+            ok = 0;
+        }
+    }
+
+    /* The sphere */
+    if (ok) {
+        int32_t make = rd_i32(&r);
+        double r_sphere;
+        uint32_t mat;
+
+        for (i = 0; i < 3; i++)
+            s->sphere_c[i] = rd_f64(&r);
+        r_sphere = rd_f64(&r);
+        mat = rd_u32(&r);
+        ok = !r.bad && mat < n_materials;
+        if (ok)
+            set_up_sphere(make, s->sphere_c, r_sphere, s->materials[mat], SPHERE_INDEX,
+                &s->sphere);
+    }
+
+    if (!ok) {
+        /* Tidy up whatever was allocated before the payload went wrong */
+        if (s->sample.compositions == NULL)
+            s->sample.n_faces = 0;
+        if (s->plate_kind == SHEM_PLATE_CAD && s->plate.compositions == NULL)
+            s->plate.n_faces = 0;
+        free_scene(s);
+        send_error(job->conn, job->request_id, SHEM_ERR_BAD_REQUEST,
+            "Malformed LOAD_SCENE request.");
+        return;
+    }
+
+    /* Replace any scene with the same id */
+    unlink_scene(s->id);
+    pthread_mutex_lock(&server.lock);
+    s->next = server.scenes;
+    server.scenes = s;
+    server.n_scenes++;
+    pthread_mutex_unlock(&server.lock);
+
+    t0 = now() - t0;
+    send_msg(job->conn, SHEM_MSG_LOAD_SCENE | SHEM_MSG_REPLY, job->request_id, &t0,
+        sizeof(t0));
+}
+
+/* Rebuild the lattices of the frames of the faces of a surface with material m */
+static void refresh_frames(Surface3D * const surf, Material const * const m) {
+    int i;
+
+    for (i = 0; i < surf->n_faces; i++) {
+        if (surf->compositions[i] == m)
+            set_frame_lattice(m->func, m->params, &surf->frames[i]);
+    }
+}
+
+static void do_set_material(Job * const job) {
+    Reader r = {job->payload, job->length, 0};
+    uint32_t id = rd_u32(&r);
+    uint32_t index = rd_u32(&r);
+    char * func_name = rd_str(&r);
+    int n_params = (int)rd_u32(&r);
+    double * params = rd_array(&r, (size_t)n_params, sizeof(double));
+    distribution_func func = func_name != NULL ? distribution_by_name(func_name) : NULL;
+    Scene * s;
+    Material * m;
+
+    if (r.bad || func == NULL || n_params < distribution_n_params(func)) {
+        free(func_name);
+        free(params);
+        send_error(job->conn, job->request_id, SHEM_ERR_BAD_REQUEST,
+            "Malformed SET_MATERIAL request, unknown function or too few parameters.");
+        return;
+    }
+    s = get_scene(id);
+    if (s == NULL || index >= (uint32_t)s->n_materials) {
+        free(func_name);
+        free(params);
+        send_error(job->conn, job->request_id, SHEM_ERR_NO_SCENE,
+            "No such scene or material.");
+        if (s != NULL) {
+            pthread_mutex_lock(&server.lock);
+            release_scene(s);
+            pthread_mutex_unlock(&server.lock);
+        }
+        return;
+    }
+
+    /* Waits for the traces of this scene to finish */
+    pthread_rwlock_wrlock(&s->lock);
+    m = &s->materials[index];
+    free(m->func_name);
+    free(m->params);
+    m->func_name = func_name;
+    m->func = func;
+    m->params = params;
+    m->n_params = n_params;
+    s->n_changes++;
+    refresh_frames(&s->sample, m);
+    if (s->plate_kind == SHEM_PLATE_CAD)
+        refresh_frames(&s->plate, m);
+    else if (index == 0)
+        s->circle.material = *m;
+    if (strcmp(s->sphere.material.name, m->name) == 0)
+        s->sphere.material = *m;
+    pthread_rwlock_unlock(&s->lock);
+
+    pthread_mutex_lock(&server.lock);
+    release_scene(s);
+    pthread_mutex_unlock(&server.lock);
+    send_msg(job->conn, SHEM_MSG_SET_MATERIAL | SHEM_MSG_REPLY, job->request_id, NULL, 0);
+}
+
+static void do_drop_scene(Job * const job) {
+    Reader r = {job->payload, job->length, 0};
+    uint32_t id = rd_u32(&r);
+
+    if (r.bad || !unlink_scene(id)) {
+        send_error(job->conn, job->request_id, SHEM_ERR_NO_SCENE, "No such scene.");
+        return;
+    }
+    send_msg(job->conn, SHEM_MSG_DROP_SCENE | SHEM_MSG_REPLY, job->request_id, NULL, 0);
+}
+
+/******************************************************************************/
+/*                                  Traces                                    */
+/******************************************************************************/
+
+/*
+ * Parse a TRACE request, or the start of a FIT request, into the job. Returns 0
+ * if it is malformed, -1 if there is no such scene.
+ */
+static int parse_trace(Job * const job, Reader * const r) {
+    uint32_t id = rd_u32(r);
+    int32_t source_model;
+    double p[7];
+    int i;
+
+    job->seed = rd_u64(r);
+    job->n_rays = rd_i64(r);
+    job->max_scatter = rd_i32(r);
+    source_model = rd_i32(r);
+    for (i = 0; i < 7; i++)
+        p[i] = rd_f64(r);
+    job->n_pixels = (int)rd_u32(r);
+    job->offsets = rd_array(r, 3*(size_t)job->n_pixels, sizeof(double));
+    if (r->bad || job->n_rays < 0 || job->max_scatter < 1 ||
+            job->max_scatter > SHEM_MAX_SCATTER || job->n_pixels < 1)
+        return 0;
+
+    job->source.pinhole_r = p[0];
+    job->source.pinhole_c[0] = p[1];
+    job->source.pinhole_c[1] = p[2];
+    job->source.pinhole_c[2] = p[3];
+    job->source.theta_max = p[4];
+    job->source.init_angle = p[5];
+    job->source.sigma = p[6];
+    job->source.source_model = source_model;
+
+    job->scene = get_scene(id);
+    if (job->scene == NULL)
+        return -1;
+    job->n_detect = job->scene->plate_kind == SHEM_PLATE_CAD ? 1 : job->scene->circle.n_detect;
+    job->stride = 1 + job->n_detect + (size_t)job->n_detect*SCATTER_BINS(job->max_scatter);
+    if (job->stride > SHEM_MAX_RESULTS/sizeof(double)/(size_t)job->n_pixels)
+        return 0;
+    return 1;
+}
+
+/*
+ * Trace the fitted materials with the parameters of the next evaluation.
+ * Returns 0 if the materials of the scene have been changed since the start.
+ */
+static int apply_trial(Job * const job) {
+    int ok, j;
+
+    pthread_rwlock_rdlock(&job->scene->lock);
+    ok = job->scene->n_changes == job->n_changes;
+    for (j = 0; j < job->n_fit && ok; j++)
+        job->fit_values[j][job->fit[j].param] = job->state.trial[j];
+    for (j = 0; j < job->n_fit && ok; j++)
+        set_up_fit_param(job->fit[j].material, job->fit_values[j], job->fit[j].param,
+            &job->fit[j]);
+    pthread_rwlock_unlock(&job->scene->lock);
+    return ok;
+}
+
+/*
+ * Parse the rest of a FIT request, after parse_trace, into the job. Returns 0
+ * if it is malformed or a parameter cannot be fitted.
+ */
+static int parse_fit(Job * const job, Reader * const r) {
+    Scene * const s = job->scene;
+    double * start;
+    double * lower;
+    double * upper;
+    uint32_t max_evals;
+    double tolerance;
+    int ok, j, k;
+
+    job->detector = (int)rd_u32(r);
+    job->measured = rd_array(r, (size_t)job->n_pixels, sizeof(double));
+    job->n_fit = (int)rd_u32(r);
+    if (r->bad || job->n_fit < 1 || (size_t)job->n_fit > r->left/32) {
+        job->n_fit = 0;
+        return 0;
+    }
+    job->fit = calloc(job->n_fit, sizeof(FitParam));
+    job->fit_material = calloc(job->n_fit, sizeof(int));
+    job->fit_values = calloc(job->n_fit, sizeof(double*));
+    start = malloc(3*job->n_fit*sizeof(double));
+    lower = start + job->n_fit;
+    upper = lower + job->n_fit;
+    for (j = 0; j < job->n_fit; j++) {
+        job->fit_material[j] = (int)rd_u32(r);
+        job->fit[j].param = (int)rd_u32(r);
+        start[j] = rd_f64(r);
+        lower[j] = rd_f64(r);
+        upper[j] = rd_f64(r);
+    }
+    max_evals = rd_u32(r);
+    tolerance = rd_f64(r);
+
+    ok = !r->bad && s->plate_kind == SHEM_PLATE_CIRCLE && job->detector >= 0 &&
+        job->detector <= job->n_detect && max_evals >= 1;
+    for (j = 0; j < job->n_fit && ok; j++)
+        ok = job->fit_material[j] >= 0 && job->fit_material[j] < s->n_materials &&
+            lower[j] < upper[j] && fabs(lower[j]) < 1e300 && fabs(upper[j]) < 1e300;
+
+    /* The parameters of a material are copied once, for all of its fitted ones */
+    if (ok) {
+        pthread_rwlock_rdlock(&s->lock);
+        job->n_changes = s->n_changes;
+        for (j = 0; j < job->n_fit && ok; j++) {
+            Material const * const m = &s->materials[job->fit_material[j]];
+
+            for (k = 0; k < j && job->fit_material[k] != job->fit_material[j]; k++)
+                ;
+            if (k < j) {
+                job->fit_values[j] = job->fit_values[k];
+            } else {
+                job->fit_values[j] = malloc((m->n_params > 0 ? m->n_params : 1)*sizeof(double));
+                memcpy(job->fit_values[j], m->params, m->n_params*sizeof(double));
+            }
+            ok = set_up_fit_param(m, job->fit_values[j], job->fit[j].param, &job->fit[j]);
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+
+    if (ok) {
+        pthread_mutex_lock(&server.load_lock);
+        set_up_fit(job->n_fit, job->n_pixels, job->measured, start, lower, upper,
+            (int)max_evals, tolerance, &job->state);
+        pthread_mutex_unlock(&server.load_lock);
+        apply_trial(job);
+        job->stride += (size_t)job->n_detect*job->n_fit;
+    }
+    free(start);
+    return ok;
+}
+
+/* Must hold server.lock */
+static void free_fit(Job * const job) {
+    int j, k;
+
+    for (j = 0; j < job->n_fit && job->fit_values != NULL; j++) {
+        for (k = 0; k < j && job->fit_values[k] != job->fit_values[j]; k++)
+            ;
+        if (k == j)
+            free(job->fit_values[j]);
+    }
+    free(job->fit_values);
+    free(job->fit_material);
+    free(job->fit);
+    free(job->measured);
+    if (job->state.lower != NULL) {
+        pthread_mutex_lock(&server.load_lock);
+        clean_up_fit(&job->state);
+        pthread_mutex_unlock(&server.load_lock);
+    }
+}
+
+static int is_cancelled(Job * const job) {
+    int c;
+
+    pthread_mutex_lock(&server.lock);
+    c = job->cancelled;
+    pthread_mutex_unlock(&server.lock);
+    return c;
+}
+
+/*
+ * The visibility map of the sample of a scene seen along the beam of the
+ * source, with cells of cell_size. The map is in the frame of the sample, so
+ * it serves every pixel and later traces with the same beam: it is built by
+ * the first pixel to ask for it and kept with the scene. NULL if it cannot be
+ * built, or the scene already has SHEM_MAX_MAPS others, the sample is then
+ * intersected in full.
+ */
+static VisibilityMap * scene_visibility(Scene * const s, SourceParam const * const source,
+        double cell_size) {
+    VisibilityMap * map = NULL;
+    double axis[3];
+    int i;
+
+    source_axis(source, axis);
+    pthread_mutex_lock(&s->vis_lock);
+    for (i = 0; i < s->n_maps && map == NULL; i++) {
+        VisibilityMap * const m = s->maps[i];
+        if (m->cell_size == cell_size && fabs(m->beam[0] - axis[0]) < 1e-12 &&
+                fabs(m->beam[1] - axis[1]) < 1e-12 && fabs(m->beam[2] - axis[2]) < 1e-12)
+            map = m;
+    }
+    if (map == NULL && s->n_maps < SHEM_MAX_MAPS && s->sample.voxels == NULL) {
+        pthread_mutex_lock(&server.load_lock);
+        map = build_visibility_map(s->sample.vertices, s->sample.faces, s->sample.normals,
+            s->sample.n_faces, axis, cell_size);
+        pthread_mutex_unlock(&server.load_lock);
+        if (map != NULL)
+            s->maps[s->n_maps++] = map;
+    }
+    pthread_mutex_unlock(&s->vis_lock);
+    return map;
+}
+
+/*
+ * Trace one pixel of a job: the sample and the sphere are translated by the
+ * offset of the pixel. The surface is copied with its offset set, so the
+ * vertices and the hierarchy are shared with the other pixels.
+ */
+static void trace_pixel(Job * const job, int pixel) {
+    Scene * const s = job->scene;
+    double * const out = &job->results[job->stride*pixel];
+    double * const counts = &out[1];
+    double * const hist = &out[1 + job->n_detect];
+    double * const gradient = &hist[(size_t)job->n_detect*SCATTER_BINS(job->max_scatter)];
+    Surface3D sample;
+    AnalytSphere sphere;
+    double sphere_c[3];
+    MTRand rng;
+    int64_t done = 0;
+    int k;
+
+    pthread_rwlock_rdlock(&s->lock);
+    sample = s->sample;
+    sphere = s->sphere;
+    for (k = 0; k < 3; k++) {
+        sample.offset[k] = job->offsets[3*pixel + k];
+        sphere_c[k] = s->sphere_c[k] + job->offsets[3*pixel + k];
+    }
+    sphere.sphere_c = sphere_c;
+    if (job->vis_cell > 0)
+        sample.visibility = scene_visibility(s, &job->source, job->vis_cell);
+    seedRand((unsigned long)(job->seed + 0x9e3779b97f4a7c15ull*(uint64_t)(pixel + 1)), &rng);
+
+    while (done < job->n_rays && !is_cancelled(job)) {
+        int64_t n = job->n_rays - done < SHEM_CHUNK ? job->n_rays - done : SHEM_CHUNK;
+        int64_t killed = 0;
+
+        if (job->type == SHEM_MSG_FIT) {
+            generating_rays_score(job->source, n, &killed, counts, job->max_scatter,
+                sample, s->circle, sphere, job->fit, job->n_fit, &rng, hist, gradient);
+        } else if (s->plate_kind == SHEM_PLATE_CAD) {
+            int64_t detected = 0;
+            generating_rays_cad_pinhole(job->source, n, &killed, &detected,
+                job->max_scatter, sample, s->plate, NULL, sphere, s->back_wall, NULL,
+                NULL, NULL, &rng, hist);
+            counts[0] += (double)detected;
+        } else {
+            generating_rays_simple_pinhole(job->source, n, &killed, counts,
+                job->max_scatter, sample, s->circle, sphere, NULL, NULL, NULL, &rng, hist);
+        }
+        out[0] += (double)killed;
+        done += n;
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/*
+ * Pass the counts of the pixels of an evaluation of a fit, with their
+ * derivatives, to the optimiser. Returns 1 if there is another evaluation, with
+ * the results cleared for it. Must not hold server.lock.
+ */
+static int next_evaluation(Job * const job) {
+    size_t const n = (size_t)job->n_pixels;
+    double * counts = calloc(n*(1 + job->n_fit), sizeof(double));
+    double * gradient = counts + n;
+    size_t i;
+    int d, j, more;
+
+    for (i = 0; i < n; i++) {
+        double const * const out = &job->results[job->stride*i];
+        double const * const g = &out[1 + job->n_detect +
+            (size_t)job->n_detect*SCATTER_BINS(job->max_scatter)];
+
+        for (d = 0; d < job->n_detect; d++) {
+            if (job->detector != 0 && job->detector != d + 1)
+                continue;
+            counts[i] += out[1 + d];
+            for (j = 0; j < job->n_fit; j++)
+                gradient[i + n*j] += g[d + job->n_detect*j];
+        }
+    }
+    more = fit_step(&job->state, counts, gradient);
+    free(counts);
+
+    /* A change of the materials ends the fit with the best parameters so far */
+    if (more && !apply_trial(job))
+        more = 0;
+    if (more)
+        memset(job->results, 0, job->stride*n*sizeof(double));
+    return more;
+}
+
+/*
+ * Reply to a finished (or cancelled) trace or fit, must not hold server.lock.
+ * The callers release the scene first so that dropping it after the reply frees
+ * it.
+ */
+static void finish_trace(Job * const job) {
+    if (job->cancelled) {
+        send_error(job->conn, job->request_id, SHEM_ERR_CANCELLED, "Cancelled.");
+    } else if (job->type == SHEM_MSG_FIT) {
+        FitState const * const st = &job->state;
+        Writer w = {NULL, 0, 0};
+
+        wr_u32(&w, (uint32_t)st->n_evals);
+        wr_u32(&w, (uint32_t)st->n_fit);
+        wr_f64(&w, st->loss);
+        wr_f64(&w, st->scale);
+        wr_bytes(&w, st->x, st->n_fit*sizeof(double));
+        wr_bytes(&w, st->history, (size_t)(st->n_fit + 1)*st->n_evals*sizeof(double));
+        send_msg(job->conn, SHEM_MSG_FIT | SHEM_MSG_REPLY, job->request_id, w.data, w.len);
+        free(w.data);
+    } else {
+        Writer w = {NULL, 0, 0};
+
+        wr_u32(&w, (uint32_t)job->n_pixels);
+        wr_u32(&w, (uint32_t)job->n_detect);
+        wr_i32(&w, job->max_scatter);
+        wr_bytes(&w, job->results, job->stride*job->n_pixels*sizeof(double));
+        send_msg(job->conn, SHEM_MSG_TRACE | SHEM_MSG_REPLY, job->request_id, w.data, w.len);
+        free(w.data);
+    }
+}
+
+/******************************************************************************/
+/*                                 The queue                                  */
+/******************************************************************************/
+
+/* Must hold server.lock */
+static void queue_job(Job * const job) {
+    job->queued = 1;
+    job->next = NULL;
+    if (server.tail == NULL)
+        server.head = job;
+    else
+        server.tail->next = job;
+    server.tail = job;
+    server.n_queued++;
+    pthread_cond_broadcast(&server.work);
+}
+
+/* Must hold server.lock */
+static void remove_queued(Job * const job) {
+    Job ** p;
+
+    for (p = &server.head; *p != NULL; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            if (server.tail == job) {
+                Job * t = server.head;
+                while (t != NULL && t->next != NULL)
+                    t = t->next;
+                server.tail = t;
+            }
+            job->next = NULL;
+            job->queued = 0;
+            server.n_queued--;
+            return;
+        }
+    }
+}
+
+/* Must hold server.lock */
+static void remove_running(Job * const job) {
+    Job ** p;
+
+    for (p = &server.running; *p != NULL; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            job->next = NULL;
+            return;
+        }
+    }
+}
+
+/* Must hold server.lock */
+static void free_job(Job * const job) {
+    if (job->scene != NULL)
+        release_scene(job->scene);
+    release_conn(job->conn);
+    free(job->payload);
+    free(job->offsets);
+    free(job->results);
+    free_fit(job);
+    free(job);
+}
+
+static void * worker(void * arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&server.lock);
+    while (!server.stop) {
+        Job * job = server.head;
+        int pixel = -1;
+
+        if (job == NULL) {
+            pthread_cond_wait(&server.work, &server.lock);
+            continue;
+        }
+
+        if (job->type == SHEM_MSG_TRACE || job->type == SHEM_MSG_FIT) {
+            /* Hand out the next pixel, the last one takes the job off the queue */
+            pixel = job->next_pixel++;
+            job->running++;
+            if (job->next_pixel == job->n_pixels) {
+                remove_queued(job);
+                job->next = server.running;
+                server.running = job;
+            }
+            pthread_mutex_unlock(&server.lock);
+
+            trace_pixel(job, pixel);
+
+            pthread_mutex_lock(&server.lock);
+            job->running--;
+            job->n_done++;
+            if (job->type == SHEM_MSG_FIT && job->running == 0 && !job->queued &&
+                    !job->cancelled && job->n_done == job->n_pixels) {
+                /* The evaluation of the fit is done, queue the next one */
+                int more;
+
+                pthread_mutex_unlock(&server.lock);
+                more = next_evaluation(job);
+                pthread_mutex_lock(&server.lock);
+                if (more && !job->cancelled) {
+                    remove_running(job);
+                    job->next_pixel = 0;
+                    job->n_done = 0;
+                    queue_job(job);
+                    continue;
+                }
+            }
+            if (job->running == 0 && !job->queued &&
+                    (job->cancelled || job->n_done == job->n_pixels)) {
+                remove_running(job);
+                release_scene(job->scene);
+                job->scene = NULL;
+                pthread_mutex_unlock(&server.lock);
+                finish_trace(job);
+                pthread_mutex_lock(&server.lock);
+                free_job(job);
+            }
+        } else {
+            remove_queued(job);
+            pthread_mutex_unlock(&server.lock);
+            switch (job->type) {
+                case SHEM_MSG_LOAD_SCENE:
+                    do_load_scene(job);
+                    break;
+                case SHEM_MSG_SET_MATERIAL:
+                    do_set_material(job);
+                    break;
+                case SHEM_MSG_DROP_SCENE:
+                    do_drop_scene(job);
+                    break;
+            }
+            pthread_mutex_lock(&server.lock);
+            free_job(job);
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+/*
+ * Cancel a trace or a fit. A queued one none of whose pixels have started is answered
+ * now, otherwise the last of its running pixels answers it.
+ */
+static uint32_t cancel_trace(uint32_t request_id) {
+    Job * job;
+    Job * done = NULL;
+    uint32_t state = SHEM_CANCEL_NOT_FOUND;
+
+    pthread_mutex_lock(&server.lock);
+    for (job = server.head; job != NULL; job = job->next) {
+        if ((job->type == SHEM_MSG_TRACE || job->type == SHEM_MSG_FIT) &&
+                job->request_id == request_id && !job->cancelled)
+            break;
+    }
+    if (job != NULL) {
+        job->cancelled = 1;
+        remove_queued(job);
+        if (job->running == 0) {
+            release_scene(job->scene);
+            job->scene = NULL;
+            done = job;
+            state = SHEM_CANCEL_QUEUED;
+        } else {
+            job->next = server.running;
+            server.running = job;
+            state = SHEM_CANCEL_RUNNING;
+        }
+    } else {
+        for (job = server.running; job != NULL; job = job->next) {
+            if (job->request_id == request_id && !job->cancelled) {
+                job->cancelled = 1;
+                state = SHEM_CANCEL_RUNNING;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if (done != NULL) {
+        finish_trace(done);
+        pthread_mutex_lock(&server.lock);
+        free_job(done);
+        pthread_mutex_unlock(&server.lock);
+    }
+    return state;
+}
+
+/******************************************************************************/
+/*                                The sockets                                 */
+/******************************************************************************/
+
+/*
+ * Dispatch a message whose payload has been read, which the job takes. Returns
+ * -1 if the connection should be closed.
+ */
+static int handle_message(Connection * const conn, ShemMsgHeader const head,
+        uint8_t * payload) {
+    Job * job;
+    int status;
+
+    job = calloc(1, sizeof(Job));
+    job->type = head.type;
+    job->request_id = head.request_id;
+    job->length = head.length;
+    job->payload = payload;
+
+    switch (head.type) {
+        case SHEM_MSG_PING: {
+            Writer w = {NULL, 0, 0};
+
+            pthread_mutex_lock(&server.lock);
+            wr_u32(&w, (uint32_t)server.n_threads);
+            wr_u32(&w, (uint32_t)server.n_scenes);
+            wr_u32(&w, (uint32_t)server.n_queued);
+            pthread_mutex_unlock(&server.lock);
+            pthread_mutex_lock(&server.load_lock);
+            wr_f64(&w, (double)get_memory_account()->total);
+            pthread_mutex_unlock(&server.load_lock);
+            send_msg(conn, SHEM_MSG_PING | SHEM_MSG_REPLY, head.request_id, w.data, w.len);
+            free(w.data);
+            free(job->payload);
+            free(job);
+            return 0;
+        }
+        case SHEM_MSG_CANCEL: {
+            Reader r = {job->payload, job->length, 0};
+            uint32_t target = rd_u32(&r);
+            uint32_t state = r.bad ? SHEM_CANCEL_NOT_FOUND : cancel_trace(target);
+
+            send_msg(conn, SHEM_MSG_CANCEL | SHEM_MSG_REPLY, head.request_id, &state,
+                sizeof(state));
+            free(job->payload);
+            free(job);
+            return 0;
+        }
+        case SHEM_MSG_TRACE:
+        case SHEM_MSG_FIT: {
+            Reader r = {job->payload, job->length, 0};
+
+            status = parse_trace(job, &r);
+            if (status == 1 && head.type == SHEM_MSG_FIT)
+                status = parse_fit(job, &r);
+            else if (status == 1 && r.left >= sizeof(double))
+                job->vis_cell = rd_f64(&r);
+            if (status == 1) {
+                job->results = calloc(job->stride*job->n_pixels, sizeof(double));
+                if (job->results == NULL)
+                    status = 0;
+            }
+            if (status != 1) {
+                send_error(conn, head.request_id, status == 0 ? SHEM_ERR_BAD_REQUEST :
+                    SHEM_ERR_NO_SCENE, status != 0 ? "No such scene." :
+                    head.type == SHEM_MSG_FIT ? "Malformed FIT request." :
+                    "Malformed TRACE request.");
+                pthread_mutex_lock(&server.lock);
+                if (job->scene != NULL)
+                    release_scene(job->scene);
+                free_fit(job);
+                pthread_mutex_unlock(&server.lock);
+                free(job->payload);
+                free(job->offsets);
+                free(job);
+                return 0;
+            }
+            break;
+        }
+        case SHEM_MSG_LOAD_SCENE:
+        case SHEM_MSG_SET_MATERIAL:
+        case SHEM_MSG_DROP_SCENE:
+            break;
+        default:
+            send_error(conn, head.request_id, SHEM_ERR_BAD_REQUEST, "Unknown request type.");
+            free(job->payload);
+            free(job);
+            return 0;
+    }
+
+    /* Queue the job */
+    pthread_mutex_lock(&server.lock);
+    job->conn = conn;
+    conn->refs++;
+    queue_job(job);
+    pthread_mutex_unlock(&server.lock);
+    return 0;
+}
+
+/*
+ * Read whatever has arrived from a client without blocking, dispatching each
+ * message once all of it has been read, so a client that sends part of a
+ * message does not hold up the others. Returns -1 if the connection should be
+ * closed.
+ */
+static int read_messages(Connection * const conn) {
+    for (;;) {
+        ShemMsgHeader head;
+        uint8_t * dst;
+        size_t want;
+        ssize_t k;
+
+        if (conn->head_got < SHEM_HEADER_SIZE) {
+            dst = conn->head + conn->head_got;
+            want = SHEM_HEADER_SIZE - conn->head_got;
+        } else {
+            memcpy(&head, conn->head, SHEM_HEADER_SIZE);
+            dst = conn->payload + conn->payload_got;
+            want = head.length - conn->payload_got;
+        }
+        if (want > 0) {
+            k = recv(conn->fd, dst, want, MSG_DONTWAIT);
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (k <= 0)
+                return -1;
+        } else {
+            k = 0;
+        }
+
+        if (conn->head_got < SHEM_HEADER_SIZE) {
+            conn->head_got += (size_t)k;
+            if (conn->head_got < SHEM_HEADER_SIZE)
+                continue;
+            memcpy(&head, conn->head, SHEM_HEADER_SIZE);
+            if (head.magic != SHEM_MAGIC || head.version != SHEM_PROTOCOL_VERSION) {
+                send_error(conn, head.request_id, SHEM_ERR_BAD_REQUEST,
+                    "Bad magic number or protocol version.");
+                return -1;
+            }
+            conn->payload = head.length < SIZE_MAX ?
+                malloc(head.length > 0 ? head.length : 1) : NULL;
+            conn->payload_got = 0;
+            if (conn->payload == NULL)
+                return -1;
+        } else {
+            conn->payload_got += (size_t)k;
+        }
+
+        if (conn->head_got == SHEM_HEADER_SIZE && conn->payload_got == head.length) {
+            uint8_t * payload = conn->payload;
+
+            conn->head_got = 0;
+            conn->payload = NULL;
+            if (handle_message(conn, head, payload) != 0)
+                return -1;
+        }
+    }
+}
+
+/* The client has gone: drop its replies and cancel its traces */
+static void close_conn(Connection * const conn) {
+    Job * job;
+    uint32_t ids[256];
+    int n = 0, i;
+
+    free(conn->payload);
+    conn->payload = NULL;
+
+    pthread_mutex_lock(&conn->write_lock);
+    conn->closed = 1;
+    pthread_mutex_unlock(&conn->write_lock);
+
+    pthread_mutex_lock(&server.lock);
+    for (job = server.head; job != NULL && n < 256; job = job->next) {
+        if (job->conn == conn && (job->type == SHEM_MSG_TRACE || job->type == SHEM_MSG_FIT))
+            ids[n++] = job->request_id;
+    }
+    for (job = server.running; job != NULL && n < 256; job = job->next) {
+        if (job->conn == conn)
+            ids[n++] = job->request_id;
+    }
+    pthread_mutex_unlock(&server.lock);
+    for (i = 0; i < n; i++)
+        cancel_trace(ids[i]);
+
+    pthread_mutex_lock(&server.lock);
+    release_conn(conn);
+    pthread_mutex_unlock(&server.lock);
+}
+
+/*
+ * Is there a socket at path that nothing is listening on, left by a server that
+ * did not shut down cleanly. Anything else at path is left alone.
+ */
+static int stale_socket(struct sockaddr_un const * const addr) {
+    struct stat st;
+    int fd, stale;
+
+    if (stat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+        return 0;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+    stale = connect(fd, (struct sockaddr const *)addr, sizeof(*addr)) != 0 &&
+        errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/*
+ * Listen on a new socket at path, only readable and writable by the user. A
+ * stale socket at path is replaced, but not a live one or any other file.
+ */
+static int open_socket(char const * path) {
+    struct sockaddr_un addr;
+    mode_t old_mask;
+    int fd, ok;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (stale_socket(&addr))
+        unlink(path);
+    old_mask = umask(0077);
+    ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!ok || listen(fd, 16) != 0) {
+        if (!ok && errno == EADDRINUSE)
+            fprintf(stderr, "%s exists and is not a stale socket\n", path);
+        else
+            perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char * argv[]) {
+    char const * path = SHEM_DEFAULT_SOCKET;
+    struct pollfd fds[SHEM_MAX_CLIENTS + 1];
+    Connection * conns[SHEM_MAX_CLIENTS + 1];
+    pthread_t * threads;
+    struct sigaction sa;
+    int n_fds = 1;
+    int listen_fd;
+    int i;
+
+    server.n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            server.n_threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-s socket_path] [-t n_threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (server.n_threads < 1)
+        server.n_threads = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    listen_fd = open_socket(path);
+    if (listen_fd < 0)
+        return 1;
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.load_lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+    reset_memory_account(0);
+    threads = malloc(server.n_threads*sizeof(pthread_t));
+    for (i = 0; i < server.n_threads; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    printf("shem_server listening on %s with %d threads\n", path, server.n_threads);
+    fflush(stdout);
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    conns[0] = NULL;
+    while (!got_signal) {
+        if (poll(fds, n_fds, 500) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* New clients */
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && n_fds <= SHEM_MAX_CLIENTS) {
+                Connection * conn = calloc(1, sizeof(Connection));
+                struct timeval timeout = {SHEM_SEND_TIMEOUT, 0};
+
+                /* A client that stops reading its replies is dropped */
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                conn->fd = fd;
+                conn->refs = 1;
+                pthread_mutex_init(&conn->write_lock, NULL);
+                fds[n_fds].fd = fd;
+                fds[n_fds].events = POLLIN;
+                fds[n_fds].revents = 0;
+                conns[n_fds] = conn;
+                n_fds++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        /* Requests from the clients, a closed client is swapped with the last */
+        for (i = 1; i < n_fds; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (read_messages(conns[i]) != 0) {
+                    close_conn(conns[i]);
+                    n_fds--;
+                    fds[i] = fds[n_fds];
+                    conns[i] = conns[n_fds];
+                    i--;
+                }
+            }
+        }
+    }
+
+    /* Shut down: answer the queued jobs and wait for the workers */
+    pthread_mutex_lock(&server.lock);
+    server.stop = 1;
+    pthread_cond_broadcast(&server.work);
+    pthread_mutex_unlock(&server.lock);
+    for (i = 0; i < server.n_threads; i++)
+        pthread_join(threads[i], NULL);
+    while (server.head != NULL) {
+        Job * job = server.head;
+        remove_queued(job);
+        send_error(job->conn, job->request_id, SHEM_ERR_SHUTDOWN, "Server shutting down.");
+        free_job(job);
+    }
+    for (i = 1; i < n_fds; i++)
+        release_conn(conns[i]);
+    while (server.scenes != NULL)
+        unlink_scene(server.scenes->id);
+    close(listen_fd);
+    unlink(path);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that the bidirectional estimator (see bidirectional.h) gives the same
+ * counts as tracing forwards, within their statistical errors, into each
+ * detector and for single and multiple scattering. The errors are estimated
+ * from the spread of batches of rays.
+ */
+
+#include "test_scenes.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+
+/* Counts of each batch into each detector, and those scattered once */
+typedef struct _batchCounts {
+    double total[2][N_BATCHES];
+    double single[2][N_BATCHES];
+} BatchCounts;
+
+static void trace_batches(int bidirectional, int64_t n_rays, Surface3D sample,
+        NBackWall plate, AnalytSphere sphere, MTRand * const myrng,
+        BatchCounts * const counts) {
+    SourceParam source = narrow_source();
+    int i, j;
+
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+        double hist[2*SCATTER_BINS(MAX_SCATTERS)] = {0};
+        int64_t killed = 0;
+
+        if (bidirectional)
+            generating_rays_bidirectional(source, n_rays, &killed, cntr, MAX_SCATTERS,
+                sample, plate, sphere, NULL, myrng, hist);
+        else
+            generating_rays_simple_pinhole(source, n_rays, &killed, cntr, MAX_SCATTERS,
+                sample, plate, sphere, NULL, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++) {
+            counts->total[j][i] = cntr[j];
+            counts->single[j][i] = hist[j*SCATTER_BINS(MAX_SCATTERS)];
+        }
+    }
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    BatchCounts forward, bidir;
+    MTRand myrng;
+    int j;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(40, 0.15, 0, &M, &sample);
+    two_aperture_plate(M, 1, &plate);
+    no_sphere(2, &sphere);
+
+    trace_batches(0, n_rays, sample, plate, sphere, &myrng, &forward);
+    trace_batches(1, n_rays, sample, plate, sphere, &myrng, &bidir);
+    for (j = 0; j < 2; j++) {
+        double multi_f[N_BATCHES], multi_b[N_BATCHES];
+        int i;
+
+        CHECK_AGREE(forward.total[j], bidir.total[j], N_BATCHES, "forward",
+            "bidirectional", "all counts into detector %i", j + 1);
+        CHECK_AGREE(forward.single[j], bidir.single[j], N_BATCHES, "forward",
+            "bidirectional", "single scattering into detector %i", j + 1);
+        for (i = 0; i < N_BATCHES; i++) {
+            multi_f[i] = forward.total[j][i] - forward.single[j][i];
+            multi_b[i] = bidir.total[j][i] - bidir.single[j][i];
+        }
+        CHECK_AGREE(multi_f, multi_b, N_BATCHES, "forward", "bidirectional",
+            "multiple scattering into detector %i", j + 1);
+    }
+
+    clean_up_surface_all_arrays(&sample);
+    return checks_failed();
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the bookkeeping of tracing with a time budget (see time_budget.h): a
+ * call that is stopped early traces whole chunks of rays, reports how many it
+ * traced and counts exactly those rays. Every ray is detected off the specular
+ * sample, so the counts and the histogram must equal the rays traced.
+ */
+
+#include "test_scenes.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_SCATTERS 20
+
+/* The budget is cancelled on the poll after the first max_polls */
+static int polls, max_polls;
+
+static int cancel_after_polls(void) {
+    return ++polls > max_polls;
+}
+
+/* Trace n_rays with the budget, checking the counts are of the rays traced */
+static int64_t trace_budgeted(int64_t n_rays, TimeBudget * const budget, Surface3D sample,
+        NBackWall plate, AnalytSphere sphere, MTRand * const myrng, char const * name) {
+    double cntr = 0;
+    double hist[SCATTER_BINS(MAX_SCATTERS)] = {0};
+    double hist_total = 0;
+    int64_t killed = 0;
+    int64_t traced;
+    int k;
+
+    traced = budgeted_rays_simple_pinhole(narrow_source(), n_rays, budget, 0, &killed,
+        &cntr, MAX_SCATTERS, sample, plate, sphere, NULL, NULL, NULL, myrng, hist);
+    for (k = 0; k < SCATTER_BINS(MAX_SCATTERS); k++)
+        hist_total += hist[k];
+    CHECK(cntr == (double)traced && hist_total == (double)traced && killed == 0,
+        "%s: %lld rays traced, %.0f detected, %.0f in the histogram", name,
+        (long long)traced, cntr, hist_total);
+    return traced;
+}
+
+int main(void) {
+    static double aperture_c[2] = {0, 0};
+    static double aperture_axes[2] = {0.5, 0.5};
+    int64_t const n_rays = 5*BUDGET_CHUNK + 123;
+    Material M = diffuse_material();
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    TimeBudget budget;
+    MTRand myrng;
+    int64_t traced;
+
+    seedRand(20201026, &myrng);
+    make_basic_sample(0, 10, &sample);
+    plate.surf_index = 1;
+    plate.n_detect = 1;
+    plate.aperture_c = aperture_c;
+    plate.aperture_axes = aperture_axes;
+    plate.circle_plate_r = 2;
+    plate.plate_represent = 1;
+    plate.material = M;
+    no_sphere(2, &sphere);
+
+    traced = trace_budgeted(n_rays, NULL, sample, plate, sphere, &myrng, "no budget");
+    CHECK(traced == n_rays, "no budget traces all %lld rays", (long long)n_rays);
+
+    set_up_time_budget(0, NULL, &budget);
+    traced = trace_budgeted(n_rays, &budget, sample, plate, sphere, &myrng,
+        "no deadline");
+    CHECK(traced == n_rays && !budget.stopped, "a budget that does not run out "
+        "traces all %lld rays", (long long)n_rays);
+
+    /* Cancelled on the third poll, after the first chunk and two more */
+    polls = 0;
+    max_polls = 2;
+    set_up_time_budget(0, cancel_after_polls, &budget);
+    traced = trace_budgeted(n_rays, &budget, sample, plate, sphere, &myrng, "cancelled");
+    CHECK(traced == 3*BUDGET_CHUNK && budget.stopped, "cancelled on the third poll "
+        "traces %lld rays, expected %d", (long long)traced, 3*BUDGET_CHUNK);
+
+    /* A deadline that has passed still traces the first chunk */
+    set_up_time_budget(0, NULL, &budget);
+    budget.deadline = budget_clock() - 1;
+    traced = trace_budgeted(n_rays, &budget, sample, plate, sphere, &myrng,
+        "deadline passed");
+    CHECK(traced == BUDGET_CHUNK && budget.stopped, "a deadline that has passed "
+        "traces %lld rays, expected %d", (long long)traced, BUDGET_CHUNK);
+
+    /* Once stopped the budget stays so */
+    budget.deadline = 0;
+    traced = trace_budgeted(n_rays, &budget, sample, plate, sphere, &myrng, "stopped");
+    CHECK(traced == BUDGET_CHUNK, "a stopped budget traces %lld rays, expected %d",
+        (long long)traced, BUDGET_CHUNK);
+
+    clean_up_surface_all_arrays(&sample);
+    return checks_failed();
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that scatterTriag finds the same hits through the bounding volume
+ * hierarchy (see bvh.h) as by looping over every face, with and without the
+ * treelet restructuring. Rays come from above the sample and from the hits
+ * they make on it, so that the face a ray is on is skipped in both, and some
+ * are given a nearer hit on another surface to beat.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The hit of the ray on the surface, nearer than min_dist */
+static int nearest_hit(Ray3D * the_ray, Surface3D surf, double * const min_dist,
+        double inter[3], double normal[3]) {
+    int meets = 0;
+    int tri_hit = -1;
+    int which_surface = -1;
+
+    scatterTriag(the_ray, surf, min_dist, inter, normal, &meets, &tri_hit,
+        &which_surface);
+    return tri_hit;
+}
+
+/*
+ * Trace n_rays rays and their second bounces with and without the hierarchy,
+ * returns the number that differ.
+ */
+static int compare_hits(Surface3D surf, int n_rays, MTRand * const myrng) {
+    Surface3D linear = surf;
+    double const down[3] = {0, -1, 0};
+    int n_differ = 0;
+    int i, k;
+
+    linear.bvh = NULL;
+    for (i = 0; i < n_rays; i++) {
+        Ray3D the_ray;
+        double e[3], d[3];
+        int bounce;
+
+        genRand(myrng, &e[0]);
+        genRand(myrng, &e[2]);
+        e[0] = 4*e[0] - 2;
+        e[1] = 0;
+        e[2] = 4*e[2] - 2;
+        random_direction(down, myrng, d);
+        start_ray(e, d, &the_ray);
+
+        for (bounce = 0; bounce < 2; bounce++) {
+            double inter[3], normal[3], l_inter[3], l_normal[3];
+            double dist = 10e10, l_dist = 10e10;
+            double bound;
+            int hit, l_hit;
+
+            /* Every fourth ray already has a nearer hit on another surface */
+            if (i % 4 == 0) {
+                genRand(myrng, &bound);
+                dist = l_dist = bound*bound;
+            }
+            hit = nearest_hit(&the_ray, surf, &dist, inter, normal);
+            l_hit = nearest_hit(&the_ray, linear, &l_dist, l_inter, l_normal);
+
+            /* A ray through an edge may be given either face */
+            if (dist != l_dist || (hit < 0) != (l_hit < 0)) {
+                n_differ++;
+                break;
+            }
+            if (hit < 0)
+                break;
+
+            /* Scatter off the hit, away from the face */
+            for (k = 0; k < 3; k++)
+                the_ray.position[k] = inter[k];
+            random_direction(normal, myrng, the_ray.direction);
+            the_ray.on_surface = surf.surf_index;
+            the_ray.on_element = hit;
+        }
+    }
+    return n_differ;
+}
+
+int main(int argc, char * argv []) {
+    int n_rays = argc > 1 ? atoi(argv[1]) : 20000;
+    Material M = diffuse_material();
+    Surface3D surf;
+    MTRand myrng;
+    double tested;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(60, 0.1, 0, &M, &surf);
+    CHECK(surf.bvh != NULL, "the surface of %i faces has a hierarchy", surf.n_faces);
+
+    CHECK(compare_hits(surf, n_rays, &myrng) == 0,
+        "the hierarchy gives the same hits as the loop over the faces");
+    tested = (double)surf.bvh->n_tested/(double)surf.bvh->n_queries;
+    CHECK(tested < 0.05*surf.n_faces, "%.1f faces tested per ray of %i", tested,
+        surf.n_faces);
+
+    bvh_treelet_optimise(surf.bvh);
+    CHECK(compare_hits(surf, n_rays, &myrng) == 0,
+        "the restructured hierarchy gives the same hits as the loop over the faces");
+
+    clean_up_surface_all_arrays(&surf);
+    return checks_failed();
+}
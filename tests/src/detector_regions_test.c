@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the labelled detector regions of a CAD pinhole plate (see
+ * DetectorRegions). The same rays are traced each time, so the checks are
+ * exact. Three polygons, one of them not convex, tile the back wall rectangle:
+ * they detect the same rays as the rectangle, each where its polygon holds the
+ * crossing, and each polygon on its own detects the same rays as it does in
+ * the single pass with all three. Tagging the faces of half the plate detects
+ * the rays that hit them there.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_RAYS 100000
+#define MAX_SCATTERS 20
+#define N_REGIONS 3
+#define FACE_DETECTOR 4
+
+/*
+ * Polygons in (x, z) over the rectangle |x|, |z| < 1: the half x < 0, the half
+ * x > 0 less a notch, and the notch x < (1 - |z|)/2.
+ */
+static int const sizes[N_REGIONS] = {4, 5, 3};
+static int const ids[N_REGIONS] = {1, 2, 3};
+static double const vertices[2*12] = {
+    -1, -1, 0, -1, 0, 1, -1, 1,
+    0, -1, 1, -1, 1, 1, 0, 1, 0.5, 0,
+    0, -1, 0.5, 0, 0, 1};
+
+/* The polygon that holds (x, z) in the rectangle, worked out directly */
+static int region_of(double x, double z) {
+    if (x < 0)
+        return 1;
+    return x < (1 - fabs(z))/2 ? 3 : 2;
+}
+
+/*
+ * Trace the bank through the plate, the detector of each ray (0 for none) and
+ * their final positions.
+ */
+static void trace_bank(Rays3D const * const bank, Surface3D sample, Surface3D plate,
+        AnalytSphere sphere, DetectorRegions const * const regions,
+        int32_t * const detected, Rays3D * const traced) {
+    double const backWall[3] = {0.5, 2, 2};
+    int64_t cntr[FACE_DETECTOR] = {0};
+    int64_t killed = 0;
+    MTRand myrng;
+
+    seedRand(20201026, &myrng);
+    memcpy(traced->rays, bank->rays, bank->nrays*sizeof(Ray3D));
+    traced->nrays = bank->nrays;
+    memset(detected, 0, bank->nrays*sizeof(int32_t));
+    given_rays_cad_pinhole(traced, &killed, cntr, sample, plate, NULL, sphere,
+        backWall, regions, MAX_SCATTERS, detected, &myrng);
+}
+
+int main(void) {
+    Material M = diffuse_material();
+    SourceParam source = narrow_source();
+    Surface3D sample, plate;
+    AnalytSphere sphere;
+    DetectorRegions regions;
+    Rays3D bank, traced;
+    int32_t * rect = malloc(N_RAYS*sizeof(int32_t));
+    int32_t * all = malloc(N_RAYS*sizeof(int32_t));
+    int32_t * alone = malloc(N_RAYS*sizeof(int32_t));
+    int32_t * tagged = malloc(N_RAYS*sizeof(int32_t));
+    int * face_detector;
+    int n_rect = 0, n_differ = 0, n_misplaced = 0, n_on_faces = 0, n_off_faces = 0;
+    int i, r, n_region, v = 0;
+    MTRand myrng;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(20, 0.1, 0, &M, &sample);
+    aperture_plate_surface(64, 0.25, 1, &M, &plate);
+    no_sphere(2, &sphere);
+    source.pinhole_c[1] = -0.05;
+    create_ray_bank(&source, N_RAYS, 0, &myrng, &bank);
+    traced.rays = malloc(N_RAYS*sizeof(Ray3D));
+
+    /* The rectangle, then the polygons tiling it */
+    trace_bank(&bank, sample, plate, sphere, NULL, rect, &traced);
+    set_up_detector_regions(N_REGIONS, sizes, vertices, ids, NULL, 0, NULL, 0, &regions);
+    trace_bank(&bank, sample, plate, sphere, &regions, all, &traced);
+    clean_up_detector_regions(&regions);
+    for (i = 0; i < N_RAYS; i++) {
+        Ray3D const * const ray = &traced.rays[i];
+
+        n_rect += rect[i] != 0;
+        n_differ += (rect[i] != 0) != (all[i] != 0);
+        if (all[i] && (fabs(ray->position[1] - 0.5) > 1e-9 ||
+                region_of(ray->position[0], ray->position[2]) != all[i]))
+            n_misplaced++;
+    }
+    CHECK(n_rect > 100 && n_differ == 0, "the polygons detect the same rays as the "
+        "rectangle, %i of %i rays differ", n_differ, n_rect);
+    CHECK(n_misplaced == 0, "%i rays detected by a polygon that does not hold them",
+        n_misplaced);
+
+    /* Each polygon on its own */
+    for (r = 0; r < N_REGIONS; r++) {
+        set_up_detector_regions(1, &sizes[r], &vertices[2*v], &ids[r], NULL, 0, NULL,
+            0, &regions);
+        trace_bank(&bank, sample, plate, sphere, &regions, alone, &traced);
+        clean_up_detector_regions(&regions);
+        n_differ = 0;
+        n_region = 0;
+        for (i = 0; i < N_RAYS; i++) {
+            n_differ += (alone[i] == ids[r]) != (all[i] == ids[r]);
+            n_region += all[i] == ids[r];
+        }
+        CHECK(n_region > 100 && n_differ == 0, "detector %i on its own and with the "
+            "others differ on %i of %i rays", ids[r], n_differ, n_region);
+        v += sizes[r];
+    }
+
+    /* Tag the faces of the plate on the x > 0 side */
+    face_detector = calloc(plate.n_faces, sizeof(int));
+    for (i = 0; i < plate.n_faces; i++) {
+        double a[3], b[3], c[3], n[3];
+
+        get_element3D(&plate, i, a, b, c, n);
+        if (a[0] + b[0] + c[0] > 0)
+            face_detector[i] = FACE_DETECTOR;
+    }
+    set_up_detector_regions(N_REGIONS, sizes, vertices, ids, face_detector,
+        plate.n_faces, NULL, 0, &regions);
+    trace_bank(&bank, sample, plate, sphere, &regions, tagged, &traced);
+    clean_up_detector_regions(&regions);
+    for (i = 0; i < N_RAYS; i++) {
+        Ray3D const * const ray = &traced.rays[i];
+
+        if (tagged[i] != FACE_DETECTOR)
+            continue;
+        n_on_faces++;
+        if (fabs(ray->position[1]) > 1e-9 || ray->position[0] < -1e-9)
+            n_off_faces++;
+    }
+    CHECK(n_on_faces > 100 && n_off_faces == 0, "%i rays detected by the tagged faces, "
+        "%i of them away from those faces", n_on_faces, n_off_faces);
+
+    free(face_detector);
+    free(traced.rays);
+    clean_up_rays(bank);
+    free(rect);
+    free(all);
+    free(alone);
+    free(tagged);
+    clean_up_surface_all_arrays(&sample);
+    clean_up_surface_all_arrays(&plate);
+    return checks_failed();
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the materials given by a material map (see material_map.h). A flat
+ * diffuse sample of two faces is given a checkerboard of specular squares by a
+ * map. Rays sent straight down onto it, with the sample moved off the origin,
+ * come straight back up exactly where the checkerboard is specular. Traced
+ * through the plate, the mapped sample counts as many rays into each detector
+ * as the same sample split into the squares of the checkerboard with their
+ * materials given directly, within their statistical errors, and noticeably
+ * fewer than the plain diffuse sample. The errors are estimated from the
+ * spread of batches of rays.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+#define N_RAYS 20000
+#define N_SQUARES 30
+#define HALF_WIDTH 0.75
+#define TEXEL (2*HALF_WIDTH/N_SQUARES)
+
+/*
+ * A flat sample at y = -1 over |x|, |z| < HALF_WIDTH of n by n squares. With
+ * checker the squares whose indices sum to an odd number are of the second
+ * material, the rest are of the first.
+ */
+static void flat_sample(int n, int checker, int surf_index, Material M[2],
+        Surface3D * const surf) {
+    int const nvert = (n + 1)*(n + 1);
+    int const ntriag = 2*n*n;
+    double * V = malloc(3*nvert*sizeof(double));
+    double * N = malloc(3*ntriag*sizeof(double));
+    int32_t * F = malloc(3*ntriag*sizeof(int32_t));
+    char ** C = malloc(ntriag*sizeof(char *));
+    int i, j, k, f = 0;
+
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag*3);
+    for (i = 0; i <= n; i++) {
+        for (j = 0; j <= n; j++) {
+            int const v = i*(n + 1) + j;
+
+            V[3*v] = -HALF_WIDTH + 2*HALF_WIDTH*i/n;
+            V[3*v + 1] = -1;
+            V[3*v + 2] = -HALF_WIDTH + 2*HALF_WIDTH*j/n;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            int const a = i*(n + 1) + j, b = a + n + 1;
+            int const tri[2][3] = {{a, a + 1, b}, {a + 1, b + 1, b}};
+            int t;
+
+            for (t = 0; t < 2; t++, f++) {
+                for (k = 0; k < 3; k++) {
+                    F[3*f + k] = tri[t][k] + 1;
+                    N[3*f + k] = k == 1;
+                }
+                C[f] = M[checker && (i + j) % 2].name;
+            }
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 2, ntriag, nvert, surf_index, surf);
+    free(C);
+}
+
+/* Trace batches with the sample moved to the pixel, the counts of each detector */
+static void trace_pixel(double const pixel[3], Surface3D sample, NBackWall plate,
+        AnalytSphere sphere, MTRand * const myrng, double counts[2][N_BATCHES]) {
+    SourceParam source = narrow_source();
+    double hist[2*SCATTER_BINS(MAX_SCATTERS)] = {0};
+    int64_t killed = 0;
+    int i, j;
+
+    for (j = 0; j < 3; j++)
+        sample.offset[j] = pixel[j];
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+
+        generating_rays_simple_pinhole(source, N_RAYS, &killed, cntr, MAX_SCATTERS,
+            sample, plate, sphere, NULL, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++)
+            counts[j][i] = cntr[j];
+    }
+}
+
+int main(void) {
+    double const origin[3] = {-HALF_WIDTH, -1, -HALF_WIDTH};
+    double const axes[6] = {1, 0, 0, 0, 0, 1};
+    double const texel[2] = {TEXEL, TEXEL};
+    int const dims[2] = {2, 1};
+    uint8_t const ids[2] = {0, 1};
+    double const pixel[3] = {0.02, 0, 0.03};
+    double const down[3] = {0, -1, 0};
+    Material M[2];
+    Surface3D mapped, split, plain;
+    MaterialMap * map;
+    NBackWall plate;
+    AnalytSphere sphere;
+    double mapped_counts[2][N_BATCHES], split_counts[2][N_BATCHES];
+    double plain_counts[2][N_BATCHES];
+    int n_wrong = 0, n_specular = 0;
+    int i, j;
+    MTRand myrng;
+
+    M[0] = diffuse_material();
+    set_up_material("specular", "pure_specular", NULL, 0, &M[1]);
+    seedRand(20201026, &myrng);
+    flat_sample(1, 0, 0, M, &mapped);
+    flat_sample(1, 0, 0, M, &plain);
+    flat_sample(N_SQUARES, 1, 0, M, &split);
+    map = build_material_map(MATERIAL_MAP_CHECKER, origin, axes, texel, dims, ids, NULL,
+        -1, &M[1], 1);
+    mapped.material_map = map;
+    two_aperture_plate(M[0], 1, &plate);
+    no_sphere(2, &sphere);
+
+    /* Specular where the squares, moved with the sample, have odd indices */
+    for (j = 0; j < 3; j++)
+        mapped.offset[j] = pixel[j];
+    for (i = 0; i < N_RAYS; i++) {
+        double e[3] = {0, 0, 0};
+        double u, v;
+        Ray3D the_ray;
+        int specular, expected;
+
+        genRand(&myrng, &e[0]);
+        genRand(&myrng, &e[2]);
+        e[0] = HALF_WIDTH*(2*e[0] - 1) + pixel[0];
+        e[2] = HALF_WIDTH*(2*e[2] - 1) + pixel[2];
+        u = (e[0] - pixel[0] + HALF_WIDTH)/TEXEL;
+        v = (e[2] - pixel[2] + HALF_WIDTH)/TEXEL;
+        if (fabs(u - round(u)) < 1e-6 || fabs(v - round(v)) < 1e-6)
+            continue;
+        expected = ((int)floor(u) + (int)floor(v)) % 2;
+
+        start_ray(e, down, &the_ray);
+        scatterOffSurface(&the_ray, mapped, sphere, &myrng);
+        specular = the_ray.status == 0 && fabs(the_ray.direction[1] - 1) < 1e-12;
+        n_specular += specular;
+        n_wrong += specular != expected;
+    }
+    CHECK(n_specular > N_RAYS/4 && n_wrong == 0, "%i of %i rays reflected specularly, "
+        "%i not as the checkerboard", n_specular, N_RAYS, n_wrong);
+
+    trace_pixel(pixel, mapped, plate, sphere, &myrng, mapped_counts);
+    trace_pixel(pixel, split, plate, sphere, &myrng, split_counts);
+    trace_pixel(pixel, plain, plate, sphere, &myrng, plain_counts);
+    for (j = 0; j < 2; j++) {
+        double total, var, plain_total, plain_var;
+
+        CHECK_AGREE(mapped_counts[j], split_counts[j], N_BATCHES, "mapped", "split",
+            "detector %i", j + 1);
+        batch_total(mapped_counts[j], N_BATCHES, &total, &var);
+        batch_total(plain_counts[j], N_BATCHES, &plain_total, &plain_var);
+        CHECK(n_sigma(total, var, plain_total, plain_var) > 4, "detector %i: mapped "
+            "%.1f +- %.1f, plain diffuse %.1f +- %.1f", j + 1, total, sqrt(var),
+            plain_total, sqrt(plain_var));
+    }
+
+    free_material_map(map);
+    clean_up_surface_all_arrays(&mapped);
+    clean_up_surface_all_arrays(&split);
+    clean_up_surface_all_arrays(&plain);
+    return checks_failed();
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that Metropolis sampling of the detected paths (see metropolis.h)
+ * gives the same counts as tracing forwards, within their statistical errors,
+ * into each detector and for single and multiple scattering. The errors are
+ * estimated from the spread of batches of rays, each batch running its own
+ * chains with the default parameters of tracingMultiGenMex.
+ */
+
+#include "test_scenes.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+
+/* Counts of each batch into each detector, and those scattered once */
+typedef struct _batchCounts {
+    double total[2][N_BATCHES];
+    double single[2][N_BATCHES];
+} BatchCounts;
+
+static void trace_batches(int metropolis, int64_t n_rays, Surface3D sample,
+        NBackWall plate, AnalytSphere sphere, MTRand * const myrng,
+        BatchCounts * const counts, MetropolisStats * const stats) {
+    SourceParam source = narrow_source();
+    MetropolisParam mlt;
+    int i, j;
+
+    mlt.n_forward = n_rays/10;
+    mlt.n_mutations = n_rays;
+    mlt.n_chains = 16;
+    mlt.large_step = 0.3;
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+        double hist[2*SCATTER_BINS(MAX_SCATTERS)] = {0};
+        int64_t killed = 0;
+
+        if (metropolis)
+            generating_rays_metropolis(source, n_rays, &mlt, &killed, cntr, MAX_SCATTERS,
+                sample, plate, sphere, NULL, myrng, hist, stats);
+        else
+            generating_rays_simple_pinhole(source, n_rays, &killed, cntr, MAX_SCATTERS,
+                sample, plate, sphere, NULL, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++) {
+            counts->total[j][i] = cntr[j];
+            counts->single[j][i] = hist[j*SCATTER_BINS(MAX_SCATTERS)];
+        }
+    }
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    BatchCounts forward, mlt;
+    MetropolisStats stats = {0, 0, 0, 0};
+    MTRand myrng;
+    int j;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(40, 0.15, 0, &M, &sample);
+    two_aperture_plate(M, 1, &plate);
+    no_sphere(2, &sphere);
+
+    trace_batches(0, n_rays, sample, plate, sphere, &myrng, &forward, NULL);
+    trace_batches(1, n_rays, sample, plate, sphere, &myrng, &mlt, &stats);
+    CHECK(stats.n_accepted > 0 && stats.n_accepted < stats.n_steps,
+        "the chains accepted %.2f of their steps",
+        (double)stats.n_accepted/(double)stats.n_steps);
+    for (j = 0; j < 2; j++) {
+        double multi_f[N_BATCHES], multi_m[N_BATCHES];
+        int i;
+
+        CHECK_AGREE(forward.total[j], mlt.total[j], N_BATCHES, "forward",
+            "Metropolis", "all counts into detector %i", j + 1);
+        CHECK_AGREE(forward.single[j], mlt.single[j], N_BATCHES, "forward",
+            "Metropolis", "single scattering into detector %i", j + 1);
+        for (i = 0; i < N_BATCHES; i++) {
+            multi_f[i] = forward.total[j][i] - forward.single[j][i];
+            multi_m[i] = mlt.total[j][i] - mlt.single[j][i];
+        }
+        CHECK_AGREE(multi_f, multi_m, N_BATCHES, "forward", "Metropolis",
+            "multiple scattering into detector %i", j + 1);
+    }
+
+    clean_up_surface_all_arrays(&sample);
+    return checks_failed();
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that multilevel Monte Carlo over a coarse and a fine mesh of a
+ * heightfield (see multilevel.h) gives the same counts as tracing the fine mesh
+ * forwards, within their statistical errors, into each detector and for single
+ * and multiple scattering. The errors are estimated from the spread of batches
+ * of rays. Also checks that the rays on the two meshes are coupled, so that
+ * the correction between them varies less than the counts on the fine mesh.
+ */
+
+#include "test_scenes.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+
+/* Counts of each batch into each detector, and those scattered once */
+typedef struct _batchCounts {
+    double total[2][N_BATCHES];
+    double single[2][N_BATCHES];
+} BatchCounts;
+
+static void trace_batches(int multilevel, int64_t n_rays, Surface3D const levels[2],
+        NBackWall plate, AnalytSphere sphere, MTRand * const myrng,
+        BatchCounts * const counts, MultilevelStats * const stats) {
+    SourceParam source = narrow_source();
+    int64_t const level_rays[2] = {n_rays, n_rays/4};
+    int i, j;
+
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+        double hist[2*SCATTER_BINS(MAX_SCATTERS)] = {0};
+        int64_t killed = 0;
+
+        if (multilevel)
+            generating_rays_multilevel(source, n_rays, level_rays, &killed, cntr,
+                MAX_SCATTERS, levels, 2, plate, sphere, NULL, NULL, myrng, hist, stats);
+        else
+            generating_rays_simple_pinhole(source, n_rays, &killed, cntr, MAX_SCATTERS,
+                levels[1], plate, sphere, NULL, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++) {
+            counts->total[j][i] = cntr[j];
+            counts->single[j][i] = hist[j*SCATTER_BINS(MAX_SCATTERS)];
+        }
+    }
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    Surface3D levels[2];
+    NBackWall plate;
+    AnalytSphere sphere;
+    BatchCounts forward, mlmc;
+    MultilevelStats stats;
+    MTRand myrng;
+    int j;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(24, 0.15, 0, &M, &levels[0]);
+    heightfield_surface(48, 0.15, 0, &M, &levels[1]);
+    two_aperture_plate(M, 1, &plate);
+    no_sphere(2, &sphere);
+    set_up_multilevel_stats(2, plate.n_detect, &stats);
+
+    trace_batches(0, n_rays, levels, plate, sphere, &myrng, &forward, NULL);
+    trace_batches(1, n_rays, levels, plate, sphere, &myrng, &mlmc, &stats);
+    for (j = 0; j < 2; j++) {
+        double multi_f[N_BATCHES], multi_m[N_BATCHES];
+        int i;
+
+        CHECK(multilevel_variance(&stats, 1, j) < multilevel_fine_variance(&stats, j),
+            "the correction into detector %i has variance %.3g, a ray on the fine mesh %.3g",
+            j + 1, multilevel_variance(&stats, 1, j), multilevel_fine_variance(&stats, j));
+        CHECK_AGREE(forward.total[j], mlmc.total[j], N_BATCHES, "forward",
+            "multilevel", "all counts into detector %i", j + 1);
+        CHECK_AGREE(forward.single[j], mlmc.single[j], N_BATCHES, "forward",
+            "multilevel", "single scattering into detector %i", j + 1);
+        for (i = 0; i < N_BATCHES; i++) {
+            multi_f[i] = forward.total[j][i] - forward.single[j][i];
+            multi_m[i] = mlmc.total[j][i] - mlmc.single[j][i];
+        }
+        CHECK_AGREE(multi_f, multi_m, N_BATCHES, "forward", "multilevel",
+            "multiple scattering into detector %i", j + 1);
+    }
+
+    clean_up_multilevel_stats(&stats);
+    clean_up_surface_all_arrays(&levels[0]);
+    clean_up_surface_all_arrays(&levels[1]);
+    return checks_failed();
+}
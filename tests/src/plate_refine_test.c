@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the multi-resolution CAD pinhole plate (see PlateRefine). The coarse
+ * plate has a square aperture and the fine plate a nearly circular one of the
+ * same radius, which lets through noticeably more rays. Refined around the
+ * aperture the coarse plate counts as many rays as the fine plate does, within
+ * their statistical errors, while refined only far from the aperture it counts
+ * as many as the coarse plate alone. The errors are estimated from the spread
+ * of batches of rays.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+#define APERTURE_R 0.25
+
+/* Trace batches through the plate, the detected rays of each batch */
+static void trace_batches(int64_t n_rays, Surface3D sample, Surface3D plate,
+        PlateRefine const * const refine, AnalytSphere sphere, MTRand * const myrng,
+        double detected[N_BATCHES]) {
+    /* Just below the plate, the back wall catches the rays through the aperture */
+    SourceParam source = narrow_source();
+    double const backWall[3] = {0.5, 2, 2};
+    double hist[SCATTER_BINS(MAX_SCATTERS)] = {0};
+    int64_t killed = 0;
+    int i;
+
+    source.pinhole_c[1] = -0.05;
+    for (i = 0; i < N_BATCHES; i++) {
+        int64_t cntr = 0;
+
+        generating_rays_cad_pinhole(source, n_rays, &killed, &cntr, MAX_SCATTERS,
+            sample, plate, refine, sphere, backWall, NULL, NULL, NULL, myrng, hist);
+        detected[i] = (double)cntr;
+    }
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    double near[4] = {0, 0, 0, 2*APERTURE_R};
+    double far[4] = {3, 0, 3, 2*APERTURE_R};
+    Surface3D sample, coarse;
+    PlateRefine refine;
+    AnalytSphere sphere;
+    double fine_only[N_BATCHES], coarse_only[N_BATCHES];
+    double refined_near[N_BATCHES], refined_far[N_BATCHES];
+    double total_fine, var_fine, total_coarse, var_coarse;
+    MTRand myrng;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(20, 0.1, 0, &M, &sample);
+    aperture_plate_surface(4, APERTURE_R, 1, &M, &coarse);
+    aperture_plate_surface(64, APERTURE_R, 3, &M, &refine.fine);
+    no_sphere(2, &sphere);
+    refine.n_regions = 1;
+
+    trace_batches(n_rays, sample, refine.fine, NULL, sphere, &myrng, fine_only);
+    trace_batches(n_rays, sample, coarse, NULL, sphere, &myrng, coarse_only);
+    refine.regions = near;
+    trace_batches(n_rays, sample, coarse, &refine, sphere, &myrng, refined_near);
+    refine.regions = far;
+    trace_batches(n_rays, sample, coarse, &refine, sphere, &myrng, refined_far);
+
+    /* The test is only meaningful if the two apertures differ */
+    batch_total(fine_only, N_BATCHES, &total_fine, &var_fine);
+    batch_total(coarse_only, N_BATCHES, &total_coarse, &var_coarse);
+    CHECK(n_sigma(total_fine, var_fine, total_coarse, var_coarse) > 4,
+        "the fine aperture lets through %.1f +- %.1f rays, the coarse %.1f +- %.1f",
+        total_fine, sqrt(var_fine), total_coarse, sqrt(var_coarse));
+
+    CHECK_AGREE(fine_only, refined_near, N_BATCHES, "fine", "refined",
+        "refined around the aperture");
+    CHECK_AGREE(coarse_only, refined_far, N_BATCHES, "coarse", "refined",
+        "refined away from the aperture");
+
+    clean_up_surface_all_arrays(&sample);
+    clean_up_surface_all_arrays(&coarse);
+    clean_up_surface_all_arrays(&refine.fine);
+    return checks_failed();
+}
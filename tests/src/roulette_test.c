@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that Russian roulette (see RouletteParam) removes the bias of killing
+ * long paths: with a low maxScatters the weighted counts with roulette agree
+ * with tracing forwards under a limit no ray reaches, within their statistical
+ * errors, while killing the rays under the same low limit loses counts. The
+ * errors are estimated from the spread of batches of rays. Also checks that
+ * the rays detected after more than maxScatters sample scattering events are
+ * counted in the overflow bin of the histogram, see SCATTER_BINS.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define LOW_SCATTERS 2
+#define HIGH_SCATTERS 40
+
+/*
+ * Trace batches, the counts into each detector of each batch and the overflow
+ * bins of their histograms. Checks the histograms add up to the counts.
+ */
+static int64_t trace_batches(int max_scatters, RouletteParam const * const roulette,
+        int64_t n_rays, Surface3D sample, NBackWall plate, AnalytSphere sphere,
+        MTRand * const myrng, double total[2][N_BATCHES], double overflow[2]) {
+    SourceParam source = narrow_source();
+    int const n_bins = SCATTER_BINS(max_scatters);
+    double * hist = (double*)calloc(2*n_bins, sizeof(double));
+    double all = 0, in_hist = 0;
+    int64_t killed = 0;
+    int i, j;
+
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+
+        generating_rays_simple_pinhole(source, n_rays, &killed, cntr, max_scatters,
+            sample, plate, sphere, roulette, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++) {
+            total[j][i] = cntr[j];
+            all += cntr[j];
+        }
+    }
+    for (j = 0; j < 2*n_bins; j++)
+        in_hist += hist[j];
+    CHECK(fabs(all - in_hist) <= 1e-9*all, "the histogram with a limit of %i holds "
+        "%.1f of %.1f counts", max_scatters, in_hist, all);
+    for (j = 0; j < 2; j++)
+        overflow[j] = hist[j*n_bins + max_scatters];
+    free(hist);
+    return killed;
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    RouletteParam const roulette = {2, 0.2};
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    double forward[2][N_BATCHES], rr[2][N_BATCHES], low[2][N_BATCHES];
+    double of_forward[2], of_rr[2], of_low[2];
+    int64_t killed_forward, killed_rr, killed_low;
+    MTRand myrng;
+    int j;
+
+    seedRand(20201026, &myrng);
+    heightfield_surface(40, 0.3, 0, &M, &sample);
+    two_aperture_plate(M, 1, &plate);
+    no_sphere(2, &sphere);
+
+    killed_forward = trace_batches(HIGH_SCATTERS, NULL, n_rays, sample, plate, sphere,
+        &myrng, forward, of_forward);
+    killed_rr = trace_batches(LOW_SCATTERS, &roulette, n_rays, sample, plate, sphere,
+        &myrng, rr, of_rr);
+    killed_low = trace_batches(LOW_SCATTERS, NULL, n_rays, sample, plate, sphere,
+        &myrng, low, of_low);
+
+    CHECK(killed_rr == 0, "roulette killed %lld rays", (long long)killed_rr);
+    CHECK(killed_low > 100*(killed_forward + 1), "the low limit killed %lld rays, "
+        "the high limit %lld", (long long)killed_low, (long long)killed_forward);
+    for (j = 0; j < 2; j++) {
+        double t_forward, v_forward, t_low, v_low;
+
+        CHECK(of_rr[j] > 0 && of_forward[j] == 0 && of_low[j] == 0, "overflow bins "
+            "of detector %i: %.1f with roulette, %.1f and %.1f without", j + 1,
+            of_rr[j], of_forward[j], of_low[j]);
+
+        CHECK_AGREE(forward[j], rr[j], N_BATCHES, "forward", "roulette",
+            "all counts into detector %i", j + 1);
+        batch_total(forward[j], N_BATCHES, &t_forward, &v_forward);
+        batch_total(low[j], N_BATCHES, &t_low, &v_low);
+        CHECK(n_sigma(t_forward, v_forward, t_low, v_low) > 4, "killing at the low limit "
+            "loses counts into detector %i: %.1f, %.1f without", j + 1, t_low, t_forward);
+    }
+
+    clean_up_surface_all_arrays(&sample);
+    return checks_failed();
+}
@@ -26,8 +26,8 @@ int main(int argc, char * argv []) {
     MTRand myrng;
 
     Ray3D the_ray;
-    int killed = 0;
-    int32_t cntr_detected;
+    int64_t killed = 0;
+    double cntr_detected;
     int maxScatters = 20;   // Maximum allowed number of scatters
     Surface3D sample;
     NBackWall plate;
@@ -54,7 +54,7 @@ int main(int argc, char * argv []) {
 
     // Counter for the number of detected
     cntr_detected = 0;
-    int32_t * numScattersRay;
+    double * numScattersRay;
 
     double aperture_c[3] = {0, 0};
     double aperture_axes[2] = {0.1, 0.1};
@@ -89,14 +89,21 @@ int main(int argc, char * argv []) {
     printf("The sample:\n");
     print_surface(&sample);
 
-    numScattersRay = (int32_t *)calloc(n, sizeof(int32_t));
+    PixelFeatures feat;
+    set_up_features(&standard_mat, 1, &feat);
+
+    numScattersRay = (double *)calloc(n, sizeof(double));
     generating_rays_simple_pinhole(source, n, &killed, &cntr_detected, maxScatters, sample,
-    		plate, sphere, &myrng, numScattersRay);
+    		plate, sphere, NULL, NULL, &feat, &myrng, numScattersRay);
+
+    printf("Fraction of first hits on the sample is: %f\n",
+    		(double)feat.n_sample/(double)feat.n_rays);
 
-    printf("Number of detected rays is: %i\n", cntr_detected);
+    printf("Number of detected rays is: %i\n", (int)cntr_detected);
     printf("Sample is set-up to be specular, all of them should be detected.\n");
 
     free(numScattersRay);
+    clean_up_features(&feat);
     clean_up_surface_all_arrays(&sample);
 }
 
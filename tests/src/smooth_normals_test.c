@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the normals interpolated across the faces of a surface (see
+ * smooth_surface_normals). Rays reflected specularly off a coarse faceted
+ * sphere go much closer to the reflections off the true sphere with smoothed
+ * normals than with flat faces, none of them are sent into the face they
+ * reflect off, and with a crease angle below the angle between neighbouring
+ * faces every edge is kept sharp so the faces reflect as flat faces do.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_RAYS 20000
+#define N_LAT 12
+#define N_LON 24
+#define SPHERE_Y -2.0
+
+/*
+ * A unit sphere centred at (0, SPHERE_Y, 0) of N_LAT bands of N_LON faces each
+ * (one face per division in the bands at the poles), the faces normal outwards.
+ */
+static void faceted_sphere(int surf_index, Material * M, Surface3D * const surf) {
+    int const nvert = 2 + (N_LAT - 1)*N_LON;
+    int const ntriag = 2*(N_LAT - 1)*N_LON;
+    double * V = malloc(3*nvert*sizeof(double));
+    double * N = malloc(3*ntriag*sizeof(double));
+    int32_t * F = malloc(3*ntriag*sizeof(int32_t));
+    char ** C = malloc(ntriag*sizeof(char *));
+    int i, j, k, f = 0;
+
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag*3);
+
+    /* The poles are vertices 0 and 1, then the rings from the top */
+    V[0] = 0; V[1] = SPHERE_Y + 1; V[2] = 0;
+    V[3] = 0; V[4] = SPHERE_Y - 1; V[5] = 0;
+    for (i = 1; i < N_LAT; i++) {
+        double const theta = M_PI*i/N_LAT;
+
+        for (j = 0; j < N_LON; j++) {
+            double const phi = 2*M_PI*j/N_LON;
+            int const v = 2 + (i - 1)*N_LON + j;
+
+            V[3*v] = sin(theta)*cos(phi);
+            V[3*v + 1] = SPHERE_Y + cos(theta);
+            V[3*v + 2] = sin(theta)*sin(phi);
+        }
+    }
+
+    for (i = 0; i < N_LAT; i++) {
+        for (j = 0; j < N_LON; j++) {
+            int const jn = (j + 1) % N_LON;
+            int const up = 2 + (i - 1)*N_LON, down = 2 + i*N_LON;
+            int tri[2][3];
+            int n_tri = 0, t;
+
+            if (i == 0) {
+                tri[n_tri][0] = 0; tri[n_tri][1] = down + j; tri[n_tri++][2] = down + jn;
+            } else if (i == N_LAT - 1) {
+                tri[n_tri][0] = 1; tri[n_tri][1] = up + j; tri[n_tri++][2] = up + jn;
+            } else {
+                tri[n_tri][0] = up + j; tri[n_tri][1] = down + j; tri[n_tri++][2] = down + jn;
+                tri[n_tri][0] = up + j; tri[n_tri][1] = down + jn; tri[n_tri++][2] = up + jn;
+            }
+            for (t = 0; t < n_tri; t++, f++) {
+                double e1[3], e2[3], normal[3], out;
+
+                for (k = 0; k < 3; k++) {
+                    F[3*f + k] = tri[t][k] + 1;
+                    e1[k] = V[3*tri[t][1] + k] - V[3*tri[t][0] + k];
+                    e2[k] = V[3*tri[t][2] + k] - V[3*tri[t][0] + k];
+                }
+                cross(e1, e2, normal);
+                normalise(normal);
+                out = normal[0]*V[3*tri[t][0]] + normal[1]*(V[3*tri[t][0] + 1] - SPHERE_Y) +
+                    normal[2]*V[3*tri[t][0] + 2];
+                for (k = 0; k < 3; k++)
+                    N[3*f + k] = out < 0 ? -normal[k] : normal[k];
+                C[f] = M->name;
+            }
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 1, f, nvert, surf_index, surf);
+    free(C);
+}
+
+/*
+ * Reflect rays coming straight down onto the sphere, the mean angle between
+ * them and the reflection off the true sphere where they hit, and the number
+ * sent into the face they hit.
+ */
+static double reflection_error(Surface3D sphere_mesh, AnalytSphere none, int * const into) {
+    double const down[3] = {0, -1, 0};
+    double total = 0;
+    MTRand myrng;
+    int i, n_hit = 0;
+
+    seedRand(20201026, &myrng);
+    *into = 0;
+    for (i = 0; i < N_RAYS; i++) {
+        Ray3D the_ray;
+        double e[3] = {0, 0, 0};
+        double radial[3], reflected[3], cos_err, cos_face;
+        int k;
+
+        /* Clear of the edge of the sphere, where the reflections graze it */
+        do {
+            genRand(&myrng, &e[0]);
+            genRand(&myrng, &e[2]);
+            e[0] = 1.6*e[0] - 0.8;
+            e[2] = 1.6*e[2] - 0.8;
+        } while (e[0]*e[0] + e[2]*e[2] > 0.64);
+        start_ray(e, down, &the_ray);
+        scatterOffSurface(&the_ray, sphere_mesh, none, &myrng);
+        if (the_ray.status != 0)
+            continue;
+        n_hit++;
+
+        for (k = 0; k < 3; k++)
+            radial[k] = the_ray.position[k] - (k == 1 ? SPHERE_Y : 0);
+        normalise(radial);
+        reflect3D(radial, down, reflected);
+        dot(reflected, the_ray.direction, &cos_err);
+        total += acos(cos_err < 1 ? cos_err : 1);
+
+        dot(&sphere_mesh.normals[3*the_ray.on_element], the_ray.direction, &cos_face);
+        if (cos_face < 0)
+            (*into)++;
+    }
+    CHECK(n_hit == N_RAYS, "%i of %i rays hit the sphere", n_hit, N_RAYS);
+    return total/N_RAYS;
+}
+
+int main(void) {
+    Material M;
+    Surface3D sphere_mesh;
+    AnalytSphere none;
+    double flat, smooth, creased;
+    int into_flat, into_smooth, into_creased;
+
+    M.name = "specular";
+    M.func_name = "pure_specular";
+    M.params = NULL;
+    M.n_params = 0;
+    M.func = distribution_by_name("pure_specular");
+    faceted_sphere(0, &M, &sphere_mesh);
+    no_sphere(1, &none);
+
+    flat = reflection_error(sphere_mesh, none, &into_flat);
+    smooth_surface_normals(&sphere_mesh, 60*M_PI/180);
+    smooth = reflection_error(sphere_mesh, none, &into_smooth);
+    /* The faces of neighbouring bands are 15 degrees apart */
+    smooth_surface_normals(&sphere_mesh, 1*M_PI/180);
+    creased = reflection_error(sphere_mesh, none, &into_creased);
+
+    /*
+     * The area weighted normals at the vertices of the bands are tilted by
+     * about a degree towards the larger faces of the band nearer the equator
+     */
+    CHECK(smooth < 0.4*flat, "mean error of the reflections %.3f degrees smoothed, "
+        "%.3f degrees flat", smooth*180/M_PI, flat*180/M_PI);
+    CHECK(into_flat == 0 && into_smooth == 0 && into_creased == 0, "rays reflected "
+        "into their face: %i flat, %i smoothed, %i creased", into_flat, into_smooth,
+        into_creased);
+    CHECK(fabs(creased - flat) <= 1e-9*flat, "mean error of the reflections %.3f "
+        "degrees with every edge creased, %.3f degrees flat", creased*180/M_PI,
+        flat*180/M_PI);
+
+    clean_up_surface_all_arrays(&sphere_mesh);
+    return checks_failed();
+}
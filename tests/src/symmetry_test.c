@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks the symmetry of a scan (see symmetry.h) against what the rays do. The
+ * sample is even in z but not in x, so with the two apertures on the x axis
+ * only the mirror z -> -z is found to leave the scene unchanged. For that
+ * mirror a pixel and its image count as many rays into each detector and the
+ * detector it maps onto, within their statistical errors, so tracing only the
+ * fundamental domain loses nothing. For the mirror x -> -x, which is rejected,
+ * they do not. The errors are estimated from the spread of batches of rays.
+ */
+
+#include "test_scenes.h"
+#include "symmetry.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_BATCHES 10
+#define MAX_SCATTERS 20
+#define TOL 1e-6
+#define N_GRID 40
+
+/*
+ * The heightfield y = -1 + 0.1 (sin(5x) + cos(4z)) over -1.5 < x, z < 1.5. Unlike
+ * heightfield_surface the diagonals of the squares are mirrored about z = 0, so
+ * that the faces, not only the heights, are even in z.
+ */
+static void mirrored_heightfield(int surf_index, Material * M, Surface3D * const surf) {
+    int const nvert = (N_GRID + 1)*(N_GRID + 1);
+    int const ntriag = 2*N_GRID*N_GRID;
+    double * V = malloc(3*nvert*sizeof(double));
+    double * N = malloc(3*ntriag*sizeof(double));
+    int32_t * F = malloc(3*ntriag*sizeof(int32_t));
+    char ** C = malloc(ntriag*sizeof(char *));
+    int i, j, k, f = 0;
+
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag*3);
+    for (i = 0; i <= N_GRID; i++) {
+        for (j = 0; j <= N_GRID; j++) {
+            int const v = i*(N_GRID + 1) + j;
+
+            V[3*v] = -1.5 + 3.0*i/N_GRID;
+            V[3*v + 2] = -1.5 + 3.0*j/N_GRID;
+            V[3*v + 1] = -1 + 0.1*(sin(5*V[3*v]) + cos(4*V[3*v + 2]));
+        }
+    }
+
+    for (i = 0; i < N_GRID; i++) {
+        for (j = 0; j < N_GRID; j++) {
+            int const a = i*(N_GRID + 1) + j, b = a + N_GRID + 1;
+            int const low[2][3] = {{a, a + 1, b}, {a + 1, b + 1, b}};
+            int const high[2][3] = {{a, b + 1, b}, {a, a + 1, b + 1}};
+            int t;
+
+            for (t = 0; t < 2; t++, f++) {
+                int const * tri = 2*j < N_GRID ? low[t] : high[t];
+                double e1[3], e2[3], normal[3];
+
+                for (k = 0; k < 3; k++) {
+                    F[3*f + k] = tri[k] + 1;
+                    e1[k] = V[3*tri[1] + k] - V[3*tri[0] + k];
+                    e2[k] = V[3*tri[2] + k] - V[3*tri[0] + k];
+                }
+                cross(e1, e2, normal);
+                normalise(normal);
+                for (k = 0; k < 3; k++)
+                    N[3*f + k] = normal[1] < 0 ? -normal[k] : normal[k];
+                C[f] = M->name;
+            }
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 1, ntriag, nvert, surf_index, surf);
+    free(C);
+}
+
+/* Trace batches with the sample moved to the pixel, the counts of each detector */
+static void trace_pixel(double const pixel[3], int64_t n_rays, Surface3D sample,
+        NBackWall plate, AnalytSphere sphere, MTRand * const myrng,
+        double counts[2][N_BATCHES]) {
+    SourceParam source = narrow_source();
+    double hist[2*SCATTER_BINS(MAX_SCATTERS)] = {0};
+    int64_t killed = 0;
+    int i, j;
+
+    for (j = 0; j < 3; j++)
+        sample.offset[j] = pixel[j];
+    for (i = 0; i < N_BATCHES; i++) {
+        double cntr[2] = {0, 0};
+
+        generating_rays_simple_pinhole(source, n_rays, &killed, cntr, MAX_SCATTERS,
+            sample, plate, sphere, NULL, NULL, NULL, myrng, hist);
+        for (j = 0; j < 2; j++)
+            counts[j][i] = cntr[j];
+    }
+}
+
+int main(int argc, char * argv []) {
+    int64_t n_rays = argc > 1 ? atoll(argv[1]) : 20000;
+    Material M = diffuse_material();
+    SourceParam source = narrow_source();
+    double const pixel[3] = {0.2, 0, 0.3};
+    double image[3];
+    double counts[2][N_BATCHES], image_counts[2][N_BATCHES];
+    int symmetric[SYM_N_OPS];
+    int perm[SYM_N_OPS][2];
+    Surface3D sample;
+    NBackWall plate;
+    AnalytSphere sphere;
+    MTRand myrng;
+    int op, j;
+
+    seedRand(20201026, &myrng);
+    mirrored_heightfield(0, &M, &sample);
+    two_aperture_plate(M, 1, &plate);
+    no_sphere(2, &sphere);
+
+    for (op = 0; op < SYM_N_OPS; op++)
+        symmetric[op] = scene_symmetric(&sample, &sphere, &plate, &source, op, TOL,
+            perm[op]);
+    CHECK(symmetric[SYM_MIRROR_Z] && perm[SYM_MIRROR_Z][0] == 0 &&
+        perm[SYM_MIRROR_Z][1] == 1, "the mirror z -> -z keeps the scene and each "
+        "aperture");
+    CHECK(!symmetric[SYM_MIRROR_X] && !symmetric[SYM_ROTATE_180], "the mirror x -> -x "
+        "and the rotation change the scene");
+    CHECK(plate_symmetric(&plate, SYM_MIRROR_X, TOL, perm[SYM_MIRROR_X]) &&
+        perm[SYM_MIRROR_X][0] == 1 && perm[SYM_MIRROR_X][1] == 0, "the mirror x -> -x "
+        "swaps the apertures");
+
+    trace_pixel(pixel, n_rays, sample, plate, sphere, &myrng, counts);
+    for (op = SYM_MIRROR_X; op <= SYM_MIRROR_Z; op++) {
+        char const * name = op == SYM_MIRROR_X ? "x -> -x" : "z -> -z";
+
+        apply_symmetry(op, pixel, image);
+        trace_pixel(image, n_rays, sample, plate, sphere, &myrng, image_counts);
+        for (j = 0; j < 2; j++) {
+            double total, var, image_total, image_var;
+            int const k = perm[op][j];
+
+            if (symmetric[op]) {
+                CHECK_AGREE(counts[j], image_counts[k], N_BATCHES, "pixel", "image",
+                    "mirror %s, detector %i onto %i", name, j + 1, k + 1);
+                continue;
+            }
+            batch_total(counts[j], N_BATCHES, &total, &var);
+            batch_total(image_counts[k], N_BATCHES, &image_total, &image_var);
+            CHECK(n_sigma(total, var, image_total, image_var) > 4, "mirror %s, "
+                "detector %i onto %i: pixel %.1f +- %.1f, image %.1f +- %.1f", name,
+                j + 1, k + 1, total, sqrt(var), image_total, sqrt(image_var));
+        }
+    }
+
+    clean_up_surface_all_arrays(&sample);
+    return checks_failed();
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Scenes and checks shared by the tests of the library, see test_scenes.h.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int n_failed = 0;
+
+int check(int ok, char const * file, int line, char const * fmt, ...) {
+    va_list args;
+
+    if (ok) {
+        printf("pass: ");
+    } else {
+        printf("FAIL %s:%i: ", file, line);
+        n_failed++;
+    }
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    return ok;
+}
+
+int check_agree(double const a[], double const b[], int n_batches, char const * name_a,
+        char const * name_b, char const * file, int line, char const * fmt, ...) {
+    char what[256];
+    double total_a, var_a, total_b, var_b;
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(what, sizeof(what), fmt, args);
+    va_end(args);
+    batch_total(a, n_batches, &total_a, &var_a);
+    batch_total(b, n_batches, &total_b, &var_b);
+    return check(n_sigma(total_a, var_a, total_b, var_b) < 4, file, line,
+        "%s: %s %.1f +- %.1f, %s %.1f +- %.1f", what, name_a, total_a, sqrt(var_a),
+        name_b, total_b, sqrt(var_b));
+}
+
+int checks_failed(void) {
+    return n_failed;
+}
+
+Material diffuse_material(void) {
+    Material M;
+
+    M.name = "diffuse";
+    M.func_name = "cosine";
+    M.params = NULL;
+    M.n_params = 0;
+    M.func = distribution_by_name("cosine");
+    return M;
+}
+
+static double height(double amplitude, double x, double z) {
+    return -1 + amplitude*(sin(5*x) + cos(4*z));
+}
+
+void heightfield_surface(int n, double amplitude, int surf_index, Material * M,
+        Surface3D * const surf) {
+    int const nvert = (n + 1)*(n + 1);
+    int const ntriag = 2*n*n;
+    double * V = malloc(3*nvert*sizeof(double));
+    double * N = malloc(3*ntriag*sizeof(double));
+    int32_t * F = malloc(3*ntriag*sizeof(int32_t));
+    char ** C = malloc(ntriag*sizeof(char *));
+    int i, j, k, f;
+
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag*3);
+    for (i = 0; i <= n; i++) {
+        for (j = 0; j <= n; j++) {
+            int const v = i*(n + 1) + j;
+            V[3*v] = -1.5 + 3.0*i/n;
+            V[3*v + 2] = -1.5 + 3.0*j/n;
+            V[3*v + 1] = height(amplitude, V[3*v], V[3*v + 2]);
+        }
+    }
+
+    /* Two faces per square, wound so that their normals face up */
+    f = 0;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            int const a = i*(n + 1) + j;
+            int const tri[2][3] = {{a, a + 1, a + n + 1}, {a + 1, a + n + 2, a + n + 1}};
+            int t;
+
+            for (t = 0; t < 2; t++, f++) {
+                double e1[3], e2[3], normal[3];
+
+                for (k = 0; k < 3; k++) {
+                    F[3*f + k] = tri[t][k] + 1;
+                    e1[k] = V[3*tri[t][1] + k] - V[3*tri[t][0] + k];
+                    e2[k] = V[3*tri[t][2] + k] - V[3*tri[t][0] + k];
+                }
+                cross(e1, e2, normal);
+                normalise(normal);
+                for (k = 0; k < 3; k++)
+                    N[3*f + k] = normal[1] < 0 ? -normal[k] : normal[k];
+                C[f] = M->name;
+            }
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 1, ntriag, nvert, surf_index, surf);
+    free(C);
+}
+
+void aperture_plate_surface(int n_sides, double r, int surf_index, Material * M,
+        Surface3D * const surf) {
+    int const nvert = 2*n_sides;
+    int const ntriag = 2*n_sides;
+    double * V = malloc(3*nvert*sizeof(double));
+    double * N = malloc(3*ntriag*sizeof(double));
+    int32_t * F = malloc(3*ntriag*sizeof(int32_t));
+    char ** C = malloc(ntriag*sizeof(char *));
+    int i, k;
+
+    account_memory(MEM_GEOMETRY, sizeof(double)*nvert*3 + (sizeof(double) +
+        sizeof(int32_t))*ntriag*3);
+
+    /*
+     * Vertex 2i is a corner of the aperture and 2i + 1 the point of the edge of
+     * the plate in the same direction, the corners of the plate are among them
+     */
+    for (i = 0; i < n_sides; i++) {
+        double const theta = M_PI/4 + 2*M_PI*i/n_sides;
+        double const c = cos(theta), s = sin(theta);
+        double const edge = 4/(fabs(c) > fabs(s) ? fabs(c) : fabs(s));
+
+        V[6*i] = r*c;
+        V[6*i + 1] = 0;
+        V[6*i + 2] = r*s;
+        V[6*i + 3] = edge*c;
+        V[6*i + 4] = 0;
+        V[6*i + 5] = edge*s;
+    }
+
+    /* Two faces between each side of the aperture and the edge of the plate */
+    for (i = 0; i < n_sides; i++) {
+        int const a = 2*i, b = 2*((i + 1) % n_sides);
+        int const tri[2][3] = {{a, a + 1, b + 1}, {a, b + 1, b}};
+        int t;
+
+        for (t = 0; t < 2; t++) {
+            int const f = 2*i + t;
+
+            for (k = 0; k < 3; k++) {
+                F[3*f + k] = tri[t][k] + 1;
+                N[3*f + k] = k == 1 ? -1 : 0;
+            }
+            C[f] = M->name;
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 1, ntriag, nvert, surf_index, surf);
+    free(C);
+}
+
+void two_aperture_plate(Material M, int surf_index, NBackWall * const plate) {
+    static double aperture_c[4] = {0.6, 0, -0.6, 0};
+    static double aperture_axes[4] = {0.5, 0.5, 0.5, 0.5};
+
+    plate->surf_index = surf_index;
+    plate->n_detect = 2;
+    plate->aperture_c = aperture_c;
+    plate->aperture_axes = aperture_axes;
+    plate->circle_plate_r = 2;
+    plate->plate_represent = 1;
+    plate->material = M;
+}
+
+void no_sphere(int surf_index, AnalytSphere * const sphere) {
+    static double sphere_c[3] = {0, 0, 0};
+
+    generate_empty_sphere(surf_index, sphere);
+    sphere->sphere_c = sphere_c;
+}
+
+SourceParam narrow_source(void) {
+    SourceParam source;
+
+    source.pinhole_r = 0.05;
+    source.pinhole_c[0] = 0;
+    source.pinhole_c[1] = 1;
+    source.pinhole_c[2] = 0;
+    source.theta_max = 0.01;
+    source.init_angle = 0;
+    source.source_model = 1;
+    source.sigma = 0.01;
+    return source;
+}
+
+void start_ray(const double e[3], const double d[3], Ray3D * const the_ray) {
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        the_ray->position[k] = e[k];
+        the_ray->direction[k] = d[k];
+    }
+    normalise(the_ray->direction);
+    the_ray->nScatters = 0;
+    the_ray->on_element = -1;
+    the_ray->on_surface = -1;
+    the_ray->status = 0;
+    the_ray->detector = 0;
+    the_ray->weight = 1;
+    the_ray->score = NULL;
+}
+
+void random_direction(const double axis[3], MTRand * const myrng, double d[3]) {
+    double along, r2;
+
+    /* Uniform in the unit ball, then onto the sphere */
+    do {
+        int k;
+
+        r2 = 0;
+        for (k = 0; k < 3; k++) {
+            genRand(myrng, &d[k]);
+            d[k] = 2*d[k] - 1;
+            r2 += d[k]*d[k];
+        }
+    } while (r2 > 1 || r2 < 1e-6);
+    dot(d, axis, &along);
+    if (along < 0) {
+        d[0] = -d[0];
+        d[1] = -d[1];
+        d[2] = -d[2];
+    }
+    normalise(d);
+}
+
+void batch_total(double const batches[], int n_batches, double * const total,
+        double * const var) {
+    double mean = 0;
+    double ss = 0;
+    int i;
+
+    for (i = 0; i < n_batches; i++)
+        mean += batches[i]/n_batches;
+    for (i = 0; i < n_batches; i++)
+        ss += (batches[i] - mean)*(batches[i] - mean);
+    *total = n_batches*mean;
+    *var = n_batches*ss/(n_batches - 1);
+}
+
+double n_sigma(double a, double var_a, double b, double var_b) {
+    return fabs(a - b)/sqrt(var_a + var_b);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Scenes and checks shared by the tests of the library. Each test is a program
+ * that prints its checks and returns the number that failed, see the makefile.
+ */
+
+#ifndef TEST_SCENES_H_
+#define TEST_SCENES_H_
+
+#include "atom_ray_tracing3D.h"
+#include "mtwister.h"
+
+/* Print a check, counting it if it failed. Returns ok. */
+#define CHECK(ok, ...) check((ok), __FILE__, __LINE__, __VA_ARGS__)
+int check(int ok, char const * file, int line, char const * fmt, ...);
+
+/*
+ * Check that the sums of two sets of n_batches independent batches agree
+ * within 4 standard errors, see batch_total. The names label the two sets.
+ */
+#define CHECK_AGREE(a, b, n_batches, name_a, name_b, ...) \
+    check_agree((a), (b), (n_batches), (name_a), (name_b), __FILE__, __LINE__, \
+    __VA_ARGS__)
+int check_agree(double const a[], double const b[], int n_batches, char const * name_a,
+        char const * name_b, char const * file, int line, char const * fmt, ...);
+
+/* The number of checks that have failed */
+int checks_failed(void);
+
+/* A diffuse (cosine) material named "diffuse" */
+Material diffuse_material(void);
+
+/*
+ * A triangulated heightfield of 2 n^2 faces over -1.5 < x, z < 1.5, at
+ * y = -1 + amplitude*(sin(5x) + cos(4z)), of the material M. The surface owns
+ * its arrays, free it with clean_up_surface_all_arrays.
+ */
+void heightfield_surface(int n, double amplitude, int surf_index, Material * M,
+        Surface3D * const surf);
+
+/*
+ * A flat CAD pinhole plate at y = 0, facing -y, over the square of half width 4
+ * centred on an aperture at the origin. The aperture is a regular polygon of
+ * n_sides, a multiple of 4, with its corners on a circle of radius r, so that
+ * more sides come closer to a circular aperture. The surface owns its arrays,
+ * free it with clean_up_surface_all_arrays.
+ */
+void aperture_plate_surface(int n_sides, double r, int surf_index, Material * M,
+        Surface3D * const surf);
+
+/* A flat plate at y = 0 with apertures at x = +-0.6 of diameter 0.5 */
+void two_aperture_plate(Material M, int surf_index, NBackWall * const plate);
+
+/* No sphere */
+void no_sphere(int surf_index, AnalytSphere * const sphere);
+
+/* A narrow uniform beam from the centre of the plate, normal to the sample */
+SourceParam narrow_source(void);
+
+/* A ray at e along d that is on no surface */
+void start_ray(const double e[3], const double d[3], Ray3D * const the_ray);
+
+/* A direction into the hemisphere about axis, uniformly distributed */
+void random_direction(const double axis[3], MTRand * const myrng, double d[3]);
+
+/*
+ * The sum of the estimates of n_batches independent batches, and its variance
+ * from their spread.
+ */
+void batch_total(double const batches[], int n_batches, double * const total,
+        double * const var);
+
+/* The number of standard errors between two independent estimates */
+double n_sigma(double a, double var_a, double b, double var_b);
+
+#endif /* TEST_SCENES_H_ */
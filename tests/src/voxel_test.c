@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2020, Sam Lambrick.
+ * All rights reserved.
+ * This file is part of the SHeM ray tracing simulation, subject to the
+ * GNU/GPL-3.0-or-later.
+ *
+ *
+ * Checks that marching rays through a grid of voxels (see voxel.h) finds the
+ * same hits as intersecting the triangulation of the exposed faces of its
+ * voxels, for a dense grid and a grid of bricks. The grid is a solid base with
+ * random voxels above it, so there are overhangs and cavities. Rays come from
+ * above the grid and from the hits they make on it.
+ */
+
+#include "test_scenes.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NX 24
+#define NY 12
+#define NZ 24
+#define VOXEL_SIZE 0.1
+
+static double const origin[3] = {-1.2, -2, -1.2};
+
+/*
+ * The triangulation of the faces of the filled voxels that have an empty
+ * neighbour, two faces for each, with their outward normals.
+ */
+static void triangulate_voxels(VoxelGrid const * const grid, Material * M,
+        Surface3D * const surf) {
+    int const dims[3] = {NX, NY, NZ};
+    int n_quads = 0;
+    double * V;
+    double * N;
+    int32_t * F;
+    char ** C;
+    int i, j, k, f, pass;
+
+    V = NULL;
+    N = NULL;
+    F = NULL;
+    C = NULL;
+    /* Count the exposed faces, then fill them in */
+    for (pass = 0; pass < 2; pass++) {
+        int q = 0;
+
+        for (k = 0; k < dims[2]; k++)
+        for (j = 0; j < dims[1]; j++)
+        for (i = 0; i < dims[0]; i++) {
+            int const ijk[3] = {i, j, k};
+
+            if (!voxel_id(grid, i, j, k))
+                continue;
+            for (f = 0; f < 6; f++) {
+                int const a = f/2;
+                int const side = f % 2;
+                int const b = (a + 1) % 3;
+                int const c = (a + 2) % 3;
+                int nb[3] = {i, j, k};
+                double corner[4][3];
+                double normal[3];
+                int m, t;
+
+                nb[a] += side ? 1 : -1;
+                if (voxel_id(grid, nb[0], nb[1], nb[2]))
+                    continue;
+                if (pass == 0) {
+                    q++;
+                    continue;
+                }
+
+                /* The corners of the face, around it */
+                for (m = 0; m < 4; m++) {
+                    corner[m][a] = origin[a] + (ijk[a] + side)*VOXEL_SIZE;
+                    corner[m][b] = origin[b] + (ijk[b] + (m == 1 || m == 2))*VOXEL_SIZE;
+                    corner[m][c] = origin[c] + (ijk[c] + (m >= 2))*VOXEL_SIZE;
+                }
+                voxel_face_normal(f, normal);
+                for (m = 0; m < 4; m++)
+                    for (t = 0; t < 3; t++)
+                        V[3*(4*q + m) + t] = corner[m][t];
+                for (t = 0; t < 2; t++) {
+                    int const tri = 2*q + t;
+                    int const vs[2][3] = {{0, 1, 2}, {0, 2, 3}};
+
+                    for (m = 0; m < 3; m++) {
+                        F[3*tri + m] = 4*q + vs[t][m] + 1;
+                        N[3*tri + m] = normal[m];
+                    }
+                    C[tri] = M->name;
+                }
+                q++;
+            }
+        }
+        if (pass == 0) {
+            n_quads = q;
+            V = malloc(12*n_quads*sizeof(double));
+            N = malloc(6*n_quads*sizeof(double));
+            F = malloc(6*n_quads*sizeof(int32_t));
+            C = malloc(2*n_quads*sizeof(char *));
+            account_memory(MEM_GEOMETRY, sizeof(double)*12*n_quads +
+                (sizeof(double) + sizeof(int32_t))*6*n_quads);
+        }
+    }
+
+    set_up_surface(V, N, F, C, M, 1, 2*n_quads, 4*n_quads, 0, surf);
+    free(C);
+}
+
+/*
+ * Trace n_rays rays and their second bounces through the voxels and their
+ * triangulation, returns the number that differ.
+ */
+static int compare_hits(Surface3D voxels, Surface3D triangles, int n_rays,
+        MTRand * const myrng) {
+    double const down[3] = {0, -1, 0};
+    int n_differ = 0;
+    int i, k;
+
+    for (i = 0; i < n_rays; i++) {
+        Ray3D v_ray, t_ray;
+        double e[3], d[3];
+        int bounce;
+
+        genRand(myrng, &e[0]);
+        genRand(myrng, &e[2]);
+        e[0] = 3*e[0] - 1.5;
+        e[1] = 0;
+        e[2] = 3*e[2] - 1.5;
+        random_direction(down, myrng, d);
+        start_ray(e, d, &v_ray);
+        start_ray(e, d, &t_ray);
+
+        for (bounce = 0; bounce < 3; bounce++) {
+            double v_inter[3], v_normal[3], t_inter[3], t_normal[3], face_normal[3];
+            double v_dist = 10e10, t_dist = 10e10;
+            int v_meets = 0, t_meets = 0;
+            int v_hit = -1, t_hit = -1;
+            int v_surf, t_surf;
+            double gap = 0;
+
+            scatterTriag(&v_ray, voxels, &v_dist, v_inter, v_normal, &v_meets, &v_hit,
+                &v_surf);
+            scatterTriag(&t_ray, triangles, &t_dist, t_inter, t_normal, &t_meets, &t_hit,
+                &t_surf);
+            if ((v_hit < 0) != (t_hit < 0)) {
+                n_differ++;
+                break;
+            }
+            if (v_hit < 0)
+                break;
+
+            /*
+             * The same point on a face facing the same way, a ray leaving a
+             * voxel starts just above its face so grazing hits move a little
+             */
+            voxel_face_normal(v_hit % 6, face_normal);
+            for (k = 0; k < 3; k++) {
+                gap += (v_inter[k] - t_inter[k])*(v_inter[k] - t_inter[k]);
+                gap += (face_normal[k] - t_normal[k])*(face_normal[k] - t_normal[k]);
+            }
+            if (gap > 1e-10) {
+                n_differ++;
+                break;
+            }
+
+            /* Scatter off the hit, away from the face */
+            random_direction(face_normal, myrng, d);
+            for (k = 0; k < 3; k++) {
+                v_ray.position[k] = t_ray.position[k] = v_inter[k];
+                v_ray.direction[k] = t_ray.direction[k] = d[k];
+            }
+            v_ray.on_surface = voxels.surf_index;
+            v_ray.on_element = v_hit;
+            t_ray.on_surface = triangles.surf_index;
+            t_ray.on_element = t_hit;
+        }
+    }
+    return n_differ;
+}
+
+int main(int argc, char * argv []) {
+    int n_rays = argc > 1 ? atoi(argv[1]) : 20000;
+    int const dims[3] = {NX, NY, NZ};
+    uint8_t ids[NX*NY*NZ];
+    Material M = diffuse_material();
+    Surface3D dense, bricks, triangles;
+    MTRand myrng;
+    int i, j, k;
+
+    /* A solid base, with random voxels above it */
+    seedRand(20201026, &myrng);
+    for (k = 0; k < NZ; k++)
+    for (j = 0; j < NY; j++)
+    for (i = 0; i < NX; i++) {
+        double r;
+
+        genRand(&myrng, &r);
+        ids[i + NX*(j + NY*k)] = j < 2 || r < 0.25;
+    }
+
+    CHECK(set_up_voxel_surface(ids, dims, origin, VOXEL_SIZE, 1, 1, &M, 1, 0, &dense),
+        "a dense grid of voxels");
+    CHECK(set_up_voxel_surface(ids, dims, origin, VOXEL_SIZE, 4, 1, &M, 1, 0, &bricks),
+        "a grid of bricks of voxels");
+    triangulate_voxels(dense.voxels, &M, &triangles);
+
+    CHECK(compare_hits(dense, triangles, n_rays, &myrng) == 0,
+        "the dense grid gives the same hits as its %i faces", triangles.n_faces);
+    CHECK(compare_hits(bricks, triangles, n_rays, &myrng) == 0,
+        "the grid of bricks gives the same hits as its %i faces", triangles.n_faces);
+
+    clean_up_surface(&dense);
+    clean_up_surface(&bricks);
+    clean_up_surface_all_arrays(&triangles);
+    return checks_failed();
+}